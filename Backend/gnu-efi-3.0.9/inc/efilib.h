@@ -142,6 +142,13 @@ extern EFI_GUID Acpi20TableGuid;
 extern EFI_GUID SMBIOSTableGuid;
 extern EFI_GUID SalSystemTableGuid;
 
+extern EFI_GUID Ip4ServiceBindingProtocol;
+extern EFI_GUID Ip4Protocol;
+extern EFI_GUID Udp4ServiceBindingProtocol;
+extern EFI_GUID Udp4Protocol;
+extern EFI_GUID Tcp4ServiceBindingProtocol;
+extern EFI_GUID Tcp4Protocol;
+
 extern EFI_GUID SimplePointerProtocol;
 extern EFI_GUID AbsolutePointerProtocol;
 
@@ -742,6 +749,37 @@ GrowBuffer(
     IN UINTN            BufferSize
     );
 
+//
+// Size hints for the library's GrowBuffer loops. Each call site starts at
+// the largest size it has needed so far plus some headroom, so repeat calls
+// normally succeed on the first try. Retries counts the extra firmware calls
+// made when the hint was still too small.
+//
+
+typedef enum {
+    GrowBufferMemoryMap,
+    GrowBufferFileInfo,
+    GrowBufferVariable,
+    GrowBufferLocateHandle,
+    GrowBufferMaxSite
+} GROW_BUFFER_SITE;
+
+typedef struct {
+    UINTN           Size;
+    UINTN           Calls;
+    UINTN           Retries;
+} GROW_BUFFER_HINT;
+
+extern GROW_BUFFER_HINT GrowBufferHints[GrowBufferMaxSite];
+
+VOID
+GrowBufferHintUpdate (
+    IN GROW_BUFFER_SITE Site,
+    IN EFI_STATUS       Status,
+    IN UINTN            BufferSize,
+    IN UINTN            Tries
+    );
+
 EFI_MEMORY_DESCRIPTOR *
 LibMemoryMap (
     OUT UINTN               *NoEntries,
@@ -814,6 +852,17 @@ LibLocateHandleByDiskSignature (
     OUT EFI_HANDLE                  **Buffer
     );
 
+//
+// LibLocateProtocol and LibLocateHandle (ByProtocol) cache their results,
+// using protocol-notify events to catch new installs. Images that exit back
+// to the firmware must call this first, since the events call into them.
+//
+
+VOID
+LibFlushHandleCache (
+    VOID
+    );
+
 EFI_STATUS
 LibInstallProtocolInterfaces (
     IN OUT EFI_HANDLE       *Handle,
@@ -962,6 +1011,54 @@ DevicePathToStr (
     EFI_DEVICE_PATH         *DevPath
     );
 
+//
+// Device path builder: appends nodes to one growable pool buffer and keeps
+// track of its own size, so building many paths (or many variants of one
+// path) doesn't re-walk every node on every append. The buffer always ends
+// with an end-of-device-path node, so Builder->DevicePath can be passed to
+// firmware directly while the builder is alive.
+//
+
+typedef struct {
+    EFI_DEVICE_PATH     *DevicePath;
+    UINTN               Size;       // Bytes in use, not counting the end node
+    UINTN               MaxSize;    // Bytes allocated
+} DEVICE_PATH_BUILDER;
+
+EFI_STATUS
+InitializeDevicePathBuilder (
+    OUT DEVICE_PATH_BUILDER *Builder,
+    IN EFI_DEVICE_PATH      *Base       OPTIONAL
+    );
+
+EFI_STATUS
+DevicePathBuilderAppendNode (
+    IN OUT DEVICE_PATH_BUILDER  *Builder,
+    IN EFI_DEVICE_PATH          *Node
+    );
+
+EFI_STATUS
+DevicePathBuilderAppendFilePath (
+    IN OUT DEVICE_PATH_BUILDER  *Builder,
+    IN CHAR16                   *FileName
+    );
+
+VOID
+DevicePathBuilderTruncate (
+    IN OUT DEVICE_PATH_BUILDER  *Builder,
+    IN UINTN                    Size
+    );
+
+EFI_DEVICE_PATH *
+DevicePathBuilderFinalize (
+    IN DEVICE_PATH_BUILDER      *Builder
+    );
+
+VOID
+FreeDevicePathBuilder (
+    IN OUT DEVICE_PATH_BUILDER  *Builder
+    );
+
 //
 // BugBug: I need my own include files
 //
@@ -1019,6 +1116,13 @@ ReadSimpleReadFile (
     );
 
 
+EFI_STATUS
+MapSimpleReadFile (
+    IN SIMPLE_READ_FILE     SimpleReadHandle,
+    OUT VOID                **Buffer,
+    OUT UINTN               *BufferSize
+    );
+
 VOID
 CloseSimpleReadFile (
     IN SIMPLE_READ_FILE     SimpleReadHandle
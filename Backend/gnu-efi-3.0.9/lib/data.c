@@ -64,6 +64,26 @@ EFI_UNICODE_COLLATION_INTERFACE   LibStubUnicodeInterface = {
 
 EFI_UNICODE_COLLATION_INTERFACE   *UnicodeInterface = &LibStubUnicodeInterface;
 
+//
+// Deferred InitializeLib work - TRUE until the first call that needs it
+// (see LibInitializeUnicode and LibInitializeDebugMask)
+//
+
+BOOLEAN  LibUnicodePending = FALSE;
+BOOLEAN  LibDebugMaskPending = FALSE;
+
+//
+// GrowBuffer starting sizes, indexed by GROW_BUFFER_SITE. These only cover
+// the first call from each site; after that they track what was needed.
+//
+
+GROW_BUFFER_HINT GrowBufferHints[GrowBufferMaxSite] = {
+    { 64 * sizeof(EFI_MEMORY_DESCRIPTOR), 0, 0 },   // GrowBufferMemoryMap
+    { SIZE_OF_EFI_FILE_INFO + 200, 0, 0 },          // GrowBufferFileInfo
+    { 100, 0, 0 },                                  // GrowBufferVariable
+    { 50 * sizeof(EFI_HANDLE), 0, 0 }               // GrowBufferLocateHandle
+};
+
 //
 // Root device path
 //
@@ -204,7 +204,34 @@ AppendDevicePathNode (
 // appended to each instance is Src1.
 {
     EFI_DEVICE_PATH     *Temp, *Eop;
-    UINTN               Length;
+    UINTN               Length, Src1Size;
+
+    //
+    // Common case: Src1 is a single instance. Find its end once and copy
+    // Src1 and the node straight into the result, skipping the terminated
+    // copy of Src2 and the extra walks AppendDevicePath would make.
+    //
+
+    if (Src1 && Src2) {
+        Eop = Src1;
+        while (!IsDevicePathEndType(Eop)) {
+            Eop = NextDevicePathNode(Eop);
+        }
+
+        if (DevicePathSubType(Eop) == END_ENTIRE_DEVICE_PATH_SUBTYPE) {
+            Src1Size = (UINTN) Eop - (UINTN) Src1;
+            Length = DevicePathNodeLength(Src2);
+
+            Temp = AllocatePool (Src1Size + Length + sizeof(EFI_DEVICE_PATH));
+            if (Temp) {
+                CopyMem (Temp, Src1, Src1Size);
+                CopyMem ((UINT8 *) Temp + Src1Size, Src2, Length);
+                Eop = (EFI_DEVICE_PATH *) ((UINT8 *) Temp + Src1Size + Length);
+                SetDevicePathEndNode(Eop);
+            }
+            return Temp;
+        }
+    }
 
     //
     // Build a Src2 that has a terminator on it
@@ -242,43 +269,28 @@ FileDevicePath (
 
 --*/
 {
-    UINTN                   Size;
-    FILEPATH_DEVICE_PATH    *FilePath;
-    EFI_DEVICE_PATH         *Eop, *DevicePath;
-
-    Size = StrSize(FileName);
-    FilePath = AllocateZeroPool (Size + SIZE_OF_FILEPATH_DEVICE_PATH + sizeof(EFI_DEVICE_PATH));
-    DevicePath = NULL;
-
-    if (FilePath) {
+    DEVICE_PATH_BUILDER     Builder;
 
-        //
-        // Build a file path
-        //
-
-        FilePath->Header.Type = MEDIA_DEVICE_PATH;
-        FilePath->Header.SubType = MEDIA_FILEPATH_DP;
-        SetDevicePathNodeLength (&FilePath->Header, Size + SIZE_OF_FILEPATH_DEVICE_PATH);
-        CopyMem (FilePath->PathName, FileName, Size);
-        Eop = NextDevicePathNode(&FilePath->Header);
-        SetDevicePathEndNode(Eop);
-
-        //
-        // Append file path to device's device path
-        //
+    //
+    // Build the device's path and the file node in one allocation, rather
+    // than building the file node by itself and appending it to a copy
+    //
 
-        DevicePath = (EFI_DEVICE_PATH *) FilePath;
-        if (Device) {
-            DevicePath = AppendDevicePath (
-                            DevicePathFromHandle(Device),
-                            DevicePath
-                            );
+    if (EFI_ERROR(InitializeDevicePathBuilder (&Builder, Device ? DevicePathFromHandle(Device) : NULL))) {
+        return NULL;
+    }
 
-            FreePool(FilePath);
-        }
+    if (EFI_ERROR(DevicePathBuilderAppendFilePath (&Builder, FileName))) {
+        FreeDevicePathBuilder (&Builder);
+        return NULL;
     }
 
-    return DevicePath;
+    //
+    // The builder's buffer is already a terminated device path, so hand it
+    // over as-is instead of copying it
+    //
+
+    return Builder.DevicePath;
 }
 
 
@@ -333,6 +345,213 @@ DuplicateDevicePath (
     return NewDevPath;
 }
 
+//
+// Device path builder
+//
+
+STATIC
+EFI_STATUS
+DevicePathBuilderReserve (
+    IN OUT DEVICE_PATH_BUILDER  *Builder,
+    IN UINTN                    Extra
+    )
+// Makes room for Extra more bytes plus the end node, growing the buffer
+// geometrically. On failure the existing contents are left intact.
+{
+    UINTN               NewSize;
+    EFI_DEVICE_PATH     *NewPath;
+
+    NewSize = Builder->Size + Extra + sizeof(EFI_DEVICE_PATH);
+    if (NewSize <= Builder->MaxSize) {
+        return EFI_SUCCESS;
+    }
+
+    if (NewSize < Builder->MaxSize * 2) {
+        NewSize = Builder->MaxSize * 2;
+    }
+
+    NewPath = AllocatePool (NewSize);
+    if (!NewPath) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    if (Builder->DevicePath) {
+        CopyMem (NewPath, Builder->DevicePath, Builder->Size + sizeof(EFI_DEVICE_PATH));
+        FreePool (Builder->DevicePath);
+    }
+
+    Builder->DevicePath = NewPath;
+    Builder->MaxSize = NewSize;
+    return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+DevicePathBuilderTerminate (
+    IN OUT DEVICE_PATH_BUILDER  *Builder
+    )
+{
+    EFI_DEVICE_PATH     *Eop;
+
+    Eop = (EFI_DEVICE_PATH *) ((UINT8 *) Builder->DevicePath + Builder->Size);
+    SetDevicePathEndNode(Eop);
+}
+
+EFI_STATUS
+InitializeDevicePathBuilder (
+    OUT DEVICE_PATH_BUILDER *Builder,
+    IN EFI_DEVICE_PATH      *Base       OPTIONAL
+    )
+/*++
+
+    Starts a new builder, optionally seeded with the first instance of
+    Base. Base is walked once here; nothing after this walks the path.
+
+--*/
+{
+    EFI_DEVICE_PATH     *Eop;
+    UINTN               BaseSize;
+    EFI_STATUS          Status;
+
+    ZeroMem (Builder, sizeof(DEVICE_PATH_BUILDER));
+
+    BaseSize = 0;
+    if (Base) {
+        Eop = Base;
+        while (!IsDevicePathEndType(Eop)) {
+            Eop = NextDevicePathNode(Eop);
+        }
+        BaseSize = (UINTN) Eop - (UINTN) Base;
+    }
+
+    // Leave room for a file path node or two without regrowing
+    Status = DevicePathBuilderReserve (Builder, BaseSize + 256);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    if (BaseSize) {
+        CopyMem (Builder->DevicePath, Base, BaseSize);
+    }
+    Builder->Size = BaseSize;
+    DevicePathBuilderTerminate (Builder);
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS
+DevicePathBuilderAppendNode (
+    IN OUT DEVICE_PATH_BUILDER  *Builder,
+    IN EFI_DEVICE_PATH          *Node
+    )
+/*++
+
+    Appends a single device path node (its terminator, if any, is ignored)
+
+--*/
+{
+    UINTN               Length;
+    EFI_STATUS          Status;
+
+    Length = DevicePathNodeLength(Node);
+    Status = DevicePathBuilderReserve (Builder, Length);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    CopyMem ((UINT8 *) Builder->DevicePath + Builder->Size, Node, Length);
+    Builder->Size += Length;
+    DevicePathBuilderTerminate (Builder);
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS
+DevicePathBuilderAppendFilePath (
+    IN OUT DEVICE_PATH_BUILDER  *Builder,
+    IN CHAR16                   *FileName
+    )
+/*++
+
+    Appends a MEDIA_FILEPATH_DP node for FileName, written in place
+
+--*/
+{
+    UINTN                   Size;
+    FILEPATH_DEVICE_PATH    *FilePath;
+    EFI_STATUS              Status;
+
+    Size = StrSize(FileName);
+    Status = DevicePathBuilderReserve (Builder, Size + SIZE_OF_FILEPATH_DEVICE_PATH);
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    FilePath = (FILEPATH_DEVICE_PATH *) ((UINT8 *) Builder->DevicePath + Builder->Size);
+    FilePath->Header.Type = MEDIA_DEVICE_PATH;
+    FilePath->Header.SubType = MEDIA_FILEPATH_DP;
+    SetDevicePathNodeLength (&FilePath->Header, Size + SIZE_OF_FILEPATH_DEVICE_PATH);
+    CopyMem (FilePath->PathName, FileName, Size);
+
+    Builder->Size += Size + SIZE_OF_FILEPATH_DEVICE_PATH;
+    DevicePathBuilderTerminate (Builder);
+
+    return EFI_SUCCESS;
+}
+
+VOID
+DevicePathBuilderTruncate (
+    IN OUT DEVICE_PATH_BUILDER  *Builder,
+    IN UINTN                    Size
+    )
+/*++
+
+    Rolls the builder back to an earlier Builder->Size, e.g. to reuse a
+    device prefix while trying many candidate file names
+
+--*/
+{
+    if (Size < Builder->Size) {
+        Builder->Size = Size;
+        DevicePathBuilderTerminate (Builder);
+    }
+}
+
+EFI_DEVICE_PATH *
+DevicePathBuilderFinalize (
+    IN DEVICE_PATH_BUILDER      *Builder
+    )
+/*++
+
+    Returns an exactly-sized pool copy of the path built so far. The
+    builder stays valid and must still be freed. The caller must FreePool
+    the returned device path.
+
+--*/
+{
+    EFI_DEVICE_PATH     *DevPath;
+    UINTN               Size;
+
+    Size = Builder->Size + sizeof(EFI_DEVICE_PATH);
+    DevPath = AllocatePool (Size);
+    if (DevPath) {
+        CopyMem (DevPath, Builder->DevicePath, Size);
+    }
+
+    return DevPath;
+}
+
+VOID
+FreeDevicePathBuilder (
+    IN OUT DEVICE_PATH_BUILDER  *Builder
+    )
+{
+    if (Builder->DevicePath) {
+        FreePool (Builder->DevicePath);
+    }
+    ZeroMem (Builder, sizeof(DEVICE_PATH_BUILDER));
+}
+
 EFI_DEVICE_PATH *
 UnpackDevicePath (
     IN EFI_DEVICE_PATH  *DevPath
@@ -1334,6 +1553,68 @@ struct {
 };
 
 
+//
+// DevPathTable indexed by node type and subtype, so DevicePathToStr doesn't
+// have to scan the table above for every node. The known types are 1-5 and
+// 0x7F, which are all distinct in their low 3 bits; slots hold the
+// DevPathTable index + 1 (0 means "no entry") and the type is re-checked on
+// lookup since other types can land in the same row.
+//
+
+#define DEV_PATH_DISPATCH_TYPES     8
+#define DEV_PATH_DISPATCH_SUBTYPES  32
+
+typedef VOID (*DEV_PATH_DUMP_NODE)(POOL_PRINT *, VOID *);
+
+STATIC UINT8    DevPathDispatch[DEV_PATH_DISPATCH_TYPES][DEV_PATH_DISPATCH_SUBTYPES];
+STATIC BOOLEAN  DevPathDispatchReady = FALSE;
+
+STATIC
+VOID
+BuildDevPathDispatch (
+    VOID
+    )
+{
+    UINTN               Index;
+
+    ZeroMem (DevPathDispatch, sizeof(DevPathDispatch));
+    for (Index = 0; DevPathTable[Index].Function; Index += 1) {
+        if (DevPathTable[Index].SubType < DEV_PATH_DISPATCH_SUBTYPES &&
+            !DevPathDispatch[DevPathTable[Index].Type & (DEV_PATH_DISPATCH_TYPES - 1)][DevPathTable[Index].SubType]) {
+            DevPathDispatch[DevPathTable[Index].Type & (DEV_PATH_DISPATCH_TYPES - 1)][DevPathTable[Index].SubType] = (UINT8) (Index + 1);
+        }
+    }
+    DevPathDispatchReady = TRUE;
+}
+
+STATIC
+DEV_PATH_DUMP_NODE
+LookupDevPathFunction (
+    IN EFI_DEVICE_PATH  *DevPathNode
+    )
+{
+    UINT8               Type, SubType;
+    UINTN               Entry;
+
+    if (!DevPathDispatchReady) {
+        BuildDevPathDispatch ();
+    }
+
+    Type = DevicePathType(DevPathNode);
+    SubType = DevicePathSubType(DevPathNode);
+    if (SubType >= DEV_PATH_DISPATCH_SUBTYPES) {
+        return NULL;
+    }
+
+    Entry = DevPathDispatch[Type & (DEV_PATH_DISPATCH_TYPES - 1)][SubType];
+    if (!Entry || DevPathTable[Entry - 1].Type != Type) {
+        return NULL;
+    }
+
+    return DevPathTable[Entry - 1].Function;
+}
+
+
 CHAR16 *
 DevicePathToStr (
     EFI_DEVICE_PATH     *DevPath
@@ -1349,7 +1630,7 @@ DevicePathToStr (
     POOL_PRINT          Str;
     EFI_DEVICE_PATH     *DevPathNode;
     VOID                (*DumpNode)(POOL_PRINT *, VOID *);
-    UINTN               Index, NewSize;
+    UINTN               NewSize;
 
     ZeroMem(&Str, sizeof(Str));
 
@@ -1360,6 +1641,18 @@ DevicePathToStr (
     DevPath = UnpackDevicePath(DevPath);
     ASSERT (DevPath);
 
+    //
+    // Size the string up front. The text form of a node is usually about as
+    // many characters as the node is bytes, so most paths never need to grow
+    // the buffer. If this fails, CatPrint will allocate as it goes.
+    //
+
+    Str.maxlen = DevicePathSize(DevPath) + 64;
+    Str.str = AllocatePool (Str.maxlen * sizeof(CHAR16));
+    if (!Str.str) {
+        Str.maxlen = 0;
+    }
+
 
     //
     // Process each device path node
@@ -1371,15 +1664,7 @@ DevicePathToStr (
         // Find the handler to dump this device path node
         //
 
-        DumpNode = NULL;
-        for (Index = 0; DevPathTable[Index].Function; Index += 1) {
-
-            if (DevicePathType(DevPathNode) == DevPathTable[Index].Type &&
-                DevicePathSubType(DevPathNode) == DevPathTable[Index].SubType) {
-                DumpNode = DevPathTable[Index].Function;
-                break;
-            }
-        }
+        DumpNode = LookupDevPathFunction (DevPathNode);
 
         //
         // If not found, use a generic function
@@ -128,6 +128,116 @@ static struct {
 	{  NULL, L"" }
 };
 
+//
+// Hashed index over KnownGuids
+//
+// The table above holds pointers to GUIDs that live in other modules, so the
+// index can't be laid out by the compiler. Instead it is filled in once (by
+// InitializeGuid, or lazily by the first GuidToString) and then every lookup
+// costs one hash and, usually, one CompareGuid instead of a scan of the table.
+// Slots hold (KnownGuids index + 1) so that 0 can mean "empty".
+//
+
+#define KNOWN_GUID_HASH_SIZE    256     // Power of 2, at least 2x the KnownGuids count
+
+STATIC UINT8    KnownGuidHash[KNOWN_GUID_HASH_SIZE];
+STATIC BOOLEAN  KnownGuidHashReady = FALSE;
+
+STATIC CHAR8 GuidHex[] = {'0','1','2','3','4','5','6','7',
+                          '8','9','A','B','C','D','E','F'};
+
+STATIC
+UINTN
+GuidHashSlot (
+    IN EFI_GUID     *Guid
+    )
+{
+    UINT32          *Words;
+    UINT32          Hash;
+
+    // Fold the 128-bit value into 32 bits, then take the top bits of a
+    // multiplicative hash so that similar GUIDs (e.g. the 0x47c7b22x shell
+    // family) still spread across the table
+    Words = (UINT32 *) Guid;
+    Hash = Words[0] ^ Words[1] ^ Words[2] ^ Words[3];
+    Hash *= 0x9E3779B1;
+
+    return (UINTN) (Hash >> 24) & (KNOWN_GUID_HASH_SIZE - 1);
+}
+
+STATIC
+VOID
+BuildKnownGuidHash (
+    VOID
+    )
+{
+    UINTN           Index;
+    UINTN           Slot;
+
+    ZeroMem (KnownGuidHash, sizeof(KnownGuidHash));
+
+    for (Index=0; KnownGuids[Index].Guid; Index++) {
+        Slot = GuidHashSlot (KnownGuids[Index].Guid);
+
+        while (KnownGuidHash[Slot]) {
+            // Keep the first name for duplicate GUIDs, like the old linear scan did
+            if (CompareGuid (KnownGuids[Index].Guid, KnownGuids[KnownGuidHash[Slot] - 1].Guid) == 0) {
+                break;
+            }
+            Slot = (Slot + 1) & (KNOWN_GUID_HASH_SIZE - 1);
+        }
+
+        if (!KnownGuidHash[Slot]) {
+            KnownGuidHash[Slot] = (UINT8) (Index + 1);
+        }
+    }
+
+    KnownGuidHashReady = TRUE;
+}
+
+STATIC
+CHAR16 *
+LookupKnownGuidName (
+    IN EFI_GUID     *Guid
+    )
+{
+    UINTN           Slot;
+    UINTN           Entry;
+
+    if (!KnownGuidHashReady) {
+        BuildKnownGuidHash ();
+    }
+
+    Slot = GuidHashSlot (Guid);
+    while ((Entry = KnownGuidHash[Slot])) {
+        if (CompareGuid (Guid, KnownGuids[Entry - 1].Guid) == 0) {
+            return KnownGuids[Entry - 1].GuidName;
+        }
+        Slot = (Slot + 1) & (KNOWN_GUID_HASH_SIZE - 1);
+    }
+
+    return NULL;
+}
+
+STATIC
+CHAR16 *
+GuidHexField (
+    OUT CHAR16      *Buffer,
+    IN UINT64       Value,
+    IN UINTN        Digits
+    )
+// Writes Value as exactly Digits uppercase hex digits and returns the next free position
+{
+    UINTN           Index;
+
+    for (Index = Digits; Index; Index--) {
+        Buffer[Index - 1] = GuidHex[(UINTN)(Value & 0xF)];
+        Value = RShiftU64 (Value, 4);
+    }
+
+    return Buffer + Digits;
+}
+
 //
 //
 //
@@ -140,6 +250,9 @@ InitializeGuid (
     VOID
     )
 {
+    if (!KnownGuidHashReady) {
+        BuildKnownGuidHash ();
+    }
 }
 
 INTN
@@ -174,34 +287,36 @@ GuidToString (
     )
 {
 
+    CHAR16          *Name;
+    CHAR16          *Pos;
     UINTN           Index;
 
     //
     // Else, (for now) use additional internal function for mapping guids
     //
 
-    for (Index=0; KnownGuids[Index].Guid; Index++) {
-        if (CompareGuid(Guid, KnownGuids[Index].Guid) == 0) {
-            SPrint (Buffer, 0, KnownGuids[Index].GuidName);
-            return ;
-        }
+    Name = LookupKnownGuidName (Guid);
+    if (Name) {
+        StrCpy (Buffer, Name);
+        return ;
     }
 
     //
-    // Else dump it
+    // Else dump it, in the same layout SPrint's
+    // "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x" used to produce
     //
 
-    SPrint (Buffer, 0, L"%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-        Guid->Data1,
-        Guid->Data2,
-        Guid->Data3,
-        Guid->Data4[0],
-        Guid->Data4[1],
-        Guid->Data4[2],
-        Guid->Data4[3],
-        Guid->Data4[4],
-        Guid->Data4[5],
-        Guid->Data4[6],
-        Guid->Data4[7]
-        );
+    Pos = GuidHexField (Buffer, Guid->Data1, 8);
+    *(Pos++) = '-';
+    Pos = GuidHexField (Pos, Guid->Data2, 4);
+    *(Pos++) = '-';
+    Pos = GuidHexField (Pos, Guid->Data3, 4);
+    *(Pos++) = '-';
+    for (Index = 0; Index < 8; Index++) {
+        if (Index == 2) {
+            *(Pos++) = '-';
+        }
+        Pos = GuidHexField (Pos, Guid->Data4[Index], 2);
+    }
+    *Pos = 0;
 }
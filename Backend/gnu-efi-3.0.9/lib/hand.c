@@ -19,6 +19,153 @@ Revision History
 #include "efistdarg.h"                        // !!!
 
 
+//
+// Handle cache
+//
+// ByProtocol LocateHandle results are kept per protocol GUID, so that
+// repeated searches for the same protocol don't go back to the firmware
+// through a GrowBuffer loop every time. Each cached protocol gets a
+// protocol-notify event, and any new install of that protocol marks its
+// entry stale; the next lookup (never the notify function itself) then
+// refreshes it. Uninstalls aren't notified by the firmware, so callers still
+// have to expect HandleProtocol to fail on a returned handle, as they always
+// did.
+//
+// The notify functions live in this image, so LibFlushHandleCache must be
+// called before an image that used the cache exits.
+//
+
+#define HANDLE_CACHE_ENTRIES    8
+
+typedef struct {
+    EFI_GUID            Protocol;
+    EFI_EVENT           Event;              // NULL if the entry is unused
+    VOID                *Registration;
+    volatile BOOLEAN    Valid;              // Cleared by HandleCacheNotify
+    EFI_STATUS          Status;             // Of the LocateHandle call
+    UINTN               NoHandles;
+    EFI_HANDLE          *Handles;
+    EFI_HANDLE          InterfaceHandle;    // Where LibLocateProtocol last found the protocol, or NULL
+} HANDLE_CACHE_ENTRY;
+
+STATIC HANDLE_CACHE_ENTRY   HandleCache[HANDLE_CACHE_ENTRIES];
+STATIC UINTN                HandleCacheNext;    // Entry to reuse when they're all taken
+
+STATIC
+EFI_STATUS
+LocateHandleUncached (
+    IN EFI_LOCATE_SEARCH_TYPE       SearchType,
+    IN EFI_GUID                     *Protocol OPTIONAL,
+    IN VOID                         *SearchKey OPTIONAL,
+    IN OUT UINTN                    *NoHandles,
+    OUT EFI_HANDLE                  **Buffer
+    );
+
+STATIC
+VOID
+EFIAPI
+HandleCacheNotify (
+    IN EFI_EVENT    Event EFI_UNUSED,
+    IN VOID         *Context
+    )
+{
+    ((HANDLE_CACHE_ENTRY *) Context)->Valid = FALSE;
+}
+
+STATIC
+VOID
+HandleCacheRelease (
+    IN HANDLE_CACHE_ENTRY   *Entry
+    )
+{
+    if (Entry->Event) {
+        uefi_call_wrapper(BS->CloseEvent, 1, Entry->Event);
+    }
+    if (Entry->Handles) {
+        FreePool (Entry->Handles);
+    }
+    ZeroMem (Entry, sizeof(HANDLE_CACHE_ENTRY));
+}
+
+STATIC
+HANDLE_CACHE_ENTRY *
+HandleCacheLookup (
+    IN EFI_GUID     *Protocol
+    )
+//
+// Returns the up-to-date cache entry for Protocol, or NULL if it can't be cached
+//
+{
+    HANDLE_CACHE_ENTRY  *Entry;
+    UINTN               Index;
+
+    Entry = NULL;
+    for (Index=0; Index < HANDLE_CACHE_ENTRIES; Index++) {
+        if (HandleCache[Index].Event && CompareGuid (&HandleCache[Index].Protocol, Protocol) == 0) {
+            Entry = &HandleCache[Index];
+            break;
+        }
+    }
+
+    if (!Entry) {
+        for (Index=0; Index < HANDLE_CACHE_ENTRIES; Index++) {
+            if (!HandleCache[Index].Event) {
+                Entry = &HandleCache[Index];
+                break;
+            }
+        }
+
+        if (!Entry) {
+            Entry = &HandleCache[HandleCacheNext];
+            HandleCacheNext = (HandleCacheNext + 1) % HANDLE_CACHE_ENTRIES;
+            HandleCacheRelease (Entry);
+        }
+
+        //
+        // The notify event gets signalled once right away, which is harmless
+        // since the entry isn't valid yet
+        //
+
+        CopyMem (&Entry->Protocol, Protocol, sizeof(EFI_GUID));
+        Entry->Valid = FALSE;
+        Entry->Event = LibCreateProtocolNotifyEvent (Protocol, TPL_CALLBACK, HandleCacheNotify, Entry, &Entry->Registration);
+        if (!Entry->Event) {
+            return NULL;
+        }
+    }
+
+    if (!Entry->Valid) {
+        if (Entry->Handles) {
+            FreePool (Entry->Handles);
+            Entry->Handles = NULL;
+        }
+        Entry->InterfaceHandle = NULL;
+
+        // Valid goes first, so that an install during the search makes it stale again
+        Entry->Valid = TRUE;
+        Entry->Status = LocateHandleUncached (ByProtocol, Protocol, NULL, &Entry->NoHandles, &Entry->Handles);
+    }
+
+    return Entry;
+}
+
+VOID
+LibFlushHandleCache (
+    VOID
+    )
+//
+// Drop all cached handles and close the cache's notify events
+//
+{
+    UINTN           Index;
+
+    for (Index=0; Index < HANDLE_CACHE_ENTRIES; Index++) {
+        HandleCacheRelease (&HandleCache[Index]);
+    }
+    HandleCacheNext = 0;
+}
+
+
 EFI_STATUS
 LibLocateProtocol (
     IN  EFI_GUID    *ProtocolGuid,
@@ -28,13 +175,47 @@ LibLocateProtocol (
 // Find the first instance of this Protocol in the system and return it's interface
 //
 {
-    EFI_STATUS      Status;
-    UINTN           NumberHandles, Index;
-    EFI_HANDLE      *Handles;
+    EFI_STATUS          Status;
+    UINTN               NumberHandles, Index;
+    EFI_HANDLE          *Handles;
+    HANDLE_CACHE_ENTRY  *Entry;
 
     
     *Interface = NULL;
-    Status = LibLocateHandle (ByProtocol, ProtocolGuid, NULL, &NumberHandles, &Handles);
+
+    //
+    // With the handles cached, the handle the protocol was found on last time
+    // is usually still the answer
+    //
+
+    Entry = HandleCacheLookup (ProtocolGuid);
+    if (Entry) {
+        if (Entry->InterfaceHandle) {
+            Status = uefi_call_wrapper(BS->HandleProtocol, 3, Entry->InterfaceHandle, ProtocolGuid, Interface);
+            if (!EFI_ERROR(Status)) {
+                return Status;
+            }
+            Entry->InterfaceHandle = NULL;
+        }
+
+        Status = Entry->Status;
+        if (EFI_ERROR(Status)) {
+            DEBUG((D_INFO, "LibLocateProtocol: Handle not found\n"));
+            return Status;
+        }
+
+        for (Index=0; Index < Entry->NoHandles; Index++) {
+            Status = uefi_call_wrapper(BS->HandleProtocol, 3, Entry->Handles[Index], ProtocolGuid, Interface);
+            if (!EFI_ERROR(Status)) {
+                Entry->InterfaceHandle = Entry->Handles[Index];
+                break;
+            }
+        }
+
+        return Status;
+    }
+
+    Status = LocateHandleUncached (ByProtocol, ProtocolGuid, NULL, &NumberHandles, &Handles);
     if (EFI_ERROR(Status)) {
         DEBUG((D_INFO, "LibLocateProtocol: Handle not found\n"));
         return Status;
@@ -63,9 +244,50 @@ LibLocateHandle (
     OUT EFI_HANDLE                  **Buffer
     )
 
+{
+    HANDLE_CACHE_ENTRY  *Entry;
+
+    //
+    // Only plain searches by protocol are cached; the caller gets its own
+    // copy of the handles to free, as before
+    //
+
+    if (SearchType == ByProtocol && Protocol) {
+        Entry = HandleCacheLookup (Protocol);
+        if (Entry) {
+            *NoHandles = 0;
+            *Buffer = NULL;
+            if (EFI_ERROR(Entry->Status)) {
+                return Entry->Status;
+            }
+
+            *Buffer = AllocatePool (Entry->NoHandles * sizeof(EFI_HANDLE));
+            if (!*Buffer) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+            CopyMem (*Buffer, Entry->Handles, Entry->NoHandles * sizeof(EFI_HANDLE));
+            *NoHandles = Entry->NoHandles;
+            return EFI_SUCCESS;
+        }
+    }
+
+    return LocateHandleUncached (SearchType, Protocol, SearchKey, NoHandles, Buffer);
+}
+
+STATIC
+EFI_STATUS
+LocateHandleUncached (
+    IN EFI_LOCATE_SEARCH_TYPE       SearchType,
+    IN EFI_GUID                     *Protocol OPTIONAL,
+    IN VOID                         *SearchKey OPTIONAL,
+    IN OUT UINTN                    *NoHandles,
+    OUT EFI_HANDLE                  **Buffer
+    )
+
 {
     EFI_STATUS          Status;
     UINTN               BufferSize;
+    UINTN               Tries;
 
     //
     // Initialize for GrowBuffer loop
@@ -73,13 +295,15 @@ LibLocateHandle (
 
     Status = EFI_SUCCESS;
     *Buffer = NULL;
-    BufferSize = 50 * sizeof(EFI_HANDLE);
+    BufferSize = GrowBufferHints[GrowBufferLocateHandle].Size;
+    Tries = 0;
 
     //
     // Call the real function
     //
 
     while (GrowBuffer (&Status, (VOID **) Buffer, BufferSize)) {
+        Tries += 1;
 
         Status = uefi_call_wrapper(
 			BS->LocateHandle,
@@ -93,6 +317,8 @@ LibLocateHandle (
 
     }
 
+    GrowBufferHintUpdate (GrowBufferLocateHandle, Status, BufferSize, Tries);
+
     *NoHandles = BufferSize / sizeof (EFI_HANDLE);
     if (EFI_ERROR(Status)) {
         *NoHandles = 0;
@@ -112,7 +338,6 @@ LibLocateHandleByDiskSignature (
 
 {
     EFI_STATUS            Status;
-    UINTN                 BufferSize;
     UINTN                 NoBlockIoHandles;
     EFI_HANDLE            *BlockIoBuffer;
     EFI_DEVICE_PATH       *DevicePath;
@@ -123,39 +348,12 @@ LibLocateHandleByDiskSignature (
     BOOLEAN               PreviousNodeIsHardDriveDevicePath;
 
     //
-    // Initialize for GrowBuffer loop
+    // Get list of device handles that support the BLOCK_IO Protocol (from
+    // the handle cache, when it's been searched for before). This is our
+    // own copy, since non-matching entries get cleared below.
     //
 
-    Status = EFI_SUCCESS;
-    BlockIoBuffer = NULL;
-    BufferSize = 50 * sizeof(EFI_HANDLE);
-
-    //
-    // Call the real function
-    //
-
-    while (GrowBuffer (&Status, (VOID **)&BlockIoBuffer, BufferSize)) {
-
-        //
-        // Get list of device handles that support the BLOCK_IO Protocol.
-        //
-
-        Status = uefi_call_wrapper(
-			BS->LocateHandle,
-			5,
-                        ByProtocol,
-                        &BlockIoProtocol,
-                        NULL,
-                        &BufferSize,
-                        BlockIoBuffer
-                        );
-
-    }
-
-    NoBlockIoHandles = BufferSize / sizeof (EFI_HANDLE);
-    if (EFI_ERROR(Status)) {
-        NoBlockIoHandles = 0;
-    }
+    Status = LibLocateHandle (ByProtocol, &BlockIoProtocol, NULL, &NoBlockIoHandles, &BlockIoBuffer);
 
     //
     // If there was an error or there are no device handles that support 
@@ -334,6 +532,7 @@ LibFileInfo (
     EFI_STATUS              Status;
     EFI_FILE_INFO           *Buffer;
     UINTN                   BufferSize;
+    UINTN                   Tries;
 
     //
     // Initialize for GrowBuffer loop
@@ -341,13 +540,15 @@ LibFileInfo (
 
     Status = EFI_SUCCESS;
     Buffer = NULL;
-    BufferSize = SIZE_OF_EFI_FILE_INFO + 200;
+    BufferSize = GrowBufferHints[GrowBufferFileInfo].Size;
+    Tries = 0;
 
     //
     // Call the real function
     //
 
     while (GrowBuffer (&Status, (VOID **) &Buffer, BufferSize)) {
+        Tries += 1;
         Status = uefi_call_wrapper(
 		    FHand->GetInfo,
 			4,
@@ -358,6 +559,8 @@ LibFileInfo (
                     );
     }
 
+    GrowBufferHintUpdate (GrowBufferFileInfo, Status, BufferSize, Tries);
+
     return Buffer;
 }
 
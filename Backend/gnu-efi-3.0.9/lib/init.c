@@ -32,6 +32,12 @@ Routine Description:
 
     Initializes EFI library for use
 
+    Only the pool allocation type is looked up here, since every allocation
+    depends on it. The EFIDebug mask, the GUID name index, and the Unicode
+    collation driver are all set up on first use instead (by DbgPrint,
+    GuidToString, and the StriCmp family), so that programs that never need
+    them don't pay for the variable reads and handle searches at startup.
+
 Arguments:
 
     Firmware's EFI system table
@@ -44,7 +50,6 @@ Returns:
 {
     EFI_LOADED_IMAGE        *LoadedImage;
     EFI_STATUS              Status;
-    CHAR8                   *LangCode;
 
     if (!LibInitialized) {
         LibInitialized = TRUE;
@@ -81,23 +86,47 @@ Returns:
             if (!EFI_ERROR(Status)) {
                 PoolAllocationType = LoadedImage->ImageDataType;
             }
-            EFIDebugVariable ();
+            LibDebugMaskPending = TRUE;
         }
 
         //
-        // Initialize Guid table
+        // The Guid table is indexed by the first GuidToString
         //
 
-        InitializeGuid();
-
         InitializeLibPlatform(ImageHandle,SystemTable);
     }
 
     //
-    //
+    // Unicode collation is looked up by the first StriCmp, MetaiMatch,
+    // StrLwr, or StrUpr
     //
 
     if (ImageHandle && UnicodeInterface == &LibStubUnicodeInterface) {
+        LibUnicodePending = TRUE;
+    }
+}
+
+VOID
+LibInitializeUnicode (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Does the Unicode collation setup that InitializeLib deferred. Until this
+    runs, the built-in stub collation (ASCII-only case folding) is in use.
+
+--*/
+{
+    CHAR8                   *LangCode;
+
+    if (!LibUnicodePending) {
+        return;
+    }
+    LibUnicodePending = FALSE;
+
+    if (UnicodeInterface == &LibStubUnicodeInterface) {
         LangCode = LibGetVariable (VarLanguage, &EfiGlobalVariable);
         InitializeUnicodeSupport (LangCode);
         if (LangCode) {
@@ -106,6 +135,24 @@ Returns:
     }
 }
 
+VOID
+LibInitializeDebugMask (
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Reads the EFIDebug variable that InitializeLib deferred
+
+--*/
+{
+    if (LibDebugMaskPending) {
+        LibDebugMaskPending = FALSE;
+        EFIDebugVariable ();
+    }
+}
+
 VOID
 InitializeUnicodeSupport (
     CHAR8 *LangCode
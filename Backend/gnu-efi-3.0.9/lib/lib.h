@@ -67,6 +67,16 @@ LibStubStrLwrUpr (
     IN CHAR16                           *Str
     );
 
+VOID
+LibInitializeUnicode (
+    VOID
+    );
+
+VOID
+LibInitializeDebugMask (
+    VOID
+    );
+
 BOOLEAN
 LibMatchDevicePaths (
     IN  EFI_DEVICE_PATH *Multi,
@@ -88,5 +98,7 @@ extern EFI_HANDLE			LibImageHandle;
 extern SIMPLE_TEXT_OUTPUT_INTERFACE     *LibRuntimeDebugOut;
 extern EFI_UNICODE_COLLATION_INTERFACE  *UnicodeInterface;
 extern EFI_UNICODE_COLLATION_INTERFACE  LibStubUnicodeInterface;
+extern BOOLEAN                          LibUnicodePending;
+extern BOOLEAN                          LibDebugMaskPending;
 extern EFI_RAISE_TPL                    LibRuntimeRaiseTPL;
 extern EFI_RESTORE_TPL                  LibRuntimeRestoreTPL;
@@ -199,6 +199,59 @@ Returns:
     return TryAgain;
 }
 
+VOID
+GrowBufferHintUpdate (
+    IN GROW_BUFFER_SITE Site,
+    IN EFI_STATUS       Status,
+    IN UINTN            BufferSize,
+    IN UINTN            Tries
+    )
+/*++
+
+Routine Description:
+
+    Records the outcome of a GrowBuffer loop started from
+    GrowBufferHints[Site].Size, raising the hint if the call
+    needed a bigger buffer than it had.
+
+Arguments:
+
+    Site        - Which call site's hint to update
+
+    Status      - Final status of the loop
+
+    BufferSize  - Buffer size the firmware reported on success
+
+    Tries       - Number of times the loop called the firmware
+
+Returns:
+
+    None
+
+--*/
+{
+    GROW_BUFFER_HINT    *Hint;
+    UINTN               Size;
+
+    Hint = &GrowBufferHints[Site];
+    Hint->Calls += 1;
+    if (Tries > 1) {
+        Hint->Retries += Tries - 1;
+    }
+
+    //
+    // Leave an eighth again as headroom, since things like the memory
+    // map tend to grow a little between calls
+    //
+
+    if (!EFI_ERROR(Status)) {
+        Size = BufferSize + BufferSize / 8;
+        if (Size > Hint->Size) {
+            Hint->Size = Size;
+        }
+    }
+}
+
 
 EFI_MEMORY_DESCRIPTOR *
 LibMemoryMap (
@@ -211,6 +264,7 @@ LibMemoryMap (
     EFI_STATUS              Status;
     EFI_MEMORY_DESCRIPTOR   *Buffer;
     UINTN                   BufferSize;
+    UINTN                   Tries;
 
     //
     // Initialize for GrowBuffer loop
@@ -218,16 +272,20 @@ LibMemoryMap (
 
     Status = EFI_SUCCESS;
     Buffer = NULL;
-    BufferSize = sizeof(EFI_MEMORY_DESCRIPTOR);
+    BufferSize = GrowBufferHints[GrowBufferMemoryMap].Size;
+    Tries = 0;
 
     //
     // Call the real function
     //
 
     while (GrowBuffer (&Status, (VOID **) &Buffer, BufferSize)) {
+        Tries += 1;
         Status = uefi_call_wrapper(BS->GetMemoryMap, 5, &BufferSize, Buffer, MapKey, DescriptorSize, DescriptorVersion);
     }
 
+    GrowBufferHintUpdate (GrowBufferMemoryMap, Status, BufferSize, Tries);
+
     //
     // Convert buffer size to NoEntries
     //
@@ -249,19 +307,22 @@ LibGetVariableAndSize (
     EFI_STATUS              Status;
     VOID                    *Buffer;
     UINTN                   BufferSize;
+    UINTN                   Tries;
 
     //
     // Initialize for GrowBuffer loop
     //
 
     Buffer = NULL;
-    BufferSize = 100;
+    BufferSize = GrowBufferHints[GrowBufferVariable].Size;
+    Tries = 0;
 
     //
     // Call the real function
     //
 
     while (GrowBuffer (&Status, &Buffer, BufferSize)) {
+        Tries += 1;
         Status = uefi_call_wrapper(
 		    RT->GetVariable,
 			5,
@@ -272,6 +333,9 @@ LibGetVariableAndSize (
                     Buffer
                     );
     }
+
+    GrowBufferHintUpdate (GrowBufferVariable, Status, BufferSize, Tries);
+
     if (Buffer) {
         *VarSize = BufferSize;
     } else {
@@ -144,6 +144,12 @@ PPUTC (
     IN CHAR16              c
     );
 
+STATIC
+VOID
+PPUTSPAN (
+    IN OUT PRINT_STATE     *ps
+    );
+
 STATIC
 VOID
 PITEM (
@@ -213,6 +219,10 @@ Returns:
     UINTN           SavedAttribute;
 
 
+    if (LibDebugMaskPending) {
+        LibInitializeDebugMask ();
+    }
+
     if (!(EFIDebug & mask)) {
         return 0;
     }
@@ -372,9 +382,14 @@ _PoolPrint (
     if (newlen > spc->maxlen) {
 
         //
-        // Grow the pool buffer
+        // Grow the pool buffer. Grow geometrically so that building a long
+        // string out of many small CatPrints (e.g. DevicePathToStr) costs a
+        // logarithmic number of ReallocatePool copies instead of a linear one.
         //
 
+        if (newlen < spc->maxlen * 2) {
+            newlen = spc->maxlen * 2;
+        }
         newlen += PRINT_STRING_LEN;
         spc->maxlen = newlen;
         spc->str = ReallocatePool (
@@ -451,15 +466,29 @@ Returns:
 
 --*/
 {
-    POOL_PRINT          spc;
+    PRINT_STATE         ps;
+    UINTN               maxlen;
 
-    spc.str    = Str;
-    spc.maxlen = (StrSize / sizeof(CHAR16)) - 1; // Why is this subtracting 1? This means we can't use SPrint directly without cutting off a character. Better to use CatPrint instead, which accounts for this.
-    spc.len    = 0;
+    maxlen = (StrSize / sizeof(CHAR16)) - 1; // Why is this subtracting 1? This means we can't use SPrint directly without cutting off a character. Better to use CatPrint instead, which accounts for this.
 
-    _PoolCatPrint (fmt, args, &spc, _SPrint);
+    //
+    // Format straight into the caller's buffer: no staging buffer, no
+    // output callback, no pool. Output past maxlen is dropped.
+    //
 
-    return spc.len;
+    ZeroMem (&ps, sizeof(ps));
+    ps.fmt.pw = fmt;
+    ps.Buffer = Str;
+    if (StrSize / sizeof(CHAR16)) {
+        ps.End = Str + maxlen;
+    } else {
+        ps.End = (CHAR16 *) (UINTN) -1; // A size of 0 means there is no limit
+    }
+    va_copy(ps.args, args);
+    _Print (&ps);
+    va_end(ps.args);
+
+    return ps.Pos - ps.Buffer;
 }
 
 UINTN
@@ -849,6 +878,12 @@ PFLUSH (
     )
 {
     *ps->Pos = 0;
+
+    // Formatting directly into a caller's buffer (VSPrint): just terminate it
+    if (!ps->Output) {
+        return;
+    }
+
     if (IsLocalPrint(ps->Output))
 	ps->Output(ps->Context, ps->Buffer);
     else
@@ -885,12 +920,77 @@ PPUTC (
         PPUTC (ps, '\r');
     }
 
-    *ps->Pos = c;
-    ps->Pos += 1;
+    // A full caller buffer (no Output) just drops the rest
+    if (ps->Pos < ps->End) {
+        *ps->Pos = c;
+        ps->Pos += 1;
+    }
     ps->Len += 1;
 
     // if at the end of the buffer, flush it
-    if (ps->Pos >= ps->End) {
+    if (ps->Pos >= ps->End && ps->Output) {
+        PFLUSH(ps);
+    }
+}
+
+STATIC
+VOID
+PPUTSPAN (
+    IN OUT PRINT_STATE     *ps
+    )
+// Copies a run of literal format characters, up to the next '%', newline or
+// end of string, in one tight loop instead of a PGETC/PPUTC pair per char
+{
+    POINTER     *p;
+    CHAR16      *Pos, *End;
+    CHAR16      c;
+    UINTN       Index;
+
+    p = &ps->fmt;
+
+    for (;;) {
+        Pos = ps->Pos;
+        End = ps->End;
+        Index = p->Index;
+
+        if (p->Ascii) {
+            while (Pos < End) {
+                c = (CHAR16) p->pc[Index];
+                if (!c || c == '%' || c == '\n') {
+                    break;
+                }
+                *(Pos++) = c;
+                Index++;
+            }
+        } else {
+            while (Pos < End) {
+                c = p->pw[Index];
+                if (!c || c == '%' || c == '\n') {
+                    break;
+                }
+                *(Pos++) = c;
+                Index++;
+            }
+        }
+
+        ps->Len += Pos - ps->Pos;
+        ps->Pos = Pos;
+        p->Index = Index;
+
+        // Stopped on a special character (or end of format)
+        if (Pos < End) {
+            return;
+        }
+
+        // Out of room in a caller's buffer: skip the rest of the span
+        if (!ps->Output) {
+            while ((c = p->Ascii ? p->pc[p->Index] : p->pw[p->Index]) && c != '%' && c != '\n') {
+                p->Index++;
+                ps->Len++;
+            }
+            return;
+        }
+
         PFLUSH(ps);
     }
 }
@@ -1027,17 +1127,27 @@ Returns:
     PRINT_ITEM      Item;
     CHAR16          Buffer[PRINT_STRING_LEN];
 
+    // Callers that format straight into their own buffer set Buffer/End;
+    // everything else is staged here and handed to ps->Output when full
+    if (!ps->Buffer) {
+        ps->Buffer = Buffer;
+        ps->End = Buffer + PRINT_STRING_LEN - 1;
+    }
+
     ps->Len = 0;
-    ps->Buffer = Buffer;
-    ps->Pos = Buffer;
-    ps->End = Buffer + PRINT_STRING_LEN - 1;
+    ps->Pos = ps->Buffer;
     ps->Item = &Item;
 
     ps->fmt.Index = 0;
     while ((c = PGETC(&ps->fmt))) {
 
         if (c != '%') {
-            PPUTC ( ps, c );
+            if (c == '\n') {
+                PPUTC ( ps, c );
+            } else {
+                ps->fmt.Index -= 1;
+                PPUTSPAN ( ps );
+            }
             continue;
         }
 
@@ -1257,14 +1367,35 @@ Returns:
 STATIC CHAR8 Hex[] = {'0','1','2','3','4','5','6','7',
                       '8','9','A','B','C','D','E','F'};
 
+//
+// Two-digit lookup tables, so numbers are converted a byte (hex) or two
+// decimal digits at a time instead of one digit per shift/divide
+//
+
+STATIC CONST CHAR8 HexPairs[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+STATIC CONST CHAR8 DecPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
 VOID
 ValueToHex (
     IN CHAR16   *Buffer,
     IN UINT64   v
     )
 {
-    CHAR8           str[30], *p1;
+    CHAR8           str[16], *p1;
     CHAR16          *p2;
+    UINTN           b;
 
     if (!v) {
         Buffer[0] = '0';
@@ -1272,17 +1403,24 @@ ValueToHex (
         return ;
     }
 
-    p1 = str;
-    p2 = Buffer;
-
+    // Fill str from the end, one byte (two hex digits) at a time
+    p1 = str + sizeof(str);
     while (v) {
-        // Without the cast, the MSVC compiler may insert a reference to __allmull
-        *(p1++) = Hex[(UINTN)(v & 0xf)];
-        v = RShiftU64 (v, 4);
+        b = (UINTN)(v & 0xff) * 2;
+        p1 -= 2;
+        p1[0] = HexPairs[b];
+        p1[1] = HexPairs[b + 1];
+        v = RShiftU64 (v, 8);
     }
 
-    while (p1 != str) {
-        *(p2++) = *(--p1);
+    // The top byte may only have one significant digit
+    if (*p1 == '0') {
+        p1++;
+    }
+
+    p2 = Buffer;
+    while (p1 != str + sizeof(str)) {
+        *(p2++) = *(p1++);
     }
     *p2 = 0;
 }
@@ -1299,28 +1437,35 @@ ValueToString (
     CHAR8        str[40], *p1;
     CHAR16       *p2;
     UINTN        c, r;
+    UINT64       u;
 
-    if (!v) {
-        Buffer[0] = '0';
-        Buffer[1] = 0;
-        return ;
-    }
-
-    p1 = str;
     p2 = Buffer;
 
     if (v < 0) {
         *(p2++) = '-';
-        v = -v;
+        u = (UINT64)0 - (UINT64)v;
+    } else {
+        u = (UINT64)v;
     }
 
-    while (v) {
-        v = (INT64)DivU64x32 ((UINT64)v, 10, &r);
-        *(p1++) = (CHAR8)r + '0';
+    // Fill str from the end, two decimal digits per divide
+    p1 = str + sizeof(str);
+    while (u >= 100) {
+        u = DivU64x32 (u, 100, &r);
+        p1 -= 2;
+        p1[0] = DecPairs[r * 2];
+        p1[1] = DecPairs[r * 2 + 1];
+    }
+    if (u >= 10) {
+        p1 -= 2;
+        p1[0] = DecPairs[u * 2];
+        p1[1] = DecPairs[u * 2 + 1];
+    } else {
+        *(--p1) = (CHAR8)u + '0';
     }
 
-    c = (Comma ? ca[(p1 - str) % 3] : 999) + 1;
-    while (p1 != str) {
+    c = (Comma ? ca[(str + sizeof(str) - p1) % 3] : 999) + 1;
+    while (p1 != str + sizeof(str)) {
 
         c -= 1;
         if (!c) {
@@ -1328,7 +1473,7 @@ ValueToString (
             c = 3;
         }
 
-        *(p2++) = *(--p1);
+        *(p2++) = *(p1++);
     }
     *p2 = 0;
 }
@@ -19,12 +19,30 @@ Revision History
 #include "lib.h"
 
 #define SIMPLE_READ_SIGNATURE       EFI_SIGNATURE_32('s','r','d','r')
+
+//
+// Reads from a file system go through a page aligned window, so parsers
+// reading a header field by field don't make a firmware call per field.
+// The window starts at a page and doubles on every sequential refill, up
+// to SIMPLE_READ_MAX_WINDOW; a seek starts it over. Reads that wouldn't
+// fit in the largest window go straight to the caller's buffer.
+//
+
+#define SIMPLE_READ_MIN_WINDOW      EFI_PAGE_SIZE
+#define SIMPLE_READ_MAX_WINDOW      (16 * EFI_PAGE_SIZE)
+
 typedef struct _SIMPLE_READ_FILE {
     UINTN               Signature;
     BOOLEAN             FreeBuffer;
     VOID                *Source;
     UINTN               SourceSize;
     EFI_FILE_HANDLE     FileHandle;
+
+    UINT8               *Window;        // SIMPLE_READ_MAX_WINDOW bytes, once needed
+    UINTN               WindowOffset;   // File offset of Window[0]
+    UINTN               WindowSize;     // Valid bytes in Window
+    UINTN               ReadAhead;      // Size of the next refill
+    UINTN               NextOffset;     // Where a sequential read would start
 } SIMPLE_READ_HANDLE;
 
        
@@ -276,6 +294,102 @@ Done:
     return Status;
 }
 
+STATIC
+EFI_STATUS
+ReadSimpleReadFileAt (
+    IN SIMPLE_READ_HANDLE   *FHand,
+    IN UINTN                Offset,
+    IN OUT UINTN            *ReadSize,
+    OUT VOID                *Buffer
+    )
+{
+    EFI_STATUS              Status;
+
+    Status = uefi_call_wrapper(FHand->FileHandle->SetPosition, 2, FHand->FileHandle, Offset);
+
+    if (!EFI_ERROR(Status)) {
+        Status = uefi_call_wrapper(FHand->FileHandle->Read, 3, FHand->FileHandle, ReadSize, Buffer);
+    }
+
+    return Status;
+}
+
+STATIC
+EFI_STATUS
+ReadSimpleReadFileWindow (
+    IN SIMPLE_READ_HANDLE   *FHand,
+    IN UINTN                Offset,
+    IN OUT UINTN            *ReadSize,
+    OUT VOID                *Buffer
+    )
+/*++
+
+Routine Description:
+
+    Satisfies a read from the window, refilling it first if the
+    requested range isn't all in it.
+
+--*/
+{
+    EFI_STATUS              Status;
+    UINTN                   Start;
+    UINTN                   Size;
+    UINTN                   Available;
+
+    if (Offset < FHand->WindowOffset ||
+        Offset + *ReadSize > FHand->WindowOffset + FHand->WindowSize) {
+
+        if (!FHand->Window) {
+            FHand->Window = AllocatePool (SIMPLE_READ_MAX_WINDOW);
+            if (!FHand->Window) {
+                return ReadSimpleReadFileAt (FHand, Offset, ReadSize, Buffer);
+            }
+        }
+
+        //
+        // Sequential reads double the read ahead, anything else resets it
+        //
+
+        if (Offset == FHand->NextOffset && FHand->ReadAhead) {
+            FHand->ReadAhead *= 2;
+            if (FHand->ReadAhead > SIMPLE_READ_MAX_WINDOW) {
+                FHand->ReadAhead = SIMPLE_READ_MAX_WINDOW;
+            }
+        } else {
+            FHand->ReadAhead = SIMPLE_READ_MIN_WINDOW;
+        }
+
+        Start = Offset & ~((UINTN) EFI_PAGE_MASK);
+        Size = FHand->ReadAhead;
+        while (Offset + *ReadSize - Start > Size) {
+            Size *= 2;
+        }
+
+        FHand->WindowOffset = Start;
+        FHand->WindowSize = 0;
+        Status = ReadSimpleReadFileAt (FHand, Start, &Size, FHand->Window);
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        FHand->WindowSize = Size;
+    }
+
+    //
+    // A short window means the file ends in it
+    //
+
+    Available = 0;
+    if (Offset < FHand->WindowOffset + FHand->WindowSize) {
+        Available = FHand->WindowOffset + FHand->WindowSize - Offset;
+    }
+    if (*ReadSize > Available) {
+        *ReadSize = Available;
+    }
+
+    CopyMem (Buffer, FHand->Window + (Offset - FHand->WindowOffset), *ReadSize);
+    return EFI_SUCCESS;
+}
+
 EFI_STATUS
 ReadSimpleReadFile (
     IN SIMPLE_READ_FILE     UserHandle,
@@ -287,6 +401,7 @@ ReadSimpleReadFile (
     UINTN                   EndPos;
     SIMPLE_READ_HANDLE      *FHand;
     EFI_STATUS              Status;
+    UINTN                   RequestSize;
 
     FHand = UserHandle;
     ASSERT (FHand->Signature == SIMPLE_READ_SIGNATURE);
@@ -310,20 +425,104 @@ ReadSimpleReadFile (
     } else {
 
         //
-        // Read data from the file
+        // Read data from the file, through the window unless it's too
+        // big to gain anything from it
         //
 
-        Status = uefi_call_wrapper(FHand->FileHandle->SetPosition, 2, FHand->FileHandle, Offset);
-
-        if (!EFI_ERROR(Status)) {
-            Status = uefi_call_wrapper(FHand->FileHandle->Read, 3, FHand->FileHandle, ReadSize, Buffer);
+        RequestSize = *ReadSize;
+        if ((Offset & EFI_PAGE_MASK) + RequestSize > SIMPLE_READ_MAX_WINDOW) {
+            Status = ReadSimpleReadFileAt (FHand, Offset, ReadSize, Buffer);
+        } else {
+            Status = ReadSimpleReadFileWindow (FHand, Offset, ReadSize, Buffer);
         }
+        FHand->NextOffset = Offset + RequestSize;
     }
 
     return Status;
 }
 
 
+EFI_STATUS
+MapSimpleReadFile (
+    IN SIMPLE_READ_FILE     UserHandle,
+    OUT VOID                **Buffer,
+    OUT UINTN               *BufferSize
+    )
+/*++
+
+Routine Description:
+
+    Reads the whole file into one buffer, so that callers can parse
+    it in place.  Later ReadSimpleReadFile calls are served from the
+    same buffer.
+
+Arguments:
+
+    UserHandle  - File to map
+
+    Buffer      - Receives a pointer to the file's contents, which
+                  stays valid until CloseSimpleReadFile
+
+    BufferSize  - Receives the file's size
+
+Returns:
+
+    EFI_SUCCESS, or the error from reading the file
+
+--*/
+{
+    SIMPLE_READ_HANDLE      *FHand;
+    EFI_FILE_INFO           *Info;
+    EFI_STATUS              Status;
+    VOID                    *Source;
+    UINTN                   Size;
+
+    FHand = UserHandle;
+    ASSERT (FHand->Signature == SIMPLE_READ_SIGNATURE);
+
+    if (!FHand->Source) {
+        Info = LibFileInfo (FHand->FileHandle);
+        if (!Info) {
+            return EFI_DEVICE_ERROR;
+        }
+        Size = (UINTN) Info->FileSize;
+        FreePool (Info);
+
+        //
+        // Zero length files still get a buffer, so the pointer is valid
+        //
+
+        Source = AllocatePool (Size ? Size : 1);
+        if (!Source) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+
+        Status = ReadSimpleReadFileAt (FHand, 0, &Size, Source);
+        if (EFI_ERROR(Status)) {
+            FreePool (Source);
+            return Status;
+        }
+
+        FHand->Source = Source;
+        FHand->SourceSize = Size;
+        FHand->FreeBuffer = TRUE;
+
+        //
+        // The window is of no use anymore
+        //
+
+        if (FHand->Window) {
+            FreePool (FHand->Window);
+            FHand->Window = NULL;
+        }
+    }
+
+    *Buffer = FHand->Source;
+    *BufferSize = FHand->SourceSize;
+    return EFI_SUCCESS;
+}
+
+
 VOID
 CloseSimpleReadFile (
     IN SIMPLE_READ_FILE     UserHandle
@@ -343,13 +542,17 @@ CloseSimpleReadFile (
     }
 
     //
-    // If we allocated the Source buffer, free it
+    // If we allocated the Source buffer or a window, free them
     //
 
     if (FHand->FreeBuffer) {
         FreePool (FHand->Source);
     }
 
+    if (FHand->Window) {
+        FreePool (FHand->Window);
+    }
+
     //
     // Done with this simple read file handle
     //
@@ -75,6 +75,10 @@ StriCmp (
     )
 // compare strings
 {
+    if (LibUnicodePending) {
+        LibInitializeUnicode ();
+    }
+
     if (UnicodeInterface == &LibStubUnicodeInterface)
     	return UnicodeInterface->StriColl(UnicodeInterface, (CHAR16 *)s1, (CHAR16 *)s2);
     else
@@ -87,6 +91,10 @@ StrLwr (
     )
 // lwoer case string
 {
+    if (LibUnicodePending) {
+        LibInitializeUnicode ();
+    }
+
     if (UnicodeInterface == &LibStubUnicodeInterface)
     	UnicodeInterface->StrLwr(UnicodeInterface, Str);
     else uefi_call_wrapper(UnicodeInterface->StrLwr, 2, UnicodeInterface, Str);
@@ -98,6 +106,10 @@ StrUpr (
     )
 // upper case string
 {
+    if (LibUnicodePending) {
+        LibInitializeUnicode ();
+    }
+
     if (UnicodeInterface == &LibStubUnicodeInterface)
         UnicodeInterface->StrUpr(UnicodeInterface, Str);
     else uefi_call_wrapper(UnicodeInterface->StrUpr, 2, UnicodeInterface, Str);
@@ -426,6 +438,10 @@ MetaiMatch (
     IN CHAR16   *Pattern
     )
 {
+    if (LibUnicodePending) {
+        LibInitializeUnicode ();
+    }
+
     if (UnicodeInterface == &LibStubUnicodeInterface)
     	return UnicodeInterface->MetaiMatch(UnicodeInterface, String, Pattern);
     else return uefi_call_wrapper(UnicodeInterface->MetaiMatch, 3, UnicodeInterface, String, Pattern);
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# =================================
+#
+# RELEASE VERSION 1.1
+#
+# UEFI Stub Loader Host Tools Linux Compile Script
+#
+# by KNNSpeed
+#
+# =================================
+#
+
+#
+# set +v disables displaying all of the code you see here in the command line
+#
+
+set +v
+
+#
+# These run on the build machine, not in UEFI, so the system's own GCC is used.
+# Each .c file in this folder is one tool, and gets built into a program of the
+# same name next to it.
+#
+
+CurDir=$(cd "$(dirname "$0")" && pwd)
+
+for f in $CurDir/*.c; do
+  echo "gcc -O2 -Wall -Wextra --std=c11 -I$CurDir/../UEFI_Stub_Loader/inc -o ${f%.*} $f"
+  gcc -O2 -Wall -Wextra --std=c11 -I"$CurDir/../UEFI_Stub_Loader/inc" -o "${f%.*}" "$f" || exit 1
+done
+
+echo
+echo "Done!"
+echo
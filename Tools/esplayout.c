@@ -0,0 +1,1589 @@
+//==================================================================================================================================
+//  UEFI Stub Loader Tools: ESP Boot File Layout
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this program:
+//
+// Host-side (Linux) tool that rearranges a FAT ESP so that the files the loader reads at boot (Kernelcmd.txt, kernels, ISO
+// images, and initrd= files) each take one contiguous run of clusters, one after the other in the order they're read. On a
+// long-lived ESP, kernel and initrd updates leave these scattered in pieces all over the partition, and the firmware's FAT
+// driver then turns every load into many small reads.
+//
+// Usage:
+//
+//  esplayout report [OPTIONS] DEVICE [PATH...]
+//                                        Show how fragmented and spread out the boot files are, and what optimize would do
+//  esplayout optimize [OPTIONS] DEVICE [PATH...]
+//                                        Move the boot files into one run of clusters, in order, and show the result
+//
+// DEVICE is the ESP's block device (e.g. /dev/nvme0n1p1), which must not be mounted, or an image of it. PATHs are boot files on
+// it, e.g. \EFI\linux\vmlinuz.efi ("/" works too, and case doesn't matter).
+//
+// Options:
+//
+//  --trace LOG                           Boot files in the order the loader read them: the "File read:" lines of a loader
+//                                        built with TRACE_FILE_READS (see Stubloader.h). A serial console capture works as-is,
+//                                        since anything else in the log is ignored.
+//  --config PATH                         This Kernelcmd.txt (text or compiled) on the volume, and the kernels and initrd=
+//                                        files of all of its entries. Kernel paths with wildcards take every matching file.
+//  --offset BYTES                        Where the FAT volume starts in DEVICE, for whole-disk images (the partition's start
+//                                        sector from "fdisk -l", times its sector size)
+//
+// Boot files are taken from --trace first, then --config, then the PATHs. Without any of them, \EFI\Boot\Kernelcmd.txt is used
+// as --config. Files on other partitions or on the network aren't on this volume, and are skipped.
+//
+// FAT16 and FAT32 are supported. Other files are only moved when they're in the way, directories are never moved, and the
+// volume has to have at least as much free space as the boot files take up. Every file is moved by copying its data first
+// and then switching the FAT over, so an interruption can at worst leave lost clusters for fsck.fat to free; nothing that was
+// on the volume is lost. Volumes that weren't cleanly unmounted have to go through fsck.fat first.
+//
+// Build with Tools/Compile.sh.
+//
+
+#define _DEFAULT_SOURCE // For pread() and friends under --std=c11
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+
+#include "Kernelcmd_bin.h"
+
+#define DEFAULT_CONFIG "\\EFI\\Boot\\Kernelcmd.txt"
+#define TRACE_PREFIX "File read: " // What TRACE_FILE_READS prints before each path
+
+#define COPY_CHUNK 0x400000 // Most copied with one read and write when moving clusters
+#define BLOCK_ALIGNMENT 4096 // Clusters that don't start on this boundary straddle device blocks
+
+#define OWNER_FREE -1
+#define OWNER_FIXED -2 // Allocated, but not part of any file: bad or lost clusters
+
+// A file or directory on the volume. Object 0 is the root directory.
+typedef struct {
+  char * Path; // UTF-8, from the root, like \EFI\Boot\Kernelcmd.txt (empty for the root)
+  int    Parent; // Directory object it's listed in, or -1 for the root
+  UINT32 EntryOffset; // Of its short name entry, in the parent directory
+  UINT32 FirstCluster; // 0 for empty files and the FAT16 root directory
+  UINT32 Size;
+  int    IsDirectory;
+} OBJECT;
+
+typedef struct {
+  const char * Name;
+  int          Fd;
+  UINT64       Offset; // Volume start in the device
+  int          Fat32;
+  UINT32       SectorSize;
+  UINT32       ClusterSize; // In bytes
+  UINT32       Clusters; // Data clusters, numbered from 2
+  UINT32       FatCount;
+  UINT64       FatStart; // From the volume start, in bytes
+  UINT64       FatSize;
+  UINT64       RootStart; // FAT16 root directory region
+  UINT32       RootSize;
+  UINT32       RootCluster; // FAT32 root directory
+  UINT64       DataStart;
+  int          Clean; // Cleanly unmounted
+  UINT8 *      Fat; // First FAT copy
+  size_t       DirtyLow; // Byte range of Fat changed since it was last written out
+  size_t       DirtyHigh;
+  int *        Owner; // Object owning each cluster, or OWNER_*
+  OBJECT *     Objects;
+  int          ObjectCount;
+  int          ObjectMax;
+} VOLUME;
+
+// Boot files, as object numbers in the order they're read
+typedef struct {
+  int * Files;
+  int   Count;
+} BOOT_FILES;
+
+//==================================================================================================================================
+//  Helpers
+//==================================================================================================================================
+//
+// Little-endian field access, allocation, whole-file reading, and device I/O relative to the volume start.
+//
+
+static UINT32 Get32(const UINT8 *p)
+{
+  return (UINT32)p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT16 Get16(const UINT8 *p)
+{
+  return (UINT16)(p[0] | (p[1] << 8));
+}
+
+static void Put32(UINT8 *p, UINT32 Value)
+{
+  p[0] = (UINT8)Value;
+  p[1] = (UINT8)(Value >> 8);
+  p[2] = (UINT8)(Value >> 16);
+  p[3] = (UINT8)(Value >> 24);
+}
+
+static void Put16(UINT8 *p, UINT16 Value)
+{
+  p[0] = (UINT8)Value;
+  p[1] = (UINT8)(Value >> 8);
+}
+
+static void * Grow(void *Pointer, size_t Size)
+{
+  Pointer = realloc(Pointer, Size ? Size : 1);
+  if(Pointer == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+  }
+  return Pointer;
+}
+
+static UINT8 * ReadFile(const char *Name, size_t *Size)
+{
+  FILE * File = fopen(Name, "rb");
+  if(File == NULL)
+  {
+    perror(Name);
+    return NULL;
+  }
+
+  size_t Max = 4096;
+  size_t Used = 0;
+  UINT8 * Data = Grow(NULL, Max + 1);
+
+  for(;;)
+  {
+    Used += fread(&Data[Used], 1, Max - Used, File);
+    if(Used < Max)
+    {
+      break;
+    }
+    Max <<= 1;
+    Data = Grow(Data, Max + 1);
+  }
+  Data[Used] = 0; // So that text can be scanned as a string
+
+  if(ferror(File))
+  {
+    fprintf(stderr, "%s: read error\n", Name);
+    free(Data);
+    Data = NULL;
+  }
+
+  fclose(File);
+  *Size = Used;
+  return Data;
+}
+
+static int ReadAt(const VOLUME *Volume, UINT64 Position, void *Buffer, size_t Size)
+{
+  UINT8 * Bytes = Buffer;
+
+  while(Size)
+  {
+    ssize_t Done = pread(Volume->Fd, Bytes, Size, (off_t)(Volume->Offset + Position));
+    if(Done <= 0)
+    {
+      fprintf(stderr, "%s: read error at byte %llu%s%s\n", Volume->Name, (unsigned long long)(Volume->Offset + Position),
+        Done ? ": " : " (past the end)", Done ? strerror(errno) : "");
+      return -1;
+    }
+    Bytes += Done;
+    Position += (UINT64)Done;
+    Size -= (size_t)Done;
+  }
+  return 0;
+}
+
+static int WriteAt(const VOLUME *Volume, UINT64 Position, const void *Buffer, size_t Size)
+{
+  const UINT8 * Bytes = Buffer;
+
+  while(Size)
+  {
+    ssize_t Done = pwrite(Volume->Fd, Bytes, Size, (off_t)(Volume->Offset + Position));
+    if(Done <= 0)
+    {
+      fprintf(stderr, "%s: write error at byte %llu: %s\n", Volume->Name, (unsigned long long)(Volume->Offset + Position),
+        Done ? strerror(errno) : "no space");
+      return -1;
+    }
+    Bytes += Done;
+    Position += (UINT64)Done;
+    Size -= (size_t)Done;
+  }
+  return 0;
+}
+
+static int Sync(const VOLUME *Volume)
+{
+  if(fsync(Volume->Fd))
+  {
+    perror(Volume->Name);
+    return -1;
+  }
+  return 0;
+}
+
+// Converts Length UTF-16LE characters at Data to a new UTF-8 string
+static char * Utf16ToUtf8(const UINT8 *Data, size_t Length)
+{
+  char * String = Grow(NULL, Length * 3 + 1);
+  size_t Used = 0;
+
+  for(size_t i = 0; i < Length; i++)
+  {
+    UINT32 CodePoint = Get16(&Data[i * 2]);
+
+    if((CodePoint >= 0xD800) && (CodePoint <= 0xDBFF) && (i + 1 < Length) && (Get16(&Data[i * 2 + 2]) >= 0xDC00)
+      && (Get16(&Data[i * 2 + 2]) <= 0xDFFF))
+    {
+      CodePoint = 0x10000 + ((CodePoint - 0xD800) << 10) + (Get16(&Data[++i * 2]) - 0xDC00);
+    }
+
+    if(CodePoint < 0x80)
+    {
+      String[Used++] = (char)CodePoint;
+    }
+    else if(CodePoint < 0x800)
+    {
+      String[Used++] = (char)(0xC0 | (CodePoint >> 6));
+      String[Used++] = (char)(0x80 | (CodePoint & 0x3F));
+    }
+    else if(CodePoint < 0x10000)
+    {
+      String[Used++] = (char)(0xE0 | (CodePoint >> 12));
+      String[Used++] = (char)(0x80 | ((CodePoint >> 6) & 0x3F));
+      String[Used++] = (char)(0x80 | (CodePoint & 0x3F));
+    }
+    else
+    {
+      // Surrogate pairs are 2 characters in, 4 bytes out, so this still fits
+      String[Used++] = (char)(0xF0 | (CodePoint >> 18));
+      String[Used++] = (char)(0x80 | ((CodePoint >> 12) & 0x3F));
+      String[Used++] = (char)(0x80 | ((CodePoint >> 6) & 0x3F));
+      String[Used++] = (char)(0x80 | (CodePoint & 0x3F));
+    }
+  }
+
+  String[Used] = '\0';
+  return String;
+}
+
+static int FoldCase(int Char)
+{
+  return ((Char >= 'a') && (Char <= 'z')) ? (Char - ('a' - 'A')) : Char;
+}
+
+// Wildcard match of a file name, ignoring case: *, ?, and [a-z] sets, as in the loader
+static int MatchName(const char *Pattern, const char *Name)
+{
+  while(*Pattern)
+  {
+    if(*Pattern == '*')
+    {
+      Pattern++;
+      for(const char * Rest = Name; ; Rest++)
+      {
+        if(MatchName(Pattern, Rest))
+        {
+          return 1;
+        }
+        if(*Rest == '\0')
+        {
+          return 0;
+        }
+      }
+    }
+
+    if(*Name == '\0')
+    {
+      return 0;
+    }
+
+    if(*Pattern == '[')
+    {
+      const char * Set = Pattern + 1;
+      int Found = 0;
+      while(*Set && (*Set != ']'))
+      {
+        if((Set[1] == '-') && Set[2] && (Set[2] != ']'))
+        {
+          Found |= (FoldCase(*Name) >= FoldCase(Set[0])) && (FoldCase(*Name) <= FoldCase(Set[2]));
+          Set += 3;
+        }
+        else
+        {
+          Found |= (FoldCase(*Name) == FoldCase(*Set));
+          Set++;
+        }
+      }
+      if(!Found || (*Set != ']'))
+      {
+        return 0;
+      }
+      Pattern = Set + 1;
+    }
+    else if((*Pattern == '?') || (FoldCase(*Pattern) == FoldCase(*Name)))
+    {
+      Pattern++;
+    }
+    else
+    {
+      return 0;
+    }
+    Name++;
+  }
+  return *Name == '\0';
+}
+
+//==================================================================================================================================
+//  FAT Access
+//==================================================================================================================================
+//
+// The first FAT copy is kept in memory. Changes to it are written to every copy by FlushFat.
+//
+
+static int IsCluster(const VOLUME *Volume, UINT32 Cluster)
+{
+  return (Cluster >= 2) && (Cluster < Volume->Clusters + 2);
+}
+
+static UINT32 GetFat(const VOLUME *Volume, UINT32 Cluster)
+{
+  return Volume->Fat32 ? (Get32(&Volume->Fat[Cluster * 4]) & 0x0FFFFFFF) : Get16(&Volume->Fat[Cluster * 2]);
+}
+
+static void SetFat(VOLUME *Volume, UINT32 Cluster, UINT32 Value)
+{
+  size_t Position = Volume->Fat32 ? (size_t)Cluster * 4 : (size_t)Cluster * 2;
+
+  if(Volume->Fat32)
+  {
+    // The top 4 bits are reserved, and have to be left as they are
+    Put32(&Volume->Fat[Position], (Get32(&Volume->Fat[Position]) & 0xF0000000) | (Value & 0x0FFFFFFF));
+  }
+  else
+  {
+    Put16(&Volume->Fat[Position], (UINT16)Value);
+  }
+
+  if(Volume->DirtyLow >= Volume->DirtyHigh)
+  {
+    Volume->DirtyLow = Position;
+    Volume->DirtyHigh = Position;
+  }
+  if(Position < Volume->DirtyLow)
+  {
+    Volume->DirtyLow = Position;
+  }
+  if(Position + (Volume->Fat32 ? 4 : 2) > Volume->DirtyHigh)
+  {
+    Volume->DirtyHigh = Position + (Volume->Fat32 ? 4 : 2);
+  }
+}
+
+static UINT32 EndOfChain(const VOLUME *Volume)
+{
+  return Volume->Fat32 ? 0x0FFFFFFF : 0xFFFF;
+}
+
+static int FlushFat(VOLUME *Volume)
+{
+  if(Volume->DirtyLow >= Volume->DirtyHigh)
+  {
+    return 0;
+  }
+
+  for(UINT32 i = 0; i < Volume->FatCount; i++)
+  {
+    if(WriteAt(Volume, Volume->FatStart + i * Volume->FatSize + Volume->DirtyLow, &Volume->Fat[Volume->DirtyLow],
+      Volume->DirtyHigh - Volume->DirtyLow))
+    {
+      return -1;
+    }
+  }
+  Volume->DirtyLow = Volume->DirtyHigh = 0;
+  return Sync(Volume);
+}
+
+static UINT64 ClusterPosition(const VOLUME *Volume, UINT32 Cluster)
+{
+  return Volume->DataStart + (UINT64)(Cluster - 2) * Volume->ClusterSize;
+}
+
+// Follows the cluster chain starting at First. Returns a new array with *Count clusters, or NULL if the chain is broken.
+static UINT32 * GetChain(const VOLUME *Volume, UINT32 First, UINT32 *Count)
+{
+  UINT32 Max = 64;
+  UINT32 * Chain = Grow(NULL, Max * sizeof(UINT32));
+  UINT32 Cluster = First;
+
+  *Count = 0;
+  if(First == 0)
+  {
+    return Chain;
+  }
+
+  for(;;)
+  {
+    if(!IsCluster(Volume, Cluster) || (*Count >= Volume->Clusters))
+    {
+      free(Chain);
+      return NULL;
+    }
+    if(*Count == Max)
+    {
+      Max <<= 1;
+      Chain = Grow(Chain, Max * sizeof(UINT32));
+    }
+    Chain[(*Count)++] = Cluster;
+
+    Cluster = GetFat(Volume, Cluster);
+    if(Cluster >= (Volume->Fat32 ? 0x0FFFFFF8 : 0xFFF8))
+    {
+      return Chain;
+    }
+  }
+}
+
+static UINT32 CountFragments(const UINT32 *Chain, UINT32 Count)
+{
+  UINT32 Fragments = Count ? 1 : 0;
+
+  for(UINT32 i = 1; i < Count; i++)
+  {
+    if(Chain[i] != Chain[i - 1] + 1)
+    {
+      Fragments++;
+    }
+  }
+  return Fragments;
+}
+
+// Reads a whole file or directory. Returns a new buffer (null-terminated, for text) and its size in *Size.
+static UINT8 * ReadObject(const VOLUME *Volume, int Object, size_t *Size)
+{
+  const OBJECT * Entry = &Volume->Objects[Object];
+  UINT8 * Data;
+
+  if(Entry->IsDirectory && (Entry->FirstCluster == 0))
+  {
+    *Size = Volume->RootSize;
+    Data = Grow(NULL, *Size + 1);
+    if(ReadAt(Volume, Volume->RootStart, Data, *Size))
+    {
+      free(Data);
+      return NULL;
+    }
+    Data[*Size] = 0;
+    return Data;
+  }
+
+  UINT32 Count;
+  UINT32 * Chain = GetChain(Volume, Entry->FirstCluster, &Count);
+  if(Chain == NULL)
+  {
+    return NULL;
+  }
+
+  Data = Grow(NULL, (size_t)Count * Volume->ClusterSize + 1);
+  for(UINT32 i = 0; i < Count; i++)
+  {
+    if(ReadAt(Volume, ClusterPosition(Volume, Chain[i]), &Data[(size_t)i * Volume->ClusterSize], Volume->ClusterSize))
+    {
+      free(Chain);
+      free(Data);
+      return NULL;
+    }
+  }
+  free(Chain);
+
+  *Size = Entry->IsDirectory ? (size_t)Count * Volume->ClusterSize : Entry->Size;
+  Data[*Size] = 0;
+  return Data;
+}
+
+//==================================================================================================================================
+//  OpenVolume: Read the Boot Sector, FAT, and Directory Tree
+//==================================================================================================================================
+//
+// Fills in Volume, including which object owns each cluster. Returns 0 on success or prints an error and returns -1. Anything
+// fsck.fat would complain about (cross-linked clusters, broken chains, sizes that don't match) stops it here, before anything
+// is written.
+//
+
+static int AddObject(VOLUME *Volume, const OBJECT *Object)
+{
+  if(Volume->ObjectCount == Volume->ObjectMax)
+  {
+    Volume->ObjectMax = Volume->ObjectMax ? (Volume->ObjectMax << 1) : 256;
+    Volume->Objects = Grow(Volume->Objects, (size_t)Volume->ObjectMax * sizeof(OBJECT));
+  }
+  Volume->Objects[Volume->ObjectCount] = *Object;
+  return Volume->ObjectCount++;
+}
+
+// Gets the name of the short entry at Entry, using the long name entries before it (in Lfn) if they belong to it
+static char * EntryName(const UINT8 *Entry, const UINT8 *Lfn, int LfnParts, UINT8 LfnChecksum)
+{
+  UINT8 Checksum = 0;
+  for(int i = 0; i < 11; i++)
+  {
+    Checksum = (UINT8)(((Checksum & 1) << 7) + (Checksum >> 1) + Entry[i]);
+  }
+
+  if(LfnParts && (Checksum == LfnChecksum))
+  {
+    size_t Length = 0;
+    while((Length < (size_t)LfnParts * 13) && (Get16(&Lfn[Length * 2]) != 0x0000) && (Get16(&Lfn[Length * 2]) != 0xFFFF))
+    {
+      Length++;
+    }
+    return Utf16ToUtf8(Lfn, Length);
+  }
+
+  // 8.3 name, with the lowercase flags Windows and Linux set for names like "vmlinuz" that only differ in case
+  char * Name = Grow(NULL, 13);
+  size_t Used = 0;
+  for(int i = 0; (i < 8) && (Entry[i] != ' '); i++)
+  {
+    char Char = (char)(((i == 0) && (Entry[0] == 0x05)) ? 0xE5 : Entry[i]);
+    Name[Used++] = (char)(((Entry[12] & 0x08) && (Char >= 'A') && (Char <= 'Z')) ? (Char + ('a' - 'A')) : Char);
+  }
+  if(Entry[8] != ' ')
+  {
+    Name[Used++] = '.';
+    for(int i = 8; (i < 11) && (Entry[i] != ' '); i++)
+    {
+      Name[Used++] = (char)(((Entry[12] & 0x10) && (Entry[i] >= 'A') && (Entry[i] <= 'Z')) ? (Entry[i] + ('a' - 'A')) : Entry[i]);
+    }
+  }
+  Name[Used] = '\0';
+  return Name;
+}
+
+static int ReadDirectory(VOLUME *Volume, int Directory)
+{
+  size_t Size;
+  UINT8 * Data = ReadObject(Volume, Directory, &Size);
+  UINT8 Lfn[20 * 26];
+  int LfnParts = 0;
+  UINT8 LfnChecksum = 0;
+
+  if(Data == NULL)
+  {
+    return -1;
+  }
+
+  for(size_t Offset = 0; (Offset + 32 <= Size) && (Data[Offset] != 0x00); Offset += 32)
+  {
+    const UINT8 * Entry = &Data[Offset];
+
+    if(Entry[0] == 0xE5)
+    {
+      LfnParts = 0;
+      continue;
+    }
+
+    if(Entry[11] == 0x0F)
+    {
+      // Long name parts come last to first, each with 13 characters
+      int Part = Entry[0] & 0x1F;
+      if((Part == 0) || (Part > 20))
+      {
+        LfnParts = 0;
+        continue;
+      }
+      if(Entry[0] & 0x40)
+      {
+        LfnParts = Part;
+        LfnChecksum = Entry[13];
+        memset(Lfn, 0xFF, sizeof(Lfn));
+      }
+      else if((LfnParts == 0) || (Entry[13] != LfnChecksum))
+      {
+        LfnParts = 0;
+        continue;
+      }
+      UINT8 * Characters = &Lfn[(Part - 1) * 26];
+      memcpy(Characters, &Entry[1], 10);
+      memcpy(&Characters[10], &Entry[14], 12);
+      memcpy(&Characters[22], &Entry[28], 4);
+      continue;
+    }
+
+    if((Entry[11] & 0x08) || (Entry[0] == '.'))
+    {
+      // Volume label, or the . and .. entries
+      LfnParts = 0;
+      continue;
+    }
+
+    char * Name = EntryName(Entry, Lfn, LfnParts, LfnChecksum);
+    LfnParts = 0;
+
+    OBJECT Object;
+    Object.Path = Grow(NULL, strlen(Volume->Objects[Directory].Path) + strlen(Name) + 2);
+    sprintf(Object.Path, "%s\\%s", Volume->Objects[Directory].Path, Name);
+    free(Name);
+    Object.Parent = Directory;
+    Object.EntryOffset = (UINT32)Offset;
+    Object.FirstCluster = ((UINT32)Get16(&Entry[20]) << 16) | Get16(&Entry[26]);
+    if(!Volume->Fat32)
+    {
+      Object.FirstCluster &= 0xFFFF;
+    }
+    Object.Size = Get32(&Entry[28]);
+    Object.IsDirectory = (Entry[11] & 0x10) != 0;
+    if(Object.IsDirectory)
+    {
+      Object.Size = 0;
+      if(Object.FirstCluster == 0)
+      {
+        fprintf(stderr, "%s: directory %s has no clusters; run fsck.fat first\n", Volume->Name, Object.Path);
+        free(Object.Path);
+        free(Data);
+        return -1;
+      }
+    }
+    AddObject(Volume, &Object);
+  }
+
+  free(Data);
+  return 0;
+}
+
+// Marks the clusters of an object as its own, checking that nothing else has them
+static int ClaimChain(VOLUME *Volume, int Object)
+{
+  const OBJECT * Entry = &Volume->Objects[Object];
+  UINT32 Count;
+  UINT32 * Chain = GetChain(Volume, Entry->FirstCluster, &Count);
+
+  if(Chain == NULL)
+  {
+    fprintf(stderr, "%s: %s has a broken cluster chain; run fsck.fat first\n", Volume->Name, Object ? Entry->Path : "\\");
+    return -1;
+  }
+
+  if(!Entry->IsDirectory && (Count != (UINT32)(((UINT64)Entry->Size + Volume->ClusterSize - 1) / Volume->ClusterSize)))
+  {
+    fprintf(stderr, "%s: %s has %u clusters for %u bytes; run fsck.fat first\n", Volume->Name, Entry->Path, Count, Entry->Size);
+    free(Chain);
+    return -1;
+  }
+
+  for(UINT32 i = 0; i < Count; i++)
+  {
+    if(Volume->Owner[Chain[i]] != OWNER_FREE)
+    {
+      fprintf(stderr, "%s: %s is cross-linked with %s; run fsck.fat first\n", Volume->Name, Object ? Entry->Path : "\\",
+        Volume->Objects[Volume->Owner[Chain[i]]].Path);
+      free(Chain);
+      return -1;
+    }
+    Volume->Owner[Chain[i]] = Object;
+  }
+
+  free(Chain);
+  return 0;
+}
+
+static int OpenVolume(const char *Name, UINT64 Offset, int Writable, VOLUME *Volume)
+{
+  UINT8 BootSector[512];
+  struct stat Info;
+
+  memset(Volume, 0, sizeof(*Volume));
+  Volume->Name = Name;
+  Volume->Offset = Offset;
+
+  // O_EXCL keeps mounted block devices from being opened at all, which is exactly what's wanted for writing
+  Volume->Fd = open(Name, Writable ? O_RDWR : O_RDONLY);
+  if((Volume->Fd >= 0) && Writable && !fstat(Volume->Fd, &Info) && S_ISBLK(Info.st_mode))
+  {
+    close(Volume->Fd);
+    Volume->Fd = open(Name, O_RDWR | O_EXCL);
+    if((Volume->Fd < 0) && (errno == EBUSY))
+    {
+      fprintf(stderr, "%s: in use; unmount it first\n", Name);
+      return -1;
+    }
+  }
+  if(Volume->Fd < 0)
+  {
+    perror(Name);
+    return -1;
+  }
+
+  if(ReadAt(Volume, 0, BootSector, sizeof(BootSector)))
+  {
+    return -1;
+  }
+
+  UINT32 SectorSize = Get16(&BootSector[11]);
+  UINT32 SectorsPerCluster = BootSector[13];
+  UINT32 ReservedSectors = Get16(&BootSector[14]);
+  UINT32 FatCount = BootSector[16];
+  UINT32 RootEntries = Get16(&BootSector[17]);
+  UINT32 TotalSectors = Get16(&BootSector[19]) ? Get16(&BootSector[19]) : Get32(&BootSector[32]);
+  UINT32 FatSectors = Get16(&BootSector[22]) ? Get16(&BootSector[22]) : Get32(&BootSector[36]);
+
+  if((Get16(&BootSector[510]) != 0xAA55) || (SectorSize < 512) || (SectorSize > 4096) || (SectorSize & (SectorSize - 1))
+    || (SectorsPerCluster == 0) || (SectorsPerCluster & (SectorsPerCluster - 1)) || (ReservedSectors == 0) || (FatCount == 0)
+    || (FatSectors == 0))
+  {
+    fprintf(stderr, "%s: not a FAT volume%s\n", Name, Offset ? "" : " (for a whole-disk image, give the partition's --offset)");
+    return -1;
+  }
+
+  UINT32 RootSectors = (RootEntries * 32 + SectorSize - 1) / SectorSize;
+  UINT64 DataSector = (UINT64)ReservedSectors + (UINT64)FatCount * FatSectors + RootSectors;
+  if(DataSector >= TotalSectors)
+  {
+    fprintf(stderr, "%s: not a FAT volume\n", Name);
+    return -1;
+  }
+
+  Volume->SectorSize = SectorSize;
+  Volume->ClusterSize = SectorSize * SectorsPerCluster;
+  Volume->Clusters = (UINT32)((TotalSectors - DataSector) / SectorsPerCluster);
+  Volume->FatCount = FatCount;
+  Volume->FatStart = (UINT64)ReservedSectors * SectorSize;
+  Volume->FatSize = (UINT64)FatSectors * SectorSize;
+  Volume->RootStart = Volume->FatStart + FatCount * Volume->FatSize;
+  Volume->RootSize = RootSectors * SectorSize;
+  Volume->DataStart = DataSector * SectorSize;
+
+  if(Volume->Clusters < 4085)
+  {
+    fprintf(stderr, "%s: FAT12 volumes aren't supported\n", Name);
+    return -1;
+  }
+  Volume->Fat32 = Volume->Clusters >= 65525;
+  if(Volume->Fat32)
+  {
+    Volume->RootCluster = Get32(&BootSector[44]);
+  }
+
+  if(Volume->FatSize < (UINT64)(Volume->Clusters + 2) * (Volume->Fat32 ? 4 : 2))
+  {
+    fprintf(stderr, "%s: FAT is too small for the volume; run fsck.fat first\n", Name);
+    return -1;
+  }
+
+  Volume->Fat = Grow(NULL, Volume->FatSize);
+  if(ReadAt(Volume, Volume->FatStart, Volume->Fat, Volume->FatSize))
+  {
+    return -1;
+  }
+
+  // Linux and Windows clear these while the volume is mounted
+  Volume->Clean = Volume->Fat32 ? ((Get32(&Volume->Fat[4]) & 0x08000000) && !(BootSector[65] & 1))
+                                : ((Get16(&Volume->Fat[2]) & 0x8000) && !(BootSector[37] & 1));
+
+  Volume->Owner = Grow(NULL, (Volume->Clusters + 2) * sizeof(int));
+  for(UINT32 i = 0; i < Volume->Clusters + 2; i++)
+  {
+    Volume->Owner[i] = OWNER_FREE;
+  }
+
+  OBJECT Root = { Grow(NULL, 1), -1, 0, Volume->Fat32 ? Volume->RootCluster : 0, 0, 1 };
+  Root.Path[0] = '\0';
+  AddObject(Volume, &Root);
+
+  // Breadth first, with each directory's clusters claimed before it's read so that loops can't go on forever
+  for(int i = 0; i < Volume->ObjectCount; i++)
+  {
+    if(ClaimChain(Volume, i) || (Volume->Objects[i].IsDirectory && ReadDirectory(Volume, i)))
+    {
+      return -1;
+    }
+  }
+
+  for(UINT32 i = 2; i < Volume->Clusters + 2; i++)
+  {
+    if((Volume->Owner[i] == OWNER_FREE) && (GetFat(Volume, i) != 0))
+    {
+      Volume->Owner[i] = OWNER_FIXED;
+    }
+  }
+
+  return 0;
+}
+
+//==================================================================================================================================
+//  Boot File Lists
+//==================================================================================================================================
+//
+// Paths are looked up the way the firmware does: from the root, with \ or / between names, ignoring case. A path without a
+// leading \ is from the root all the same.
+//
+
+// Paths on the volume are kept as \NAME\NAME; this turns any other way of writing one into that, like /efi//boot/ for \efi\boot
+static char * NormalizePath(const char *Path)
+{
+  char * Normal = Grow(NULL, strlen(Path) + 2);
+  size_t Used = 0;
+
+  for(; *Path; Path++)
+  {
+    if((*Path == '\\') || (*Path == '/'))
+    {
+      continue;
+    }
+    if((Used == 0) || (Path[-1] == '\\') || (Path[-1] == '/'))
+    {
+      Normal[Used++] = '\\';
+    }
+    Normal[Used++] = *Path;
+  }
+  Normal[Used] = '\0';
+  return Normal;
+}
+
+static int FindPath(const VOLUME *Volume, const char *Path)
+{
+  char * Normal = NormalizePath(Path);
+
+  for(int i = 1; i < Volume->ObjectCount; i++)
+  {
+    const char * a = Volume->Objects[i].Path;
+    const char * b = Normal;
+    while(*a && (FoldCase(*a) == FoldCase(*b)))
+    {
+      a++;
+      b++;
+    }
+    if((*a == '\0') && (*b == '\0'))
+    {
+      free(Normal);
+      return i;
+    }
+  }
+  free(Normal);
+  return -1;
+}
+
+static void AddObjectToList(BOOT_FILES *List, int Object)
+{
+  for(int i = 0; i < List->Count; i++)
+  {
+    if(List->Files[i] == Object)
+    {
+      return;
+    }
+  }
+  List->Files = Grow(List->Files, (List->Count + 1) * sizeof(int));
+  List->Files[List->Count++] = Object;
+}
+
+// Adds the file at Path, or every file matching it if its file name is a wildcard pattern
+static void AddPath(const VOLUME *Volume, BOOT_FILES *List, const char *Path, const char *From)
+{
+  const char * FileName = Path;
+  for(const char * p = Path; *p; p++)
+  {
+    if((*p == '\\') || (*p == '/'))
+    {
+      FileName = p + 1;
+    }
+  }
+
+  if(strpbrk(FileName, "*?["))
+  {
+    char * Directory = Grow(NULL, (size_t)(FileName - Path) + 1);
+    memcpy(Directory, Path, (size_t)(FileName - Path));
+    Directory[FileName - Path] = '\0';
+    if((FileName > Path) && (Directory[FileName - Path - 1] == '\\' || Directory[FileName - Path - 1] == '/'))
+    {
+      Directory[FileName - Path - 1] = '\0';
+    }
+    int Parent = Directory[0] ? FindPath(Volume, Directory) : 0;
+    free(Directory);
+
+    int Found = 0;
+    for(int i = 1; (Parent >= 0) && (i < Volume->ObjectCount); i++)
+    {
+      const OBJECT * Object = &Volume->Objects[i];
+      if((Object->Parent == Parent) && !Object->IsDirectory && MatchName(FileName, strrchr(Object->Path, '\\') + 1))
+      {
+        AddObjectToList(List, i);
+        Found = 1;
+      }
+    }
+    if(!Found)
+    {
+      printf("%s: nothing matches %s on this volume, skipped\n", From, Path);
+    }
+    return;
+  }
+
+  int Object = FindPath(Volume, Path);
+  if((Object < 0) || Volume->Objects[Object].IsDirectory)
+  {
+    printf("%s: %s isn't a file on this volume, skipped\n", From, Path);
+    return;
+  }
+  AddObjectToList(List, Object);
+}
+
+// Takes the "File read:" paths in a loader log, in order
+static int AddTrace(const VOLUME *Volume, BOOT_FILES *List, const char *LogName)
+{
+  size_t Size;
+  char * Log = (char *)ReadFile(LogName, &Size);
+  int Lines = 0;
+
+  if(Log == NULL)
+  {
+    return -1;
+  }
+
+  for(char * Line = strstr(Log, TRACE_PREFIX); Line != NULL; Line = strstr(Line, TRACE_PREFIX))
+  {
+    Line += strlen(TRACE_PREFIX);
+    char * End = Line + strcspn(Line, "\r\n");
+    char Saved = *End;
+    *End = '\0';
+
+    // Trailing spaces are cut off in place; the scan picks up again from End, where the line really ended
+    size_t Length = (size_t)(End - Line);
+    while(Length && (Line[Length - 1] == ' '))
+    {
+      Line[--Length] = '\0';
+    }
+    if(Length)
+    {
+      AddPath(Volume, List, Line, LogName);
+      Lines++;
+    }
+
+    *End = Saved;
+    Line = End;
+  }
+
+  free(Log);
+  if(Lines == 0)
+  {
+    fprintf(stderr, "%s: no \"" TRACE_PREFIX "\" lines; build the loader with TRACE_FILE_READS\n", LogName);
+    return -1;
+  }
+  return 0;
+}
+
+// Adds the files of one boot entry: its kernel (or ISO image), and its initrd= files unless they're inside an ISO image
+static void AddEntry(const VOLUME *Volume, BOOT_FILES *List, const char *ConfigPath, char *KernelPath, const char *Cmdline)
+{
+  // PARTUUID=..., TFTP=..., and so on are somewhere else
+  size_t PrefixLength = strcspn(KernelPath, "\\/");
+  if(memchr(KernelPath, '=', PrefixLength))
+  {
+    printf("%s: %s isn't on this volume, skipped\n", ConfigPath, KernelPath);
+    return;
+  }
+
+  // \EFI\iso\rescue.iso:\casper\vmlinuz reads only the image from here
+  char * IsoSeparator = strchr(KernelPath, ':');
+  if(IsoSeparator != NULL)
+  {
+    *IsoSeparator = '\0';
+    AddPath(Volume, List, KernelPath, ConfigPath);
+    *IsoSeparator = ':';
+    return;
+  }
+
+  AddPath(Volume, List, KernelPath, ConfigPath);
+
+  for(const char * Argument = Cmdline; *Argument; )
+  {
+    Argument += strspn(Argument, " \t");
+    size_t Length = strcspn(Argument, " \t");
+    if((Length > 7) && !strncmp(Argument, "initrd=", 7))
+    {
+      char * Path = Grow(NULL, Length - 6);
+      memcpy(Path, Argument + 7, Length - 7);
+      Path[Length - 7] = '\0';
+      AddPath(Volume, List, Path, ConfigPath);
+      free(Path);
+    }
+    Argument += Length;
+  }
+}
+
+// Takes Kernelcmd.txt itself and the files of all of its entries
+static int AddConfig(const VOLUME *Volume, BOOT_FILES *List, const char *ConfigPath)
+{
+  int Object = FindPath(Volume, ConfigPath);
+  if((Object < 0) || Volume->Objects[Object].IsDirectory)
+  {
+    fprintf(stderr, "%s: %s isn't on this volume\n", Volume->Name, ConfigPath);
+    return -1;
+  }
+  AddObjectToList(List, Object);
+
+  size_t Size;
+  UINT8 * Data = ReadObject(Volume, Object, &Size);
+  if(Data == NULL)
+  {
+    return -1;
+  }
+
+  if((Size >= sizeof(KERNELCMD_BIN_HEADER)) && (Get32(Data) == KERNELCMD_BIN_SIGNATURE))
+  {
+    // Compiled config; "kcmdtool check" is the one to complain about anything wrong with it, so bad entries are just skipped
+    UINT32 EntryCount = Get32(&Data[16]);
+    UINT32 EntrySize = Get32(&Data[20]);
+    UINT32 EntryTable = Get32(&Data[24]);
+
+    for(UINT32 i = 0; (EntrySize >= sizeof(KERNELCMD_BIN_ENTRY)) && (i < EntryCount); i++)
+    {
+      UINT64 EntryOffset = EntryTable + (UINT64)i * EntrySize;
+      if(EntryOffset + sizeof(KERNELCMD_BIN_ENTRY) > Size)
+      {
+        break;
+      }
+      const UINT8 * Entry = &Data[EntryOffset];
+      if(((UINT64)Get32(&Entry[0]) + (UINT64)Get32(&Entry[4]) * 2 > Size) || ((UINT64)Get32(&Entry[8]) + (UINT64)Get32(&Entry[12]) * 2 > Size))
+      {
+        continue;
+      }
+      char * KernelPath = Utf16ToUtf8(&Data[Get32(&Entry[0])], Get32(&Entry[4]));
+      char * Cmdline = Utf16ToUtf8(&Data[Get32(&Entry[8])], Get32(&Entry[12]));
+      AddEntry(Volume, List, ConfigPath, KernelPath, Cmdline);
+      free(KernelPath);
+      free(Cmdline);
+    }
+    free(Data);
+    return 0;
+  }
+
+  // Text config: the first line is the kernel path with spaces dropped, and the second is the command line
+  char * Text;
+  if((Size >= 2) && (Data[0] == 0xFF) && (Data[1] == 0xFE))
+  {
+    Text = Utf16ToUtf8(&Data[2], (Size - 2) / 2);
+  }
+  else
+  {
+    size_t Bom = ((Size >= 3) && (Data[0] == 0xEF) && (Data[1] == 0xBB) && (Data[2] == 0xBF)) ? 3 : 0;
+    Text = Grow(NULL, Size - Bom + 1);
+    memcpy(Text, &Data[Bom], Size - Bom + 1);
+  }
+  free(Data);
+
+  size_t PathLength = strcspn(Text, "\r\n");
+  char * Cmdline = &Text[PathLength];
+  if((Cmdline[0] == '\r') && (Cmdline[1] == '\n'))
+  {
+    Cmdline += 2;
+  }
+  else if(*Cmdline)
+  {
+    Cmdline++;
+  }
+  Cmdline[strcspn(Cmdline, "\r\n")] = '\0';
+  Text[PathLength] = '\0';
+
+  size_t Used = 0;
+  for(size_t i = 0; i < PathLength; i++)
+  {
+    if(Text[i] != ' ')
+    {
+      Text[Used++] = Text[i];
+    }
+  }
+  Text[Used] = '\0';
+
+  if(Used)
+  {
+    AddEntry(Volume, List, ConfigPath, Text, Cmdline);
+  }
+  free(Text);
+  return 0;
+}
+
+//==================================================================================================================================
+//  PrintLayout: Show Where the Boot Files Are
+//==================================================================================================================================
+//
+// Lists each boot file's clusters and fragments, and how far apart the first and last boot clusters are. Returns 1 if the
+// files are already laid out as well as they can be: each in one piece, right after the one before it.
+//
+
+static int PrintLayout(const VOLUME *Volume, const BOOT_FILES *List)
+{
+  UINT64 TotalClusters = 0;
+  UINT64 TotalFragments = 0;
+  UINT32 Lowest = 0xFFFFFFFF;
+  UINT32 Highest = 0;
+  UINT32 Previous = 0; // Last cluster of the previous non-empty file
+  int InOrder = 1;
+
+  printf("%10s %9s %9s  %s\n", "Bytes", "Fragments", "Cluster", "File");
+  for(int i = 0; i < List->Count; i++)
+  {
+    const OBJECT * Object = &Volume->Objects[List->Files[i]];
+    UINT32 Count;
+    UINT32 * Chain = GetChain(Volume, Object->FirstCluster, &Count);
+    UINT32 Fragments = CountFragments(Chain, Count);
+
+    printf("%10u %9u %9u  %s\n", Object->Size, Fragments, Object->FirstCluster, Object->Path);
+
+    if(Count)
+    {
+      TotalClusters += Count;
+      TotalFragments += Fragments;
+      InOrder &= (Fragments == 1) && ((Previous == 0) || (Chain[0] == Previous + 1));
+      Previous = Chain[Count - 1];
+      for(UINT32 c = 0; c < Count; c++)
+      {
+        Lowest = (Chain[c] < Lowest) ? Chain[c] : Lowest;
+        Highest = (Chain[c] > Highest) ? Chain[c] : Highest;
+      }
+    }
+    free(Chain);
+  }
+
+  if(TotalClusters == 0)
+  {
+    printf("No clusters to lay out.\n");
+    return 1;
+  }
+
+  printf("%d file%s in %llu fragment%s, %llu clusters of %u bytes spread over %u clusters\n", List->Count, (List->Count == 1) ? "" : "s",
+    (unsigned long long)TotalFragments, (TotalFragments == 1) ? "" : "s", (unsigned long long)TotalClusters, Volume->ClusterSize,
+    Highest - Lowest + 1);
+  return InOrder;
+}
+
+//==================================================================================================================================
+//  FindSpace: Pick Where the Boot Files Go
+//==================================================================================================================================
+//
+// Finds the run of Needed clusters with the fewest allocated clusters in it (to move out of the way), skipping any with
+// directories or clusters that don't belong to a file, and the lowest of those if there's a tie. Returns 0 and the run's first
+// cluster and allocated count, or prints why there's no room and returns -1.
+//
+
+static int FindSpace(const VOLUME *Volume, UINT32 Needed, UINT32 *Start, UINT32 *InTheWay)
+{
+  UINT32 Free = 0;
+  for(UINT32 c = 2; c < Volume->Clusters + 2; c++)
+  {
+    Free += (Volume->Owner[c] == OWNER_FREE);
+  }
+
+  // Everything in the run gets moved out first, boot files included, so there has to be room for all of it elsewhere
+  if(Free < Needed)
+  {
+    fprintf(stderr, "%s: needs %llu bytes free to move the boot files, but has %llu\n", Volume->Name,
+      (unsigned long long)Needed * Volume->ClusterSize, (unsigned long long)Free * Volume->ClusterSize);
+    return -1;
+  }
+
+  UINT32 Used = 0;
+  UINT32 Fixed = 0;
+  UINT32 Best = 0xFFFFFFFF;
+
+  for(UINT32 c = 2; c < Volume->Clusters + 2; c++)
+  {
+    int Owner = Volume->Owner[c];
+    Used += (Owner != OWNER_FREE);
+    Fixed += (Owner == OWNER_FIXED) || ((Owner >= 0) && Volume->Objects[Owner].IsDirectory);
+
+    if(c >= 2 + Needed)
+    {
+      Owner = Volume->Owner[c - Needed];
+      Used -= (Owner != OWNER_FREE);
+      Fixed -= (Owner == OWNER_FIXED) || ((Owner >= 0) && Volume->Objects[Owner].IsDirectory);
+    }
+
+    if((c + 1 >= 2 + Needed) && (Fixed == 0) && (Used < Best))
+    {
+      Best = Used;
+      *Start = c + 1 - Needed;
+      if(Used == 0)
+      {
+        break;
+      }
+    }
+  }
+
+  if(Best == 0xFFFFFFFF)
+  {
+    fprintf(stderr, "%s: no run of %u clusters without directories in it\n", Volume->Name, Needed);
+    return -1;
+  }
+  *InTheWay = Best;
+  return 0;
+}
+
+//==================================================================================================================================
+//  MoveClusters: Move Some of a File's Clusters
+//==================================================================================================================================
+//
+// Moves the clusters of Object's chain (Old, Count long) to New, which has the same clusters where they stay put and free ones
+// where they move. The data is copied and synced first, then the new clusters are linked up among themselves, then the file is
+// switched over to them (its directory entry and any clusters staying put that lead into moved ones), and only then are the old
+// ones freed. Either chain holds the same data until the switch, so stopping anywhere leaves the file whole.
+//
+
+static int WriteFirstCluster(VOLUME *Volume, int Object, UINT32 Cluster)
+{
+  const OBJECT * Entry = &Volume->Objects[Object];
+  const OBJECT * Parent = &Volume->Objects[Entry->Parent];
+  UINT64 Position;
+  UINT8 DirEntry[32];
+
+  if(Parent->FirstCluster == 0)
+  {
+    Position = Volume->RootStart + Entry->EntryOffset;
+  }
+  else
+  {
+    // Directories never move, so their chains are the same as when they were read
+    UINT32 Count;
+    UINT32 * Chain = GetChain(Volume, Parent->FirstCluster, &Count);
+    Position = ClusterPosition(Volume, Chain[Entry->EntryOffset / Volume->ClusterSize]) + Entry->EntryOffset % Volume->ClusterSize;
+    free(Chain);
+  }
+
+  if(ReadAt(Volume, Position, DirEntry, sizeof(DirEntry)))
+  {
+    return -1;
+  }
+  if(((((UINT32)Get16(&DirEntry[20]) << 16) | Get16(&DirEntry[26])) & (Volume->Fat32 ? 0x0FFFFFFF : 0xFFFF)) != Entry->FirstCluster)
+  {
+    fprintf(stderr, "%s: directory entry of %s changed while working on it\n", Volume->Name, Entry->Path);
+    return -1;
+  }
+
+  if(Volume->Fat32)
+  {
+    Put16(&DirEntry[20], (UINT16)(Cluster >> 16));
+  }
+  Put16(&DirEntry[26], (UINT16)Cluster);
+  return WriteAt(Volume, Position, DirEntry, sizeof(DirEntry));
+}
+
+static int MoveClusters(VOLUME *Volume, int Object, const UINT32 *Old, const UINT32 *New, UINT32 Count)
+{
+  UINT8 * Buffer = Grow(NULL, COPY_CHUNK);
+  UINT32 ChunkClusters = COPY_CHUNK / Volume->ClusterSize;
+
+  ChunkClusters = ChunkClusters ? ChunkClusters : 1;
+  for(UINT32 i = 0; i < Count; )
+  {
+    if(Old[i] == New[i])
+    {
+      i++;
+      continue;
+    }
+
+    // Copy runs that are contiguous on both ends in one go
+    UINT32 Run = 1;
+    while((i + Run < Count) && (Run < ChunkClusters) && (Old[i + Run] == Old[i] + Run) && (New[i + Run] == New[i] + Run))
+    {
+      Run++;
+    }
+    size_t Bytes = (size_t)Run * Volume->ClusterSize;
+    if(Bytes > COPY_CHUNK)
+    {
+      Buffer = Grow(Buffer, Bytes); // Only for clusters bigger than COPY_CHUNK
+    }
+    if(ReadAt(Volume, ClusterPosition(Volume, Old[i]), Buffer, Bytes) || WriteAt(Volume, ClusterPosition(Volume, New[i]), Buffer, Bytes))
+    {
+      free(Buffer);
+      return -1;
+    }
+    i += Run;
+  }
+  free(Buffer);
+  if(Sync(Volume))
+  {
+    return -1;
+  }
+
+  for(UINT32 i = 0; i < Count; i++)
+  {
+    if(Old[i] != New[i])
+    {
+      SetFat(Volume, New[i], (i + 1 < Count) ? New[i + 1] : EndOfChain(Volume));
+      Volume->Owner[New[i]] = Object;
+    }
+  }
+  if(FlushFat(Volume))
+  {
+    return -1;
+  }
+
+  for(UINT32 i = 0; i + 1 < Count; i++)
+  {
+    if((Old[i] == New[i]) && (Old[i + 1] != New[i + 1]))
+    {
+      SetFat(Volume, Old[i], New[i + 1]);
+    }
+  }
+  if(Count && (Old[0] != New[0]))
+  {
+    if(WriteFirstCluster(Volume, Object, New[0]))
+    {
+      return -1;
+    }
+    Volume->Objects[Object].FirstCluster = New[0];
+  }
+  if(FlushFat(Volume))
+  {
+    return -1;
+  }
+
+  for(UINT32 i = 0; i < Count; i++)
+  {
+    if(Old[i] != New[i])
+    {
+      SetFat(Volume, Old[i], 0);
+      Volume->Owner[Old[i]] = OWNER_FREE;
+    }
+  }
+  return FlushFat(Volume);
+}
+
+//==================================================================================================================================
+//  Optimize: Lay Out the Boot Files
+//==================================================================================================================================
+//
+// Clears out the run FindSpace picked by moving whatever's there to free clusters outside of it, then moves the boot files
+// into it one after the other. Boot files already in the run get moved out and back in like anything else, which keeps this
+// simple at the cost of some copying.
+//
+
+static int Optimize(VOLUME *Volume, const BOOT_FILES *List, UINT32 Needed)
+{
+  UINT32 Start;
+  UINT32 InTheWay;
+
+  if(FindSpace(Volume, Needed, &Start, &InTheWay))
+  {
+    return -1;
+  }
+
+  UINT32 End = Start + Needed;
+  UINT32 Next = (End < Volume->Clusters + 2) ? End : 2; // Where to look for free clusters next
+  UINT32 Moved = 0;
+
+  for(int o = 1; (o < Volume->ObjectCount) && (Moved < InTheWay); o++)
+  {
+    OBJECT * Object = &Volume->Objects[o];
+    UINT32 Count;
+    UINT32 * Old = GetChain(Volume, Object->FirstCluster, &Count);
+    UINT32 * New = Grow(NULL, (Count ? Count : 1) * sizeof(UINT32));
+    int InRun = 0;
+
+    for(UINT32 i = 0; i < Count; i++)
+    {
+      New[i] = Old[i];
+      if((Old[i] >= Start) && (Old[i] < End))
+      {
+        // Searching on from the last one keeps the moved clusters of each file together
+        while((Volume->Owner[Next] != OWNER_FREE) || ((Next >= Start) && (Next < End)))
+        {
+          Next = (Next + 1 < Volume->Clusters + 2) ? Next + 1 : 2;
+        }
+        New[i] = Next;
+        Volume->Owner[Next] = o; // Reserved until MoveClusters links it up
+        InRun++;
+      }
+    }
+
+    int Failed = InRun && MoveClusters(Volume, o, Old, New, Count);
+    Moved += (UINT32)InRun;
+    free(Old);
+    free(New);
+    if(Failed)
+    {
+      return -1;
+    }
+  }
+  if(InTheWay)
+  {
+    printf("Moved %u clusters out of the way\n", Moved);
+  }
+
+  UINT32 Cluster = Start;
+  for(int i = 0; i < List->Count; i++)
+  {
+    UINT32 Count;
+    UINT32 * Old = GetChain(Volume, Volume->Objects[List->Files[i]].FirstCluster, &Count);
+    UINT32 * New = Grow(NULL, (Count ? Count : 1) * sizeof(UINT32));
+
+    for(UINT32 c = 0; c < Count; c++)
+    {
+      New[c] = Cluster++;
+    }
+
+    int Failed = MoveClusters(Volume, List->Files[i], Old, New, Count);
+    free(Old);
+    free(New);
+    if(Failed)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int Usage(void)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  esplayout report [--trace LOG] [--config PATH] [--offset BYTES] DEVICE [PATH...]\n");
+  fprintf(stderr, "  esplayout optimize [--trace LOG] [--config PATH] [--offset BYTES] DEVICE [PATH...]\n");
+  return 2;
+}
+
+int main(int argc, char **argv)
+{
+  const char * TraceName = NULL;
+  const char * ConfigPath = NULL;
+  UINT64 Offset = 0;
+  int Arg = 2;
+
+  if((argc < 3) || (strcmp(argv[1], "report") && strcmp(argv[1], "optimize")))
+  {
+    return Usage();
+  }
+  int Write = !strcmp(argv[1], "optimize");
+
+  while((Arg + 1 < argc) && !strncmp(argv[Arg], "--", 2))
+  {
+    const char * Option = argv[Arg++];
+    const char * Value = argv[Arg++];
+    char * End;
+
+    if(!strcmp(Option, "--trace"))
+    {
+      TraceName = Value;
+    }
+    else if(!strcmp(Option, "--config"))
+    {
+      ConfigPath = Value;
+    }
+    else if(!strcmp(Option, "--offset") && (*Value >= '0') && (*Value <= '9'))
+    {
+      Offset = strtoull(Value, &End, 0);
+      if(*End != '\0')
+      {
+        fprintf(stderr, "Bad option: %s %s\n", Option, Value);
+        return Usage();
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Bad option: %s %s\n", Option, Value);
+      return Usage();
+    }
+  }
+  if(Arg >= argc)
+  {
+    return Usage();
+  }
+
+  VOLUME Volume;
+  if(OpenVolume(argv[Arg], Offset, Write, &Volume))
+  {
+    return 1;
+  }
+  Arg++;
+
+  if((TraceName == NULL) && (ConfigPath == NULL) && (Arg == argc))
+  {
+    ConfigPath = DEFAULT_CONFIG;
+  }
+
+  BOOT_FILES List = { NULL, 0 };
+  if((TraceName && AddTrace(&Volume, &List, TraceName)) || (ConfigPath && AddConfig(&Volume, &List, ConfigPath)))
+  {
+    return 1;
+  }
+  for(; Arg < argc; Arg++)
+  {
+    AddPath(&Volume, &List, argv[Arg], "Command line");
+  }
+  if(List.Count == 0)
+  {
+    fprintf(stderr, "No boot files found on %s\n", Volume.Name);
+    return 1;
+  }
+
+  if((Volume.Offset + Volume.DataStart) % BLOCK_ALIGNMENT)
+  {
+    printf("Note: the data area starts %llu bytes into %s, which isn't a multiple of %u, so every cluster straddles device blocks.\n"
+      "Only reformatting (or recreating the partition at an aligned offset) can fix that.\n",
+      (unsigned long long)(Volume.Offset + Volume.DataStart), Volume.Name, BLOCK_ALIGNMENT);
+  }
+
+  printf("%s:\n", Write ? "Before" : "Boot files");
+  int Done = PrintLayout(&Volume, &List);
+
+  UINT32 Needed = 0;
+  for(int i = 0; i < List.Count; i++)
+  {
+    Needed += (UINT32)(((UINT64)Volume.Objects[List.Files[i]].Size + Volume.ClusterSize - 1) / Volume.ClusterSize);
+  }
+
+  if(Done)
+  {
+    printf("Already contiguous and in order.\n");
+    return 0;
+  }
+
+  if(!Write)
+  {
+    UINT32 Start;
+    UINT32 InTheWay;
+    if(FindSpace(&Volume, Needed, &Start, &InTheWay))
+    {
+      return 1;
+    }
+    printf("optimize would put them at clusters %u to %u, after moving the %u clusters in use there out of the way\n", Start,
+      Start + Needed - 1, InTheWay);
+    return 0;
+  }
+
+  if(!Volume.Clean)
+  {
+    fprintf(stderr, "%s: wasn't cleanly unmounted; run fsck.fat first\n", Volume.Name);
+    return 1;
+  }
+
+  if(Optimize(&Volume, &List, Needed))
+  {
+    return 1;
+  }
+
+  printf("After:\n");
+  PrintLayout(&Volume, &List);
+  return 0;
+}
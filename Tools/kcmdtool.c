@@ -0,0 +1,1582 @@
+//==================================================================================================================================
+//  UEFI Stub Loader Tools: Kernelcmd.txt Compiler
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this program:
+//
+// Host-side (Linux) tool that turns text Kernelcmd.txt files into the precompiled binary format described in
+// UEFI_Stub_Loader/inc/Kernelcmd_bin.h, and checks either kind of file for mistakes. All the decoding and validation happens
+// here, so the loader only has to check a CRC and point at the strings.
+//
+// Usage:
+//
+//  kcmdtool compile [OPTIONS] -o OUTPUT INPUT...
+//                                        Compile text configs into one binary file, one boot entry per INPUT, in order.
+//  kcmdtool check FILE...                Validate text or binary configs; exits with 1 if any of them has an error
+//  kcmdtool dump FILE                    Print the entries of a text or binary config
+//  kcmdtool setvar [OPTIONS] INPUT...    Compile text configs straight into the Kernelcmd EFI variable (needs root)
+//  kcmdtool showvar                      Print the entries in the Kernelcmd EFI variable
+//  kcmdtool delvar                       Delete the Kernelcmd EFI variable, so that the loader goes back to Kernelcmd.txt
+//  kcmdtool showfail                     Print the entries that failed to boot since the last reboot (from the
+//                                        KernelcmdFailure variable); exits with 1 if there were any
+//
+// Options:
+//
+//  --timeout SECONDS                     Show a boot menu of the entries for this long before booting the default one.
+//                                        "forever" waits for a choice. 0, the default, boots the default entry right away.
+//  --default N                           Entry booted without the menu or when it times out, counting from 1 (default 1)
+//  --allow-override                      Only matters when the file is embedded in the loader (see Compile.sh), and lets
+//                                        the variable or Kernelcmd.txt be used instead when present
+//  --match N:product=NAME                Make entry N the default on machines with this SMBIOS product name, SKU, or system
+//  --match N:sku=SKU                     UUID (as shown by "dmidecode -t 1"). Can be given any number of times. A UUID match
+//  --match N:uuid=UUID                   wins over a SKU match, which wins over a product name match.
+//  --fallback N                          If the entry being booted can't be loaded or returns, boot entry N instead. Give it
+//                                        more than once for a longer chain; entries are tried in the order given.
+//
+// Entries are numbered from 1 everywhere, as in the loader's boot menu.
+//
+// The variable commands go through efivarfs, which has to be mounted at /sys/firmware/efi/efivars (most distros do this).
+//
+// Text inputs are read the same way the loader reads them: ASCII, UTF-8 (with or without a BOM), or UTF-16LE with a BOM. The
+// first line is the kernel path (spaces are dropped), and the second line is the command line. The rest is ignored.
+//
+// Build with Tools/Compile.sh.
+//
+
+#define _DEFAULT_SOURCE // For ioctl() and friends under --std=c11
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+
+#include "Kernelcmd_bin.h"
+
+_Static_assert(sizeof(KERNELCMD_BIN_HEADER) == 56, "KERNELCMD_BIN_HEADER layout changed");
+_Static_assert(sizeof(KERNELCMD_BIN_ENTRY) == 16, "KERNELCMD_BIN_ENTRY layout changed");
+_Static_assert(sizeof(KERNELCMD_BIN_MATCH) == 20, "KERNELCMD_BIN_MATCH layout changed");
+_Static_assert(sizeof(KERNELCMD_FAILURE) == 16, "KERNELCMD_FAILURE layout changed");
+
+#define EFIVARFS_PATH "/sys/firmware/efi/efivars/" KERNELCMD_VARIABLE_NAME "-" KERNELCMD_VARIABLE_GUID_STRING
+#define EFIVARFS_FAILURE_PATH "/sys/firmware/efi/efivars/" KERNELCMD_FAILURE_VARIABLE_NAME "-" KERNELCMD_VARIABLE_GUID_STRING
+#define EFI_VARIABLE_NON_VOLATILE 0x00000001
+#define EFI_VARIABLE_BOOTSERVICE_ACCESS 0x00000002
+#define EFI_VARIABLE_RUNTIME_ACCESS 0x00000004
+
+#define MAX_CMDLINE_CHARS 4096 // Largest COMMAND_LINE_SIZE of any Linux architecture; longer lines get cut off by the kernel
+
+typedef struct {
+  UINT16 * KernelPath;
+  UINT32   KernelPathLength;
+  UINT16 * Cmdline;
+  UINT32   CmdlineLength;
+} ENTRY;
+
+// A hardware match: Entry (counting from 0) is the default on machines where the SMBIOS field of this Kind is Key
+typedef struct {
+  UINT32       Kind;
+  UINT32       Entry;
+  const UINT8 * Key;
+  UINT32       KeyLength;
+} MATCH;
+
+// Header settings that aren't about any one entry. DefaultEntry and Fallbacks count from 0, as in the file.
+typedef struct {
+  UINT32   Flags;
+  UINT32   MenuTimeout;
+  UINT32   DefaultEntry;
+  MATCH *  Matches;
+  UINT32   MatchCount;
+  UINT32 * Fallbacks;
+  UINT32   FallbackCount;
+} OPTIONS;
+
+//==================================================================================================================================
+//  Helpers
+//==================================================================================================================================
+//
+// Little-endian field access, the CRC32 used by UEFI (and lib/crc.c), and whole-file reading.
+//
+
+static UINT32 Get32(const UINT8 *p)
+{
+  return (UINT32)p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT16 Get16(const UINT8 *p)
+{
+  return (UINT16)(p[0] | (p[1] << 8));
+}
+
+static void Put32(UINT8 *p, UINT32 Value)
+{
+  p[0] = (UINT8)Value;
+  p[1] = (UINT8)(Value >> 8);
+  p[2] = (UINT8)(Value >> 16);
+  p[3] = (UINT8)(Value >> 24);
+}
+
+static void Put16(UINT8 *p, UINT16 Value)
+{
+  p[0] = (UINT8)Value;
+  p[1] = (UINT8)(Value >> 8);
+}
+
+static UINT32 Crc32(const UINT8 *Data, size_t Size)
+{
+  UINT32 Crc = 0xFFFFFFFF;
+
+  for(size_t i = 0; i < Size; i++)
+  {
+    Crc ^= Data[i];
+    for(int Bit = 0; Bit < 8; Bit++)
+    {
+      Crc = (Crc >> 1) ^ (0xEDB88320 & (0 - (Crc & 1)));
+    }
+  }
+
+  return Crc ^ 0xFFFFFFFF;
+}
+
+static UINT32 MatchHash(UINT32 Kind, const UINT8 *Key, UINT32 KeyLength)
+{
+  UINT32 Hash = (KERNELCMD_MATCH_FNV_OFFSET ^ (UINT8)Kind) * KERNELCMD_MATCH_FNV_PRIME;
+
+  for(UINT32 i = 0; i < KeyLength; i++)
+  {
+    Hash = (Hash ^ Key[i]) * KERNELCMD_MATCH_FNV_PRIME;
+  }
+
+  return Hash ? Hash : 1;
+}
+
+// The usual text form of a UUID, stored the way SMBIOS 2.6+ and EFI_GUID do: the first three fields little endian
+static int ParseUuid(const char *Text, UINT8 *Uuid)
+{
+  static const int Order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+  int Byte = 0;
+
+  for(int i = 0; (Byte < 16) && Text[i]; i++)
+  {
+    if(((i == 8) || (i == 13) || (i == 18) || (i == 23)) && (Text[i] == '-'))
+    {
+      continue;
+    }
+
+    int High = Text[i];
+    int Low = Text[++i];
+    char Digits[3] = { (char)High, (char)Low, 0 };
+    char * End;
+    unsigned long Value = strtoul(Digits, &End, 16);
+    if((Low == 0) || (*End != 0) || (High == '+') || (High == '-') || (High == ' '))
+    {
+      return -1;
+    }
+    Uuid[Order[Byte++]] = (UINT8)Value;
+  }
+
+  return ((Byte == 16) && (strlen(Text) == 36)) ? 0 : -1;
+}
+
+static void PrintMatch(FILE *Out, const MATCH *Match)
+{
+  if(Match->Kind == KERNELCMD_MATCH_UUID)
+  {
+    const UINT8 * u = Match->Key;
+    fprintf(Out, "uuid=%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", u[3], u[2], u[1], u[0], u[5], u[4], u[7], u[6],
+      u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+  }
+  else
+  {
+    fprintf(Out, "%s=%.*s", (Match->Kind == KERNELCMD_MATCH_SKU) ? "sku" : "product", (int)Match->KeyLength, (const char *)Match->Key);
+  }
+}
+
+static UINT8 * ReadFile(const char *Name, size_t *Size)
+{
+  FILE * File = fopen(Name, "rb");
+  if(File == NULL)
+  {
+    perror(Name);
+    return NULL;
+  }
+
+  size_t Max = 4096;
+  size_t Used = 0;
+  UINT8 * Data = malloc(Max);
+
+  while(Data != NULL)
+  {
+    Used += fread(&Data[Used], 1, Max - Used, File);
+    if(Used < Max)
+    {
+      break;
+    }
+    Max <<= 1;
+    Data = realloc(Data, Max);
+  }
+
+  if((Data == NULL) || ferror(File))
+  {
+    fprintf(stderr, "%s: read error\n", Name);
+    free(Data);
+    Data = NULL;
+  }
+
+  fclose(File);
+  *Size = Used;
+  return Data;
+}
+
+// Appends a UTF-16 character to a growing string
+static void Append(UINT16 **String, UINT32 *Length, size_t *Max, UINT16 Char)
+{
+  if((size_t)*Length + 1 >= *Max)
+  {
+    *Max = *Max ? (*Max << 1) : 256;
+    *String = realloc(*String, *Max * sizeof(UINT16));
+    if(*String == NULL)
+    {
+      fprintf(stderr, "Out of memory\n");
+      exit(2);
+    }
+  }
+  (*String)[(*Length)++] = Char;
+  (*String)[*Length] = 0;
+}
+
+static void PrintUtf16(FILE *Out, const UINT16 *String, UINT32 Length)
+{
+  for(UINT32 i = 0; i < Length; i++)
+  {
+    UINT32 CodePoint = String[i];
+
+    if((CodePoint >= 0xD800) && (CodePoint <= 0xDBFF) && (i + 1 < Length) && (String[i + 1] >= 0xDC00) && (String[i + 1] <= 0xDFFF))
+    {
+      CodePoint = 0x10000 + ((CodePoint - 0xD800) << 10) + (String[++i] - 0xDC00);
+    }
+
+    if(CodePoint < 0x80)
+    {
+      fputc((int)CodePoint, Out);
+    }
+    else if(CodePoint < 0x800)
+    {
+      fputc(0xC0 | (CodePoint >> 6), Out);
+      fputc(0x80 | (CodePoint & 0x3F), Out);
+    }
+    else if(CodePoint < 0x10000)
+    {
+      fputc(0xE0 | (CodePoint >> 12), Out);
+      fputc(0x80 | ((CodePoint >> 6) & 0x3F), Out);
+      fputc(0x80 | (CodePoint & 0x3F), Out);
+    }
+    else
+    {
+      fputc(0xF0 | (CodePoint >> 18), Out);
+      fputc(0x80 | ((CodePoint >> 12) & 0x3F), Out);
+      fputc(0x80 | ((CodePoint >> 6) & 0x3F), Out);
+      fputc(0x80 | (CodePoint & 0x3F), Out);
+    }
+  }
+}
+
+//==================================================================================================================================
+//  ParseText: Read a Text Kernelcmd.txt
+//==================================================================================================================================
+//
+// Decodes Data into UTF-16 and splits it into an entry exactly the way the loader's ReadKernelcmd does. Returns 0 on success or
+// prints an error and returns -1.
+//
+
+static int ParseText(const char *Name, const UINT8 *Data, size_t Size, ENTRY *Entry)
+{
+  size_t PathMax = 0, CmdlineMax = 0;
+  size_t i = 0;
+  int Line = 0;
+  int SkipLF = 0;
+  int Utf16 = 0;
+
+  memset(Entry, 0, sizeof(*Entry));
+
+  if(Size == 0)
+  {
+    fprintf(stderr, "%s: file is empty\n", Name);
+    return -1;
+  }
+
+  if((Size >= 2) && (Data[0] == 0xFF) && (Data[1] == 0xFE))
+  {
+    Utf16 = 1;
+    i = 2;
+  }
+  else if((Size >= 2) && (Data[0] == 0xFE) && (Data[1] == 0xFF))
+  {
+    fprintf(stderr, "%s: big endian UTF-16 is not supported; save it as UTF-8, ASCII, or UTF-16LE with BOM\n", Name);
+    return -1;
+  }
+  else if((Size >= 2) && (Data[1] == 0x00))
+  {
+    fprintf(stderr, "%s: looks like UTF-16 without a BOM; save it as UTF-8, ASCII, or UTF-16LE with BOM\n", Name);
+    return -1;
+  }
+  else if((Size >= 3) && (Data[0] == 0xEF) && (Data[1] == 0xBB) && (Data[2] == 0xBF))
+  {
+    i = 3;
+  }
+
+  while((i < Size) && (Line < 2))
+  {
+    UINT32 CodePoint;
+    size_t Start = i;
+
+    if(Utf16)
+    {
+      if(Size - i < 2) // Stray odd byte at the end, which the loader ignores too
+      {
+        break;
+      }
+      CodePoint = Get16(&Data[i]);
+      i += 2;
+    }
+    else
+    {
+      UINT8 Lead = Data[i];
+      size_t Length;
+      UINT32 Minimum;
+
+      if(Lead < 0x80)
+      {
+        Length = 1;
+        CodePoint = Lead;
+        Minimum = 0;
+      }
+      else if((Lead & 0xE0) == 0xC0)
+      {
+        Length = 2;
+        CodePoint = Lead & 0x1F;
+        Minimum = 0x80;
+      }
+      else if((Lead & 0xF0) == 0xE0)
+      {
+        Length = 3;
+        CodePoint = Lead & 0x0F;
+        Minimum = 0x800;
+      }
+      else if((Lead & 0xF8) == 0xF0)
+      {
+        Length = 4;
+        CodePoint = Lead & 0x07;
+        Minimum = 0x10000;
+      }
+      else
+      {
+        fprintf(stderr, "%s: invalid UTF-8 sequence at byte %zu\n", Name, Start);
+        return -1;
+      }
+
+      if(Size - i < Length) // Cut off at the end of the file, which the loader ignores too
+      {
+        break;
+      }
+
+      for(size_t j = 1; j < Length; j++)
+      {
+        if((Data[i + j] & 0xC0) != 0x80)
+        {
+          fprintf(stderr, "%s: invalid UTF-8 sequence at byte %zu\n", Name, Start);
+          return -1;
+        }
+        CodePoint = (CodePoint << 6) | (Data[i + j] & 0x3F);
+      }
+
+      if((CodePoint < Minimum) || (CodePoint > 0x10FFFF) || ((CodePoint >= 0xD800) && (CodePoint <= 0xDFFF)))
+      {
+        fprintf(stderr, "%s: invalid UTF-8 sequence at byte %zu\n", Name, Start);
+        return -1;
+      }
+      i += Length;
+    }
+
+    if(SkipLF)
+    {
+      SkipLF = 0;
+      if(CodePoint == '\n')
+      {
+        continue;
+      }
+    }
+
+    if((CodePoint == '\n') || (CodePoint == '\r'))
+    {
+      Line++;
+      SkipLF = (CodePoint == '\r');
+      continue;
+    }
+
+    UINT16 ** String = Line ? &Entry->Cmdline : &Entry->KernelPath;
+    UINT32 * Length = Line ? &Entry->CmdlineLength : &Entry->KernelPathLength;
+    size_t * Max = Line ? &CmdlineMax : &PathMax;
+
+    if((Line == 0) && (CodePoint == ' '))
+    {
+      continue;
+    }
+
+    if(CodePoint >= 0x10000)
+    {
+      CodePoint -= 0x10000;
+      Append(String, Length, Max, (UINT16)(0xD800 | (CodePoint >> 10)));
+      Append(String, Length, Max, (UINT16)(0xDC00 | (CodePoint & 0x3FF)));
+    }
+    else
+    {
+      Append(String, Length, Max, (UINT16)CodePoint);
+    }
+  }
+
+  // Empty strings still need their terminators
+  if(Entry->KernelPath == NULL)
+  {
+    Append(&Entry->KernelPath, &Entry->KernelPathLength, &PathMax, 0);
+    Entry->KernelPathLength = 0;
+  }
+  if(Entry->Cmdline == NULL)
+  {
+    Append(&Entry->Cmdline, &Entry->CmdlineLength, &CmdlineMax, 0);
+    Entry->CmdlineLength = 0;
+  }
+
+  return 0;
+}
+
+//==================================================================================================================================
+//  ParseBinary: Read a Precompiled Kernelcmd.txt
+//==================================================================================================================================
+//
+// Checks everything the loader relies on (and more), and returns the entries in a newly allocated array. The strings point into
+// Data. Returns -1 after printing an error if the file is broken.
+//
+
+static int StringInFile(const UINT8 *Data, UINT32 FileSize, UINT32 Offset, UINT32 Length)
+{
+  return !(Offset & 1) && (Offset <= FileSize) && ((((uint64_t)Length + 1) << 1) <= (FileSize - Offset)) && (Get16(&Data[Offset + (Length << 1)]) == 0);
+}
+
+static int ParseBinary(const char *Name, UINT8 *Data, size_t Size, ENTRY **Entries, UINT32 *EntryCount, OPTIONS *Options)
+{
+  memset(Options, 0, sizeof(*Options));
+
+  if(Size < KERNELCMD_BIN_HEADER_MIN_SIZE)
+  {
+    fprintf(stderr, "%s: truncated header\n", Name);
+    return -1;
+  }
+
+  UINT16 Version = Get16(&Data[4]);
+  UINT16 HeaderSize = Get16(&Data[6]);
+  UINT32 FileSize = Get32(&Data[8]);
+  UINT32 StoredCrc = Get32(&Data[12]);
+  UINT32 Count = Get32(&Data[16]);
+  UINT32 EntrySize = Get32(&Data[20]);
+  UINT32 TableOffset = Get32(&Data[24]);
+
+  if((Version != KERNELCMD_BIN_VERSION) || (HeaderSize < KERNELCMD_BIN_HEADER_MIN_SIZE))
+  {
+    fprintf(stderr, "%s: unsupported version %u\n", Name, Version);
+    return -1;
+  }
+
+  if((FileSize != Size) || (FileSize < HeaderSize))
+  {
+    fprintf(stderr, "%s: header says %u bytes, but the file is %zu bytes\n", Name, FileSize, Size);
+    return -1;
+  }
+
+  // Fields past HeaderSize count as 0
+  Options->Flags = Get32(&Data[28]);
+  Options->MenuTimeout = (HeaderSize >= 36) ? Get32(&Data[32]) : 0;
+  Options->DefaultEntry = (HeaderSize >= 40) ? Get32(&Data[36]) : 0;
+  UINT32 SlotCount = (HeaderSize >= 44) ? Get32(&Data[40]) : 0;
+  UINT32 MatchTable = (HeaderSize >= 48) ? Get32(&Data[44]) : 0;
+  UINT32 FallbackCount = (HeaderSize >= 52) ? Get32(&Data[48]) : 0;
+  UINT32 FallbackTable = (HeaderSize >= 56) ? Get32(&Data[52]) : 0;
+
+  Put32(&Data[12], 0);
+  UINT32 Crc = Crc32(Data, Size);
+  Put32(&Data[12], StoredCrc);
+  if(Crc != StoredCrc)
+  {
+    fprintf(stderr, "%s: CRC mismatch (stored 0x%08x, computed 0x%08x)\n", Name, StoredCrc, Crc);
+    return -1;
+  }
+
+  if((Count == 0) || (EntrySize < sizeof(KERNELCMD_BIN_ENTRY)) || (TableOffset & 3) || (TableOffset > FileSize)
+    || ((uint64_t)Count * EntrySize > FileSize - TableOffset))
+  {
+    fprintf(stderr, "%s: bad entry table\n", Name);
+    return -1;
+  }
+
+  if(Options->DefaultEntry >= Count)
+  {
+    fprintf(stderr, "%s: default entry %u doesn't exist (there are %u)\n", Name, Options->DefaultEntry + 1, Count);
+    return -1;
+  }
+
+  if(SlotCount && ((SlotCount & (SlotCount - 1)) || (MatchTable & 3) || (MatchTable > FileSize)
+    || ((uint64_t)SlotCount * sizeof(KERNELCMD_BIN_MATCH) > FileSize - MatchTable)))
+  {
+    fprintf(stderr, "%s: bad match table\n", Name);
+    return -1;
+  }
+
+  if(FallbackCount && ((FallbackTable & 3) || (FallbackTable > FileSize) || ((uint64_t)FallbackCount * sizeof(UINT32) > FileSize - FallbackTable)))
+  {
+    fprintf(stderr, "%s: bad fallback list\n", Name);
+    return -1;
+  }
+
+  for(UINT32 i = 0; i < FallbackCount; i++)
+  {
+    UINT32 Fallback = Get32(&Data[FallbackTable + i * sizeof(UINT32)]);
+    if(Fallback >= Count)
+    {
+      fprintf(stderr, "%s: fallback entry %u doesn't exist (there are %u)\n", Name, Fallback + 1, Count);
+      return -1;
+    }
+  }
+
+  Options->Matches = calloc(SlotCount ? SlotCount : 1, sizeof(MATCH));
+  Options->Fallbacks = calloc(FallbackCount ? FallbackCount : 1, sizeof(UINT32));
+  *Entries = calloc(Count, sizeof(ENTRY));
+  if((*Entries == NULL) || (Options->Matches == NULL) || (Options->Fallbacks == NULL))
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+  }
+
+  for(UINT32 i = 0; i < FallbackCount; i++)
+  {
+    Options->Fallbacks[Options->FallbackCount++] = Get32(&Data[FallbackTable + i * sizeof(UINT32)]);
+  }
+
+  // Every key has to be where the loader will look for it: reachable from its home slot without passing a free one
+  for(UINT32 i = 0; i < SlotCount; i++)
+  {
+    const UINT8 * Slot = &Data[MatchTable + i * sizeof(KERNELCMD_BIN_MATCH)];
+    MATCH * Match = &Options->Matches[Options->MatchCount];
+    UINT32 Hash = Get32(&Slot[0]);
+    UINT32 KeyOffset = Get32(&Slot[8]);
+
+    if(Hash == 0)
+    {
+      continue;
+    }
+
+    Match->Kind = Get32(&Slot[4]);
+    Match->KeyLength = Get32(&Slot[12]);
+    Match->Entry = Get32(&Slot[16]);
+    Match->Key = &Data[KeyOffset];
+
+    UINT32 Home = Hash & (SlotCount - 1);
+    int Reachable = 1;
+    for(UINT32 j = Home; j != i; j = (j + 1) & (SlotCount - 1))
+    {
+      Reachable &= (Get32(&Data[MatchTable + j * sizeof(KERNELCMD_BIN_MATCH)]) != 0);
+    }
+
+    if((Match->Kind < KERNELCMD_MATCH_PRODUCT) || (Match->Kind > KERNELCMD_MATCH_UUID) || (Match->Entry >= Count) || (KeyOffset > FileSize)
+      || (Match->KeyLength > FileSize - KeyOffset) || (MatchHash(Match->Kind, Match->Key, Match->KeyLength) != Hash) || !Reachable)
+    {
+      fprintf(stderr, "%s: bad match table slot %u\n", Name, i);
+      free(Options->Matches);
+      Options->Matches = NULL;
+      free(Options->Fallbacks);
+      Options->Fallbacks = NULL;
+      return -1;
+    }
+    Options->MatchCount++;
+  }
+
+  for(UINT32 i = 0; i < Count; i++)
+  {
+    const UINT8 * Raw = &Data[TableOffset + i * EntrySize];
+    UINT32 PathOffset = Get32(&Raw[0]);
+    UINT32 PathLength = Get32(&Raw[4]);
+    UINT32 CmdlineOffset = Get32(&Raw[8]);
+    UINT32 CmdlineLength = Get32(&Raw[12]);
+
+    if(!StringInFile(Data, FileSize, PathOffset, PathLength) || !StringInFile(Data, FileSize, CmdlineOffset, CmdlineLength))
+    {
+      fprintf(stderr, "%s: entry %u has a string outside the file or without a terminator\n", Name, i + 1);
+      free(*Entries);
+      free(Options->Matches);
+      Options->Matches = NULL;
+      free(Options->Fallbacks);
+      Options->Fallbacks = NULL;
+      return -1;
+    }
+
+    // The file's strings are little endian, and so is every system the loader is built for
+    (*Entries)[i].KernelPath = (UINT16 *)&Data[PathOffset];
+    (*Entries)[i].KernelPathLength = PathLength;
+    (*Entries)[i].Cmdline = (UINT16 *)&Data[CmdlineOffset];
+    (*Entries)[i].CmdlineLength = CmdlineLength;
+  }
+
+  *EntryCount = Count;
+  return 0;
+}
+
+//==================================================================================================================================
+//  CheckEntry: Catch Configs That Can't Boot
+//==================================================================================================================================
+//
+// Problems the loader would only find out about at boot time, if at all. Returns the number of errors; warnings don't count.
+// Number is the entry's number as shown to the user, counting from 1.
+//
+
+// Length of a PARTUUID=, PARTTYPE=, or PARTLABEL= prefix up to the \ that follows it, 0 without one, or -1 for a bad GUID
+static UINT32 PartitionPrefixLength(const ENTRY *Entry)
+{
+  static const char * const Prefixes[] = {"PARTUUID=", "PARTTYPE=", "PARTLABEL="};
+  const UINT16 * Path = Entry->KernelPath;
+  UINT32 Length = Entry->KernelPathLength;
+
+  for(UINT32 p = 0; p < 3; p++)
+  {
+    UINT32 PrefixLength = (UINT32)strlen(Prefixes[p]);
+    UINT32 i = 0;
+    while((i < PrefixLength) && (i < Length) && (Path[i] == (UINT16)Prefixes[p][i]))
+    {
+      i++;
+    }
+    if(i < PrefixLength)
+    {
+      continue;
+    }
+
+    if(p < 2)
+    {
+      if(Length < PrefixLength + 36)
+      {
+        return (UINT32)-1;
+      }
+      for(UINT32 j = 0; j < 36; j++)
+      {
+        UINT16 Char = Path[PrefixLength + j];
+        int Dash = (j == 8) || (j == 13) || (j == 18) || (j == 23);
+        if(Dash ? (Char != '-') : !(((Char >= '0') && (Char <= '9')) || (((Char | 0x20) >= 'a') && ((Char | 0x20) <= 'f'))))
+        {
+          return (UINT32)-1;
+        }
+      }
+      return PrefixLength + 36;
+    }
+
+    while((i < Length) && (Path[i] != '\\'))
+    {
+      i++;
+    }
+    return i;
+  }
+
+  return 0;
+}
+
+// Whether the kernel path starts with TFTP= or HTTP=
+static int IsNetworkPath(const ENTRY *Entry)
+{
+  static const char * const Prefixes[] = {"TFTP=", "HTTP="};
+
+  for(UINT32 p = 0; p < 2; p++)
+  {
+    UINT32 i = 0;
+    while((i < 5) && (i < Entry->KernelPathLength) && (Entry->KernelPath[i] == (UINT16)Prefixes[p][i]))
+    {
+      i++;
+    }
+    if(i == 5)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// TFTP=ADDRESS[:PORT]\PATH and HTTP=ADDRESS[:PORT]\PATH fetch the kernel over the network (see Network.c), from the PXE server
+// if ADDRESS is empty
+static int CheckNetworkPath(const char *Name, UINT32 Number, const ENTRY *Entry)
+{
+  const UINT16 * Path = Entry->KernelPath;
+  UINT32 Length = Entry->KernelPathLength;
+  UINT32 i = 5;
+
+  // Dotted decimal: four numbers up to 255
+  if((i < Length) && (Path[i] != '\\') && (Path[i] != ':'))
+  {
+    UINT32 Parts = 0;
+    int Bad = 0;
+    while(!Bad && (Parts < 4))
+    {
+      UINT32 Value = 0;
+      UINT32 Digits = 0;
+      while((i < Length) && (Path[i] >= '0') && (Path[i] <= '9') && (Digits < 3))
+      {
+        Value = Value * 10 + (Path[i++] - '0');
+        Digits++;
+      }
+      Bad = (Digits == 0) || (Value > 255);
+      Parts++;
+      if((Parts < 4) && !Bad)
+      {
+        Bad = (i == Length) || (Path[i++] != '.');
+      }
+    }
+    if(Bad || ((i < Length) && (Path[i] != '\\') && (Path[i] != ':')))
+    {
+      fprintf(stderr, "%s: entry %u: server must be an IPv4 address like 10.0.0.2, or nothing for the PXE server\n", Name, Number);
+      return 1;
+    }
+  }
+
+  if((i < Length) && (Path[i] == ':'))
+  {
+    UINT32 Value = 0;
+    UINT32 Digits = 0;
+    for(i++; (i < Length) && (Path[i] >= '0') && (Path[i] <= '9') && (Digits < 5); i++)
+    {
+      Value = Value * 10 + (Path[i] - '0');
+      Digits++;
+    }
+    if((Digits == 0) || (Value == 0) || (Value > 0xFFFF) || ((i < Length) && (Path[i] != '\\')))
+    {
+      fprintf(stderr, "%s: entry %u: server port must be a number from 1 to 65535\n", Name, Number);
+      return 1;
+    }
+  }
+
+  if(i + 1 >= Length)
+  {
+    fprintf(stderr, "%s: entry %u: kernel path needs a \\ and a path after the server\n", Name, Number);
+    return 1;
+  }
+
+  // Paths go to the server as they are, so there's nothing to expand wildcards or open ISO images with
+  for(; i < Length; i++)
+  {
+    if((Path[i] == '*') || (Path[i] == '?') || (Path[i] == '[') || (Path[i] == ':') || (Path[i] < 0x20) || (Path[i] > 0x7E))
+    {
+      fprintf(stderr, "%s: entry %u: network kernel paths can only be plain ASCII, without wildcards or ISO images\n", Name, Number);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int CheckKernelPath(const char *Name, UINT32 Number, const ENTRY *Entry)
+{
+  int Errors = 0;
+
+  // PARTUUID=GUID, PARTTYPE=GUID, or PARTLABEL=LABEL in front of the path picks another partition (see Partition.c)
+  UINT32 PathStart = PartitionPrefixLength(Entry);
+  if(PathStart == (UINT32)-1)
+  {
+    fprintf(stderr, "%s: entry %u: kernel path has a bad partition GUID (it should look like 8c3e2f5a-1d2b-4f60-9a7e-2b5c6d7e8f90)\n", Name, Number);
+    return 1;
+  }
+
+  if((PathStart == Entry->KernelPathLength) || (Entry->KernelPath[PathStart] != '\\'))
+  {
+    if(PathStart == 0)
+    {
+      fprintf(stderr, "%s: entry %u: kernel path must start with \\ (it is relative to the root of the EFI system partition)\n", Name, Number);
+    }
+    else
+    {
+      fprintf(stderr, "%s: entry %u: kernel path needs a \\ after the partition\n", Name, Number);
+    }
+    Errors++;
+  }
+
+  for(UINT32 i = 0; i < Entry->KernelPathLength; i++)
+  {
+    if(Entry->KernelPath[i] == '/')
+    {
+      fprintf(stderr, "%s: entry %u: kernel path uses / instead of \\\n", Name, Number);
+      Errors++;
+      break;
+    }
+  }
+
+  // IMAGE.iso:\PATH boots PATH from inside an ISO image (see Iso9660.c)
+  UINT32 PathEnd = Entry->KernelPathLength;
+  for(UINT32 i = PathStart; i < Entry->KernelPathLength; i++)
+  {
+    if(Entry->KernelPath[i] == ':')
+    {
+      PathEnd = i;
+      break;
+    }
+  }
+  if((PathEnd < Entry->KernelPathLength) && ((PathEnd + 1 == Entry->KernelPathLength) || (Entry->KernelPath[PathEnd + 1] != '\\')))
+  {
+    fprintf(stderr, "%s: entry %u: kernel path needs a \\ after the : of its ISO image\n", Name, Number);
+    Errors++;
+  }
+
+  // The loader only expands wildcards in the file name (see Wildcard.c), which is the ISO image's for a kernel inside one
+  UINT32 NameStart = 0;
+  for(UINT32 i = 0; i < PathEnd; i++)
+  {
+    if(Entry->KernelPath[i] == '\\')
+    {
+      NameStart = i + 1;
+    }
+  }
+  for(UINT32 i = 0; i < Entry->KernelPathLength; i++)
+  {
+    UINT16 Char = Entry->KernelPath[i];
+    if(((i < NameStart) || (i > PathEnd)) && ((Char == '*') || (Char == '?') || (Char == '[')))
+    {
+      fprintf(stderr, "%s: entry %u: only the file name of the kernel path (or of its ISO image) can have wildcards\n", Name, Number);
+      Errors++;
+      break;
+    }
+  }
+
+  return Errors;
+}
+
+static int CheckEntry(const char *Name, UINT32 Number, const ENTRY *Entry)
+{
+  int Errors = 0;
+
+  if(Entry->KernelPathLength == 0)
+  {
+    fprintf(stderr, "%s: entry %u: kernel path is empty\n", Name, Number);
+    return 1;
+  }
+
+  if(IsNetworkPath(Entry))
+  {
+    Errors += CheckNetworkPath(Name, Number, Entry);
+  }
+  else
+  {
+    Errors += CheckKernelPath(Name, Number, Entry);
+  }
+
+  for(UINT32 i = 0; i < Entry->CmdlineLength; i++)
+  {
+    UINT16 Char = Entry->Cmdline[i];
+    if(((Char < 0x20) && (Char != '\t')) || (Char == 0x7F))
+    {
+      fprintf(stderr, "%s: entry %u: command line has a control character (0x%02x) at position %u\n", Name, Number, Char, i);
+      Errors++;
+      break;
+    }
+  }
+
+  if(Entry->CmdlineLength >= MAX_CMDLINE_CHARS)
+  {
+    fprintf(stderr, "%s: entry %u: warning: command line is %u characters; the kernel may cut it off\n", Name, Number, Entry->CmdlineLength);
+  }
+
+  return Errors;
+}
+
+// Loads any kind of config into entries. Returns -1 if it can't be read at all.
+static int LoadConfig(const char *Name, UINT8 **Data, ENTRY **Entries, UINT32 *EntryCount, OPTIONS *Options)
+{
+  size_t Size;
+
+  memset(Options, 0, sizeof(*Options));
+
+  *Data = ReadFile(Name, &Size);
+  if(*Data == NULL)
+  {
+    return -1;
+  }
+
+  if((Size >= 4) && (Get32(*Data) == KERNELCMD_BIN_SIGNATURE))
+  {
+    return ParseBinary(Name, *Data, Size, Entries, EntryCount, Options);
+  }
+
+  *Entries = malloc(sizeof(ENTRY));
+  if(*Entries == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+  }
+  *EntryCount = 1;
+  return ParseText(Name, *Data, Size, *Entries);
+}
+
+//==================================================================================================================================
+//  Commands
+//==================================================================================================================================
+
+// Compiles text configs into a precompiled image. Returns NULL after printing why if any of them has errors.
+static UINT8 * Build(const char *OutputName, char **Inputs, int InputCount, const OPTIONS *Options, size_t *ImageSize)
+{
+  ENTRY * Entries = calloc(InputCount, sizeof(ENTRY));
+  int Errors = 0;
+
+  if(Entries == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+  }
+
+  // Half-empty at most, so that lookups stay short
+  UINT32 SlotCount = 0;
+  if(Options->MatchCount)
+  {
+    for(SlotCount = 1; SlotCount < Options->MatchCount * 2; SlotCount <<= 1);
+  }
+
+  // Lay out the file as it's checked: header, entry table, match table, fallback list, then the strings and match keys
+  size_t Size = sizeof(KERNELCMD_BIN_HEADER) + (size_t)InputCount * sizeof(KERNELCMD_BIN_ENTRY) + (size_t)SlotCount * sizeof(KERNELCMD_BIN_MATCH)
+    + (size_t)Options->FallbackCount * sizeof(UINT32);
+
+  for(int i = 0; i < InputCount; i++)
+  {
+    size_t InputSize;
+    UINT8 * Input = ReadFile(Inputs[i], &InputSize);
+    if((Input == NULL) || ParseText(Inputs[i], Input, InputSize, &Entries[i]))
+    {
+      free(Input);
+      return NULL;
+    }
+    free(Input);
+
+    Errors += CheckEntry(Inputs[i], (UINT32)i + 1, &Entries[i]);
+    Size += ((size_t)Entries[i].KernelPathLength + 1 + Entries[i].CmdlineLength + 1) * sizeof(UINT16);
+  }
+
+  if(Options->DefaultEntry >= (UINT32)InputCount)
+  {
+    fprintf(stderr, "%s: default entry %u doesn't exist (there are %d)\n", OutputName, Options->DefaultEntry + 1, InputCount);
+    Errors++;
+  }
+
+  for(UINT32 i = 0; i < Options->FallbackCount; i++)
+  {
+    if(Options->Fallbacks[i] >= (UINT32)InputCount)
+    {
+      fprintf(stderr, "%s: fallback entry %u doesn't exist (there are %d)\n", OutputName, Options->Fallbacks[i] + 1, InputCount);
+      Errors++;
+    }
+
+    for(UINT32 j = 0; j < i; j++)
+    {
+      if(Options->Fallbacks[j] == Options->Fallbacks[i])
+      {
+        fprintf(stderr, "%s: entry %u is in the fallback list more than once\n", OutputName, Options->Fallbacks[i] + 1);
+        Errors++;
+        break;
+      }
+    }
+  }
+
+  for(UINT32 i = 0; i < Options->MatchCount; i++)
+  {
+    const MATCH * Match = &Options->Matches[i];
+
+    if(Match->Entry >= (UINT32)InputCount)
+    {
+      fprintf(stderr, "%s: match for entry %u, which doesn't exist (there are %d)\n", OutputName, Match->Entry + 1, InputCount);
+      Errors++;
+    }
+
+    for(UINT32 j = 0; j < i; j++)
+    {
+      if((Options->Matches[j].Kind == Match->Kind) && (Options->Matches[j].KeyLength == Match->KeyLength)
+        && !memcmp(Options->Matches[j].Key, Match->Key, Match->KeyLength))
+      {
+        fprintf(stderr, "%s: the same hardware is matched more than once (", OutputName);
+        PrintMatch(stderr, Match);
+        fprintf(stderr, ")\n");
+        Errors++;
+        break;
+      }
+    }
+
+    Size += Match->KeyLength;
+  }
+
+  if(Errors)
+  {
+    fprintf(stderr, "%s not written: %d error(s)\n", OutputName, Errors);
+    return NULL;
+  }
+
+  if(Size > 0xFFFFFFFF)
+  {
+    fprintf(stderr, "%s not written: too large\n", OutputName);
+    return NULL;
+  }
+
+  UINT8 * Output = calloc(1, Size);
+  if(Output == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+  }
+
+  UINT32 EntryTable = sizeof(KERNELCMD_BIN_HEADER);
+  UINT32 MatchTable = EntryTable + (UINT32)InputCount * sizeof(KERNELCMD_BIN_ENTRY);
+  UINT32 FallbackTable = MatchTable + SlotCount * sizeof(KERNELCMD_BIN_MATCH);
+  UINT32 Strings = FallbackTable + Options->FallbackCount * sizeof(UINT32);
+
+  Put32(&Output[0], KERNELCMD_BIN_SIGNATURE);
+  Put16(&Output[4], KERNELCMD_BIN_VERSION);
+  Put16(&Output[6], sizeof(KERNELCMD_BIN_HEADER));
+  Put32(&Output[8], (UINT32)Size);
+  Put32(&Output[16], (UINT32)InputCount);
+  Put32(&Output[20], sizeof(KERNELCMD_BIN_ENTRY));
+  Put32(&Output[24], EntryTable);
+  Put32(&Output[28], Options->Flags);
+  Put32(&Output[32], Options->MenuTimeout);
+  Put32(&Output[36], Options->DefaultEntry);
+  Put32(&Output[40], SlotCount);
+  Put32(&Output[44], SlotCount ? MatchTable : 0);
+  Put32(&Output[48], Options->FallbackCount);
+  Put32(&Output[52], Options->FallbackCount ? FallbackTable : 0);
+
+  for(UINT32 i = 0; i < Options->FallbackCount; i++)
+  {
+    Put32(&Output[FallbackTable + i * sizeof(UINT32)], Options->Fallbacks[i]);
+  }
+
+  for(int i = 0; i < InputCount; i++)
+  {
+    UINT8 * Raw = &Output[EntryTable + i * sizeof(KERNELCMD_BIN_ENTRY)];
+
+    Put32(&Raw[0], Strings);
+    Put32(&Raw[4], Entries[i].KernelPathLength);
+    for(UINT32 j = 0; j <= Entries[i].KernelPathLength; j++, Strings += 2)
+    {
+      Put16(&Output[Strings], j < Entries[i].KernelPathLength ? Entries[i].KernelPath[j] : 0);
+    }
+
+    Put32(&Raw[8], Strings);
+    Put32(&Raw[12], Entries[i].CmdlineLength);
+    for(UINT32 j = 0; j <= Entries[i].CmdlineLength; j++, Strings += 2)
+    {
+      Put16(&Output[Strings], j < Entries[i].CmdlineLength ? Entries[i].Cmdline[j] : 0);
+    }
+  }
+
+  // Keys go after the strings, each in the first free slot from its home slot on
+  for(UINT32 i = 0; i < Options->MatchCount; i++)
+  {
+    const MATCH * Match = &Options->Matches[i];
+    UINT32 Hash = MatchHash(Match->Kind, Match->Key, Match->KeyLength);
+    UINT32 Slot = Hash & (SlotCount - 1);
+
+    while(Get32(&Output[MatchTable + Slot * sizeof(KERNELCMD_BIN_MATCH)]) != 0)
+    {
+      Slot = (Slot + 1) & (SlotCount - 1);
+    }
+
+    UINT8 * Raw = &Output[MatchTable + Slot * sizeof(KERNELCMD_BIN_MATCH)];
+    Put32(&Raw[0], Hash);
+    Put32(&Raw[4], Match->Kind);
+    Put32(&Raw[8], Strings);
+    Put32(&Raw[12], Match->KeyLength);
+    Put32(&Raw[16], Match->Entry);
+
+    memcpy(&Output[Strings], Match->Key, Match->KeyLength);
+    Strings += Match->KeyLength;
+  }
+
+  Put32(&Output[12], Crc32(Output, Size));
+
+  for(int i = 0; i < InputCount; i++)
+  {
+    free(Entries[i].KernelPath);
+    free(Entries[i].Cmdline);
+  }
+  free(Entries);
+
+  *ImageSize = Size;
+  return Output;
+}
+
+static int Compile(const char *OutputName, char **Inputs, int InputCount, const OPTIONS *Options)
+{
+  size_t Size;
+  UINT8 * Output = Build(OutputName, Inputs, InputCount, Options, &Size);
+  if(Output == NULL)
+  {
+    return 1;
+  }
+
+  FILE * File = fopen(OutputName, "wb");
+  if((File == NULL) || (fwrite(Output, 1, Size, File) != Size) || fclose(File))
+  {
+    perror(OutputName);
+    return 1;
+  }
+
+  printf("%s: %d entr%s, %zu bytes\n", OutputName, InputCount, (InputCount == 1) ? "y" : "ies", Size);
+  free(Output);
+  return 0;
+}
+
+static int Check(char **Files, int FileCount)
+{
+  int Failed = 0;
+
+  for(int f = 0; f < FileCount; f++)
+  {
+    UINT8 * Data;
+    ENTRY * Entries = NULL;
+    UINT32 EntryCount = 0;
+    OPTIONS Options;
+    int Errors = 0;
+
+    if(LoadConfig(Files[f], &Data, &Entries, &EntryCount, &Options))
+    {
+      Errors = 1;
+    }
+    else
+    {
+      for(UINT32 i = 0; i < EntryCount; i++)
+      {
+        Errors += CheckEntry(Files[f], i + 1, &Entries[i]);
+      }
+    }
+
+    if(Errors)
+    {
+      Failed = 1;
+    }
+    else
+    {
+      printf("%s: OK\n", Files[f]);
+    }
+
+    free(Options.Matches);
+  free(Options.Fallbacks);
+    free(Entries);
+    free(Data);
+  }
+
+  return Failed;
+}
+
+static void PrintEntries(const ENTRY *Entries, UINT32 EntryCount, const OPTIONS *Options)
+{
+  if((EntryCount > 1) && (Options->MenuTimeout == KERNELCMD_MENU_TIMEOUT_FOREVER))
+  {
+    printf("Boot menu: waits for a choice\n");
+  }
+  else if((EntryCount > 1) && Options->MenuTimeout)
+  {
+    printf("Boot menu: %u second timeout\n", Options->MenuTimeout);
+  }
+  else
+  {
+    printf("Boot menu: none\n");
+  }
+
+  if(Options->FallbackCount)
+  {
+    printf("Fallback order:");
+    for(UINT32 i = 0; i < Options->FallbackCount; i++)
+    {
+      printf(" %u", Options->Fallbacks[i] + 1);
+    }
+    printf("\n");
+  }
+
+  for(UINT32 i = 0; i < EntryCount; i++)
+  {
+    printf("Entry %u%s\n  Kernel: ", i + 1, (i == Options->DefaultEntry) ? " (default)" : "");
+    PrintUtf16(stdout, Entries[i].KernelPath, Entries[i].KernelPathLength);
+    printf("\n  Command line: ");
+    PrintUtf16(stdout, Entries[i].Cmdline, Entries[i].CmdlineLength);
+    printf("\n");
+
+    for(UINT32 j = 0; j < Options->MatchCount; j++)
+    {
+      if(Options->Matches[j].Entry == i)
+      {
+        printf("  Default on: ");
+        PrintMatch(stdout, &Options->Matches[j]);
+        printf("\n");
+      }
+    }
+  }
+}
+
+static int Dump(const char *Name)
+{
+  UINT8 * Data;
+  ENTRY * Entries = NULL;
+  UINT32 EntryCount = 0;
+  OPTIONS Options;
+
+  if(LoadConfig(Name, &Data, &Entries, &EntryCount, &Options))
+  {
+    return 1;
+  }
+
+  PrintEntries(Entries, EntryCount, &Options);
+
+  free(Options.Matches);
+  free(Options.Fallbacks);
+  free(Entries);
+  free(Data);
+  return 0;
+}
+
+//==================================================================================================================================
+//  Variable Commands
+//==================================================================================================================================
+//
+// An efivarfs file holds the variable's 4-byte attributes followed by its data, and a new value has to be written in a single
+// write() call. The kernel marks variable files immutable to stop accidental deletion, so that flag has to be cleared before
+// changing or deleting one.
+//
+
+static int MakeMutable(void)
+{
+  int File = open(EFIVARFS_PATH, O_RDONLY);
+  if(File < 0)
+  {
+    return (errno == ENOENT) ? 0 : -1;
+  }
+
+  int Flags;
+  int Result = 0;
+  if(ioctl(File, FS_IOC_GETFLAGS, &Flags) == 0)
+  {
+    Flags &= ~FS_IMMUTABLE_FL;
+    Result = ioctl(File, FS_IOC_SETFLAGS, &Flags);
+  }
+
+  close(File);
+  return Result;
+}
+
+static int SetVariable(char **Inputs, int InputCount, const OPTIONS *Options)
+{
+  size_t Size;
+  UINT8 * Image = Build(KERNELCMD_VARIABLE_NAME " variable", Inputs, InputCount, Options, &Size);
+  if(Image == NULL)
+  {
+    return 1;
+  }
+
+  UINT8 * Data = malloc(Size + 4);
+  if(Data == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  Put32(Data, EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS);
+  memcpy(&Data[4], Image, Size);
+
+  int File = -1;
+  if(MakeMutable() == 0)
+  {
+    File = open(EFIVARFS_PATH, O_WRONLY | O_CREAT, 0644);
+  }
+  if((File < 0) || (write(File, Data, Size + 4) != (ssize_t)(Size + 4)) || close(File))
+  {
+    perror(EFIVARFS_PATH);
+    return 1;
+  }
+
+  printf("%s: %d entr%s, %zu bytes\n", EFIVARFS_PATH, InputCount, (InputCount == 1) ? "y" : "ies", Size);
+  free(Data);
+  free(Image);
+  return 0;
+}
+
+static int ShowVariable(void)
+{
+  size_t Size;
+  UINT8 * Data = ReadFile(EFIVARFS_PATH, &Size);
+  ENTRY * Entries = NULL;
+  UINT32 EntryCount = 0;
+  OPTIONS Options;
+
+  if(Data == NULL)
+  {
+    return 1;
+  }
+
+  if((Size < 4) || ParseBinary(KERNELCMD_VARIABLE_NAME " variable", &Data[4], Size - 4, &Entries, &EntryCount, &Options))
+  {
+    fprintf(stderr, "The loader will ignore this variable and use Kernelcmd.txt\n");
+    free(Data);
+    return 1;
+  }
+
+  printf("Attributes: 0x%08x\n", Get32(Data));
+  PrintEntries(Entries, EntryCount, &Options);
+
+  free(Options.Matches);
+  free(Options.Fallbacks);
+  free(Entries);
+  free(Data);
+  return 0;
+}
+
+static int DeleteVariable(void)
+{
+  if((MakeMutable() != 0) || (unlink(EFIVARFS_PATH) != 0))
+  {
+    perror(EFIVARFS_PATH);
+    return 1;
+  }
+
+  return 0;
+}
+
+// The loader only sets KernelcmdFailure when something didn't boot, and it's gone after a reboot
+static int ShowFailures(void)
+{
+  static const char * Stages[] = { "for an unknown reason", "to be found", "to load", "and returned" };
+
+  if(access(EFIVARFS_FAILURE_PATH, F_OK) != 0)
+  {
+    printf("No failed boot attempts\n");
+    return 0;
+  }
+
+  size_t Size;
+  UINT8 * Data = ReadFile(EFIVARFS_FAILURE_PATH, &Size);
+  if(Data == NULL)
+  {
+    return 2;
+  }
+
+  // 4 bytes of attributes, then one record per attempt
+  for(size_t Offset = 4; Offset + sizeof(KERNELCMD_FAILURE) <= Size; Offset += sizeof(KERNELCMD_FAILURE))
+  {
+    UINT32 Stage = Get32(&Data[Offset + 4]);
+    UINT64 Status = Get32(&Data[Offset + 8]) | ((UINT64)Get32(&Data[Offset + 12]) << 32);
+
+    printf("Entry %u failed %s (status 0x%llx)\n", Get32(&Data[Offset]) + 1, Stages[(Stage <= KERNELCMD_STAGE_START) ? Stage : 0],
+      (unsigned long long)Status);
+  }
+
+  free(Data);
+  return 1;
+}
+
+static int Usage(void)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  kcmdtool compile [--timeout SECONDS|forever] [--default N] [--match N:KIND=VALUE]... [--fallback N]... [--allow-override] -o OUTPUT INPUT...\n");
+  fprintf(stderr, "  kcmdtool check FILE...\n");
+  fprintf(stderr, "  kcmdtool dump FILE\n");
+  fprintf(stderr, "  kcmdtool setvar [--timeout SECONDS|forever] [--default N] [--match N:KIND=VALUE]... [--fallback N]... INPUT...\n");
+  fprintf(stderr, "  kcmdtool showvar\n");
+  fprintf(stderr, "  kcmdtool delvar\n");
+  fprintf(stderr, "  kcmdtool showfail\n");
+  fprintf(stderr, "KIND is product, sku, or uuid.\n");
+  return 2;
+}
+
+// Adds a --match KIND=VALUE for Entry (counting from 0). Returns -1 if it doesn't make sense.
+static int ParseMatch(const char *Text, UINT32 Entry, OPTIONS *Options)
+{
+  const char * Value = strchr(Text, '=');
+  MATCH Match = { 0, Entry, NULL, 0 };
+
+  if(Value == NULL)
+  {
+    return -1;
+  }
+  Value++;
+
+  if(!strncmp(Text, "uuid=", 5))
+  {
+    UINT8 * Uuid = malloc(16);
+    if((Uuid == NULL) || ParseUuid(Value, Uuid))
+    {
+      free(Uuid);
+      return -1;
+    }
+    Match.Kind = KERNELCMD_MATCH_UUID;
+    Match.Key = Uuid;
+    Match.KeyLength = 16;
+  }
+  else if(!strncmp(Text, "product=", 8) || !strncmp(Text, "sku=", 4))
+  {
+    // Trimmed the same way the loader trims the SMBIOS strings
+    size_t Length = strlen(Value);
+    while(*Value == ' ')
+    {
+      Value++;
+      Length--;
+    }
+    while(Length && (Value[Length - 1] == ' '))
+    {
+      Length--;
+    }
+    if(Length == 0)
+    {
+      return -1;
+    }
+    Match.Kind = (Text[0] == 's') ? KERNELCMD_MATCH_SKU : KERNELCMD_MATCH_PRODUCT;
+    Match.Key = (const UINT8 *)Value;
+    Match.KeyLength = (UINT32)Length;
+  }
+  else
+  {
+    return -1;
+  }
+
+  Options->Matches = realloc(Options->Matches, (Options->MatchCount + 1) * sizeof(MATCH));
+  if(Options->Matches == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+  }
+  Options->Matches[Options->MatchCount++] = Match;
+  return 0;
+}
+
+// Reads the options before the inputs, starting at argv[*Arg]. Returns -1 if one of them is bad.
+static int ParseOptions(int argc, char **argv, int *Arg, OPTIONS *Options)
+{
+  memset(Options, 0, sizeof(*Options));
+
+  while((*Arg < argc) && !strncmp(argv[*Arg], "--", 2))
+  {
+    const char * Option = argv[(*Arg)++];
+
+    if(!strcmp(Option, "--allow-override"))
+    {
+      Options->Flags |= KERNELCMD_BIN_FLAG_ALLOW_OVERRIDE;
+      continue;
+    }
+
+    if(*Arg >= argc)
+    {
+      return -1;
+    }
+    const char * Value = argv[(*Arg)++];
+    char * End;
+    unsigned long Number = strtoul(Value, &End, 10);
+    int IsNumber = (*Value >= '0') && (*Value <= '9') && (*End == '\0') && (Number < KERNELCMD_MENU_TIMEOUT_FOREVER);
+
+    if(!strcmp(Option, "--timeout") && !strcmp(Value, "forever"))
+    {
+      Options->MenuTimeout = KERNELCMD_MENU_TIMEOUT_FOREVER;
+    }
+    else if(!strcmp(Option, "--timeout") && IsNumber)
+    {
+      Options->MenuTimeout = (UINT32)Number;
+    }
+    else if(!strcmp(Option, "--default") && IsNumber && (Number > 0))
+    {
+      Options->DefaultEntry = (UINT32)Number - 1;
+    }
+    else if(!strcmp(Option, "--fallback") && IsNumber && (Number > 0))
+    {
+      Options->Fallbacks = realloc(Options->Fallbacks, (Options->FallbackCount + 1) * sizeof(UINT32));
+      if(Options->Fallbacks == NULL)
+      {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+      }
+      Options->Fallbacks[Options->FallbackCount++] = (UINT32)Number - 1;
+    }
+    else if(!strcmp(Option, "--match") && (*Value >= '1') && (*Value <= '9') && (*End == ':') && (Number <= 0xFFFFFFFF)
+      && !ParseMatch(End + 1, (UINT32)Number - 1, Options))
+    {
+      continue;
+    }
+    else
+    {
+      fprintf(stderr, "Bad option: %s %s\n", Option, Value);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc == 2)
+  {
+    if(!strcmp(argv[1], "showvar"))
+    {
+      return ShowVariable();
+    }
+    else if(!strcmp(argv[1], "delvar"))
+    {
+      return DeleteVariable();
+    }
+    else if(!strcmp(argv[1], "showfail"))
+    {
+      return ShowFailures();
+    }
+  }
+
+  if(argc < 3)
+  {
+    return Usage();
+  }
+
+  OPTIONS Options;
+  int Arg = 2;
+
+  if(!strcmp(argv[1], "compile"))
+  {
+    if(ParseOptions(argc, argv, &Arg, &Options) || (argc < Arg + 3) || strcmp(argv[Arg], "-o"))
+    {
+      return Usage();
+    }
+    return Compile(argv[Arg + 1], &argv[Arg + 2], argc - Arg - 2, &Options);
+  }
+  else if(!strcmp(argv[1], "check"))
+  {
+    return Check(&argv[2], argc - 2);
+  }
+  else if(!strcmp(argv[1], "dump") && (argc == 3))
+  {
+    return Dump(argv[2]);
+  }
+  else if(!strcmp(argv[1], "setvar"))
+  {
+    if(ParseOptions(argc, argv, &Arg, &Options) || (argc < Arg + 1))
+    {
+      return Usage();
+    }
+    return SetVariable(&argv[Arg], argc - Arg, &Options);
+  }
+
+  return Usage();
+}
@@ -36,6 +36,7 @@ cd ../Backend
 rm STUBLOAD.EFI
 rm output.map
 rm objects.list
+rm kcmd.o
 
 while read f; do
   rm ${f%.*}.o
@@ -35,6 +35,7 @@ rem
 del STUBLOAD.EFI
 del output.map
 del objects.list
+del kcmd.o
 
 @echo on
 FOR /F "tokens=*" %%f IN ('type "%CurDir%\c_files_windows.txt"') DO (del "%%~df%%~pf%%~nf.o" & del "%%~df%%~pf%%~nf.d" & del "%%~df%%~pf%%~nf.out")
@@ -37,6 +37,7 @@ rm program.so
 rm STUBLOAD.EFI
 rm output.map
 rm objects.list
+rm kcmd.o
 
 while read f; do
   rm ${f%.*}.o
@@ -146,6 +146,23 @@ for f in $CurDir/src/*.o; do
   echo "$f" | tee -a objects.list
 done
 
+#
+# Optionally build a precompiled Kernelcmd.txt (made with Tools/kcmdtool) into
+# the loader as a .kcmd section, e.g. "EMBEDDED_KCMD=Kernelcmd.bin ./Compile-Mac.sh"
+# The loader then uses it instead of looking for a config anywhere else.
+#
+
+if [ -n "$EMBEDDED_KCMD" ]; then
+  case $EMBEDDED_KCMD in
+    /*) ;;
+    *) EMBEDDED_KCMD=$CurDir/$EMBEDDED_KCMD ;;
+  esac
+  set -v
+  "$GCC_PREFIX-objcopy" -I binary -O pe-x86-64 -B i386:x86-64 --rename-section .data=.kcmd,alloc,load,data,contents "$EMBEDDED_KCMD" kcmd.o
+  set +v
+  echo "kcmd.o" | tee -a objects.list
+fi
+
 #
 # Link the object files using all the objects in objects.list to generate the
 # output binary, which is called "STUBLOAD.EFI"
@@ -163,6 +163,18 @@ rem
 
 FOR %%f IN ("%CurDir2%/src/*.o") DO echo "%CurDir3%/src/%%~nxf" >> objects.list
 
+rem
+rem Optionally build a precompiled Kernelcmd.txt (made with Tools/kcmdtool) into
+rem the loader as a .kcmd section: "set EMBEDDED_KCMD=C:\full\path\Kernelcmd.bin"
+rem before running this script. The loader then uses it instead of looking for a
+rem config anywhere else.
+rem
+
+if defined EMBEDDED_KCMD (
+  "%GCC_FOLDER_NAME%\bin\objcopy.exe" -I binary -O pe-x86-64 -B i386:x86-64 --rename-section .data=.kcmd,alloc,load,data,contents "%EMBEDDED_KCMD%" kcmd.o
+  echo kcmd.o >> objects.list
+)
+
 rem
 rem Link the object files using all the objects in objects.list to generate the
 rem output binary, which is called "STUBLOAD.EFI"
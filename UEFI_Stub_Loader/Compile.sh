@@ -152,6 +152,23 @@ for f in $CurDir/src/*.o; do
   echo "$f" | tee -a objects.list
 done
 
+#
+# Optionally build a precompiled Kernelcmd.txt (made with Tools/kcmdtool) into
+# the loader as a .kcmd section, e.g. "EMBEDDED_KCMD=Kernelcmd.bin ./Compile.sh"
+# The loader then uses it instead of looking for a config anywhere else.
+#
+
+if [ -n "$EMBEDDED_KCMD" ]; then
+  case $EMBEDDED_KCMD in
+    /*) ;;
+    *) EMBEDDED_KCMD=$CurDir/$EMBEDDED_KCMD ;;
+  esac
+  set -v
+  "$BINUTILS_FOLDER_NAME/bin/objcopy" -I binary -O elf64-x86-64 -B i386:x86-64 --rename-section .data=.kcmd,alloc,load,data,contents "$EMBEDDED_KCMD" kcmd.o
+  set +v
+  echo "kcmd.o" | tee -a objects.list
+fi
+
 #
 # Link the object files using all the objects in objects.list and a linker
 # script (in the Backend/Linker directory) to generate the output binary, which
@@ -170,7 +187,7 @@ set +v
 echo
 echo Generating binary and Printing size information:
 echo
-"$BINUTILS_FOLDER_NAME/bin/objcopy" -j .text -j .sdata -j .data -j .dynamic -j .dynsym -j .rel -j .rela -j .rel.* -j .rela.* -j .rel* -j .rela* -j .reloc --target=efi-app-x86_64 "program.so" "STUBLOAD.EFI"
+"$BINUTILS_FOLDER_NAME/bin/objcopy" -j .text -j .sdata -j .data -j .dynamic -j .dynsym -j .rel -j .rela -j .rel.* -j .rela.* -j .rel* -j .rela* -j .reloc -j .kcmd --target=efi-app-x86_64 "program.so" "STUBLOAD.EFI"
 "$BINUTILS_FOLDER_NAME/bin/size" "STUBLOAD.EFI"
 echo
 
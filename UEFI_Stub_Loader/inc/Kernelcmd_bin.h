@@ -0,0 +1,127 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Precompiled Kernelcmd Format
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// This file describes the binary form of Kernelcmd.txt made by Tools/kcmdtool. It is shared by the loader and the host tool, so
+// it only uses the fixed-size UINT8/UINT16/UINT32 types (the tool typedefs them itself) and has no other dependencies.
+//
+// Layout, all little endian:
+//
+//  KERNELCMD_BIN_HEADER  at offset 0
+//  KERNELCMD_BIN_ENTRY   EntryCount of them at EntryTableOffset, each EntrySize bytes apart
+//  KERNELCMD_BIN_MATCH   Optional hash table of MatchSlotCount slots at MatchTableOffset (see below)
+//  Fallback list         FallbackCount UINT32 entry indexes at FallbackTableOffset
+//  String data           null-terminated UTF-16 strings, each at an even offset, pointed to by the entries
+//  Match keys            raw bytes pointed to by the match slots, in no particular alignment
+//
+// The header can grow without a version change: fields past HeaderSize count as 0, so older files simply don't have the newer
+// fields, and older loaders skip over the ones they don't know about. KERNELCMD_BIN_HEADER_MIN_SIZE is the original size.
+//
+// The CRC32 covers all FileSize bytes of the file, computed with the Crc32 field set to 0. It is the same CRC32 that UEFI uses
+// for its own tables (see CalculateCrc in lib/crc.c).
+//
+// The same data can also be built into the loader itself as a KERNELCMD_SECTION_NAME PE section (see Compile.sh), or stored in
+// the KERNELCMD_VARIABLE_NAME NV variable under KERNELCMD_VARIABLE_GUID, where the loader looks before reading Kernelcmd.txt.
+// On Linux that is the efivarfs file /sys/firmware/efi/efivars/Kernelcmd-5b1b3b9e-6d4c-4c5a-9f2e-7a41c80d532b.
+//
+// The first signature byte (0xF8) can never start a UTF-8 file, and together with the second it is neither a UTF-16 BOM nor
+// an ASCII character followed by a zero, so a binary file can't be mistaken for any of the text encodings.
+//
+
+#ifndef _Kernelcmd_bin_H
+#define _Kernelcmd_bin_H
+
+#define KERNELCMD_BIN_SIGNATURE 0x444D4BF8 // Bytes F8 'K' 'M' 'D'
+#define KERNELCMD_BIN_VERSION 1
+#define KERNELCMD_BIN_HEADER_MIN_SIZE 32 // Header size up to and including Flags
+
+#define KERNELCMD_SECTION_NAME ".kcmd" // PE section names are at most 8 bytes
+
+#define KERNELCMD_VARIABLE_NAME "Kernelcmd" // Narrow so that the host tool can use it too; the loader widens it
+#define KERNELCMD_VARIABLE_GUID_STRING "5b1b3b9e-6d4c-4c5a-9f2e-7a41c80d532b"
+#define KERNELCMD_VARIABLE_GUID { 0x5b1b3b9e, 0x6d4c, 0x4c5a, { 0x9f, 0x2e, 0x7a, 0x41, 0xc8, 0x0d, 0x53, 0x2b } }
+
+typedef struct {
+  UINT32 Signature; // KERNELCMD_BIN_SIGNATURE
+  UINT16 Version; // KERNELCMD_BIN_VERSION
+  UINT16 HeaderSize; // sizeof(KERNELCMD_BIN_HEADER)
+  UINT32 FileSize; // Size of the whole file, in bytes
+  UINT32 Crc32; // CRC32 of the whole file with this field zeroed
+  UINT32 EntryCount; // Boot entries in the file; there is always at least one
+  UINT32 EntrySize; // sizeof(KERNELCMD_BIN_ENTRY)
+  UINT32 EntryTableOffset; // From the start of the file
+  UINT32 Flags; // KERNELCMD_BIN_FLAG_*
+  UINT32 MenuTimeout; // Seconds to show the boot menu before booting DefaultEntry, or KERNELCMD_MENU_TIMEOUT_FOREVER
+  UINT32 DefaultEntry; // Index of the entry booted without the menu, or when it times out
+  UINT32 MatchSlotCount; // Slots in the match table, a power of two; 0 if there isn't one
+  UINT32 MatchTableOffset; // From the start of the file
+  UINT32 FallbackCount; // Entries to try, in order, if the chosen one fails to load or start
+  UINT32 FallbackTableOffset; // From the start of the file
+} KERNELCMD_BIN_HEADER;
+
+// A MenuTimeout of 0 never shows the menu (or waits for anything), and neither does a file with only one entry
+#define KERNELCMD_MENU_TIMEOUT_FOREVER 0xFFFFFFFF
+
+// Only meaningful for a config embedded in the loader's .kcmd section: let the Kernelcmd variable or Kernelcmd.txt take
+// precedence over it when they exist. Without this flag, an embedded config is the only one the loader will look at.
+#define KERNELCMD_BIN_FLAG_ALLOW_OVERRIDE 0x00000001
+
+typedef struct {
+  UINT32 KernelPathOffset; // From the start of the file
+  UINT32 KernelPathLength; // In characters, not counting the null terminator
+  UINT32 CmdlineOffset;
+  UINT32 CmdlineLength;
+} KERNELCMD_BIN_ENTRY;
+
+// Hardware matching: the match table maps an SMBIOS product name, SKU, or system UUID to the entry that this machine should
+// boot by default, overriding DefaultEntry. It is an open-addressing hash table built by kcmdtool: a key goes in the slot at
+// KERNELCMD_MATCH_HASH & (MatchSlotCount - 1), or the next free one after it (wrapping around), and a slot with a Hash of 0 is
+// free. kcmdtool keeps at least half of the slots free, so a lookup only ever looks at a few of them.
+//
+// The hash is 32-bit FNV-1a over the Kind byte followed by the key bytes, with a result of 0 turned into 1. Product names and SKUs
+// are the SMBIOS strings as they are, minus any leading or trailing spaces; UUIDs are the 16 bytes of the SMBIOS Type 1 UUID field,
+// which since SMBIOS 2.6 has the same layout as an EFI_GUID.
+//
+
+#define KERNELCMD_MATCH_PRODUCT 1 // SMBIOS Type 1 Product Name
+#define KERNELCMD_MATCH_SKU 2 // SMBIOS Type 1 SKU Number
+#define KERNELCMD_MATCH_UUID 3 // SMBIOS Type 1 UUID
+
+#define KERNELCMD_MATCH_FNV_OFFSET 0x811C9DC5
+#define KERNELCMD_MATCH_FNV_PRIME 0x01000193
+
+typedef struct {
+  UINT32 Hash; // 0 for a free slot
+  UINT32 Kind; // KERNELCMD_MATCH_*
+  UINT32 KeyOffset; // From the start of the file
+  UINT32 KeyLength; // In bytes
+  UINT32 Entry; // Index of the entry to boot
+} KERNELCMD_BIN_MATCH;
+
+// Failover: when an entry fails to load (which includes failing Secure Boot verification) or its kernel returns an error, the
+// loader moves straight on to the next entry in the fallback list. Each failure is added to the volatile
+// KERNELCMD_FAILURE_VARIABLE_NAME variable (under KERNELCMD_VARIABLE_GUID) as a KERNELCMD_FAILURE, so that the OS that does boot
+// can see what happened. Being volatile, it only ever describes the current boot.
+//
+
+#define KERNELCMD_FAILURE_VARIABLE_NAME "KernelcmdFailure"
+
+#define KERNELCMD_STAGE_FIND 1 // The kernel path or wildcard couldn't be resolved
+#define KERNELCMD_STAGE_LOAD 2 // LoadImage failed: missing file, bad image, or failed verification
+#define KERNELCMD_STAGE_START 3 // The kernel started, but returned an error
+
+typedef struct {
+  UINT32 Entry; // Index of the entry that failed
+  UINT32 Stage; // KERNELCMD_STAGE_*
+  UINT64 Status; // EFI_STATUS it failed with
+} KERNELCMD_FAILURE;
+
+#endif
@@ -19,6 +19,9 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include <pe.h>
+
+#include "Kernelcmd_bin.h"
 
 #define MAJOR_VER 2
 #define MINOR_VER 1
@@ -39,9 +42,106 @@
     #define DISABLE_UEFI_WATCHDOG_TIMER
     #define DEBUG_ENABLED
     #define SHOW_KERNEL_METADATA
+    #define TRACE_FILE_READS
 #endif
 
 
+//==================================================================================================================================
+// Output Settings
+//==================================================================================================================================
+//
+// All loader output is buffered (see Output.c) and only written out before waiting for a key or starting the kernel.
+//
+// QUIET_BOOT: Show nothing at all unless something goes wrong. On errors the whole buffered log is shown.
+// SERIAL_OUTPUT: Write output to the first serial port instead of ConOut. Serial-redirected consoles are much slower than the
+//  port itself, since every ConOut call goes through the firmware's terminal emulation.
+// SERIAL_BAUD_RATE: Baud rate to switch the serial port to with SERIAL_OUTPUT, e.g. 921600. 0 keeps the firmware's setting.
+// TRACE_FILE_READS: Print a "File read: PATH" line for each file read from a filesystem during boot, in the order they're read
+//  (initrd= files last, since Linux reads those itself). "Tools/esplayout --trace" lays the ESP out in that order.
+//
+
+//#define QUIET_BOOT
+//#define SERIAL_OUTPUT
+#define SERIAL_BAUD_RATE 0
+//#define TRACE_FILE_READS
+
+#define OUTPUT_BUFFER_CHARS 8192
+
+//==================================================================================================================================
+// Unattended Boot Settings
+//==================================================================================================================================
+//
+// Failed entries are skipped without waiting when the config has a fallback list (see Kernelcmd_bin.h). Errors that leave
+// nothing to boot still stop at a "Press any key" prompt, which is where this comes in.
+//
+// KEYWAIT_TIMEOUT: Seconds that prompt waits before continuing anyway. On an error that means returning to the firmware, which
+//  moves on to its next boot option, so a headless machine doesn't sit at the prompt until someone gets to it. 0 waits forever.
+//
+
+#define KEYWAIT_TIMEOUT 0
+
+//==================================================================================================================================
+// Random Seed Settings
+//==================================================================================================================================
+//
+// Linux gets a random seed from the firmware RNG and a seed file on the ESP (see Randomseed.c), so that it doesn't have to wait
+// for entropy early in boot.
+//
+// DISABLE_RANDOM_SEED: Don't touch the seed file or install a seed, e.g. for read-only ESPs.
+// RANDOM_SEED_FILE_NAME: Seed file, in the same directory as this loader. It's rewritten on every boot.
+// RANDOM_SEED_MAX_PREVIOUS: Largest seed table left by the firmware or another loader that gets mixed in (Linux's own limit).
+//
+
+//#define DISABLE_RANDOM_SEED
+#define RANDOM_SEED_FILE_NAME L"Randomseed.bin"
+#define RANDOM_SEED_MAX_PREVIOUS 512
+
+//==================================================================================================================================
+// Block Cache Settings
+//==================================================================================================================================
+//
+// The loader's own on-disk parsers read through a small LRU block cache (see Blockcache.c).
+//
+// BLOCK_CACHE_BLOCK_SIZE: Bytes per cached block. Devices with blocks that don't divide this aren't cached.
+// BLOCK_CACHE_BLOCKS: Blocks in the cache. Needs to be a power of 2.
+// BLOCK_CACHE_BYPASS_SIZE: Reads at least this big go around the cache, and it's also the most read in one go on misses. Needs
+//  to be a multiple of BLOCK_CACHE_BLOCK_SIZE.
+//
+
+#define BLOCK_CACHE_BLOCK_SIZE 4096
+#define BLOCK_CACHE_BLOCKS 64
+#define BLOCK_CACHE_BYPASS_SIZE 0x10000
+
+//==================================================================================================================================
+// Network Boot Settings
+//==================================================================================================================================
+//
+// For kernels fetched over TFTP (see Tftp.c) or HTTP (see Http.c).
+//
+// TFTP_BLOCK_SIZE: Bytes per block asked of the server. 1468 fills a 1500-byte Ethernet frame; bigger blocks get split into IP
+//  fragments, and losing any one of those loses the whole block.
+// TFTP_WINDOW_SIZE: Blocks the server sends before waiting for an ACK.
+// TFTP_TIMEOUT_MS: How long to wait for the server before resending, in milliseconds.
+// TFTP_RETRIES: Resends in a row before giving up.
+// NETWORK_MAPPING_TIMEOUT: Seconds to wait for the network interface to get an address, when not PXE booted.
+// HTTP_CONNECTIONS: Range requests to run at once for each file fetched over HTTP.
+// HTTP_FIRST_RANGE: Bytes asked for in the first request for a file, before its size is known. Files that aren't any bigger
+//  only take the one request.
+// HTTP_RECEIVE_BUFFER: TCP receive buffer asked of the firmware for each connection, which is what limits its window.
+// HTTP_TIMEOUT_MS: How long to wait for the HTTP server before giving up, in milliseconds.
+//
+
+#define TFTP_BLOCK_SIZE 1468
+#define TFTP_WINDOW_SIZE 32
+#define TFTP_TIMEOUT_MS 1000
+#define TFTP_RETRIES 5
+#define NETWORK_MAPPING_TIMEOUT 10
+
+#define HTTP_CONNECTIONS 4
+#define HTTP_FIRST_RANGE 0x100000
+#define HTTP_RECEIVE_BUFFER 0x400000
+#define HTTP_TIMEOUT_MS 10000
+
 //==================================================================================================================================
 // Text File UCS-2 Definitions
 //==================================================================================================================================
@@ -56,6 +156,151 @@
 #define UTF16_BOM_LE 0xFEFF
 #define UTF16_BOM_BE 0xFFFE
 
+//==================================================================================================================================
+// Kernelcmd.txt Parser Settings
+//==================================================================================================================================
+//
+// KERNELCMD_WINDOW_SIZE: Bytes read from Kernelcmd.txt per Read() call. Reading stops once the command line has been parsed.
+// KERNELCMD_PATH_CHARS & KERNELCMD_CMDLINE_CHARS: Starting buffer sizes, in characters. Longer lines just grow the buffers.
+// KERNELCMD_BIN_MAX_SIZE: Largest precompiled (binary) Kernelcmd.txt the loader will accept. See Kernelcmd_bin.h.
+//
+
+#define KERNELCMD_WINDOW_SIZE 512 // Needs to be even
+#define KERNELCMD_PATH_CHARS 256
+#define KERNELCMD_CMDLINE_CHARS 1024
+#define KERNELCMD_BIN_MAX_SIZE 0x100000
+
+// KERNEL_DIR_INFO_SIZE: Buffer size for reading directory entries when the kernel path has wildcards (see Wildcard.c). This
+//  fits an EFI_FILE_INFO with the longest name FAT allows, so every entry is read in one go.
+#define KERNEL_DIR_INFO_SIZE (SIZE_OF_EFI_FILE_INFO + 256 * sizeof(CHAR16))
+
+// KERNELCMD_MAX_FAILURES: Failed boot attempts that get recorded in the KernelcmdFailure variable (see Kernelcmd_bin.h).
+#define KERNELCMD_MAX_FAILURES 16
+
+#define KERNELCMD_ENCODING_UNKNOWN 0
+#define KERNELCMD_ENCODING_UTF16 1 // Native byte order, with BOM
+#define KERNELCMD_ENCODING_UTF8 2 // With or without BOM; includes ASCII
+
+//==================================================================================================================================
+// Structure Definitions
+//==================================================================================================================================
+//
+// Kernel image location and command line, as parsed from the boot configuration. Lengths are in characters and don't count
+// the null terminator. With a precompiled config, both strings point straight into the loaded file, variable, or embedded
+// section (Image) instead of having their own pools, and SelectKernelcmdEntry switches them to another of its entries.
+//
+
+typedef struct {
+  CHAR16 * KernelPath;
+  UINTN    KernelPathLength;
+  CHAR16 * Cmdline; // Allocated as EfiLoaderData so that it persists into the kernel
+  UINTN    CmdlineLength;
+  VOID *   Image; // Precompiled config the strings live in (EfiLoaderData or this loader's image), or NULL if parsed from text
+  UINT32   Flags; // KERNELCMD_BIN_FLAG_* from a precompiled config, 0 for text
+  UINT32   EntryCount; // Boot entries to choose from; text configs only have 1
+  UINT32   MenuTimeout; // In seconds; 0 means no menu (see Kernelcmd_bin.h)
+  UINT32   DefaultEntry;
+  UINT32   MatchSlotCount; // Hardware match table of a precompiled config, if it has one (see Smbios.c)
+  UINT32   MatchTableOffset;
+  UINT32   FallbackCount; // Fallback list of a precompiled config, checked to only name existing entries
+  UINT32   FallbackTableOffset;
+  UINT32   Entry; // Index of the entry KernelPath and Cmdline are from
+} KERNEL_CONFIG;
+
+//
+// SMBIOS 3.0 64-bit entry point, which gnu-efi's libsmbios.h doesn't have. Newer firmware may only provide this one.
+//
+
+#pragma pack(1)
+typedef struct {
+  UINT8  AnchorString[5]; // "_SM3_"
+  UINT8  EntryPointStructureChecksum;
+  UINT8  EntryPointLength;
+  UINT8  MajorVersion;
+  UINT8  MinorVersion;
+  UINT8  DocRev;
+  UINT8  EntryPointRevision;
+  UINT8  Reserved;
+  UINT32 TableMaximumSize;
+  UINT64 TableAddress;
+} SMBIOS3_ENTRY_POINT;
+#pragma pack()
+
+//
+// The SMBIOS System Information (Type 1) fields that configs can match on. Strings point into the SMBIOS table and aren't
+// null-terminated; they are NULL if the machine doesn't have them.
+//
+
+typedef struct {
+  CONST UINT8 * ProductName;
+  UINTN         ProductNameLength;
+  CONST UINT8 * Sku;
+  UINTN         SkuLength;
+  EFI_GUID      Uuid;
+  BOOLEAN       HaveUuid;
+} SMBIOS_SYSTEM_INFO;
+
+//
+// Linux's random seed configuration table (struct linux_efi_random_seed), which gnu-efi doesn't have
+//
+
+#define LINUX_EFI_RANDOM_SEED_TABLE_GUID \
+  { 0x1ce1e5bc, 0x7ceb, 0x42f2, {0x81, 0xe5, 0x8a, 0xad, 0xf1, 0x80, 0xf5, 0x7b} }
+
+typedef struct {
+  UINT32 Size; // Bytes in Bits
+  UINT8  Bits[];
+} LINUX_EFI_RANDOM_SEED;
+
+//
+// Vendor media device path Linux looks for a LoadFile2 protocol on to get its initrd from (Linux 5.8 and newer)
+//
+
+#define LINUX_EFI_INITRD_MEDIA_GUID \
+  { 0x5568e427, 0x68fc, 0x4f3d, {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68} }
+
+//
+// Block cache counters, shown in debug builds before a kernel is started. Hits and Misses count cache blocks, ReadCalls counts
+// ReadBlocks calls, and BypassBytes counts bytes read around the cache.
+//
+
+typedef struct {
+  UINT64 Hits;
+  UINT64 Misses;
+  UINT64 ReadCalls;
+  UINT64 BypassBytes;
+} BLOCK_CACHE_STATS;
+
+extern BLOCK_CACHE_STATS BlockCacheStats;
+
+//
+// A network interface and the addresses to fetch a kernel with (see Network.c). The station address, subnet mask, and gateway
+// only count if UseDefaultAddress is FALSE, and the gateway only if HasGateway is TRUE.
+//
+
+typedef struct {
+  EFI_HANDLE            ServiceHandle;
+  EFI_SERVICE_BINDING * ServiceBinding; // UDP4 or TCP4
+  BOOLEAN               UseDefaultAddress;
+  EFI_IPv4_ADDRESS      StationAddress;
+  EFI_IPv4_ADDRESS      SubnetMask;
+  EFI_IPv4_ADDRESS      Gateway;
+  BOOLEAN               HasGateway;
+  EFI_IPv4_ADDRESS      Server;
+  UINT16                ServerPort;
+} NETWORK_INTERFACE;
+
+//
+// A buffer that fetched files are appended to. Capacity is what's allocated, Size what's used.
+//
+
+typedef struct {
+  UINT8 *         Data;
+  UINTN           Size;
+  UINTN           Capacity;
+  EFI_MEMORY_TYPE MemoryType;
+} NETWORK_BUFFER;
+
 //==================================================================================================================================
 // Function Prototypes
 //==================================================================================================================================
@@ -64,6 +309,45 @@
 //
 
 EFI_STATUS Keywait(CHAR16 *String);
+EFI_STATUS ReadKernelcmdFile(EFI_HANDLE ImageHandle, EFI_LOADED_IMAGE_PROTOCOL *LoadedImage, KERNEL_CONFIG *Config);
+EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, EFI_LOADED_IMAGE_PROTOCOL *LoadedImage, CONST KERNEL_CONFIG *Config, UINT32 *Stage);
+EFI_STATUS LoadKernelFile(EFI_HANDLE ImageHandle, EFI_HANDLE DeviceHandle, CHAR16 *KernelPath, UINT32 *Stage, EFI_HANDLE *KernelImageHandle);
 UINT8 compare(const void* firstitem, const void* seconditem, UINT64 comparelength);
 
+EFI_STATUS ReadKernelcmd(EFI_FILE *KernelcmdFile, KERNEL_CONFIG *Config);
+EFI_STATUS ReadKernelcmdVariable(KERNEL_CONFIG *Config);
+EFI_STATUS ReadKernelcmdEmbedded(EFI_LOADED_IMAGE_PROTOCOL *LoadedImage, KERNEL_CONFIG *Config);
+VOID SelectKernelcmdEntry(KERNEL_CONFIG *Config, UINT32 Index);
+UINT32 KernelcmdFallback(CONST KERNEL_CONFIG *Config, UINT32 Index);
+BOOLEAN FindKernelcmdMatch(CONST KERNEL_CONFIG *Config, UINT32 Kind, CONST UINT8 *Key, UINTN KeyLength, UINT32 *Entry);
+EFI_STATUS ReadSmbiosSystemInfo(SMBIOS_SYSTEM_INFO *Info);
+VOID SelectKernelcmdByHardware(KERNEL_CONFIG *Config);
+EFI_STATUS BootMenu(KERNEL_CONFIG *Config);
+VOID InstallRandomSeed(EFI_LOADED_IMAGE_PROTOCOL *LoadedImage);
+EFI_STATUS Utf8ToUtf16(CONST UINT8 *Input, UINTN InputSize, CHAR16 *Output, UINTN *OutputLength, UINTN *Consumed);
+
+INTN CompareVersions(CONST CHAR16 *First, CONST CHAR16 *Second);
+EFI_STATUS ResolveKernelPath(EFI_HANDLE DeviceHandle, CHAR16 *KernelPath, CHAR16 **ResolvedPath);
+EFI_STATUS LocateKernelPartition(EFI_HANDLE DefaultHandle, CHAR16 *KernelPath, EFI_HANDLE *DeviceHandle, CHAR16 **Path);
+VOID FreePartitionIndex(VOID);
+EFI_STATUS BlockCacheRead(EFI_BLOCK_IO *BlockIo, UINT64 Offset, UINTN Size, VOID *Buffer);
+VOID BlockCacheFlush(VOID);
+CONST CHAR16 * FindIsoSeparator(CONST CHAR16 *KernelPath);
+EFI_STATUS LoadIsoKernel(EFI_HANDLE ImageHandle, EFI_HANDLE DeviceHandle, CONST CHAR16 *KernelPath, CONST CHAR16 *Separator, CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINT32 *Stage, EFI_HANDLE *KernelImageHandle);
+BOOLEAN NextInitrdArgument(CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINTN *Position, UINTN *Start, UINTN *Length);
+EFI_STATUS InstallInitrd(VOID *Buffer, UINTN Size);
+VOID FreeInitrd(VOID);
+EFI_STATUS LoadKernelImage(EFI_HANDLE ImageHandle, EFI_HANDLE DeviceHandle, CONST CHAR16 *Path, VOID *KernelBuffer, UINTN KernelSize, VOID *InitrdBuffer, UINTN InitrdBufferSize, EFI_HANDLE *KernelImageHandle);
+EFI_STATUS OpenNetwork(EFI_HANDLE DefaultHandle, EFI_GUID *ServiceBindingProtocol, CONST CHAR16 *KernelPath, UINT16 DefaultPort, NETWORK_INTERFACE *Network, CONST CHAR16 **Path);
+EFI_STATUS ReserveNetworkBuffer(NETWORK_BUFFER *Buffer, UINTN Size);
+VOID FreeNetworkBuffer(NETWORK_BUFFER *Buffer);
+EFI_STATUS LoadFetchedKernel(EFI_HANDLE ImageHandle, CONST NETWORK_INTERFACE *Network, CONST CHAR16 *Path, NETWORK_BUFFER *Kernel, NETWORK_BUFFER *Initrd, EFI_HANDLE *KernelImageHandle);
+EFI_STATUS LoadTftpKernel(EFI_HANDLE ImageHandle, EFI_HANDLE DefaultHandle, CONST CHAR16 *KernelPath, CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINT32 *Stage, EFI_HANDLE *KernelImageHandle);
+EFI_STATUS LoadHttpKernel(EFI_HANDLE ImageHandle, EFI_HANDLE DefaultHandle, CONST CHAR16 *KernelPath, CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINT32 *Stage, EFI_HANDLE *KernelImageHandle);
+
+VOID OutputInit(VOID);
+UINTN LoaderPrint(CONST CHAR16 *fmt, ...);
+VOID OutputSync(VOID);
+VOID OutputDiscard(VOID);
+
 #endif
@@ -0,0 +1,354 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Block Cache
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// A small read cache over EFI_BLOCK_IO_PROTOCOL for the loader's own on-disk parsers (like the GPT reader in Partition.c), which
+// keep going back to the same few metadata blocks. BlockCacheRead takes byte offsets like DiskIo->ReadDisk does, but goes
+// through BLOCK_CACHE_BLOCKS blocks of BLOCK_CACHE_BLOCK_SIZE bytes, hashed by device and block number and evicted least
+// recently used first (see Stubloader.h for the sizes).
+//
+// Blocks a read misses that are next to each other are fetched with a single ReadBlocks call. Reads of BLOCK_CACHE_BYPASS_SIZE
+// or more are streaming data rather than metadata, so they go around the cache without pushing anything out of it.
+//
+// The loader never writes to anything it reads this way, so the cache is only ever dropped as a whole: when a device reports a
+// media change, and by BlockCacheFlush before returning to the firmware.
+//
+
+#include "Stubloader.h"
+
+#define BLOCK_CACHE_NONE 0xFFFFFFFF
+#define BLOCK_CACHE_BUCKETS (BLOCK_CACHE_BLOCKS * 2)
+#define BLOCK_CACHE_MAX_RUN (BLOCK_CACHE_BYPASS_SIZE / BLOCK_CACHE_BLOCK_SIZE) // Blocks per coalesced ReadBlocks
+
+typedef struct {
+  EFI_BLOCK_IO * BlockIo; // NULL if the entry is unused
+  UINT32         MediaId;
+  UINT64         Number; // Device offset / BLOCK_CACHE_BLOCK_SIZE
+  UINTN          Valid; // Bytes of Data on the device; only the device's last block can be short
+  UINT32         HashNext;
+  UINT32         LruPrev; // Towards the most recently used entry
+  UINT32         LruNext; // Towards the least recently used entry
+  UINT8 *        Data;
+} BLOCK_CACHE_ENTRY;
+
+STATIC BLOCK_CACHE_ENTRY CacheEntries[BLOCK_CACHE_BLOCKS];
+STATIC UINT32 CacheBuckets[BLOCK_CACHE_BUCKETS];
+STATIC UINT32 LruFirst = BLOCK_CACHE_NONE; // Most recently used
+STATIC UINT32 LruLast = BLOCK_CACHE_NONE; // Least recently used, evicted next
+STATIC UINT8 * CacheData = NULL; // Pages for all the blocks, then BLOCK_CACHE_BYPASS_SIZE bytes of staging
+STATIC UINT8 * Staging = NULL;
+
+BLOCK_CACHE_STATS BlockCacheStats = {0, 0, 0, 0};
+
+#define CACHE_PAGES EFI_SIZE_TO_PAGES(BLOCK_CACHE_BLOCKS * BLOCK_CACHE_BLOCK_SIZE + BLOCK_CACHE_BYPASS_SIZE)
+
+//==================================================================================================================================
+//  Cache Bookkeeping
+//==================================================================================================================================
+//
+// Hash chains and the LRU list are both linked through entry indices. Pages from AllocatePages satisfy any IoAlign a device
+// can ask for with BLOCK_CACHE_BLOCK_SIZE-sized blocks, so ReadBlocks can read straight into the staging area.
+//
+
+STATIC UINTN CacheHash(EFI_BLOCK_IO *BlockIo, UINT64 Number)
+{
+  return (UINTN)(((Number * 0x9E3779B1) ^ ((UINTN)BlockIo >> 4)) & (BLOCK_CACHE_BUCKETS - 1));
+}
+
+STATIC VOID LruUnlink(UINT32 Index)
+{
+  BLOCK_CACHE_ENTRY * Entry = &CacheEntries[Index];
+
+  if(Entry->LruPrev != BLOCK_CACHE_NONE)
+  {
+    CacheEntries[Entry->LruPrev].LruNext = Entry->LruNext;
+  }
+  else
+  {
+    LruFirst = Entry->LruNext;
+  }
+
+  if(Entry->LruNext != BLOCK_CACHE_NONE)
+  {
+    CacheEntries[Entry->LruNext].LruPrev = Entry->LruPrev;
+  }
+  else
+  {
+    LruLast = Entry->LruPrev;
+  }
+}
+
+STATIC VOID LruPushFirst(UINT32 Index)
+{
+  CacheEntries[Index].LruPrev = BLOCK_CACHE_NONE;
+  CacheEntries[Index].LruNext = LruFirst;
+  if(LruFirst != BLOCK_CACHE_NONE)
+  {
+    CacheEntries[LruFirst].LruPrev = Index;
+  }
+  else
+  {
+    LruLast = Index;
+  }
+  LruFirst = Index;
+}
+
+// Empties every entry, keeping the memory
+STATIC VOID CacheReset(VOID)
+{
+  for(UINT32 i = 0; i < BLOCK_CACHE_BUCKETS; i++)
+  {
+    CacheBuckets[i] = BLOCK_CACHE_NONE;
+  }
+
+  LruFirst = BLOCK_CACHE_NONE;
+  LruLast = BLOCK_CACHE_NONE;
+  for(UINT32 i = 0; i < BLOCK_CACHE_BLOCKS; i++)
+  {
+    CacheEntries[i].BlockIo = NULL;
+    CacheEntries[i].Data = &CacheData[i * BLOCK_CACHE_BLOCK_SIZE];
+    LruPushFirst(i);
+  }
+}
+
+STATIC EFI_STATUS CacheInit(VOID)
+{
+  EFI_PHYSICAL_ADDRESS Pages;
+  EFI_STATUS Status;
+
+  Status = ST->BootServices->AllocatePages(AllocateAnyPages, EfiBootServicesData, CACHE_PAGES, &Pages);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Block cache AllocatePages error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  CacheData = (UINT8*)(UINTN)Pages;
+  Staging = &CacheData[BLOCK_CACHE_BLOCKS * BLOCK_CACHE_BLOCK_SIZE];
+  CacheReset();
+
+  return EFI_SUCCESS;
+}
+
+STATIC BLOCK_CACHE_ENTRY * CacheLookup(EFI_BLOCK_IO *BlockIo, UINT32 MediaId, UINT64 Number)
+{
+  for(UINT32 Index = CacheBuckets[CacheHash(BlockIo, Number)]; Index != BLOCK_CACHE_NONE; Index = CacheEntries[Index].HashNext)
+  {
+    BLOCK_CACHE_ENTRY * Entry = &CacheEntries[Index];
+    if((Entry->BlockIo == BlockIo) && (Entry->Number == Number) && (Entry->MediaId == MediaId))
+    {
+      LruUnlink(Index);
+      LruPushFirst(Index);
+      return Entry;
+    }
+  }
+  return NULL;
+}
+
+// Reuses the least recently used entry for a new block, which becomes the most recently used
+STATIC BLOCK_CACHE_ENTRY * CacheEvict(EFI_BLOCK_IO *BlockIo, UINT32 MediaId, UINT64 Number)
+{
+  UINT32 Index = LruLast;
+  BLOCK_CACHE_ENTRY * Entry = &CacheEntries[Index];
+
+  if(Entry->BlockIo != NULL)
+  {
+    UINT32 * Link = &CacheBuckets[CacheHash(Entry->BlockIo, Entry->Number)];
+    while(*Link != Index)
+    {
+      Link = &CacheEntries[*Link].HashNext;
+    }
+    *Link = Entry->HashNext;
+  }
+
+  Entry->BlockIo = BlockIo;
+  Entry->MediaId = MediaId;
+  Entry->Number = Number;
+
+  UINTN Bucket = CacheHash(BlockIo, Number);
+  Entry->HashNext = CacheBuckets[Bucket];
+  CacheBuckets[Bucket] = Index;
+
+  LruUnlink(Index);
+  LruPushFirst(Index);
+  return Entry;
+}
+
+// Copies the part of [Offset, Offset + Size) that's in the BlockSize bytes at Start
+STATIC VOID CopyOverlap(UINT64 Start, CONST UINT8 *Data, UINTN BlockSize, UINT64 Offset, UINTN Size, UINT8 *Buffer)
+{
+  UINT64 From = (Offset > Start) ? Offset : Start;
+  UINT64 To = ((Offset + Size) < (Start + BlockSize)) ? (Offset + Size) : (Start + BlockSize);
+
+  if(From < To)
+  {
+    CopyMem(&Buffer[From - Offset], &Data[From - Start], (UINTN)(To - From));
+  }
+}
+
+//==================================================================================================================================
+//  StreamRead: Read Around the Cache
+//==================================================================================================================================
+//
+// Straight into Buffer when the device can take it as is, otherwise through the staging area one chunk at a time.
+//
+
+STATIC EFI_STATUS StreamRead(EFI_BLOCK_IO *BlockIo, UINT64 Offset, UINTN Size, UINT8 *Buffer)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_MEDIA * Media = BlockIo->Media;
+  UINT32 IoAlign = (Media->IoAlign > 1) ? Media->IoAlign : 1;
+
+  BlockCacheStats.BypassBytes += Size;
+
+  if(((Offset % Media->BlockSize) == 0) && ((Size % Media->BlockSize) == 0) && (((UINTN)Buffer & (IoAlign - 1)) == 0))
+  {
+    BlockCacheStats.ReadCalls++;
+    return BlockIo->ReadBlocks(BlockIo, Media->MediaId, Offset / Media->BlockSize, Size, Buffer);
+  }
+
+  if((Staging == NULL) || (Media->BlockSize > BLOCK_CACHE_BYPASS_SIZE) || (IoAlign > EFI_PAGE_SIZE))
+  {
+    return EFI_UNSUPPORTED;
+  }
+
+  UINTN ChunkSize = BLOCK_CACHE_BYPASS_SIZE - (BLOCK_CACHE_BYPASS_SIZE % Media->BlockSize);
+  UINT64 DeviceSize = (Media->LastBlock + 1) * Media->BlockSize;
+  UINT64 Start = Offset - (Offset % Media->BlockSize);
+
+  while(Start < Offset + Size)
+  {
+    UINTN Length = ((DeviceSize - Start) < ChunkSize) ? (UINTN)(DeviceSize - Start) : ChunkSize;
+
+    BlockCacheStats.ReadCalls++;
+    Status = BlockIo->ReadBlocks(BlockIo, Media->MediaId, Start / Media->BlockSize, Length, Staging);
+    if(EFI_ERROR(Status))
+    {
+      return Status;
+    }
+
+    CopyOverlap(Start, Staging, Length, Offset, Size, Buffer);
+    Start += Length;
+  }
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  BlockCacheRead: Cached Byte-Granular Device Read
+//==================================================================================================================================
+//
+// Reads Size bytes at byte Offset of the device behind BlockIo into Buffer, which needs no particular alignment. Devices whose
+// block size doesn't divide BLOCK_CACHE_BLOCK_SIZE (or that need more than page alignment) are just read around the cache.
+//
+
+EFI_STATUS BlockCacheRead(EFI_BLOCK_IO *BlockIo, UINT64 Offset, UINTN Size, VOID *Buffer)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO_MEDIA * Media = BlockIo->Media;
+
+  if(!Media->MediaPresent)
+  {
+    return EFI_NO_MEDIA;
+  }
+
+  UINT64 DeviceSize = (Media->LastBlock + 1) * Media->BlockSize;
+  if((Offset > DeviceSize) || (Size > DeviceSize - Offset))
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+  if(Size == 0)
+  {
+    return EFI_SUCCESS;
+  }
+
+  if((CacheData == NULL) && EFI_ERROR(CacheInit()))
+  {
+    return StreamRead(BlockIo, Offset, Size, Buffer);
+  }
+
+  if((Size >= BLOCK_CACHE_BYPASS_SIZE) || (Media->BlockSize > BLOCK_CACHE_BLOCK_SIZE) || ((BLOCK_CACHE_BLOCK_SIZE % Media->BlockSize) != 0) || (Media->IoAlign > EFI_PAGE_SIZE))
+  {
+    return StreamRead(BlockIo, Offset, Size, Buffer);
+  }
+
+  UINT64 Number = Offset / BLOCK_CACHE_BLOCK_SIZE;
+  UINT64 Last = (Offset + Size - 1) / BLOCK_CACHE_BLOCK_SIZE;
+
+  while(Number <= Last)
+  {
+    UINT64 Start = Number * BLOCK_CACHE_BLOCK_SIZE;
+    BLOCK_CACHE_ENTRY * Entry = CacheLookup(BlockIo, Media->MediaId, Number);
+    if(Entry != NULL)
+    {
+      BlockCacheStats.Hits++;
+      CopyOverlap(Start, Entry->Data, Entry->Valid, Offset, Size, Buffer);
+      Number++;
+      continue;
+    }
+
+    // Gather this miss and the ones right after it into one read
+    UINTN Run = 1;
+    while((Number + Run <= Last) && (Run < BLOCK_CACHE_MAX_RUN) && (CacheLookup(BlockIo, Media->MediaId, Number + Run) == NULL))
+    {
+      Run++;
+    }
+
+    UINTN Length = Run * BLOCK_CACHE_BLOCK_SIZE;
+    if(Length > DeviceSize - Start)
+    {
+      Length = (UINTN)(DeviceSize - Start);
+    }
+
+    BlockCacheStats.Misses += Run;
+    BlockCacheStats.ReadCalls++;
+    Status = BlockIo->ReadBlocks(BlockIo, Media->MediaId, Start / Media->BlockSize, Length, Staging);
+    if(EFI_ERROR(Status))
+    {
+      if(Status == EFI_MEDIA_CHANGED)
+      {
+        CacheReset();
+      }
+      return Status;
+    }
+
+    for(UINTN i = 0; i < Run; i++)
+    {
+      Entry = CacheEvict(BlockIo, Media->MediaId, Number + i);
+      Entry->Valid = ((Length - i * BLOCK_CACHE_BLOCK_SIZE) < BLOCK_CACHE_BLOCK_SIZE) ? (Length - i * BLOCK_CACHE_BLOCK_SIZE) : BLOCK_CACHE_BLOCK_SIZE;
+      CopyMem(Entry->Data, &Staging[i * BLOCK_CACHE_BLOCK_SIZE], Entry->Valid);
+      CopyOverlap(Start + i * BLOCK_CACHE_BLOCK_SIZE, Entry->Data, Entry->Valid, Offset, Size, Buffer);
+    }
+
+    Number += Run;
+  }
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  BlockCacheFlush: Drop the Block Cache
+//==================================================================================================================================
+//
+// Empties the cache and gives its memory back, e.g. before returning to the firmware. The counters are left alone.
+//
+
+VOID BlockCacheFlush(VOID)
+{
+  if(CacheData != NULL)
+  {
+    ST->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)CacheData, CACHE_PAGES);
+    CacheData = NULL;
+    Staging = NULL;
+  }
+}
@@ -0,0 +1,717 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: HTTP Network Boot
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Fetches the kernel and its initrd= files over plain HTTP, for kernel paths like HTTP=10.0.0.2:8000\boot\vmlinuz (port 80
+// without a :PORT, and the PXE server without an address). The initrd= paths are fetched from the same server.
+//
+// One TCP connection only gets as far as the window the firmware's TCP driver is willing to keep open, so each file is fetched
+// as several Range requests on HTTP_CONNECTIONS connections at once. The first request asks for the first HTTP_FIRST_RANGE
+// bytes, which is all of smaller files and gives the size of bigger ones; the rest is then split evenly over the connections.
+// Each connection asks the driver for an HTTP_RECEIVE_BUFFER receive buffer with window scaling, and receives straight into
+// the part of the file's buffer its range goes to, so the parts are put together where they land. A server that doesn't do
+// ranges (e.g. Python's http.server) answers the first request with the whole file, which then comes over that one connection.
+//
+// Every request is sent with Connection: close and gets its own connection, which is dropped as soon as its range is in.
+//
+// The kernel is loaded from memory, and the initrds are handed to it as described in Initrd.c.
+//
+
+#include "Stubloader.h"
+
+#define HTTP_SERVER_PORT 80
+#define HTTP_MAX_HEADER 4096 // Request and response headers
+#define HTTP_MAX_RECEIVE 0x40000000 // Most asked of one Receive call
+
+#define HTTP_STATE_IDLE 0
+#define HTTP_STATE_CONNECTING 1
+#define HTTP_STATE_SENDING 2
+#define HTTP_STATE_HEADERS 3
+#define HTTP_STATE_BODY 4
+
+typedef struct {
+  UINT32                    State;
+  EFI_HANDLE                ChildHandle;
+  EFI_TCP4 *                Tcp;
+  EFI_EVENT                 Event; // For whichever token is in flight; there's only ever one
+  EFI_TCP4_CONNECTION_TOKEN ConnectToken;
+  EFI_TCP4_IO_TOKEN         TxToken;
+  EFI_TCP4_IO_TOKEN         RxToken;
+  EFI_TCP4_TRANSMIT_DATA    TxData;
+  EFI_TCP4_RECEIVE_DATA     RxData;
+  UINT64                    Start; // Where the range starts in the file
+  UINT64                    Length; // How long it is; for the first request, how much was asked for until the answer says
+  UINT64                    Received; // Bytes of the range in so far
+  UINTN                     HeaderLength;
+  UINT8                     Header[HTTP_MAX_HEADER]; // The request on the way out, the response headers on the way in
+} HTTP_CONNECTION;
+
+typedef struct {
+  NETWORK_INTERFACE * Network;
+  NETWORK_BUFFER *    Buffer;
+  UINTN               Base; // Where the file starts in Buffer
+  BOOLEAN             SizeKnown;
+  UINT64              Size;
+  UINT64              NextStart; // Of the next range to fetch
+  UINT64              PartSize;
+  UINT8               Path[HTTP_MAX_HEADER / 2]; // Percent-encoded, null-terminated
+#ifdef DEBUG_ENABLED
+  UINTN               Requests;
+#endif
+} HTTP_FETCH;
+
+STATIC HTTP_CONNECTION Connections[HTTP_CONNECTIONS];
+
+//
+// Building requests
+//
+
+STATIC UINT8 * HttpPutString(UINT8 *Out, CONST CHAR8 *String)
+{
+  while(*String != '\0')
+  {
+    *Out++ = *String++;
+  }
+  return Out;
+}
+
+STATIC UINT8 * HttpPutNumber(UINT8 *Out, UINT64 Number)
+{
+  CHAR8 Digits[21];
+  UINTN i = sizeof(Digits) - 1;
+
+  Digits[i] = '\0';
+  do
+  {
+    Digits[--i] = (CHAR8)('0' + Number % 10);
+    Number /= 10;
+  } while(Number != 0);
+
+  return HttpPutString(Out, &Digits[i]);
+}
+
+// Turns Path (PathLength characters) into the request's path: / for \, and anything but letters, digits, and -._~/ as %XX
+STATIC EFI_STATUS HttpEncodePath(CONST CHAR16 *Path, UINTN PathLength, UINT8 *Out, UINTN OutSize)
+{
+  STATIC CONST CHAR8 Hex[] = "0123456789ABCDEF";
+  UINTN Length = 0;
+
+  while((PathLength != 0) && ((*Path == L'\\') || (*Path == L'/')))
+  {
+    Path++;
+    PathLength--;
+  }
+  if(PathLength == 0)
+  {
+    LoaderPrint(L"Bad HTTP path.\r\n");
+    return EFI_INVALID_PARAMETER;
+  }
+
+  Out[Length++] = '/';
+  for(UINTN i = 0; i < PathLength; i++)
+  {
+    CHAR16 Char = (Path[i] == L'\\') ? L'/' : Path[i];
+    if((Char < 0x20) || (Char > 0x7E))
+    {
+      LoaderPrint(L"HTTP paths can only be ASCII.\r\n");
+      return EFI_INVALID_PARAMETER;
+    }
+    if(Length + 4 > OutSize)
+    {
+      LoaderPrint(L"HTTP path is too long.\r\n");
+      return EFI_INVALID_PARAMETER;
+    }
+
+    if(((Char >= L'a') && (Char <= L'z')) || ((Char >= L'A') && (Char <= L'Z')) || ((Char >= L'0') && (Char <= L'9')) || (Char == L'-') || (Char == L'.') || (Char == L'_') || (Char == L'~') || (Char == L'/'))
+    {
+      Out[Length++] = (UINT8)Char;
+    }
+    else
+    {
+      Out[Length++] = '%';
+      Out[Length++] = Hex[Char >> 4];
+      Out[Length++] = Hex[Char & 0xF];
+    }
+  }
+  Out[Length] = '\0';
+  return EFI_SUCCESS;
+}
+
+//
+// Reading responses
+//
+
+// Finds the value of the header called Name (lowercase) in the response headers, or returns NULL
+STATIC CONST UINT8 * HttpFindHeader(CONST HTTP_CONNECTION *Connection, CONST CHAR8 *Name)
+{
+  CONST UINT8 * Line = Connection->Header;
+  CONST UINT8 * End = Connection->Header + Connection->HeaderLength;
+
+  while(Line < End)
+  {
+    // The status line and each header end in \r\n
+    CONST UINT8 * Next = Line;
+    while((Next < End) && (*Next != '\n'))
+    {
+      Next++;
+    }
+
+    CONST UINT8 * Char = Line;
+    CONST CHAR8 * Match = Name;
+    while((*Match != '\0') && (Char < Next) && ((*Char | 0x20) == (UINT8)*Match))
+    {
+      Char++;
+      Match++;
+    }
+    if((*Match == '\0') && (Char < Next) && (*Char == ':'))
+    {
+      Char++;
+      while((Char < Next) && ((*Char == ' ') || (*Char == '\t')))
+      {
+        Char++;
+      }
+      return Char;
+    }
+
+    Line = Next + 1;
+  }
+  return NULL;
+}
+
+// Reads a decimal number, and moves *Text past it; FALSE without one
+STATIC BOOLEAN HttpParseNumber(CONST UINT8 **Text, UINT64 *Number)
+{
+  CONST UINT8 * Char = *Text;
+  UINT64 Value = 0;
+
+  while((*Char >= '0') && (*Char <= '9') && (Value < 0x0CCCCCCCCCCCCCCCULL))
+  {
+    Value = Value * 10 + (*Char++ - '0');
+  }
+  if(Char == *Text)
+  {
+    return FALSE;
+  }
+
+  *Number = Value;
+  *Text = Char;
+  return TRUE;
+}
+
+//
+// Connections
+//
+
+STATIC VOID HttpStop(HTTP_FETCH *Fetch, HTTP_CONNECTION *Connection)
+{
+  if(Connection->State == HTTP_STATE_IDLE)
+  {
+    return;
+  }
+
+  // Resetting the instance drops the connection and cancels what's in flight
+  Connection->Tcp->Configure(Connection->Tcp, NULL);
+  ST->BootServices->CloseEvent(Connection->Event);
+  Fetch->Network->ServiceBinding->DestroyChild(Fetch->Network->ServiceBinding, Connection->ChildHandle);
+  Connection->State = HTTP_STATE_IDLE;
+}
+
+//==================================================================================================================================
+//  HttpStart: Request a Range
+//==================================================================================================================================
+//
+// Opens a connection for the Length bytes at Start in the file, which gets sent once it's connected. Without an address from
+// PXE, waits up to NETWORK_MAPPING_TIMEOUT seconds for the firmware's default address to be configured (e.g. over DHCP).
+// Prints what went wrong on errors.
+//
+
+STATIC EFI_STATUS HttpStart(HTTP_FETCH *Fetch, HTTP_CONNECTION *Connection, UINT64 Start, UINT64 Length)
+{
+  EFI_STATUS Status;
+  NETWORK_INTERFACE * Network = Fetch->Network;
+
+  Connection->Start = Start;
+  Connection->Length = Length;
+  Connection->Received = 0;
+  Connection->HeaderLength = 0;
+
+  Status = Network->ServiceBinding->CreateChild(Network->ServiceBinding, &Connection->ChildHandle);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Tcp4 CreateChild error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  Status = ST->BootServices->HandleProtocol(Connection->ChildHandle, &Tcp4Protocol, (void**)&Connection->Tcp);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Tcp4 HandleProtocol error. 0x%llx\r\n", Status);
+    Network->ServiceBinding->DestroyChild(Network->ServiceBinding, Connection->ChildHandle);
+    return Status;
+  }
+
+  EFI_TCP4_OPTION Option;
+  ZeroMem(&Option, sizeof(Option));
+  Option.ReceiveBufferSize = HTTP_RECEIVE_BUFFER;
+  Option.DataRetries = 12; // Some drivers take 0 as no retransmissions at all
+  Option.EnableTimeStamp = TRUE;
+  Option.EnableWindowScaling = TRUE; // Without it, the window stops at 64KB whatever the buffer is
+
+  EFI_TCP4_CONFIG_DATA Config;
+  ZeroMem(&Config, sizeof(Config));
+  Config.TimeToLive = 64;
+  Config.AccessPoint.UseDefaultAddress = Network->UseDefaultAddress;
+  Config.AccessPoint.StationAddress = Network->StationAddress;
+  Config.AccessPoint.SubnetMask = Network->SubnetMask;
+  Config.AccessPoint.RemoteAddress = Network->Server;
+  Config.AccessPoint.RemotePort = Network->ServerPort;
+  Config.AccessPoint.ActiveFlag = TRUE;
+  Config.ControlOption = &Option;
+
+  // Until DHCP is done, there's no default address yet
+  Status = Connection->Tcp->Configure(Connection->Tcp, &Config);
+  if((Status == EFI_UNSUPPORTED) || (Status == EFI_INVALID_PARAMETER))
+  {
+    // Drivers that won't take the options get their defaults
+    Config.ControlOption = NULL;
+    Status = Connection->Tcp->Configure(Connection->Tcp, &Config);
+  }
+  for(UINTN Waited = 0; (Status == EFI_NO_MAPPING) && (Waited < NETWORK_MAPPING_TIMEOUT * 10); Waited++)
+  {
+    ST->BootServices->Stall(100000);
+    Status = Connection->Tcp->Configure(Connection->Tcp, &Config);
+  }
+  if(!EFI_ERROR(Status) && Network->HasGateway)
+  {
+    EFI_IPv4_ADDRESS Zero;
+    ZeroMem(&Zero, sizeof(Zero));
+    Status = Connection->Tcp->Routes(Connection->Tcp, FALSE, &Zero, &Zero, &Network->Gateway);
+  }
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Tcp4 Configure error. 0x%llx\r\n", Status);
+    Connection->Tcp->Configure(Connection->Tcp, NULL);
+    Network->ServiceBinding->DestroyChild(Network->ServiceBinding, Connection->ChildHandle);
+    return Status;
+  }
+
+  Status = ST->BootServices->CreateEvent(0, 0, NULL, NULL, &Connection->Event);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"HTTP CreateEvent error. 0x%llx\r\n", Status);
+    Connection->Tcp->Configure(Connection->Tcp, NULL);
+    Network->ServiceBinding->DestroyChild(Network->ServiceBinding, Connection->ChildHandle);
+    return Status;
+  }
+  Connection->State = HTTP_STATE_CONNECTING;
+
+  Connection->ConnectToken.CompletionToken.Event = Connection->Event;
+  Status = Connection->Tcp->Connect(Connection->Tcp, &Connection->ConnectToken);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Tcp4 Connect error. 0x%llx\r\n", Status);
+    HttpStop(Fetch, Connection);
+    return Status;
+  }
+
+#ifdef DEBUG_ENABLED
+  Fetch->Requests++;
+#endif
+  return EFI_SUCCESS;
+}
+
+// Receives up to Size bytes into Buffer
+STATIC EFI_STATUS HttpReceive(HTTP_CONNECTION *Connection, VOID *Buffer, UINT64 Size)
+{
+  EFI_STATUS Status;
+
+  Connection->RxData.UrgentFlag = FALSE;
+  Connection->RxData.DataLength = (UINT32)((Size < HTTP_MAX_RECEIVE) ? Size : HTTP_MAX_RECEIVE);
+  Connection->RxData.FragmentCount = 1;
+  Connection->RxData.FragmentTable[0].FragmentLength = Connection->RxData.DataLength;
+  Connection->RxData.FragmentTable[0].FragmentBuffer = Buffer;
+  Connection->RxToken.CompletionToken.Event = Connection->Event;
+  Connection->RxToken.Packet.RxData = &Connection->RxData;
+
+  Status = Connection->Tcp->Receive(Connection->Tcp, &Connection->RxToken);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Tcp4 Receive error. 0x%llx\r\n", Status);
+  }
+  return Status;
+}
+
+//==================================================================================================================================
+//  HttpParseResponse: Check a Response's Headers
+//==================================================================================================================================
+//
+// Checks that the response is the range that was asked for, and for the first response of a file, takes the file's size from
+// it and makes room for the file. Prints what went wrong on errors.
+//
+
+STATIC EFI_STATUS HttpParseResponse(HTTP_FETCH *Fetch, HTTP_CONNECTION *Connection)
+{
+  EFI_STATUS Status;
+
+  // HTTP/1.x NNN
+  CONST UINT8 * Text = Connection->Header;
+  UINT64 Code = 0;
+  if((Connection->HeaderLength < 12) || (CompareMem(Text, "HTTP/1.", 7) != 0) || (Text[8] != ' '))
+  {
+    LoaderPrint(L"Not an HTTP response.\r\n");
+    return EFI_PROTOCOL_ERROR;
+  }
+  Text += 9;
+  HttpParseNumber(&Text, &Code);
+  if(Code == 404)
+  {
+    LoaderPrint(L"HTTP server doesn't have %a\r\n", Fetch->Path);
+    return EFI_NOT_FOUND;
+  }
+  if((Code != 200) && (Code != 206))
+  {
+    LoaderPrint(L"HTTP error %lu from server.\r\n", Code);
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  UINT64 Length;
+  Text = HttpFindHeader(Connection, (CONST CHAR8*)"content-length");
+  if((Text == NULL) || !HttpParseNumber(&Text, &Length))
+  {
+    LoaderPrint(L"HTTP server didn't say how long the file is.\r\n");
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  // A range (bytes FIRST-LAST/SIZE), or the whole file from a server that doesn't do ranges
+  UINT64 Start = 0;
+  UINT64 Size = Length;
+  if(Code == 206)
+  {
+    UINT64 Last;
+    Text = HttpFindHeader(Connection, (CONST CHAR8*)"content-range");
+    if((Text == NULL) || (CompareMem(Text, "bytes ", 6) != 0))
+    {
+      LoaderPrint(L"HTTP server didn't say which range it sent.\r\n");
+      return EFI_PROTOCOL_ERROR;
+    }
+    Text += 6;
+    if(!HttpParseNumber(&Text, &Start) || (*Text++ != '-') || !HttpParseNumber(&Text, &Last) || (*Text++ != '/') || !HttpParseNumber(&Text, &Size) || (Last + 1 - Start != Length) || (Last >= Size))
+    {
+      LoaderPrint(L"HTTP server sent a bad Content-Range.\r\n");
+      return EFI_PROTOCOL_ERROR;
+    }
+  }
+
+  if(!Fetch->SizeKnown)
+  {
+    if((Size > (UINTN)-1 - Fetch->Base) || (Start != 0) || ((Code == 206) && (Length > Connection->Length)))
+    {
+      LoaderPrint(L"HTTP server sent the wrong range.\r\n");
+      return EFI_PROTOCOL_ERROR;
+    }
+
+    Status = ReserveNetworkBuffer(Fetch->Buffer, (UINTN)Size);
+    if(EFI_ERROR(Status))
+    {
+      return Status;
+    }
+
+    // The rest goes to all connections, in parts that are a multiple of 64KB
+    Fetch->SizeKnown = TRUE;
+    Fetch->Size = Size;
+    Fetch->NextStart = Length;
+    Fetch->PartSize = ((Size - Length + HTTP_CONNECTIONS - 1) / HTTP_CONNECTIONS + 0xFFFF) & ~0xFFFFULL;
+    Connection->Length = Length;
+  }
+  else if((Code != 206) || (Size != Fetch->Size) || (Start != Connection->Start) || (Length != Connection->Length))
+  {
+    LoaderPrint(L"HTTP server sent the wrong range.\r\n");
+    return EFI_PROTOCOL_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  HttpStep: Move a Connection Along
+//==================================================================================================================================
+//
+// Called when the token a connection has in flight completes, and starts the next step. Prints what went wrong on errors.
+//
+
+STATIC EFI_STATUS HttpStep(HTTP_FETCH *Fetch, HTTP_CONNECTION *Connection)
+{
+  EFI_STATUS Status;
+
+  switch(Connection->State)
+  {
+    case HTTP_STATE_CONNECTING:
+    {
+      Status = Connection->ConnectToken.CompletionToken.Status;
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"HTTP connect error. 0x%llx\r\n", Status);
+        return Status;
+      }
+
+      // The request for the range
+      UINT8 * Out = HttpPutString(Connection->Header, (CONST CHAR8*)"GET ");
+      Out = HttpPutString(Out, (CONST CHAR8*)Fetch->Path);
+      Out = HttpPutString(Out, (CONST CHAR8*)" HTTP/1.1\r\nHost: ");
+      for(UINTN i = 0; i < 4; i++)
+      {
+        Out = HttpPutNumber(Out, Fetch->Network->Server.Addr[i]);
+        *Out++ = (i < 3) ? '.' : ':';
+      }
+      Out = HttpPutNumber(Out, Fetch->Network->ServerPort);
+      Out = HttpPutString(Out, (CONST CHAR8*)"\r\nRange: bytes=");
+      Out = HttpPutNumber(Out, Connection->Start);
+      *Out++ = '-';
+      Out = HttpPutNumber(Out, Connection->Start + Connection->Length - 1);
+      Out = HttpPutString(Out, (CONST CHAR8*)"\r\nConnection: close\r\n\r\n");
+
+      Connection->TxData.Push = TRUE;
+      Connection->TxData.Urgent = FALSE;
+      Connection->TxData.DataLength = (UINT32)(Out - Connection->Header);
+      Connection->TxData.FragmentCount = 1;
+      Connection->TxData.FragmentTable[0].FragmentLength = Connection->TxData.DataLength;
+      Connection->TxData.FragmentTable[0].FragmentBuffer = Connection->Header;
+      Connection->TxToken.CompletionToken.Event = Connection->Event;
+      Connection->TxToken.Packet.TxData = &Connection->TxData;
+      Connection->State = HTTP_STATE_SENDING;
+
+      Status = Connection->Tcp->Transmit(Connection->Tcp, &Connection->TxToken);
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"Tcp4 Transmit error. 0x%llx\r\n", Status);
+      }
+      return Status;
+    }
+
+    case HTTP_STATE_SENDING:
+      Status = Connection->TxToken.CompletionToken.Status;
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"HTTP send error. 0x%llx\r\n", Status);
+        return Status;
+      }
+
+      Connection->State = HTTP_STATE_HEADERS;
+      return HttpReceive(Connection, Connection->Header, HTTP_MAX_HEADER - 1);
+
+    case HTTP_STATE_HEADERS:
+    {
+      Status = Connection->RxToken.CompletionToken.Status;
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"HTTP receive error. 0x%llx\r\n", Status);
+        return Status;
+      }
+
+      // Until the empty line after the headers
+      UINTN Searched = (Connection->HeaderLength < 3) ? 0 : (Connection->HeaderLength - 3);
+      Connection->HeaderLength += Connection->RxData.DataLength;
+      UINTN HeaderEnd = 0;
+      for(UINTN i = Searched; (i + 4 <= Connection->HeaderLength) && (HeaderEnd == 0); i++)
+      {
+        if(CompareMem(&Connection->Header[i], "\r\n\r\n", 4) == 0)
+        {
+          HeaderEnd = i + 4;
+        }
+      }
+      if(HeaderEnd == 0)
+      {
+        if(Connection->HeaderLength == HTTP_MAX_HEADER - 1)
+        {
+          LoaderPrint(L"HTTP response headers are too long.\r\n");
+          return EFI_PROTOCOL_ERROR;
+        }
+        return HttpReceive(Connection, Connection->Header + Connection->HeaderLength, HTTP_MAX_HEADER - 1 - Connection->HeaderLength);
+      }
+
+      // What came after the headers is the start of the range
+      UINTN Extra = Connection->HeaderLength - HeaderEnd;
+      Connection->HeaderLength = HeaderEnd;
+      Connection->Header[HeaderEnd - 1] = '\0'; // The \n of the empty line, so the parsing stops there
+      Status = HttpParseResponse(Fetch, Connection);
+      if(EFI_ERROR(Status))
+      {
+        return Status;
+      }
+      if(Extra > Connection->Length)
+      {
+        LoaderPrint(L"HTTP server sent more than the range.\r\n");
+        return EFI_PROTOCOL_ERROR;
+      }
+      CopyMem(Fetch->Buffer->Data + Fetch->Base + Connection->Start, Connection->Header + HeaderEnd, Extra);
+      Connection->Received = Extra;
+      Connection->RxData.DataLength = 0;
+      Connection->State = HTTP_STATE_BODY;
+    }
+    // Fall through
+    case HTTP_STATE_BODY:
+      Status = Connection->RxToken.CompletionToken.Status;
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"HTTP receive error. 0x%llx\r\n", Status);
+        return Status;
+      }
+
+      // Straight into the file's buffer
+      Connection->Received += Connection->RxData.DataLength;
+      if(Connection->Received < Connection->Length)
+      {
+        return HttpReceive(Connection, Fetch->Buffer->Data + Fetch->Base + Connection->Start + Connection->Received, Connection->Length - Connection->Received);
+      }
+
+      HttpStop(Fetch, Connection);
+      return EFI_SUCCESS;
+
+    default:
+      return EFI_SUCCESS;
+  }
+}
+
+//==================================================================================================================================
+//  HttpGet: Fetch One File
+//==================================================================================================================================
+//
+// Fetches Path (PathLength characters, not necessarily null-terminated) from the server and appends it to Buffer. Prints what
+// went wrong on errors.
+//
+
+STATIC EFI_STATUS HttpGet(NETWORK_INTERFACE *Network, EFI_EVENT TimerEvent, CONST CHAR16 *Path, UINTN PathLength, NETWORK_BUFFER *Buffer)
+{
+  EFI_STATUS Status;
+  HTTP_FETCH Fetch;
+
+  ZeroMem(&Fetch, sizeof(Fetch));
+  Fetch.Network = Network;
+  Fetch.Buffer = Buffer;
+  Fetch.Base = Buffer->Size;
+  Status = HttpEncodePath(Path, PathLength, Fetch.Path, sizeof(Fetch.Path));
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  // The first range, which says how big the file is
+  Status = HttpStart(&Fetch, &Connections[0], 0, HTTP_FIRST_RANGE);
+
+  BOOLEAN Busy = TRUE;
+  while(!EFI_ERROR(Status) && Busy)
+  {
+    Status = ST->BootServices->SetTimer(TimerEvent, TimerRelative, HTTP_TIMEOUT_MS * 10000ULL);
+    BOOLEAN Progress = FALSE;
+    while(!EFI_ERROR(Status) && Busy && !Progress)
+    {
+      Busy = FALSE;
+      for(UINTN i = 0; (i < HTTP_CONNECTIONS) && !EFI_ERROR(Status); i++)
+      {
+        HTTP_CONNECTION * Connection = &Connections[i];
+
+        // Connections that are done take the next range
+        if((Connection->State == HTTP_STATE_IDLE) && Fetch.SizeKnown && (Fetch.NextStart < Fetch.Size))
+        {
+          UINT64 Length = ((Fetch.Size - Fetch.NextStart) < Fetch.PartSize) ? (Fetch.Size - Fetch.NextStart) : Fetch.PartSize;
+          Status = HttpStart(&Fetch, Connection, Fetch.NextStart, Length);
+          Fetch.NextStart += Length;
+        }
+
+        if(!EFI_ERROR(Status) && (Connection->State != HTTP_STATE_IDLE))
+        {
+          Busy = TRUE;
+          Connection->Tcp->Poll(Connection->Tcp);
+          if(ST->BootServices->CheckEvent(Connection->Event) == EFI_SUCCESS)
+          {
+            Progress = TRUE;
+            Status = HttpStep(&Fetch, Connection);
+          }
+        }
+      }
+
+      if(!EFI_ERROR(Status) && Busy && !Progress && (ST->BootServices->CheckEvent(TimerEvent) == EFI_SUCCESS))
+      {
+        LoaderPrint(L"HTTP server stopped answering.\r\n");
+        Status = EFI_TIMEOUT;
+      }
+    }
+  }
+
+  for(UINTN i = 0; i < HTTP_CONNECTIONS; i++)
+  {
+    HttpStop(&Fetch, &Connections[i]);
+  }
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  Buffer->Size += (UINTN)Fetch.Size;
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"HTTP: %lu bytes in %u requests.\r\n", Fetch.Size, Fetch.Requests);
+#endif
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  LoadHttpKernel: Load a Kernel Over HTTP
+//==================================================================================================================================
+//
+// Fetches the kernel of an HTTP=ADDRESS[:PORT]\PATH kernel path and the initrd= files of Cmdline (CmdlineLength characters),
+// installs the initrds for Linux to pick up, and loads the kernel from memory into *KernelImageHandle. DefaultHandle is the
+// device this loader was booted from. *Stage is set like BootKernel's. Prints what went wrong on errors.
+//
+
+EFI_STATUS LoadHttpKernel(EFI_HANDLE ImageHandle, EFI_HANDLE DefaultHandle, CONST CHAR16 *KernelPath, CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINT32 *Stage, EFI_HANDLE *KernelImageHandle)
+{
+  EFI_STATUS Status;
+
+  NETWORK_INTERFACE Network;
+  CONST CHAR16 * Path;
+  Status = OpenNetwork(DefaultHandle, &Tcp4ServiceBindingProtocol, KernelPath, HTTP_SERVER_PORT, &Network, &Path);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  EFI_EVENT TimerEvent;
+  Status = ST->BootServices->CreateEvent(EVT_TIMER, 0, NULL, NULL, &TimerEvent);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"HTTP timer CreateEvent error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  *Stage = KERNELCMD_STAGE_LOAD;
+  NETWORK_BUFFER Kernel = {NULL, 0, 0, EfiBootServicesData};
+  NETWORK_BUFFER Initrd = {NULL, 0, 0, EfiLoaderData}; // Several initrds go back to back
+  Status = HttpGet(&Network, TimerEvent, Path, StrLen(Path), &Kernel);
+
+  UINTN Position = 0;
+  UINTN Start;
+  UINTN Length;
+  while(!EFI_ERROR(Status) && NextInitrdArgument(Cmdline, CmdlineLength, &Position, &Start, &Length))
+  {
+    Status = HttpGet(&Network, TimerEvent, &Cmdline[Start], Length, &Initrd);
+  }
+  ST->BootServices->CloseEvent(TimerEvent);
+
+  if(EFI_ERROR(Status))
+  {
+    FreeNetworkBuffer(&Kernel);
+    FreeNetworkBuffer(&Initrd);
+    return Status;
+  }
+  return LoadFetchedKernel(ImageHandle, &Network, Path, &Kernel, &Initrd, KernelImageHandle);
+}
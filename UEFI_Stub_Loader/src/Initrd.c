@@ -0,0 +1,216 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Initrd Handover
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Kernels loaded from memory (out of an ISO image, or over the network) can't open their initrd= files themselves, since
+// those aren't on any filesystem the firmware knows about. The loader reads them instead and hands them over through Linux's
+// LINUX_EFI_INITRD_MEDIA_GUID device path: a LoadFile2 protocol on it, which Linux 5.8 and newer look for before the initrd=
+// arguments (and use instead of them, if it's there). Several initrd= files are put back to back, as Linux's EFI stub does.
+//
+
+#include "Stubloader.h"
+
+//
+// LoadFile2 device path for the initrds, which Linux finds with LocateDevicePath
+//
+
+#pragma pack(1)
+typedef struct {
+  VENDOR_DEVICE_PATH Vendor;
+  EFI_DEVICE_PATH    End;
+} INITRD_DEVICE_PATH;
+#pragma pack()
+
+STATIC INITRD_DEVICE_PATH InitrdDevicePath = {
+  {{MEDIA_DEVICE_PATH, MEDIA_VENDOR_DP, {sizeof(VENDOR_DEVICE_PATH), 0}}, LINUX_EFI_INITRD_MEDIA_GUID},
+  {END_DEVICE_PATH_TYPE, END_ENTIRE_DEVICE_PATH_SUBTYPE, {sizeof(EFI_DEVICE_PATH), 0}}
+};
+
+STATIC EFI_HANDLE InitrdHandle = NULL;
+STATIC VOID * Initrd = NULL; // EfiLoaderData
+STATIC UINTN InitrdSize = 0;
+
+//==================================================================================================================================
+//  NextInitrdArgument: Find the initrd= Files of a Command Line
+//==================================================================================================================================
+//
+// Steps through the initrd= arguments of Cmdline (CmdlineLength characters), giving the start and length of each path. Position
+// starts at 0 and is where the next search picks up.
+//
+
+BOOLEAN NextInitrdArgument(CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINTN *Position, UINTN *Start, UINTN *Length)
+{
+  while(*Position < CmdlineLength)
+  {
+    while((*Position < CmdlineLength) && ((Cmdline[*Position] == L' ') || (Cmdline[*Position] == L'\t')))
+    {
+      (*Position)++;
+    }
+
+    UINTN ArgumentStart = *Position;
+    while((*Position < CmdlineLength) && (Cmdline[*Position] != L' ') && (Cmdline[*Position] != L'\t'))
+    {
+      (*Position)++;
+    }
+
+    if((*Position - ArgumentStart > 7) && (StrnCmp(&Cmdline[ArgumentStart], L"initrd=", 7) == 0))
+    {
+      *Start = ArgumentStart + 7;
+      *Length = *Position - *Start;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+//==================================================================================================================================
+//  InitrdLoadFile: Hand the Initrds to Linux
+//==================================================================================================================================
+//
+// The LoadFile2 protocol on the initrd device path. Linux asks for the size with no buffer first, and then for the data.
+//
+
+STATIC EFI_STATUS EFIAPI InitrdLoadFile(EFI_LOAD_FILE_PROTOCOL *This, EFI_DEVICE_PATH *FilePath, BOOLEAN BootPolicy, UINTN *BufferSize, VOID *Buffer)
+{
+  (void)This;
+  (void)FilePath;
+
+  if(BootPolicy)
+  {
+    return EFI_UNSUPPORTED;
+  }
+  if(BufferSize == NULL)
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+  if((Buffer == NULL) || (*BufferSize < InitrdSize))
+  {
+    *BufferSize = InitrdSize;
+    return EFI_BUFFER_TOO_SMALL;
+  }
+
+  CopyMem(Buffer, Initrd, InitrdSize);
+  *BufferSize = InitrdSize;
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_LOAD_FILE_PROTOCOL InitrdLoadFileProtocol = {InitrdLoadFile};
+
+//==================================================================================================================================
+//  InstallInitrd: Make the Initrds Findable
+//==================================================================================================================================
+//
+// Installs the LoadFile2 protocol on the initrd device path, serving Size bytes from Buffer. Buffer is EfiLoaderData pool that
+// this takes over, even if it fails; Linux copies the initrds out of it in its EFI stub, so it only has to last until then.
+//
+
+EFI_STATUS InstallInitrd(VOID *Buffer, UINTN Size)
+{
+  EFI_STATUS Status;
+
+  FreeInitrd();
+  Initrd = Buffer;
+  InitrdSize = Size;
+
+  // Some other loader in the chain may have left its own initrd behind, which Linux would find instead of this one
+  EFI_DEVICE_PATH * DevicePath = (EFI_DEVICE_PATH*)&InitrdDevicePath;
+  EFI_HANDLE ExistingHandle;
+  Status = ST->BootServices->LocateDevicePath(&LoadFile2Protocol, &DevicePath, &ExistingHandle);
+  if(!EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Another initrd is already installed.\r\n");
+    FreeInitrd();
+    return EFI_ALREADY_STARTED;
+  }
+
+  Status = LibInstallProtocolInterfaces(&InitrdHandle, &DevicePathProtocol, &InitrdDevicePath, &LoadFile2Protocol, &InitrdLoadFileProtocol, NULL);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Initrd InstallProtocolInterfaces error. 0x%llx\r\n", Status);
+    InitrdHandle = NULL;
+    FreeInitrd();
+  }
+  return Status;
+}
+
+//==================================================================================================================================
+//  FreeInitrd: Take the Initrds Back
+//==================================================================================================================================
+//
+// Uninstalls the initrd device path and frees the initrds, if a kernel loaded from memory left any. For when that kernel failed
+// to start or returned, so that a fallback entry's kernel doesn't get them.
+//
+
+VOID FreeInitrd(VOID)
+{
+  if(InitrdHandle != NULL)
+  {
+    LibUninstallProtocolInterfaces(InitrdHandle, &DevicePathProtocol, &InitrdDevicePath, &LoadFile2Protocol, &InitrdLoadFileProtocol, NULL);
+    InitrdHandle = NULL;
+  }
+  if(Initrd != NULL)
+  {
+    BS->FreePool(Initrd);
+    Initrd = NULL;
+    InitrdSize = 0;
+  }
+}
+
+//==================================================================================================================================
+//  LoadKernelImage: Load a Kernel Along With Its Initrds
+//==================================================================================================================================
+//
+// Installs InitrdBuffer (if not NULL; it's taken over like InstallInitrd's) for Linux to pick up, and loads the kernel at Path on
+// DeviceHandle into *KernelImageHandle. The kernel comes from KernelBuffer if it's already in memory, in which case the device
+// path is only for the firmware (e.g. Secure Boot policy) to go by, or from the file itself if KernelBuffer is NULL. KernelBuffer
+// stays the caller's. On errors, a kernel that failed verification is unloaded again and the initrds are taken back. Prints what
+// went wrong on errors.
+//
+
+EFI_STATUS LoadKernelImage(EFI_HANDLE ImageHandle, EFI_HANDLE DeviceHandle, CONST CHAR16 *Path, VOID *KernelBuffer, UINTN KernelSize, VOID *InitrdBuffer, UINTN InitrdBufferSize, EFI_HANDLE *KernelImageHandle)
+{
+  EFI_STATUS Status;
+
+  if(InitrdBuffer != NULL)
+  {
+    Status = InstallInitrd(InitrdBuffer, InitrdBufferSize);
+    if(EFI_ERROR(Status))
+    {
+      return Status;
+    }
+  }
+
+  EFI_DEVICE_PATH * FullDevicePath = FileDevicePath(DeviceHandle, (CHAR16*)Path); // This allocates memory for us
+  if(FullDevicePath == NULL)
+  {
+    LoaderPrint(L"FileDevicePath error.\r\n");
+    FreeInitrd();
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  // LoadImage makes its own copy of a kernel in memory
+  *KernelImageHandle = NULL;
+  Status = ST->BootServices->LoadImage(FALSE, ImageHandle, FullDevicePath, KernelBuffer, KernelSize, KernelImageHandle);
+  BS->FreePool(FullDevicePath);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"LoadedKernelImageHandle LoadImage error. 0x%llx\r\n", Status);
+    if((Status == EFI_SECURITY_VIOLATION) && (*KernelImageHandle != NULL))
+    {
+      // Loaded, but failed verification: it can't be started, and has to be unloaded
+      ST->BootServices->UnloadImage(*KernelImageHandle);
+    }
+    FreeInitrd();
+  }
+  return Status;
+}
@@ -0,0 +1,493 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: ISO Image Boot
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Boots a kernel that's inside an ISO9660 image on the ESP (or any other partition the firmware can read), e.g. a distro's
+// install or rescue ISO, with a kernel path like \EFI\iso\rescue.iso:\casper\vmlinuz. A colon can't be in a FAT file name, so
+// it's what separates the image from the path inside it.
+//
+// Files in an ISO9660 image are single contiguous extents, so there's no need to mount anything: the image's directories are
+// walked straight from the file (through gnu-efi's SIMPLE_READ_FILE, whose read-ahead window turns the small directory record
+// reads into a few big ones), and then the kernel and its initrd= files are each read into memory with one offset read into
+// the image. The kernel is loaded from memory, and since it can't open files inside the image itself, the initrds are handed
+// to it as described in Initrd.c (which needs Linux 5.8 or newer).
+//
+// Joliet names are used if the image has them (xorriso -J, and every distro ISO does), and plain ISO9660 names otherwise,
+// without their ";1" versions and compared without regard to case. Rock Ridge names aren't read.
+//
+
+#include "Stubloader.h"
+
+#define ISO_SECTOR_SIZE 2048
+#define ISO_FIRST_VOLUME_DESCRIPTOR 16
+#define ISO_MAX_VOLUME_DESCRIPTORS 32 // Real images have 3 or 4; this just stops a damaged image from being read to its end
+
+#define ISO_VOLUME_DESCRIPTOR_PRIMARY 1
+#define ISO_VOLUME_DESCRIPTOR_SUPPLEMENTARY 2
+#define ISO_VOLUME_DESCRIPTOR_TERMINATOR 255
+
+// Directory record: length, extended attribute length, extent (both-endian), data length (both-endian), date, flags, file
+// unit size, interleave gap, volume sequence number, identifier length, and then the identifier
+#define ISO_RECORD_EXTENT 2
+#define ISO_RECORD_DATA_LENGTH 10
+#define ISO_RECORD_FLAGS 25
+#define ISO_RECORD_FILE_UNIT_SIZE 26
+#define ISO_RECORD_ID_LENGTH 32
+#define ISO_RECORD_ID 33
+
+#define ISO_FLAG_DIRECTORY 0x02
+#define ISO_FLAG_MULTI_EXTENT 0x80 // Files of 4GB and up are split into several records
+
+#define ISO_MAX_INITRDS 8
+
+typedef struct {
+  SIMPLE_READ_FILE File;
+  BOOLEAN          Joliet;
+  UINT32           RootExtent;
+  UINT32           RootSize;
+} ISO_IMAGE;
+
+typedef struct {
+  UINT32 Extent; // In sectors
+  UINT32 Size; // In bytes
+} ISO_FILE;
+
+//==================================================================================================================================
+//  IsoRead: Read From the Image
+//==================================================================================================================================
+//
+// Reads Size bytes at Offset into the image. A short read means the image is cut off, which is as bad as a read error.
+//
+
+STATIC UINT32 IsoGet32(CONST UINT8 *Bytes)
+{
+  return (UINT32)Bytes[0] | ((UINT32)Bytes[1] << 8) | ((UINT32)Bytes[2] << 16) | ((UINT32)Bytes[3] << 24);
+}
+
+STATIC EFI_STATUS IsoRead(ISO_IMAGE *Iso, UINTN Offset, UINTN Size, VOID *Buffer)
+{
+  UINTN ReadSize = Size;
+  EFI_STATUS Status = ReadSimpleReadFile(Iso->File, Offset, &ReadSize, Buffer);
+  if(!EFI_ERROR(Status) && (ReadSize != Size))
+  {
+    Status = EFI_VOLUME_CORRUPTED;
+  }
+  return Status;
+}
+
+//==================================================================================================================================
+//  IsoOpen: Open an Image and Find Its Root Directory
+//==================================================================================================================================
+//
+// Opens the image at IsoPath on DeviceHandle and reads its volume descriptors, picking the Joliet root directory if there is
+// one and the primary volume descriptor's otherwise. Prints what went wrong on errors.
+//
+
+STATIC EFI_STATUS IsoOpen(EFI_HANDLE DeviceHandle, CHAR16 *IsoPath, ISO_IMAGE *Iso)
+{
+  EFI_STATUS Status;
+
+  EFI_DEVICE_PATH * FullDevicePath = FileDevicePath(DeviceHandle, IsoPath);
+  if(FullDevicePath == NULL)
+  {
+    LoaderPrint(L"FileDevicePath error.\r\n");
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  // OpenSimpleReadFile moves the path pointer along, so it gets its own copy of it
+  EFI_DEVICE_PATH * FilePath = FullDevicePath;
+  EFI_HANDLE FileDeviceHandle;
+  Status = OpenSimpleReadFile(FALSE, NULL, 0, &FilePath, &FileDeviceHandle, &Iso->File);
+  BS->FreePool(FullDevicePath);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"ISO image %s can't be opened. 0x%llx\r\n", IsoPath, Status);
+    return Status;
+  }
+
+  UINT8 Descriptor[ISO_SECTOR_SIZE];
+  BOOLEAN HavePrimary = FALSE;
+  Iso->Joliet = FALSE;
+
+  for(UINTN Sector = ISO_FIRST_VOLUME_DESCRIPTOR; Sector < ISO_FIRST_VOLUME_DESCRIPTOR + ISO_MAX_VOLUME_DESCRIPTORS; Sector++)
+  {
+    Status = IsoRead(Iso, Sector * ISO_SECTOR_SIZE, ISO_SECTOR_SIZE, Descriptor);
+    if(EFI_ERROR(Status) || !compare(&Descriptor[1], "CD001", 5) || (Descriptor[0] == ISO_VOLUME_DESCRIPTOR_TERMINATOR))
+    {
+      break;
+    }
+
+    // Joliet is a supplementary volume descriptor with one of the UCS-2 escape sequences. Only 2048-byte logical blocks
+    // (which is all anyone makes) are supported.
+    BOOLEAN Joliet = (Descriptor[0] == ISO_VOLUME_DESCRIPTOR_SUPPLEMENTARY) && (Descriptor[88] == '%') && (Descriptor[89] == '/') && ((Descriptor[90] == '@') || (Descriptor[90] == 'C') || (Descriptor[90] == 'E'));
+    if((Joliet || ((Descriptor[0] == ISO_VOLUME_DESCRIPTOR_PRIMARY) && !HavePrimary)) && (Descriptor[128] == (ISO_SECTOR_SIZE & 0xFF)) && (Descriptor[129] == (ISO_SECTOR_SIZE >> 8)))
+    {
+      Iso->RootExtent = IsoGet32(&Descriptor[156 + ISO_RECORD_EXTENT]);
+      Iso->RootSize = IsoGet32(&Descriptor[156 + ISO_RECORD_DATA_LENGTH]);
+      HavePrimary = TRUE;
+      if(Joliet)
+      {
+        Iso->Joliet = TRUE;
+        break;
+      }
+    }
+  }
+
+  if(!HavePrimary)
+  {
+    if(!EFI_ERROR(Status))
+    {
+      Status = EFI_UNSUPPORTED;
+    }
+    LoaderPrint(L"%s isn't an ISO9660 image. 0x%llx\r\n", IsoPath, Status);
+    CloseSimpleReadFile(Iso->File);
+    return Status;
+  }
+
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"ISO image: %s names, root directory at sector %u.\r\n", Iso->Joliet ? L"Joliet" : L"ISO9660", Iso->RootExtent);
+#endif
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  IsoFindFile: Look Up a Path in the Image
+//==================================================================================================================================
+//
+// Walks the image's directories for Path (PathLength characters, not necessarily null-terminated, with \ or / between names)
+// and gets the extent of the file at its end. Directory records never cross a sector, and a record length of 0 means the rest
+// of the sector is padding.
+//
+
+STATIC BOOLEAN IsoNameMatches(CONST ISO_IMAGE *Iso, CONST UINT8 *Id, UINTN IdLength, CONST CHAR16 *Name, UINTN NameLength)
+{
+  UINTN Length = Iso->Joliet ? (IdLength >> 1) : IdLength;
+
+  // Drop the ";1" version, and the "." of ISO9660 names that don't have an extension
+  for(UINTN i = 0; i < Length; i++)
+  {
+    if((Iso->Joliet ? Id[(i << 1) + 1] : Id[i]) == ';')
+    {
+      Length = i;
+      break;
+    }
+  }
+  if(!Iso->Joliet && (Length > 0) && (Id[Length - 1] == '.'))
+  {
+    Length--;
+  }
+
+  if(Length != NameLength)
+  {
+    return FALSE;
+  }
+
+  for(UINTN i = 0; i < Length; i++)
+  {
+    CHAR16 IdChar = Iso->Joliet ? (CHAR16)((Id[i << 1] << 8) | Id[(i << 1) + 1]) : Id[i];
+    CHAR16 NameChar = Name[i];
+    if((IdChar >= L'a') && (IdChar <= L'z'))
+    {
+      IdChar -= L'a' - L'A';
+    }
+    if((NameChar >= L'a') && (NameChar <= L'z'))
+    {
+      NameChar -= L'a' - L'A';
+    }
+    if(IdChar != NameChar)
+    {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+STATIC EFI_STATUS IsoFindRecord(ISO_IMAGE *Iso, CONST ISO_FILE *Directory, CONST CHAR16 *Name, UINTN NameLength, ISO_FILE *Found, UINT8 *Flags)
+{
+  EFI_STATUS Status;
+  UINT8 Sector[ISO_SECTOR_SIZE];
+
+  for(UINTN Offset = 0; Offset < Directory->Size; Offset += ISO_SECTOR_SIZE)
+  {
+    UINTN SectorSize = ((Directory->Size - Offset) < ISO_SECTOR_SIZE) ? (Directory->Size - Offset) : ISO_SECTOR_SIZE;
+    Status = IsoRead(Iso, (UINTN)Directory->Extent * ISO_SECTOR_SIZE + Offset, SectorSize, Sector);
+    if(EFI_ERROR(Status))
+    {
+      return Status;
+    }
+
+    for(UINTN Position = 0; (Position + ISO_RECORD_ID <= SectorSize) && (Sector[Position] != 0); Position += Sector[Position])
+    {
+      UINT8 * Record = &Sector[Position];
+      if((Record[0] < ISO_RECORD_ID) || (Position + Record[0] > SectorSize) || (ISO_RECORD_ID + Record[ISO_RECORD_ID_LENGTH] > Record[0]))
+      {
+        return EFI_VOLUME_CORRUPTED;
+      }
+
+      // The "." and ".." records are named 0 and 1, which never match a name from a path
+      if(IsoNameMatches(Iso, &Record[ISO_RECORD_ID], Record[ISO_RECORD_ID_LENGTH], Name, NameLength))
+      {
+        // Data comes after the extended attribute record, if the file has one
+        Found->Extent = IsoGet32(&Record[ISO_RECORD_EXTENT]) + Record[1];
+        Found->Size = IsoGet32(&Record[ISO_RECORD_DATA_LENGTH]);
+        *Flags = Record[ISO_RECORD_FLAGS];
+
+        // Interleaved files aren't contiguous, and neither are files split into several extents
+        if((Record[ISO_RECORD_FILE_UNIT_SIZE] != 0) || (*Flags & ISO_FLAG_MULTI_EXTENT))
+        {
+          return EFI_UNSUPPORTED;
+        }
+        return EFI_SUCCESS;
+      }
+    }
+  }
+
+  return EFI_NOT_FOUND;
+}
+
+STATIC EFI_STATUS IsoFindFile(ISO_IMAGE *Iso, CONST CHAR16 *Path, UINTN PathLength, ISO_FILE *File)
+{
+  EFI_STATUS Status;
+  ISO_FILE Directory = {Iso->RootExtent, Iso->RootSize};
+  UINTN Position = 0;
+
+  for(;;)
+  {
+    while((Position < PathLength) && ((Path[Position] == L'\\') || (Path[Position] == L'/')))
+    {
+      Position++;
+    }
+    if(Position == PathLength)
+    {
+      return EFI_NOT_FOUND; // The path ends in a directory
+    }
+
+    UINTN NameStart = Position;
+    while((Position < PathLength) && (Path[Position] != L'\\') && (Path[Position] != L'/'))
+    {
+      Position++;
+    }
+
+    UINT8 Flags;
+    Status = IsoFindRecord(Iso, &Directory, &Path[NameStart], Position - NameStart, File, &Flags);
+    if(EFI_ERROR(Status))
+    {
+      return Status;
+    }
+
+    if(!(Flags & ISO_FLAG_DIRECTORY))
+    {
+      // A file has to be the last thing in the path
+      UINTN Rest = Position;
+      while((Rest < PathLength) && ((Path[Rest] == L'\\') || (Path[Rest] == L'/')))
+      {
+        Rest++;
+      }
+      return (Rest == PathLength) ? EFI_SUCCESS : EFI_NOT_FOUND;
+    }
+
+    Directory = *File;
+  }
+}
+
+//==================================================================================================================================
+//  FindIsoSeparator: Check for a Kernel Path Inside an ISO Image
+//==================================================================================================================================
+//
+// Returns the colon between an ISO image's path and the kernel's path inside it, or NULL if KernelPath is a plain file.
+//
+
+CONST CHAR16 * FindIsoSeparator(CONST CHAR16 *KernelPath)
+{
+  for(CONST CHAR16 * Char = KernelPath; *Char != L'\0'; Char++)
+  {
+    if(*Char == L':')
+    {
+      return Char;
+    }
+  }
+  return NULL;
+}
+
+//==================================================================================================================================
+//  ReadIsoFiles: Read a Kernel and Its Initrds Out of an Image
+//==================================================================================================================================
+//
+// Finds the kernel at KernelIsoPath and the initrd= files of Cmdline (CmdlineLength characters) in the image, and then reads
+// the kernel into a new pool at *KernelBuffer and the initrds one after the other into an EfiLoaderData pool at *InitrdBuffer
+// (NULL if there aren't any). Everything is found before anything is read, so that a typo in an initrd= doesn't cost reading
+// a whole kernel first.
+//
+
+STATIC EFI_STATUS ReadIsoFiles(ISO_IMAGE *Iso, CONST CHAR16 *IsoPath, CONST CHAR16 *KernelIsoPath, CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINT32 *Stage, VOID **KernelBuffer, UINTN *KernelSize, VOID **InitrdBuffer, UINTN *InitrdSize)
+{
+  EFI_STATUS Status;
+  ISO_FILE Kernel;
+  ISO_FILE Initrds[ISO_MAX_INITRDS];
+  UINTN InitrdCount = 0;
+  UINTN TotalInitrdSize = 0;
+
+  *InitrdBuffer = NULL;
+  *InitrdSize = 0;
+
+  Status = IsoFindFile(Iso, KernelIsoPath, StrLen(KernelIsoPath), &Kernel);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Kernel %s isn't in %s. 0x%llx\r\n", KernelIsoPath, IsoPath, Status);
+    return Status;
+  }
+
+  UINTN Position = 0;
+  UINTN Start;
+  UINTN Length;
+  while(NextInitrdArgument(Cmdline, CmdlineLength, &Position, &Start, &Length))
+  {
+    if(InitrdCount == ISO_MAX_INITRDS)
+    {
+      LoaderPrint(L"Only %u initrd= files can come from an ISO image.\r\n", ISO_MAX_INITRDS);
+      return EFI_UNSUPPORTED;
+    }
+
+    Status = IsoFindFile(Iso, &Cmdline[Start], Length, &Initrds[InitrdCount]);
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"initrd= file %u of the command line isn't in %s. 0x%llx\r\n", InitrdCount + 1, IsoPath, Status);
+      return Status;
+    }
+    TotalInitrdSize += Initrds[InitrdCount].Size;
+    InitrdCount++;
+  }
+
+  // Files inside the image are contiguous, so each one is a single read
+  *Stage = KERNELCMD_STAGE_LOAD;
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, Kernel.Size, KernelBuffer);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Kernel AllocatePool error. 0x%llx\r\n", Status);
+    return Status;
+  }
+  *KernelSize = Kernel.Size;
+
+  Status = IsoRead(Iso, (UINTN)Kernel.Extent * ISO_SECTOR_SIZE, Kernel.Size, *KernelBuffer);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Kernel read error. 0x%llx\r\n", Status);
+    BS->FreePool(*KernelBuffer);
+    return Status;
+  }
+
+  if(InitrdCount != 0)
+  {
+    Status = ST->BootServices->AllocatePool(EfiLoaderData, TotalInitrdSize, InitrdBuffer);
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"Initrd AllocatePool error. 0x%llx\r\n", Status);
+      *InitrdBuffer = NULL;
+      BS->FreePool(*KernelBuffer);
+      return Status;
+    }
+
+    UINT8 * Next = *InitrdBuffer;
+    for(UINTN i = 0; i < InitrdCount; i++)
+    {
+      Status = IsoRead(Iso, (UINTN)Initrds[i].Extent * ISO_SECTOR_SIZE, Initrds[i].Size, Next);
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"Initrd read error. 0x%llx\r\n", Status);
+        BS->FreePool(*InitrdBuffer);
+        *InitrdBuffer = NULL;
+        BS->FreePool(*KernelBuffer);
+        return Status;
+      }
+      Next += Initrds[i].Size;
+    }
+    *InitrdSize = TotalInitrdSize;
+  }
+
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"Kernel from ISO image: %u bytes, %u initrd= files with %u bytes.\r\n", Kernel.Size, InitrdCount, TotalInitrdSize);
+#endif
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  LoadIsoKernel: Load a Kernel From Inside an ISO Image
+//==================================================================================================================================
+//
+// Loads the kernel after Separator in KernelPath from the ISO image before it on DeviceHandle (the image's file name can be a
+// wildcard pattern) into *KernelImageHandle, with the initrd= files of Cmdline installed for Linux to pick up. *Stage is set
+// like BootKernel's. Prints what went wrong on errors.
+//
+
+EFI_STATUS LoadIsoKernel(EFI_HANDLE ImageHandle, EFI_HANDLE DeviceHandle, CONST CHAR16 *KernelPath, CONST CHAR16 *Separator, CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINT32 *Stage, EFI_HANDLE *KernelImageHandle)
+{
+  EFI_STATUS Status;
+
+  // The image's path needs its own null terminator
+  UINTN IsoPathLength = Separator - KernelPath;
+  CHAR16 * IsoPath;
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, (IsoPathLength + 1) * sizeof(CHAR16), (void**)&IsoPath);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"IsoPath AllocatePool error. 0x%llx\r\n", Status);
+    return Status;
+  }
+  CopyMem(IsoPath, KernelPath, IsoPathLength * sizeof(CHAR16));
+  IsoPath[IsoPathLength] = L'\0';
+
+  // An image path like \EFI\iso\rescue-*.iso picks the newest matching image
+  CHAR16 * ResolvedPath;
+  Status = ResolveKernelPath(DeviceHandle, IsoPath, &ResolvedPath);
+  if(EFI_ERROR(Status))
+  {
+    BS->FreePool(IsoPath);
+    return Status;
+  }
+  if(ResolvedPath != NULL)
+  {
+    BS->FreePool(IsoPath);
+    IsoPath = ResolvedPath;
+  }
+
+  ISO_IMAGE Iso;
+  Status = IsoOpen(DeviceHandle, IsoPath, &Iso);
+  if(EFI_ERROR(Status))
+  {
+    BS->FreePool(IsoPath);
+    return Status;
+  }
+
+#ifdef TRACE_FILE_READS
+  LoaderPrint(L"File read: %s\r\n", IsoPath);
+#endif
+
+  VOID * KernelBuffer;
+  UINTN KernelSize;
+  VOID * InitrdBuffer;
+  UINTN InitrdSize;
+  Status = ReadIsoFiles(&Iso, IsoPath, Separator + 1, Cmdline, CmdlineLength, Stage, &KernelBuffer, &KernelSize, &InitrdBuffer, &InitrdSize);
+  CloseSimpleReadFile(Iso.File);
+  if(EFI_ERROR(Status))
+  {
+    BS->FreePool(IsoPath);
+    return Status;
+  }
+
+  // The kernel gets the image's own device path, for the firmware (e.g. Secure Boot policy) to go by
+  Status = LoadKernelImage(ImageHandle, DeviceHandle, IsoPath, KernelBuffer, KernelSize, InitrdBuffer, InitrdSize, KernelImageHandle);
+  BS->FreePool(IsoPath);
+  BS->FreePool(KernelBuffer);
+  return Status;
+}
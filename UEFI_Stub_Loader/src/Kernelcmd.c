@@ -0,0 +1,644 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Kernelcmd.txt Parser
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Reads the kernel image path and kernel command line out of Kernelcmd.txt. See Stubloader.c for the file format. The file can be
+// UTF-16 with a BOM, UTF-8 with or without a BOM, or plain ASCII; UTF-8 is converted to UTF-16 as it is read (see Utf8.c).
+//
+// The file is read in small fixed-size windows and parsed in a single pass: each character is looked at once and copied
+// straight into its final buffer. Reading stops as soon as the command line is complete, so any notes kept further down in the
+// file are never read at all.
+//
+// Kernelcmd.txt can also be precompiled with Tools/kcmdtool (see Kernelcmd_bin.h). That file is loaded whole, checked against
+// its CRC32, and used as-is: the strings are already UTF-16 and null-terminated, so the loader points at them directly. The
+// same precompiled data can be stored in an NV variable instead, which the loader checks before touching the filesystem.
+//
+
+#include "Stubloader.h"
+
+//==================================================================================================================================
+//  GrowString: Enlarge a Parser Output Buffer
+//==================================================================================================================================
+//
+// Doubles the capacity (in characters) of a pool-allocated string, keeping its contents and memory type.
+//
+
+STATIC EFI_STATUS GrowString(CHAR16 **String, UINTN *MaxLength, UINTN Length, EFI_MEMORY_TYPE PoolType)
+{
+  EFI_STATUS Status;
+  CHAR16 * NewString;
+
+  Status = ST->BootServices->AllocatePool(PoolType, (*MaxLength << 1) * sizeof(CHAR16), (void**)&NewString);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  CopyMem(NewString, *String, Length * sizeof(CHAR16));
+  ST->BootServices->FreePool(*String);
+
+  *String = NewString;
+  *MaxLength <<= 1;
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  ParseKernelcmdText: Line Parser
+//==================================================================================================================================
+//
+// Feeds a chunk of UTF-16 text through the line parser. Parser state lives in *State so that lines can span chunks.
+//
+
+typedef struct {
+  UINT8   Line; // 0: kernel path, 1: command line, 2: done
+  BOOLEAN SkipLF; // A \r was just seen, so a following \n belongs to the same line break
+  UINTN   KernelPathMax;
+  UINTN   CmdlineMax;
+} KERNELCMD_PARSE_STATE;
+
+STATIC EFI_STATUS ParseKernelcmdText(KERNELCMD_PARSE_STATE *State, CONST CHAR16 *Text, UINTN TextLength, KERNEL_CONFIG *Config)
+{
+  EFI_STATUS Status;
+
+  for(UINTN i = 0; (i < TextLength) && (State->Line < 2); i++)
+  {
+    CHAR16 Char = Text[i];
+
+    if(State->SkipLF)
+    {
+      State->SkipLF = FALSE;
+      if(Char == L'\n')
+      {
+        continue;
+      }
+    }
+
+    if((Char == L'\n') || (Char == L'\r')) // Reached the end of the line
+    {
+      State->Line++;
+      State->SkipLF = (Char == L'\r');
+      continue;
+    }
+
+    if(State->Line == 0)
+    {
+      if(Char == L' ') // There might be an errant space or two. Ignore them.
+      {
+        continue;
+      }
+
+      // +1 keeps room for the null terminator
+      if((Config->KernelPathLength + 1) >= State->KernelPathMax)
+      {
+        Status = GrowString(&Config->KernelPath, &State->KernelPathMax, Config->KernelPathLength, EfiBootServicesData);
+        if(EFI_ERROR(Status))
+        {
+          LoaderPrint(L"KernelPath AllocatePool error. 0x%llx\r\n", Status);
+          return Status;
+        }
+      }
+      Config->KernelPath[Config->KernelPathLength++] = Char;
+    }
+    else
+    {
+      if((Config->CmdlineLength + 1) >= State->CmdlineMax)
+      {
+        Status = GrowString(&Config->Cmdline, &State->CmdlineMax, Config->CmdlineLength, EfiLoaderData);
+        if(EFI_ERROR(Status))
+        {
+          LoaderPrint(L"Cmdline AllocatePool error. 0x%llx\r\n", Status);
+          return Status;
+        }
+      }
+      Config->Cmdline[Config->CmdlineLength++] = Char;
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  UseKernelcmdImage: Check a Precompiled Config
+//==================================================================================================================================
+//
+// Checks a whole precompiled config (from Kernelcmd.txt, the Kernelcmd variable, or the .kcmd section), including every entry,
+// and points Config at the strings of its default entry. Image has to stay in memory after the kernel starts, since the command
+// line is in it, and has to be writable for the CRC check. Source names it in error messages.
+//
+
+STATIC BOOLEAN BinaryStringValid(CONST UINT8 *Image, UINT32 FileSize, UINT32 Offset, UINT32 Length)
+{
+  // Even offset, fits in the file with its terminator, and actually is terminated
+  if((Offset & 1) || (Offset > FileSize) || ((((UINT64)Length + 1) << 1) > (FileSize - Offset)))
+  {
+    return FALSE;
+  }
+  return (((CONST CHAR16*)&Image[Offset])[Length] == L'\0');
+}
+
+STATIC EFI_STATUS UseKernelcmdImage(UINT8 *Image, UINTN ImageSize, CONST CHAR16 *Source, KERNEL_CONFIG *Config)
+{
+  KERNELCMD_BIN_HEADER Header;
+
+  if(ImageSize < KERNELCMD_BIN_HEADER_MIN_SIZE)
+  {
+    LoaderPrint(L"Error: %s is truncated.\r\n", Source);
+    return EFI_LOAD_ERROR;
+  }
+  ZeroMem(&Header, sizeof(Header));
+  CopyMem(&Header, Image, KERNELCMD_BIN_HEADER_MIN_SIZE);
+
+  if(Header.Signature != KERNELCMD_BIN_SIGNATURE)
+  {
+    LoaderPrint(L"Error: %s is not a precompiled config.\r\n", Source);
+    return EFI_UNSUPPORTED;
+  }
+
+  if((Header.Version != KERNELCMD_BIN_VERSION) || (Header.HeaderSize < KERNELCMD_BIN_HEADER_MIN_SIZE))
+  {
+    LoaderPrint(L"Error: %s is version %hu, but this loader only knows version %d.\r\n", Source, Header.Version, KERNELCMD_BIN_VERSION);
+    LoaderPrint(L"Please recompile it with the kcmdtool that came with this loader.\r\n");
+    return EFI_UNSUPPORTED;
+  }
+
+  if((Header.FileSize != ImageSize) || (Header.HeaderSize > Header.FileSize))
+  {
+    LoaderPrint(L"Error: %s is %llu bytes, but its header says %u bytes.\r\n", Source, ImageSize, Header.FileSize);
+    return EFI_LOAD_ERROR;
+  }
+
+  // Newer fields that this file has; any it doesn't have stay 0
+  CopyMem(&Header, Image, (Header.HeaderSize < sizeof(Header)) ? Header.HeaderSize : sizeof(Header));
+
+  // The CRC was computed with its own field zeroed
+  ((KERNELCMD_BIN_HEADER*)Image)->Crc32 = 0;
+  if(CalculateCrc(Image, Header.FileSize) != Header.Crc32)
+  {
+    LoaderPrint(L"Error: %s is corrupted (CRC mismatch).\r\n", Source);
+    return EFI_CRC_ERROR;
+  }
+  ((KERNELCMD_BIN_HEADER*)Image)->Crc32 = Header.Crc32;
+
+  // The file passed its CRC, so these only catch a broken kcmdtool, not disk errors. Every entry gets checked here so that the
+  // boot menu can switch between them freely.
+  BOOLEAN TableValid = (Header.EntryCount != 0) && (Header.EntrySize >= sizeof(KERNELCMD_BIN_ENTRY)) && !(Header.EntryTableOffset & 3)
+    && (Header.EntryTableOffset <= Header.FileSize) && (((UINT64)Header.EntryCount * Header.EntrySize) <= (Header.FileSize - Header.EntryTableOffset))
+    && (Header.DefaultEntry < Header.EntryCount);
+
+  // Just the table's bounds; FindKernelcmdMatch checks the slots it actually looks at
+  TableValid = TableValid && (!Header.MatchSlotCount || (!(Header.MatchSlotCount & (Header.MatchSlotCount - 1)) && !(Header.MatchTableOffset & 3)
+    && (Header.MatchTableOffset <= Header.FileSize) && (((UINT64)Header.MatchSlotCount * sizeof(KERNELCMD_BIN_MATCH)) <= (Header.FileSize - Header.MatchTableOffset))));
+
+  TableValid = TableValid && (!Header.FallbackCount || (!(Header.FallbackTableOffset & 3) && (Header.FallbackTableOffset <= Header.FileSize)
+    && (((UINT64)Header.FallbackCount * sizeof(UINT32)) <= (Header.FileSize - Header.FallbackTableOffset))));
+
+  for(UINT32 i = 0; TableValid && (i < Header.FallbackCount); i++)
+  {
+    TableValid = (((CONST UINT32*)&Image[Header.FallbackTableOffset])[i] < Header.EntryCount);
+  }
+
+  for(UINT32 i = 0; TableValid && (i < Header.EntryCount); i++)
+  {
+    KERNELCMD_BIN_ENTRY * Entry = (KERNELCMD_BIN_ENTRY*)&Image[Header.EntryTableOffset + i * Header.EntrySize];
+    TableValid = BinaryStringValid(Image, Header.FileSize, Entry->KernelPathOffset, Entry->KernelPathLength)
+      && BinaryStringValid(Image, Header.FileSize, Entry->CmdlineOffset, Entry->CmdlineLength);
+  }
+
+  if(!TableValid)
+  {
+    LoaderPrint(L"Error: %s has a bad entry table.\r\n", Source);
+    return EFI_LOAD_ERROR;
+  }
+
+  Config->Image = Image;
+  Config->Flags = Header.Flags;
+  Config->EntryCount = Header.EntryCount;
+  Config->MenuTimeout = Header.MenuTimeout;
+  Config->DefaultEntry = Header.DefaultEntry;
+  Config->MatchSlotCount = Header.MatchSlotCount;
+  Config->MatchTableOffset = Header.MatchTableOffset;
+  Config->FallbackCount = Header.FallbackCount;
+  Config->FallbackTableOffset = Header.FallbackTableOffset;
+  SelectKernelcmdEntry(Config, Header.DefaultEntry);
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  SelectKernelcmdEntry: Switch Boot Entries
+//==================================================================================================================================
+//
+// Points Config at the strings of entry Index (which has to be below Config->EntryCount) of a precompiled config. UseKernelcmdImage
+// has already checked every entry, so there's nothing left to go wrong. Text configs only have the one entry they're already on.
+//
+
+VOID SelectKernelcmdEntry(KERNEL_CONFIG *Config, UINT32 Index)
+{
+  if(Config->Image == NULL)
+  {
+    return;
+  }
+
+  CONST KERNELCMD_BIN_HEADER * Header = (CONST KERNELCMD_BIN_HEADER*)Config->Image;
+  CONST KERNELCMD_BIN_ENTRY * Entry = (CONST KERNELCMD_BIN_ENTRY*)((UINT8*)Config->Image + Header->EntryTableOffset + Index * Header->EntrySize);
+
+  Config->KernelPath = (CHAR16*)((UINT8*)Config->Image + Entry->KernelPathOffset);
+  Config->KernelPathLength = Entry->KernelPathLength;
+  Config->Cmdline = (CHAR16*)((UINT8*)Config->Image + Entry->CmdlineOffset);
+  Config->CmdlineLength = Entry->CmdlineLength;
+  Config->Entry = Index;
+}
+
+//==================================================================================================================================
+//  KernelcmdFallback: Read the Fallback List
+//==================================================================================================================================
+//
+// Returns the entry index at position Index (below Config->FallbackCount) of a precompiled config's fallback list.
+//
+
+UINT32 KernelcmdFallback(CONST KERNEL_CONFIG *Config, UINT32 Index)
+{
+  return ((CONST UINT32*)((CONST UINT8*)Config->Image + Config->FallbackTableOffset))[Index];
+}
+
+//==================================================================================================================================
+//  FindKernelcmdMatch: Look Up a Hardware Key
+//==================================================================================================================================
+//
+// Looks up a key of the given KERNELCMD_MATCH_* kind in the match table of a precompiled config, and sets *Entry to the entry
+// it selects. Returns FALSE if there is no table or the key isn't in it. See Kernelcmd_bin.h for how the table works.
+//
+
+BOOLEAN FindKernelcmdMatch(CONST KERNEL_CONFIG *Config, UINT32 Kind, CONST UINT8 *Key, UINTN KeyLength, UINT32 *Entry)
+{
+  if((Config->Image == NULL) || (Config->MatchSlotCount == 0))
+  {
+    return FALSE;
+  }
+
+  UINT32 Hash = (KERNELCMD_MATCH_FNV_OFFSET ^ (UINT8)Kind) * KERNELCMD_MATCH_FNV_PRIME;
+  for(UINTN i = 0; i < KeyLength; i++)
+  {
+    Hash = (Hash ^ Key[i]) * KERNELCMD_MATCH_FNV_PRIME;
+  }
+  if(Hash == 0)
+  {
+    Hash = 1;
+  }
+
+  CONST UINT8 * Image = Config->Image;
+  UINT32 FileSize = ((CONST KERNELCMD_BIN_HEADER*)Image)->FileSize;
+  CONST KERNELCMD_BIN_MATCH * Table = (CONST KERNELCMD_BIN_MATCH*)&Image[Config->MatchTableOffset];
+
+  for(UINT32 Probe = 0; Probe < Config->MatchSlotCount; Probe++)
+  {
+    CONST KERNELCMD_BIN_MATCH * Slot = &Table[(Hash + Probe) & (Config->MatchSlotCount - 1)];
+
+    if(Slot->Hash == 0) // Not in the table
+    {
+      return FALSE;
+    }
+
+    if((Slot->Hash == Hash) && (Slot->Kind == Kind) && (Slot->KeyLength == KeyLength) && (Slot->KeyOffset <= FileSize)
+      && (KeyLength <= (FileSize - Slot->KeyOffset)) && (Slot->Entry < Config->EntryCount) && compare(&Image[Slot->KeyOffset], Key, KeyLength))
+    {
+      *Entry = Slot->Entry;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+//==================================================================================================================================
+//  ReadKernelcmdBinary: Load a Precompiled Kernelcmd.txt
+//==================================================================================================================================
+//
+// Loads the rest of a precompiled file whose first HeadSize bytes have already been read into Head, then checks and uses it.
+//
+
+STATIC EFI_STATUS ReadKernelcmdBinary(EFI_FILE *KernelcmdFile, CONST UINT8 *Head, UINTN HeadSize, KERNEL_CONFIG *Config)
+{
+  EFI_STATUS Status;
+  KERNELCMD_BIN_HEADER Header;
+  UINT8 * Image;
+  UINTN ReadSize;
+
+  if(HeadSize < KERNELCMD_BIN_HEADER_MIN_SIZE)
+  {
+    LoaderPrint(L"Error: Precompiled Kernelcmd.txt is truncated.\r\n");
+    return EFI_LOAD_ERROR;
+  }
+  CopyMem(&Header, Head, KERNELCMD_BIN_HEADER_MIN_SIZE);
+
+  // Just enough checking to know how much to read; UseKernelcmdImage does the rest
+  if((Header.FileSize < KERNELCMD_BIN_HEADER_MIN_SIZE) || (Header.FileSize > KERNELCMD_BIN_MAX_SIZE) || (HeadSize > Header.FileSize))
+  {
+    LoaderPrint(L"Error: Precompiled Kernelcmd.txt has a bad file size (%u bytes).\r\n", Header.FileSize);
+    return EFI_LOAD_ERROR;
+  }
+
+  Status = ST->BootServices->AllocatePool(EfiLoaderData, Header.FileSize, (void**)&Image);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Kernelcmd image AllocatePool error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  CopyMem(Image, Head, HeadSize);
+
+  ReadSize = Header.FileSize - HeadSize;
+  if(ReadSize)
+  {
+    Status = KernelcmdFile->Read(KernelcmdFile, &ReadSize, &Image[HeadSize]);
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"Kernelcmd.txt read error. 0x%llx\r\n", Status);
+      ST->BootServices->FreePool(Image);
+      return Status;
+    }
+  }
+
+  Status = UseKernelcmdImage(Image, HeadSize + ReadSize, L"Precompiled Kernelcmd.txt", Config);
+  if(EFI_ERROR(Status))
+  {
+    ST->BootServices->FreePool(Image);
+  }
+
+  return Status;
+}
+
+//==================================================================================================================================
+//  ReadKernelcmdVariable: Get the Boot Config From NVRAM
+//==================================================================================================================================
+//
+// Uses the Kernelcmd variable under the loader's vendor GUID, which holds a precompiled config (see "kcmdtool setvar"). This
+// skips the filesystem entirely. Returns EFI_NOT_FOUND quietly if there is no such variable, or prints what's wrong with it
+// and returns an error if it can't be used; either way the caller falls back to Kernelcmd.txt.
+//
+
+EFI_STATUS ReadKernelcmdVariable(KERNEL_CONFIG *Config)
+{
+  EFI_STATUS Status;
+  EFI_GUID VariableGuid = KERNELCMD_VARIABLE_GUID;
+  UINTN VariableSize;
+  UINT8 * Image;
+
+  // Pool allocations from the library are EfiLoaderData in an application, so the command line can stay in this buffer
+  Image = LibGetVariableAndSize(L"" KERNELCMD_VARIABLE_NAME, &VariableGuid, &VariableSize);
+  if(Image == NULL)
+  {
+    return EFI_NOT_FOUND;
+  }
+
+  Status = UseKernelcmdImage(Image, VariableSize, L"Kernelcmd variable", Config);
+  if(EFI_ERROR(Status))
+  {
+    ST->BootServices->FreePool(Image);
+  }
+
+  return Status;
+}
+
+//==================================================================================================================================
+//  ReadKernelcmdEmbedded: Get the Boot Config Built Into the Loader
+//==================================================================================================================================
+//
+// Looks through this loader's own PE section table, which is still in memory at LoadedImage->ImageBase, for a .kcmd section
+// holding a precompiled config. Returns EFI_NOT_FOUND quietly if the loader was built without one.
+//
+
+EFI_STATUS ReadKernelcmdEmbedded(EFI_LOADED_IMAGE_PROTOCOL *LoadedImage, KERNEL_CONFIG *Config)
+{
+  UINT8 * ImageBase = (UINT8*)LoadedImage->ImageBase;
+  IMAGE_DOS_HEADER * DosHeader = (IMAGE_DOS_HEADER*)ImageBase;
+
+  if(DosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+  {
+    return EFI_NOT_FOUND;
+  }
+
+  UINT32 * NtSignature = (UINT32*)&ImageBase[DosHeader->e_lfanew];
+  if(*NtSignature != IMAGE_NT_SIGNATURE)
+  {
+    return EFI_NOT_FOUND;
+  }
+
+  // The section table comes right after the optional header, whose size is in the file header
+  IMAGE_FILE_HEADER * FileHeader = (IMAGE_FILE_HEADER*)(NtSignature + 1);
+  IMAGE_SECTION_HEADER * Section = (IMAGE_SECTION_HEADER*)((UINT8*)(FileHeader + 1) + FileHeader->SizeOfOptionalHeader);
+
+  for(UINTN i = 0; i < FileHeader->NumberOfSections; i++, Section++)
+  {
+    if(compare(Section->Name, KERNELCMD_SECTION_NAME, sizeof(KERNELCMD_SECTION_NAME)))
+    {
+      // VirtualSize is the real size; SizeOfRawData is padded to the file alignment
+      return UseKernelcmdImage(&ImageBase[Section->VirtualAddress], Section->Misc.VirtualSize, L"Embedded .kcmd section", Config);
+    }
+  }
+
+  return EFI_NOT_FOUND;
+}
+
+//==================================================================================================================================
+//  ReadKernelcmd: Parse Kernelcmd.txt
+//==================================================================================================================================
+//
+// Fills in Config->KernelPath (EfiBootServicesData) and Config->Cmdline (EfiLoaderData, so it can be handed to the kernel as
+// its LoadOptions as-is). Both are null-terminated. Prints what went wrong and returns an error if the file can't be used, with
+// both freed and set to NULL.
+//
+// The encoding is picked from the start of the file: the KERNELCMD_BIN_SIGNATURE means a precompiled file, a UTF-16 BOM means
+// UTF-16 in this system's byte order, and anything else is UTF-8 (with or without its BOM), which covers plain ASCII too.
+//
+
+EFI_STATUS ReadKernelcmd(EFI_FILE *KernelcmdFile, KERNEL_CONFIG *Config)
+{
+  EFI_STATUS Status;
+
+  // Raw file bytes, plus room for a partial character carried over from the previous window. CHAR16 keeps it aligned for UTF-16.
+  CHAR16 RawWindow[(KERNELCMD_WINDOW_SIZE + 4) / sizeof(CHAR16)];
+  UINT8 * Raw = (UINT8*)RawWindow;
+  // UTF-8 converted to UTF-16; never more characters than there were bytes
+  CHAR16 Text[KERNELCMD_WINDOW_SIZE + 4];
+
+  UINTN Carry = 0; // Bytes at the start of Raw left over from the last window
+  UINTN ReadSize;
+  UINTN Available;
+  UINTN Start;
+  UINTN TextLength;
+  UINTN Consumed;
+  UINT64 FileOffset = 0; // Of the start of Raw, for error messages
+
+  UINT8 Encoding = KERNELCMD_ENCODING_UNKNOWN;
+
+  KERNELCMD_PARSE_STATE State;
+  State.Line = 0;
+  State.SkipLF = FALSE;
+  State.KernelPathMax = KERNELCMD_PATH_CHARS;
+  State.CmdlineMax = KERNELCMD_CMDLINE_CHARS;
+
+  Config->KernelPathLength = 0;
+  Config->CmdlineLength = 0;
+  Config->Image = NULL;
+  Config->Flags = 0;
+  Config->EntryCount = 1;
+  Config->MenuTimeout = 0;
+  Config->DefaultEntry = 0;
+  Config->MatchSlotCount = 0;
+  Config->MatchTableOffset = 0;
+  Config->FallbackCount = 0;
+  Config->FallbackTableOffset = 0;
+  Config->Entry = 0;
+  Config->KernelPath = NULL;
+  Config->Cmdline = NULL;
+
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, State.KernelPathMax * sizeof(CHAR16), (void**)&Config->KernelPath);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"KernelPath AllocatePool error. 0x%llx\r\n", Status);
+    Config->KernelPath = NULL;
+    return Status;
+  }
+
+  Status = ST->BootServices->AllocatePool(EfiLoaderData, State.CmdlineMax * sizeof(CHAR16), (void**)&Config->Cmdline);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Cmdline AllocatePool error. 0x%llx\r\n", Status);
+    Config->Cmdline = NULL;
+    goto Cleanup;
+  }
+
+  while(State.Line < 2)
+  {
+    ReadSize = KERNELCMD_WINDOW_SIZE;
+    Status = KernelcmdFile->Read(KernelcmdFile, &ReadSize, &Raw[Carry]);
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"Kernelcmd.txt read error. 0x%llx\r\n", Status);
+      goto Cleanup;
+    }
+
+    if(ReadSize == 0) // End of file. A stray odd byte (UTF-16) or cut-off sequence (UTF-8) at the very end is ignored.
+    {
+      break;
+    }
+
+    Available = Carry + ReadSize;
+    Start = 0;
+
+    if(Encoding == KERNELCMD_ENCODING_UNKNOWN)
+    {
+      UINT32 Signature = 0;
+      if(Available >= sizeof(Signature))
+      {
+        CopyMem(&Signature, Raw, sizeof(Signature));
+      }
+
+      if(Signature == KERNELCMD_BIN_SIGNATURE)
+      {
+        // Nothing to parse; the text buffers aren't needed
+        ST->BootServices->FreePool(Config->KernelPath);
+        ST->BootServices->FreePool(Config->Cmdline);
+        Config->KernelPath = NULL;
+        Config->Cmdline = NULL;
+        return ReadKernelcmdBinary(KernelcmdFile, Raw, Available, Config);
+      }
+      else if((Available >= 2) && (RawWindow[0] == UTF16_BOM_LE))
+      {
+        Encoding = KERNELCMD_ENCODING_UTF16;
+        Start = 2;
+      }
+      else if((Available >= 2) && (RawWindow[0] == UTF16_BOM_BE)) // Check endianness
+      {
+        LoaderPrint(L"Error: Kernelcmd.txt is UTF-16 with the wrong endianness for this system.\r\n");
+        LoaderPrint(L"Please fix the file and try again.\r\n");
+        Status = EFI_UNSUPPORTED;
+        goto Cleanup;
+      }
+      else if((Available >= 2) && (Raw[1] == 0x00)) // An ASCII character followed by a zero byte is UTF-16 text, not UTF-8
+      {
+        LoaderPrint(L"Error: Kernelcmd.txt looks like UTF-16 without a BOM.\r\n");
+        LoaderPrint(L"Please save it as UTF-8, ASCII, or UTF-16 with BOM and try again.\r\n");
+        Status = EFI_UNSUPPORTED;
+        goto Cleanup;
+      }
+      else
+      {
+        Encoding = KERNELCMD_ENCODING_UTF8;
+        if((Available >= 3) && (Raw[0] == 0xEF) && (Raw[1] == 0xBB) && (Raw[2] == 0xBF)) // Optional UTF-8 BOM
+        {
+          Start = 3;
+        }
+      }
+    }
+
+    if(Encoding == KERNELCMD_ENCODING_UTF16)
+    {
+      // Parse the file data in place
+      TextLength = (Available - Start) >> 1;
+      Status = ParseKernelcmdText(&State, (CHAR16*)&Raw[Start], TextLength, Config);
+      Consumed = Start + (TextLength << 1);
+    }
+    else
+    {
+      Status = Utf8ToUtf16(&Raw[Start], Available - Start, Text, &TextLength, &Consumed);
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"Error: Kernelcmd.txt has an invalid UTF-8 sequence at byte %llu.\r\n", FileOffset + Start + Consumed);
+        LoaderPrint(L"Please save it as UTF-8, ASCII, or UTF-16 with BOM and try again.\r\n");
+        Status = EFI_UNSUPPORTED;
+        goto Cleanup;
+      }
+      Consumed += Start;
+      Status = ParseKernelcmdText(&State, Text, TextLength, Config);
+    }
+
+    if(EFI_ERROR(Status))
+    {
+      goto Cleanup;
+    }
+
+    // Move any partial character to the front for the next window
+    Carry = Available - Consumed;
+    for(UINTN i = 0; i < Carry; i++)
+    {
+      Raw[i] = Raw[Consumed + i];
+    }
+    FileOffset += Consumed;
+  }
+
+  if(Encoding == KERNELCMD_ENCODING_UNKNOWN)
+  {
+    LoaderPrint(L"Error: Kernelcmd.txt is empty.\r\n");
+    Status = EFI_UNSUPPORTED;
+    goto Cleanup;
+  }
+
+  Config->KernelPath[Config->KernelPathLength] = L'\0'; // Need to null-terminate these strings
+  Config->Cmdline[Config->CmdlineLength] = L'\0';
+
+  return EFI_SUCCESS;
+
+Cleanup:
+  // Every error after the first allocation ends up here, so that falling back to another config source doesn't leak them
+  ST->BootServices->FreePool(Config->KernelPath);
+  Config->KernelPath = NULL;
+  if(Config->Cmdline != NULL)
+  {
+    ST->BootServices->FreePool(Config->Cmdline);
+    Config->Cmdline = NULL;
+  }
+  return Status;
+}
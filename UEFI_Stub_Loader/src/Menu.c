@@ -0,0 +1,129 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Boot Menu
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Lets a precompiled config with more than one entry offer them as a simple boot menu, so one loader can boot several OSes. The
+// menu is plain lines of text redrawn with carriage returns, which works the same on a graphical console and over serial.
+//
+// Waiting is all done on ConIn->WaitForKey with WaitForSingleEvent (lib/event.c), which puts the CPU to sleep between timer ticks
+// and keystrokes instead of polling ReadKeyStroke. With a MenuTimeout of 0 the menu is skipped entirely, so unattended boots
+// don't wait on the console at all.
+//
+
+#include "Stubloader.h"
+
+#define MENU_TICK 10000000 // One second, in the 100ns units of SetTimer
+
+//==================================================================================================================================
+//  BootMenu: Choose a Boot Entry
+//==================================================================================================================================
+//
+// Shows Config's entries and switches Config to the one picked. A number key boots that entry right away, Up/Down move the
+// selection, and Enter boots it. If no key is pressed before MenuTimeout runs out, the default entry boots; any key stops the
+// countdown. Returns without doing anything if there's nothing to choose from or the timeout is 0.
+//
+
+STATIC VOID ShowChoice(UINT32 Selected, UINT32 SecondsLeft)
+{
+  if(SecondsLeft)
+  {
+    LoaderPrint(L"\rBoot entry: %u (booting in %u s)   ", Selected + 1, SecondsLeft);
+  }
+  else
+  {
+    LoaderPrint(L"\rBoot entry: %u                     \rBoot entry: %u", Selected + 1, Selected + 1);
+  }
+  OutputSync();
+}
+
+EFI_STATUS BootMenu(KERNEL_CONFIG *Config)
+{
+  EFI_STATUS Status;
+  EFI_INPUT_KEY Key;
+
+  if((Config->EntryCount < 2) || (Config->MenuTimeout == 0))
+  {
+    return EFI_SUCCESS;
+  }
+
+#ifdef QUIET_BOOT
+  // The menu is the only thing that should be on screen
+  OutputDiscard();
+#endif
+
+  LoaderPrint(L"Boot menu:\r\n");
+  for(UINT32 i = 0; i < Config->EntryCount; i++)
+  {
+    SelectKernelcmdEntry(Config, i);
+    LoaderPrint(L"  %u) %s\r\n", i + 1, Config->KernelPath);
+  }
+  LoaderPrint(L"Press a number, or use Up/Down and Enter.\r\n");
+
+  UINT32 Selected = Config->DefaultEntry;
+  UINT32 SecondsLeft = (Config->MenuTimeout == KERNELCMD_MENU_TIMEOUT_FOREVER) ? 0 : Config->MenuTimeout;
+  BOOLEAN Chosen = FALSE;
+
+  // Drop keys pressed before the menu was up
+  ST->ConIn->Reset(ST->ConIn, FALSE);
+
+  ShowChoice(Selected, SecondsLeft);
+
+  while(!Chosen)
+  {
+    Status = WaitForSingleEvent(ST->ConIn->WaitForKey, SecondsLeft ? MENU_TICK : 0);
+    if(Status == EFI_TIMEOUT)
+    {
+      SecondsLeft--;
+      Chosen = (SecondsLeft == 0);
+      ShowChoice(Selected, SecondsLeft);
+      continue;
+    }
+    else if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"\r\nWaitForKey error. 0x%llx\r\n", Status);
+      break;
+    }
+
+    if(EFI_ERROR(ST->ConIn->ReadKeyStroke(ST->ConIn, &Key)))
+    {
+      continue;
+    }
+
+    SecondsLeft = 0;
+
+    if((Key.UnicodeChar > L'0') && (Key.UnicodeChar <= L'9') && ((UINT32)(Key.UnicodeChar - L'1') < Config->EntryCount))
+    {
+      Selected = Key.UnicodeChar - L'1';
+      Chosen = TRUE;
+    }
+    else if((Key.UnicodeChar == CHAR_CARRIAGE_RETURN) || (Key.UnicodeChar == CHAR_LINEFEED))
+    {
+      Chosen = TRUE;
+    }
+    else if(Key.ScanCode == SCAN_UP)
+    {
+      Selected = (Selected == 0) ? (Config->EntryCount - 1) : (Selected - 1);
+    }
+    else if(Key.ScanCode == SCAN_DOWN)
+    {
+      Selected = (Selected + 1 == Config->EntryCount) ? 0 : (Selected + 1);
+    }
+
+    ShowChoice(Selected, 0);
+  }
+
+  LoaderPrint(L"\r\n\n");
+  SelectKernelcmdEntry(Config, Selected);
+
+  return EFI_SUCCESS;
+}
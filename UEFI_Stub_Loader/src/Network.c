@@ -0,0 +1,283 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Network Boot Common Code
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// What the TFTP (Tftp.c) and HTTP (Http.c) clients have in common: picking the network interface and the addresses to use
+// from a kernel path like TFTP=10.0.0.2\boot\vmlinuz or HTTP=10.0.0.2:8000\boot\vmlinuz, the buffers files are fetched into,
+// and loading the kernel out of its buffer with the initrds handed over as described in Initrd.c.
+//
+// An empty server address means the server this loader was itself PXE booted from, whose addresses the firmware's PXE base
+// code protocol still has. A PXE boot also brings this machine's address, subnet, and gateway, which then get used as they
+// are; otherwise, the UDP and TCP instances use the firmware's default address (e.g. from DHCP).
+//
+
+#include "Stubloader.h"
+
+#define NETWORK_MIN_BUFFER 0x400000 // Smallest buffer allocated for fetched files
+
+STATIC EFI_IPv4_ADDRESS ZeroAddress = {{0, 0, 0, 0}};
+
+//==================================================================================================================================
+//  ParseIpv4Address: Read a Server's Address
+//==================================================================================================================================
+//
+// Reads a dotted decimal address from Address (AddressLength characters, not necessarily null-terminated).
+//
+
+STATIC BOOLEAN ParseIpv4Address(CONST CHAR16 *Address, UINTN AddressLength, EFI_IPv4_ADDRESS *Ip)
+{
+  UINTN Part = 0;
+  UINTN Value = 0;
+  UINTN Digits = 0;
+
+  for(UINTN i = 0; i <= AddressLength; i++)
+  {
+    if((i == AddressLength) || (Address[i] == L'.'))
+    {
+      if((Digits == 0) || (Part == 4))
+      {
+        return FALSE;
+      }
+      Ip->Addr[Part++] = (UINT8)Value;
+      Value = 0;
+      Digits = 0;
+    }
+    else if((Address[i] >= L'0') && (Address[i] <= L'9') && (Digits < 3))
+    {
+      Value = Value * 10 + (Address[i] - L'0');
+      Digits++;
+      if(Value > 255)
+      {
+        return FALSE;
+      }
+    }
+    else
+    {
+      return FALSE;
+    }
+  }
+  return Part == 4;
+}
+
+// Same for a port number
+STATIC BOOLEAN ParsePort(CONST CHAR16 *Port, UINTN PortLength, UINT16 *Number)
+{
+  UINTN Value = 0;
+
+  if((PortLength == 0) || (PortLength > 5))
+  {
+    return FALSE;
+  }
+  for(UINTN i = 0; i < PortLength; i++)
+  {
+    if((Port[i] < L'0') || (Port[i] > L'9'))
+    {
+      return FALSE;
+    }
+    Value = Value * 10 + (Port[i] - L'0');
+  }
+  if((Value == 0) || (Value > 0xFFFF))
+  {
+    return FALSE;
+  }
+
+  *Number = (UINT16)Value;
+  return TRUE;
+}
+
+//==================================================================================================================================
+//  OpenNetwork: Pick the Network Interface and Addresses
+//==================================================================================================================================
+//
+// Finds a network interface with ServiceBindingProtocol (UDP4 or TCP4), preferring DefaultHandle, the device this loader was
+// booted from, and reads the server address out of KernelPath (PREFIX=ADDRESS[:PORT]\PATH). *Path is set to the \PATH part.
+// Prints what went wrong on errors.
+//
+
+EFI_STATUS OpenNetwork(EFI_HANDLE DefaultHandle, EFI_GUID *ServiceBindingProtocol, CONST CHAR16 *KernelPath, UINT16 DefaultPort, NETWORK_INTERFACE *Network, CONST CHAR16 **Path)
+{
+  EFI_STATUS Status;
+
+  ZeroMem(Network, sizeof(NETWORK_INTERFACE));
+  Network->UseDefaultAddress = TRUE;
+  Network->ServerPort = DefaultPort;
+
+  Network->ServiceHandle = DefaultHandle;
+  Status = ST->BootServices->HandleProtocol(DefaultHandle, ServiceBindingProtocol, (void**)&Network->ServiceBinding);
+  if(EFI_ERROR(Status))
+  {
+    EFI_HANDLE * Handles;
+    UINTN HandleCount;
+    Status = LibLocateHandle(ByProtocol, ServiceBindingProtocol, NULL, &HandleCount, &Handles);
+    if(EFI_ERROR(Status) || (HandleCount == 0))
+    {
+      LoaderPrint(L"No network interface for this protocol. 0x%llx\r\n", Status);
+      return EFI_ERROR(Status) ? Status : EFI_NOT_FOUND;
+    }
+    Network->ServiceHandle = Handles[0];
+    BS->FreePool(Handles);
+
+    Status = ST->BootServices->HandleProtocol(Network->ServiceHandle, ServiceBindingProtocol, (void**)&Network->ServiceBinding);
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"ServiceBinding HandleProtocol error. 0x%llx\r\n", Status);
+      return Status;
+    }
+  }
+
+  // PXE has the addresses of this machine and of the server it booted from, if that's how this loader got here
+  EFI_PXE_BASE_CODE * Pxe;
+  if(EFI_ERROR(ST->BootServices->HandleProtocol(Network->ServiceHandle, &PxeBaseCodeProtocol, (void**)&Pxe)) || !Pxe->Mode->Started || Pxe->Mode->UsingIpv6 || !Pxe->Mode->DhcpAckReceived)
+  {
+    Pxe = NULL;
+  }
+
+  CONST CHAR16 * Address = KernelPath;
+  while(*Address != L'=')
+  {
+    Address++;
+  }
+  Address++;
+  UINTN AddressLength = 0;
+  while((Address[AddressLength] != L'\0') && (Address[AddressLength] != L'\\'))
+  {
+    AddressLength++;
+  }
+  *Path = &Address[AddressLength];
+
+  UINTN HostLength = 0;
+  while((HostLength < AddressLength) && (Address[HostLength] != L':'))
+  {
+    HostLength++;
+  }
+  if((HostLength < AddressLength) && !ParsePort(&Address[HostLength + 1], AddressLength - HostLength - 1, &Network->ServerPort))
+  {
+    LoaderPrint(L"Bad server port.\r\n");
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if(HostLength != 0)
+  {
+    if(!ParseIpv4Address(Address, HostLength, &Network->Server))
+    {
+      LoaderPrint(L"Bad server address.\r\n");
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+  else if(Pxe != NULL)
+  {
+    CopyMem(&Network->Server, Pxe->Mode->ProxyOfferReceived ? Pxe->Mode->ProxyOffer.Dhcpv4.BootpSiAddr : Pxe->Mode->DhcpAck.Dhcpv4.BootpSiAddr, sizeof(EFI_IPv4_ADDRESS));
+  }
+  else
+  {
+    LoaderPrint(L"No server address, and this loader wasn't PXE booted.\r\n");
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if(Pxe != NULL)
+  {
+    Network->UseDefaultAddress = FALSE;
+    CopyMem(&Network->StationAddress, &Pxe->Mode->StationIp.v4, sizeof(EFI_IPv4_ADDRESS));
+    CopyMem(&Network->SubnetMask, &Pxe->Mode->SubnetMask.v4, sizeof(EFI_IPv4_ADDRESS));
+
+    // An instance with its own address has no routes, so a server on another subnet needs PXE's default gateway
+    BOOLEAN OnLink = TRUE;
+    for(UINTN i = 0; i < 4; i++)
+    {
+      OnLink = OnLink && ((Network->Server.Addr[i] & Network->SubnetMask.Addr[i]) == (Network->StationAddress.Addr[i] & Network->SubnetMask.Addr[i]));
+    }
+    for(UINT32 i = 0; !OnLink && (i < Pxe->Mode->RouteTableEntries) && (i < EFI_PXE_BASE_CODE_MAX_ROUTE_ENTRIES); i++)
+    {
+      if(CompareMem(&Pxe->Mode->RouteTable[i].SubnetMask.v4, &ZeroAddress, sizeof(EFI_IPv4_ADDRESS)) == 0)
+      {
+        CopyMem(&Network->Gateway, &Pxe->Mode->RouteTable[i].GwAddr.v4, sizeof(EFI_IPv4_ADDRESS));
+        Network->HasGateway = TRUE;
+      }
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  ReserveNetworkBuffer: Make Room for Fetched Data
+//==================================================================================================================================
+//
+// Makes room for Size more bytes after what's already in Buffer, moving it to a bigger pool if need be. Prints what went wrong
+// on errors.
+//
+
+EFI_STATUS ReserveNetworkBuffer(NETWORK_BUFFER *Buffer, UINTN Size)
+{
+  EFI_STATUS Status;
+
+  if(Buffer->Capacity - Buffer->Size >= Size)
+  {
+    return EFI_SUCCESS;
+  }
+
+  UINTN Capacity = (Buffer->Capacity < NETWORK_MIN_BUFFER) ? NETWORK_MIN_BUFFER : (Buffer->Capacity << 1);
+  if(Capacity < Buffer->Size + Size)
+  {
+    Capacity = Buffer->Size + Size;
+  }
+
+  UINT8 * Data;
+  Status = ST->BootServices->AllocatePool(Buffer->MemoryType, Capacity, (void**)&Data);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Network buffer AllocatePool error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  if(Buffer->Data != NULL)
+  {
+    CopyMem(Data, Buffer->Data, Buffer->Size);
+    BS->FreePool(Buffer->Data);
+  }
+  Buffer->Data = Data;
+  Buffer->Capacity = Capacity;
+  return EFI_SUCCESS;
+}
+
+// For buffers that didn't make it to LoadFetchedKernel
+VOID FreeNetworkBuffer(NETWORK_BUFFER *Buffer)
+{
+  if(Buffer->Data != NULL)
+  {
+    BS->FreePool(Buffer->Data);
+    Buffer->Data = NULL;
+  }
+  Buffer->Size = 0;
+  Buffer->Capacity = 0;
+}
+
+//==================================================================================================================================
+//  LoadFetchedKernel: Load a Kernel Out of Memory
+//==================================================================================================================================
+//
+// Installs Initrd (if anything was fetched into it) for Linux to pick up, and loads the kernel in Kernel into
+// *KernelImageHandle. Path is the kernel's path on the server. Both buffers are freed (or taken over) either way. Prints what
+// went wrong on errors.
+//
+
+EFI_STATUS LoadFetchedKernel(EFI_HANDLE ImageHandle, CONST NETWORK_INTERFACE *Network, CONST CHAR16 *Path, NETWORK_BUFFER *Kernel, NETWORK_BUFFER *Initrd, EFI_HANDLE *KernelImageHandle)
+{
+  // The kernel gets the network interface's device path, for the firmware (e.g. Secure Boot policy) to go by
+  EFI_STATUS Status = LoadKernelImage(ImageHandle, Network->ServiceHandle, Path, Kernel->Data, Kernel->Size, Initrd->Data, Initrd->Size, KernelImageHandle);
+  Initrd->Data = NULL; // Taken over either way
+
+  FreeNetworkBuffer(Kernel);
+  FreeNetworkBuffer(Initrd);
+  return Status;
+}
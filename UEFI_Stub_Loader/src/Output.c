@@ -0,0 +1,190 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Buffered Console Output
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Every Print() goes straight to ConOut->OutputString, and on a serial-
+// redirected console each of those calls can cost milliseconds. Instead, the
+// loader formats everything into one large pool buffer with LoaderPrint() and
+// only hands it to the console at sync points: before waiting for a key,
+// before starting the kernel, and when the buffer fills up.
+//
+// Two build switches in Stubloader.h change where the buffer goes:
+//
+// - SERIAL_OUTPUT writes it to the first EFI_SERIAL_IO_PROTOCOL instance
+//   (optionally reprogrammed to SERIAL_BAUD_RATE) instead of ConOut.
+// - QUIET_BOOT never shows it on the success path. Output is only flushed if
+//   something goes wrong and the loader stops to wait for a key, so errors
+//   still come with the full log leading up to them.
+//
+
+#include "Stubloader.h"
+
+STATIC CHAR16 * OutputBuffer = NULL; // OUTPUT_BUFFER_CHARS characters, always null-terminated
+STATIC UINTN OutputUsed = 0; // Characters in OutputBuffer, not counting the null terminator
+
+#ifdef SERIAL_OUTPUT
+STATIC EFI_SERIAL_IO_PROTOCOL * SerialOut = NULL;
+#endif
+
+//==================================================================================================================================
+//  OutputInit: Set Up Buffered Output
+//==================================================================================================================================
+//
+// Allocates the output buffer and, with SERIAL_OUTPUT, finds and configures the serial port. If any of this fails, LoaderPrint
+// falls back to printing straight to ConOut, so this never needs to be checked for errors.
+//
+
+VOID OutputInit(VOID)
+{
+  EFI_STATUS Status;
+
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, OUTPUT_BUFFER_CHARS * sizeof(CHAR16), (void**)&OutputBuffer);
+  if(EFI_ERROR(Status))
+  {
+    OutputBuffer = NULL;
+    return;
+  }
+  OutputBuffer[0] = L'\0';
+  OutputUsed = 0;
+
+#ifdef SERIAL_OUTPUT
+  Status = ST->BootServices->LocateProtocol(&SerialIoProtocol, NULL, (void**)&SerialOut);
+  if(EFI_ERROR(Status))
+  {
+    SerialOut = NULL; // Fall back to ConOut
+    return;
+  }
+
+#if SERIAL_BAUD_RATE
+  if(SerialOut->Mode->BaudRate != SERIAL_BAUD_RATE)
+  {
+    // Keep everything except the baud rate as firmware set it up
+    Status = SerialOut->SetAttributes(SerialOut, SERIAL_BAUD_RATE, SerialOut->Mode->ReceiveFifoDepth, SerialOut->Mode->Timeout, (EFI_PARITY_TYPE)SerialOut->Mode->Parity, (UINT8)SerialOut->Mode->DataBits, (EFI_STOP_BITS_TYPE)SerialOut->Mode->StopBits);
+    if(EFI_ERROR(Status))
+    {
+      SerialOut = NULL; // Port is in an unknown state, so don't use it
+    }
+  }
+#endif
+#endif
+}
+
+//==================================================================================================================================
+//  LoaderPrint: Buffered Print
+//==================================================================================================================================
+//
+// Drop-in replacement for Print() that formats directly into the output buffer. Nothing reaches the screen until OutputSync.
+//
+
+UINTN LoaderPrint(CONST CHAR16 *fmt, ...)
+{
+  va_list args;
+  va_list retry;
+  UINTN Room, Length;
+
+  va_start(args, fmt);
+
+  if(OutputBuffer == NULL)
+  {
+    Length = VPrint(fmt, args);
+    va_end(args);
+    return Length;
+  }
+
+  va_copy(retry, args);
+
+  // VSPrint stops one character short of the size it's given, so a result that fills all of Room may have been cut off
+  Room = OUTPUT_BUFFER_CHARS - OutputUsed;
+  Length = VSPrint(&OutputBuffer[OutputUsed], Room * sizeof(CHAR16), fmt, args);
+
+  if(Length + 1 >= Room)
+  {
+    // Throw away the partial copy, make room, and format it again
+    OutputBuffer[OutputUsed] = L'\0';
+
+#ifdef QUIET_BOOT
+    // Nothing gets shown unless there's an error, so keep the newest half of the log
+    UINTN Keep = OutputUsed >> 1;
+    CopyMem(OutputBuffer, &OutputBuffer[OutputUsed - Keep], (Keep + 1) * sizeof(CHAR16));
+    OutputUsed = Keep;
+#else
+    OutputSync();
+#endif
+
+    Room = OUTPUT_BUFFER_CHARS - OutputUsed;
+    Length = VSPrint(&OutputBuffer[OutputUsed], Room * sizeof(CHAR16), fmt, retry);
+  }
+
+  OutputUsed += Length;
+
+  va_end(retry);
+  va_end(args);
+  return Length;
+}
+
+//==================================================================================================================================
+//  OutputSync: Flush Buffered Output
+//==================================================================================================================================
+//
+// Writes everything buffered so far in one go, to the serial port if SERIAL_OUTPUT found one or to ConOut otherwise.
+//
+
+VOID OutputSync(VOID)
+{
+  if((OutputBuffer == NULL) || (OutputUsed == 0))
+  {
+    return;
+  }
+
+#ifdef SERIAL_OUTPUT
+  if(SerialOut != NULL)
+  {
+    // Serial ports take bytes, so narrow the UTF-16 text a chunk at a time
+    CHAR8 SerialChunk[256];
+    UINTN Done = 0;
+
+    while(Done < OutputUsed)
+    {
+      UINTN ChunkSize = 0;
+      while((ChunkSize < sizeof(SerialChunk)) && (Done < OutputUsed))
+      {
+        CHAR16 Char = OutputBuffer[Done++];
+        SerialChunk[ChunkSize++] = (Char < 0x80) ? (CHAR8)Char : '?';
+      }
+      SerialOut->Write(SerialOut, &ChunkSize, SerialChunk);
+    }
+  }
+  else
+#endif
+  {
+    ST->ConOut->OutputString(ST->ConOut, OutputBuffer);
+  }
+
+  OutputDiscard();
+}
+
+//==================================================================================================================================
+//  OutputDiscard: Drop Buffered Output
+//==================================================================================================================================
+//
+// Empties the buffer without showing it. Used by QUIET_BOOT right before starting the kernel.
+//
+
+VOID OutputDiscard(VOID)
+{
+  if(OutputBuffer != NULL)
+  {
+    OutputBuffer[0] = L'\0';
+    OutputUsed = 0;
+  }
+}
@@ -0,0 +1,417 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Partition Index
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Lets kernel paths point at other partitions, e.g. PARTUUID=1b2c...\vmlinuz.efi, PARTLABEL=boot\vmlinuz.efi, or
+// PARTTYPE=bc13c2ff-59e6-4262-a352-b275fd6f7172\vmlinuz.efi (the first partition of that type, here an XBOOTLDR partition).
+//
+// LibLocateHandleByDiskSignature would walk every BlockIo handle's device path again on each lookup. Instead, the first lookup
+// indexes all GPT partitions by PARTUUID in one pass over the BlockIo handles, using the Hard Drive node at the end of each
+// device path, and every lookup after that is a single hash probe. Types and labels aren't in device paths, so they come from
+// each disk's GPT, which is only read (through the block cache, and checked with the CRC routines in lib/crc.c) the first time
+// a PARTLABEL or PARTTYPE path needs it. Kernel paths without one of these prefixes never touch any of this.
+//
+
+#include "Stubloader.h"
+#include <efigpt.h>
+
+typedef struct {
+  EFI_GUID   PartUuid;
+  EFI_GUID   TypeGuid; // All zeros until the disk's GPT has been read
+  CHAR16     Label[36 + 1]; // Empty until the disk's GPT has been read
+  EFI_HANDLE Handle;
+} PARTITION_INDEX_ENTRY;
+
+STATIC PARTITION_INDEX_ENTRY * PartitionEntries = NULL;
+STATIC UINTN PartitionCount = 0;
+STATIC UINT32 * PartitionSlots = NULL; // Open addressing, power-of-2 size: index into PartitionEntries + 1, or 0 if empty
+STATIC UINTN PartitionSlotMask = 0;
+STATIC BOOLEAN PartitionIndexBuilt = FALSE;
+STATIC BOOLEAN PartitionTablesRead = FALSE;
+
+STATIC EFI_GUID ZeroGuid = {0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0}};
+
+#define PARTITION_KEY_UUID 0
+#define PARTITION_KEY_TYPE 1
+#define PARTITION_KEY_LABEL 2
+
+// GPT header size up to the entry array CRC; sizeof(EFI_PARTITION_TABLE_HEADER) pads it to 96
+#define GPT_HEADER_SIZE (EFI_FIELD_OFFSET(EFI_PARTITION_TABLE_HEADER, PartitionEntryArrayCRC32) + sizeof(UINT32))
+
+//==================================================================================================================================
+//  BuildPartitionIndex: Index Partitions by PARTUUID
+//==================================================================================================================================
+//
+// Adds every GPT partition with a BlockIo handle to the index. PARTUUIDs are random, so a couple of their bytes make a fine
+// hash. If two partitions claim the same PARTUUID (e.g. a cloned disk), the first one the firmware lists wins.
+//
+
+STATIC UINTN PartitionHash(EFI_GUID *Guid)
+{
+  return (Guid->Data1 ^ ((UINT32)Guid->Data4[4] << 24) ^ ((UINT32)Guid->Data4[5] << 16) ^ ((UINT32)Guid->Data4[6] << 8) ^ Guid->Data4[7]) & PartitionSlotMask;
+}
+
+STATIC PARTITION_INDEX_ENTRY * FindPartitionByUuid(EFI_GUID *PartUuid)
+{
+  for(UINTN Slot = PartitionHash(PartUuid); PartitionSlots[Slot] != 0; Slot = (Slot + 1) & PartitionSlotMask)
+  {
+    PARTITION_INDEX_ENTRY * Entry = &PartitionEntries[PartitionSlots[Slot] - 1];
+    if(CompareGuid(&Entry->PartUuid, PartUuid) == 0)
+    {
+      return Entry;
+    }
+  }
+  return NULL;
+}
+
+STATIC EFI_STATUS BuildPartitionIndex(EFI_HANDLE **Handles, UINTN *HandleCount)
+{
+  EFI_STATUS Status;
+
+  Status = LibLocateHandle(ByProtocol, &BlockIoProtocol, NULL, HandleCount, Handles);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"BlockIo LocateHandle error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  // At least twice as many slots as there could be partitions keeps the probe chains short
+  UINTN SlotCount = 4;
+  while(SlotCount < (*HandleCount << 1))
+  {
+    SlotCount <<= 1;
+  }
+
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, *HandleCount * sizeof(PARTITION_INDEX_ENTRY) + SlotCount * sizeof(UINT32), (void**)&PartitionEntries);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"PartitionEntries AllocatePool error. 0x%llx\r\n", Status);
+    PartitionEntries = NULL;
+    BS->FreePool(*Handles);
+    return Status;
+  }
+  PartitionSlots = (UINT32*)&PartitionEntries[*HandleCount];
+  PartitionSlotMask = SlotCount - 1;
+  ZeroMem(PartitionSlots, SlotCount * sizeof(UINT32));
+
+  for(UINTN i = 0; i < *HandleCount; i++)
+  {
+    EFI_DEVICE_PATH * Node = DevicePathFromHandle((*Handles)[i]);
+    EFI_DEVICE_PATH * Last = NULL;
+    if(Node == NULL)
+    {
+      continue;
+    }
+
+    while(!IsDevicePathEnd(Node))
+    {
+      Last = Node;
+      Node = NextDevicePathNode(Node);
+    }
+
+    // Whole disks and MBR partitions don't have a PARTUUID
+    if((Last == NULL) || (DevicePathType(Last) != MEDIA_DEVICE_PATH) || (DevicePathSubType(Last) != MEDIA_HARDDRIVE_DP) || (((HARDDRIVE_DEVICE_PATH*)Last)->SignatureType != SIGNATURE_TYPE_GUID))
+    {
+      continue;
+    }
+
+    PARTITION_INDEX_ENTRY * Entry = &PartitionEntries[PartitionCount];
+    CopyMem(&Entry->PartUuid, ((HARDDRIVE_DEVICE_PATH*)Last)->Signature, sizeof(EFI_GUID));
+    if(FindPartitionByUuid(&Entry->PartUuid) != NULL)
+    {
+      continue;
+    }
+    Entry->TypeGuid = ZeroGuid;
+    Entry->Label[0] = L'\0';
+    Entry->Handle = (*Handles)[i];
+
+    UINTN Slot = PartitionHash(&Entry->PartUuid);
+    while(PartitionSlots[Slot] != 0)
+    {
+      Slot = (Slot + 1) & PartitionSlotMask;
+    }
+    PartitionSlots[Slot] = (UINT32)++PartitionCount;
+  }
+
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"Partition index: %u GPT partitions on %u BlockIo handles.\r\n", PartitionCount, *HandleCount);
+#endif
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  ReadPartitionTable: Add Types and Labels from a Disk's GPT
+//==================================================================================================================================
+//
+// Reads the primary GPT of a whole-disk BlockIo handle and fills in the type and label of each of its partitions that's in the
+// index. Disks whose primary GPT doesn't check out are skipped; their partitions can still be found by PARTUUID.
+//
+
+STATIC VOID ReadPartitionTable(EFI_HANDLE DiskHandle)
+{
+  EFI_STATUS Status;
+  EFI_BLOCK_IO * BlockIo;
+
+  Status = ST->BootServices->HandleProtocol(DiskHandle, &BlockIoProtocol, (void**)&BlockIo);
+  if(EFI_ERROR(Status) || BlockIo->Media->LogicalPartition || !BlockIo->Media->MediaPresent || (BlockIo->Media->BlockSize < sizeof(EFI_PARTITION_TABLE_HEADER)))
+  {
+    return;
+  }
+
+  UINT32 BlockSize = BlockIo->Media->BlockSize;
+  EFI_PARTITION_TABLE_HEADER * Header;
+
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, BlockSize, (void**)&Header);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"GPT header AllocatePool error. 0x%llx\r\n", Status);
+    return;
+  }
+
+  // Entries have to be at least as big as the spec's 128 bytes, and 1MB of them is far beyond what any real disk uses
+  Status = BlockCacheRead(BlockIo, (UINT64)PRIMARY_PART_HEADER_LBA * BlockSize, BlockSize, Header);
+  if(EFI_ERROR(Status)
+    || !compare(&Header->Header.Signature, EFI_PTAB_HEADER_ID, 8)
+    || (Header->Header.HeaderSize < GPT_HEADER_SIZE)
+    || !CheckCrc(BlockSize, &Header->Header)
+    || (Header->MyLBA != PRIMARY_PART_HEADER_LBA)
+    || (Header->SizeOfPartitionEntry < sizeof(EFI_PARTITION_ENTRY))
+    || (Header->NumberOfPartitionEntries == 0)
+    || ((UINT64)Header->NumberOfPartitionEntries * Header->SizeOfPartitionEntry > 0x100000))
+  {
+    BS->FreePool(Header);
+    return;
+  }
+
+  UINT32 EntrySize = Header->SizeOfPartitionEntry;
+  UINTN ArraySize = (UINTN)Header->NumberOfPartitionEntries * EntrySize;
+  UINT64 ArrayOffset = Header->PartitionEntryLBA * BlockSize;
+  UINT32 ArrayCrc = Header->PartitionEntryArrayCRC32;
+  BS->FreePool(Header);
+
+  UINT8 * Array;
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, ArraySize, (void**)&Array);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"GPT entries AllocatePool error. 0x%llx\r\n", Status);
+    return;
+  }
+
+  Status = BlockCacheRead(BlockIo, ArrayOffset, ArraySize, Array);
+  if(!EFI_ERROR(Status) && (CalculateCrc(Array, ArraySize) == ArrayCrc))
+  {
+    for(UINTN Offset = 0; Offset < ArraySize; Offset += EntrySize)
+    {
+      EFI_PARTITION_ENTRY * GptEntry = (EFI_PARTITION_ENTRY*)&Array[Offset];
+      PARTITION_INDEX_ENTRY * Entry = FindPartitionByUuid(&GptEntry->UniquePartitionGUID);
+
+      if((Entry != NULL) && (CompareGuid(&GptEntry->PartitionTypeGUID, &ZeroGuid) != 0))
+      {
+        Entry->TypeGuid = GptEntry->PartitionTypeGUID;
+        CopyMem(Entry->Label, GptEntry->PartitionName, sizeof(GptEntry->PartitionName));
+        Entry->Label[36] = L'\0';
+      }
+    }
+  }
+
+  BS->FreePool(Array);
+}
+
+//==================================================================================================================================
+//  LocateKernelPartition: Find the Partition a Kernel Path Refers To
+//==================================================================================================================================
+//
+// If KernelPath starts with PARTUUID=, PARTLABEL=, or PARTTYPE=, sets *DeviceHandle to that partition and *Path to the rest of
+// KernelPath (its \ included). Otherwise they are set to DefaultHandle and KernelPath. PARTUUID and PARTTYPE GUIDs can be in
+// either case; labels have to match exactly. Prints what went wrong on errors.
+//
+
+// Reads a GUID in its usual 8-4-4-4-12 text form
+STATIC BOOLEAN ParseGuid(CONST CHAR16 *Text, EFI_GUID *Guid)
+{
+  UINT8 Bytes[16];
+  UINTN Byte = 0;
+
+  for(UINTN i = 0; i < 36; )
+  {
+    if((i == 8) || (i == 13) || (i == 18) || (i == 23))
+    {
+      if(Text[i++] != L'-')
+      {
+        return FALSE;
+      }
+      continue;
+    }
+
+    UINT8 Value = 0;
+    for(UINTN Digit = 0; Digit < 2; Digit++, i++)
+    {
+      CHAR16 Char = Text[i];
+      Value <<= 4;
+      if((Char >= L'0') && (Char <= L'9'))
+      {
+        Value |= Char - L'0';
+      }
+      else if(((Char | 0x20) >= L'a') && ((Char | 0x20) <= L'f'))
+      {
+        Value |= (Char | 0x20) - L'a' + 10;
+      }
+      else
+      {
+        return FALSE;
+      }
+    }
+    Bytes[Byte++] = Value;
+  }
+
+  // The first three groups are stored little endian
+  Guid->Data1 = ((UINT32)Bytes[0] << 24) | ((UINT32)Bytes[1] << 16) | ((UINT32)Bytes[2] << 8) | Bytes[3];
+  Guid->Data2 = (UINT16)((Bytes[4] << 8) | Bytes[5]);
+  Guid->Data3 = (UINT16)((Bytes[6] << 8) | Bytes[7]);
+  CopyMem(Guid->Data4, &Bytes[8], 8);
+
+  return TRUE;
+}
+
+EFI_STATUS LocateKernelPartition(EFI_HANDLE DefaultHandle, CHAR16 *KernelPath, EFI_HANDLE *DeviceHandle, CHAR16 **Path)
+{
+  EFI_STATUS Status;
+  UINT32 Kind;
+  UINTN KeyStart;
+  EFI_GUID Guid;
+
+  *DeviceHandle = DefaultHandle;
+  *Path = KernelPath;
+
+  if((StrnCmp(KernelPath, L"PARTUUID=", 9) == 0) || (StrnCmp(KernelPath, L"PARTTYPE=", 9) == 0))
+  {
+    Kind = (KernelPath[4] == L'U') ? PARTITION_KEY_UUID : PARTITION_KEY_TYPE;
+    KeyStart = 9;
+    if(!ParseGuid(&KernelPath[KeyStart], &Guid) || (KernelPath[KeyStart + 36] != L'\\'))
+    {
+      LoaderPrint(L"Error: Bad GUID in kernel path %s\r\n", KernelPath);
+      return EFI_INVALID_PARAMETER;
+    }
+  }
+  else if(StrnCmp(KernelPath, L"PARTLABEL=", 10) == 0)
+  {
+    Kind = PARTITION_KEY_LABEL;
+    KeyStart = 10;
+  }
+  else
+  {
+    return EFI_SUCCESS;
+  }
+
+  UINTN KeyLength = 0;
+  while((KernelPath[KeyStart + KeyLength] != L'\\') && (KernelPath[KeyStart + KeyLength] != L'\0'))
+  {
+    KeyLength++;
+  }
+  if(KernelPath[KeyStart + KeyLength] != L'\\')
+  {
+    LoaderPrint(L"Error: Kernel path %s has no file path after the partition.\r\n", KernelPath);
+    return EFI_INVALID_PARAMETER;
+  }
+
+  // Only built once, even when going through fallback entries
+  EFI_HANDLE * Handles = NULL;
+  UINTN HandleCount = 0;
+  if(!PartitionIndexBuilt)
+  {
+    Status = BuildPartitionIndex(&Handles, &HandleCount);
+    if(EFI_ERROR(Status))
+    {
+      return Status;
+    }
+    PartitionIndexBuilt = TRUE;
+  }
+
+  PARTITION_INDEX_ENTRY * Entry = NULL;
+  if(Kind == PARTITION_KEY_UUID)
+  {
+    Entry = FindPartitionByUuid(&Guid);
+  }
+  else
+  {
+    if(!PartitionTablesRead)
+    {
+      if(Handles == NULL)
+      {
+        Status = LibLocateHandle(ByProtocol, &BlockIoProtocol, NULL, &HandleCount, &Handles);
+        if(EFI_ERROR(Status))
+        {
+          LoaderPrint(L"BlockIo LocateHandle error. 0x%llx\r\n", Status);
+          return Status;
+        }
+      }
+      for(UINTN i = 0; i < HandleCount; i++)
+      {
+        ReadPartitionTable(Handles[i]);
+      }
+      PartitionTablesRead = TRUE;
+    }
+
+    // Few enough partitions that going through them in order is fine, and it makes "first of this type" mean firmware order
+    for(UINTN i = 0; (i < PartitionCount) && (Entry == NULL); i++)
+    {
+      if(Kind == PARTITION_KEY_TYPE)
+      {
+        if(CompareGuid(&PartitionEntries[i].TypeGuid, &Guid) == 0)
+        {
+          Entry = &PartitionEntries[i];
+        }
+      }
+      else if((KeyLength <= 36) && (StrnCmp(PartitionEntries[i].Label, &KernelPath[KeyStart], KeyLength) == 0) && (PartitionEntries[i].Label[KeyLength] == L'\0'))
+      {
+        Entry = &PartitionEntries[i];
+      }
+    }
+  }
+
+  if(Handles != NULL)
+  {
+    BS->FreePool(Handles);
+  }
+
+  if(Entry == NULL)
+  {
+    LoaderPrint(L"Error: No partition for kernel path %s\r\n", KernelPath);
+    return EFI_NOT_FOUND;
+  }
+
+  *DeviceHandle = Entry->Handle;
+  *Path = &KernelPath[KeyStart + KeyLength];
+
+  return EFI_SUCCESS;
+}
+
+//==================================================================================================================================
+//  FreePartitionIndex: Release the Partition Index
+//==================================================================================================================================
+//
+// Only needed when returning to the firmware; an OS just reclaims the memory.
+//
+
+VOID FreePartitionIndex(VOID)
+{
+  if(PartitionEntries != NULL)
+  {
+    BS->FreePool(PartitionEntries);
+    PartitionEntries = NULL;
+  }
+  PartitionCount = 0;
+  PartitionIndexBuilt = FALSE;
+  PartitionTablesRead = FALSE;
+}
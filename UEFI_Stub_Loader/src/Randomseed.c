@@ -0,0 +1,391 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Random Seed Handoff
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Gives Linux a random seed before it starts, so that its CRNG is ready right away instead of stalling early userspace on
+// machines (mostly VMs) with little entropy. The seed goes in the LINUX_EFI_RANDOM_SEED_TABLE configuration table, which the
+// kernel mixes into its pool during early boot.
+//
+// Two sources are combined: EFI_RNG_PROTOCOL, if the firmware has it, and a seed file kept next to this loader on the ESP. The
+// file is replaced with a fresh seed on every boot, before the kernel gets its own, so that no seed is ever used twice. Both go
+// through BLAKE2s (the hash Linux's own CRNG uses), along with any seed table already installed and the time. If neither source
+// is available, or the file can't be rewritten and there's nothing else, no table is installed at all.
+//
+
+#include "Stubloader.h"
+
+#define RANDOM_SEED_SIZE 32 // One BLAKE2s-256 digest, which is also what Linux asks EFI_RNG_PROTOCOL for
+
+STATIC EFI_GUID RngProtocolGuid = EFI_RNG_PROTOCOL_GUID;
+STATIC EFI_GUID LinuxRandomSeedGuid = LINUX_EFI_RANDOM_SEED_TABLE_GUID;
+
+//==================================================================================================================================
+//  BLAKE2s
+//==================================================================================================================================
+//
+// Unkeyed BLAKE2s-256 (RFC 7693). Small and fast without any SIMD, which suits a loader that hashes a few hundred bytes.
+//
+
+typedef struct {
+  UINT32 H[8];
+  UINT8  Block[64];
+  UINTN  Used; // Bytes in Block
+  UINT64 Count; // Bytes compressed so far
+} BLAKE2S_STATE;
+
+STATIC CONST UINT32 Blake2sIv[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+STATIC CONST UINT8 Blake2sSigma[10][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+  { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+  { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+  { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+  { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+  { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+  { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+  { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 }
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define BLAKE2S_G(a, b, c, d, x, y) \
+  do { \
+    V[a] += V[b] + (x); V[d] = ROTR32(V[d] ^ V[a], 16); \
+    V[c] += V[d];       V[b] = ROTR32(V[b] ^ V[c], 12); \
+    V[a] += V[b] + (y); V[d] = ROTR32(V[d] ^ V[a], 8); \
+    V[c] += V[d];       V[b] = ROTR32(V[b] ^ V[c], 7); \
+  } while(0)
+
+STATIC VOID Blake2sCompress(BLAKE2S_STATE *State, BOOLEAN Last)
+{
+  UINT32 M[16];
+  UINT32 V[16];
+
+  for(UINTN i = 0; i < 16; i++)
+  {
+    CONST UINT8 * p = &State->Block[i * 4];
+    M[i] = (UINT32)p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+  }
+
+  for(UINTN i = 0; i < 8; i++)
+  {
+    V[i] = State->H[i];
+    V[i + 8] = Blake2sIv[i];
+  }
+  V[12] ^= (UINT32)State->Count;
+  V[13] ^= (UINT32)(State->Count >> 32);
+  if(Last)
+  {
+    V[14] = ~V[14];
+  }
+
+  for(UINTN Round = 0; Round < 10; Round++)
+  {
+    CONST UINT8 * s = Blake2sSigma[Round];
+    BLAKE2S_G(0, 4, 8, 12, M[s[0]], M[s[1]]);
+    BLAKE2S_G(1, 5, 9, 13, M[s[2]], M[s[3]]);
+    BLAKE2S_G(2, 6, 10, 14, M[s[4]], M[s[5]]);
+    BLAKE2S_G(3, 7, 11, 15, M[s[6]], M[s[7]]);
+    BLAKE2S_G(0, 5, 10, 15, M[s[8]], M[s[9]]);
+    BLAKE2S_G(1, 6, 11, 12, M[s[10]], M[s[11]]);
+    BLAKE2S_G(2, 7, 8, 13, M[s[12]], M[s[13]]);
+    BLAKE2S_G(3, 4, 9, 14, M[s[14]], M[s[15]]);
+  }
+
+  for(UINTN i = 0; i < 8; i++)
+  {
+    State->H[i] ^= V[i] ^ V[i + 8];
+  }
+}
+
+STATIC VOID Blake2sInit(BLAKE2S_STATE *State)
+{
+  ZeroMem(State, sizeof(BLAKE2S_STATE));
+  CopyMem(State->H, Blake2sIv, sizeof(State->H));
+  State->H[0] ^= 0x01010000 | RANDOM_SEED_SIZE; // No key, 32-byte digest
+}
+
+STATIC VOID Blake2sUpdate(BLAKE2S_STATE *State, CONST VOID *Data, UINTN Size)
+{
+  CONST UINT8 * Input = Data;
+
+  while(Size)
+  {
+    // The last block has to be compressed differently, so a full block only gets compressed once more input shows up
+    if(State->Used == sizeof(State->Block))
+    {
+      State->Count += sizeof(State->Block);
+      Blake2sCompress(State, FALSE);
+      State->Used = 0;
+    }
+
+    UINTN Chunk = sizeof(State->Block) - State->Used;
+    if(Chunk > Size)
+    {
+      Chunk = Size;
+    }
+    CopyMem(&State->Block[State->Used], Input, Chunk);
+    State->Used += Chunk;
+    Input += Chunk;
+    Size -= Chunk;
+  }
+}
+
+STATIC VOID Blake2sFinal(BLAKE2S_STATE *State, UINT8 *Digest)
+{
+  State->Count += State->Used;
+  ZeroMem(&State->Block[State->Used], sizeof(State->Block) - State->Used);
+  Blake2sCompress(State, TRUE);
+
+  for(UINTN i = 0; i < RANDOM_SEED_SIZE; i++)
+  {
+    Digest[i] = (UINT8)(State->H[i / 4] >> (8 * (i % 4)));
+  }
+  ZeroMem(State, sizeof(BLAKE2S_STATE));
+}
+
+//==================================================================================================================================
+//  InstallRandomSeed: Hand Linux a Random Seed
+//==================================================================================================================================
+//
+// Mixes the firmware RNG, the ESP seed file, and any existing seed table into a new LINUX_EFI_RANDOM_SEED_TABLE, and refreshes
+// the seed file for next time. Nothing here is fatal: if it fails, the kernel just has to gather its own entropy as before.
+//
+
+// Opens the seed file in the loader's directory for reading and writing, creating it if Create is set
+STATIC EFI_STATUS OpenSeedFile(EFI_LOADED_IMAGE_PROTOCOL *LoadedImage, BOOLEAN Create, EFI_FILE **SeedFile)
+{
+  EFI_STATUS Status;
+  CONST CHAR16 SeedFileName[] = RANDOM_SEED_FILE_NAME;
+
+  CHAR16 * BootFilePath = ((FILEPATH_DEVICE_PATH*)LoadedImage->FilePath)->PathName;
+  UINTN PrefixLength = 0;
+  for(UINTN i = 0; BootFilePath[i] != L'\0'; i++)
+  {
+    if(BootFilePath[i] == L'\\')
+    {
+      PrefixLength = i + 1;
+    }
+  }
+
+  CHAR16 * SeedFilePath;
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, PrefixLength * sizeof(CHAR16) + sizeof(SeedFileName), (void**)&SeedFilePath);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+  CopyMem(SeedFilePath, BootFilePath, PrefixLength * sizeof(CHAR16));
+  CopyMem(&SeedFilePath[PrefixLength], SeedFileName, sizeof(SeedFileName));
+
+  EFI_FILE * Root = LibOpenRoot(LoadedImage->DeviceHandle);
+  if(Root == NULL)
+  {
+    ST->BootServices->FreePool(SeedFilePath);
+    return EFI_NOT_FOUND;
+  }
+
+  Status = Root->Open(Root, SeedFile, SeedFilePath, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | (Create ? EFI_FILE_MODE_CREATE : 0), 0);
+  Root->Close(Root);
+
+#ifdef TRACE_FILE_READS
+  if(!EFI_ERROR(Status))
+  {
+    LoaderPrint(L"File read: %s\r\n", SeedFilePath);
+  }
+#endif
+
+  ST->BootServices->FreePool(SeedFilePath);
+
+  return Status;
+}
+
+VOID InstallRandomSeed(EFI_LOADED_IMAGE_PROTOCOL *LoadedImage)
+{
+  EFI_STATUS Status;
+  BLAKE2S_STATE Hash;
+  UINT8 RngSeed[RANDOM_SEED_SIZE];
+  UINT8 FileSeed[RANDOM_SEED_SIZE];
+  UINT8 Mixed[RANDOM_SEED_SIZE];
+  UINT8 NextFileSeed[RANDOM_SEED_SIZE];
+  UINTN FileSeedSize = 0;
+  BOOLEAN HaveRng = FALSE;
+  BOOLEAN FileRefreshed = FALSE;
+
+  // Firmware RNG first, so that a seed file can be created with it on the first boot
+  EFI_RNG_PROTOCOL * Rng;
+  Status = ST->BootServices->LocateProtocol(&RngProtocolGuid, NULL, (void**)&Rng);
+  if(!EFI_ERROR(Status))
+  {
+    Status = Rng->GetRNG(Rng, NULL, sizeof(RngSeed), RngSeed);
+    HaveRng = !EFI_ERROR(Status);
+    if(!HaveRng)
+    {
+      LoaderPrint(L"GetRNG error. 0x%llx\r\n", Status);
+    }
+  }
+
+  EFI_FILE * SeedFile = NULL;
+  Status = OpenSeedFile(LoadedImage, FALSE, &SeedFile);
+  if((Status == EFI_NOT_FOUND) && HaveRng)
+  {
+    Status = OpenSeedFile(LoadedImage, TRUE, &SeedFile);
+  }
+  if(EFI_ERROR(Status))
+  {
+    SeedFile = NULL;
+  }
+  else
+  {
+    FileSeedSize = sizeof(FileSeed);
+    Status = SeedFile->Read(SeedFile, &FileSeedSize, FileSeed);
+    if(EFI_ERROR(Status))
+    {
+      FileSeedSize = 0;
+    }
+  }
+
+  // A seed already installed by the firmware or an earlier loader; Linux only takes one table, so it gets folded into ours
+  LINUX_EFI_RANDOM_SEED * PreviousSeed = NULL;
+  if(EFI_ERROR(LibGetSystemConfigurationTable(&LinuxRandomSeedGuid, (VOID**)&PreviousSeed)) || (PreviousSeed->Size > RANDOM_SEED_MAX_PREVIOUS))
+  {
+    PreviousSeed = NULL;
+  }
+
+  if(!HaveRng && (FileSeedSize == 0) && (PreviousSeed == NULL))
+  {
+    if(SeedFile != NULL)
+    {
+      SeedFile->Close(SeedFile);
+    }
+#ifdef DEBUG_ENABLED
+    LoaderPrint(L"No random seed sources.\r\n");
+#endif
+    return;
+  }
+
+  // Everything goes into one hash, which the kernel's seed and the next file seed are then derived from separately. The time and
+  // monotonic count don't add much entropy, but they keep two boots from ever producing the same seed.
+  EFI_TIME Time;
+  UINT64 MonotonicCount = 0;
+  ZeroMem(&Time, sizeof(Time));
+  ST->RuntimeServices->GetTime(&Time, NULL);
+  ST->BootServices->GetNextMonotonicCount(&MonotonicCount);
+
+  Blake2sInit(&Hash);
+  Blake2sUpdate(&Hash, "UEFI Stub Loader random seed", 28);
+  Blake2sUpdate(&Hash, &FileSeedSize, sizeof(FileSeedSize));
+  Blake2sUpdate(&Hash, FileSeed, FileSeedSize);
+  Blake2sUpdate(&Hash, &HaveRng, sizeof(HaveRng));
+  Blake2sUpdate(&Hash, RngSeed, HaveRng ? sizeof(RngSeed) : 0);
+  if(PreviousSeed != NULL)
+  {
+    Blake2sUpdate(&Hash, PreviousSeed, sizeof(UINT32) + PreviousSeed->Size);
+  }
+  Blake2sUpdate(&Hash, &Time, sizeof(Time));
+  Blake2sUpdate(&Hash, &MonotonicCount, sizeof(MonotonicCount));
+  Blake2sFinal(&Hash, Mixed);
+
+  Blake2sInit(&Hash);
+  Blake2sUpdate(&Hash, "file", 4);
+  Blake2sUpdate(&Hash, Mixed, sizeof(Mixed));
+  Blake2sFinal(&Hash, NextFileSeed);
+
+  // The file has to be rewritten before its old contents count for anything, or the next boot could reuse them
+  if(SeedFile != NULL)
+  {
+    UINTN WriteSize = sizeof(NextFileSeed);
+    Status = SeedFile->SetPosition(SeedFile, 0);
+    if(!EFI_ERROR(Status))
+    {
+      Status = SeedFile->Write(SeedFile, &WriteSize, NextFileSeed);
+    }
+    if(!EFI_ERROR(Status) && (WriteSize == sizeof(NextFileSeed)))
+    {
+      // A longer file keeps its old tail past the new seed unless it's cut down to size
+      EFI_FILE_INFO * FileInfo = LibFileInfo(SeedFile);
+      if(FileInfo == NULL)
+      {
+        Status = EFI_LOAD_ERROR;
+      }
+      else
+      {
+        if(FileInfo->FileSize != sizeof(NextFileSeed))
+        {
+          FileInfo->FileSize = sizeof(NextFileSeed);
+          Status = SeedFile->SetInfo(SeedFile, &GenericFileInfo, FileInfo->Size, FileInfo);
+        }
+        ST->BootServices->FreePool(FileInfo);
+      }
+    }
+    if(!EFI_ERROR(Status))
+    {
+      Status = SeedFile->Flush(SeedFile);
+    }
+    SeedFile->Close(SeedFile);
+
+    FileRefreshed = !EFI_ERROR(Status) && (WriteSize == sizeof(NextFileSeed));
+    if(!FileRefreshed)
+    {
+      LoaderPrint(L"Error updating random seed file. 0x%llx\r\n", Status);
+    }
+  }
+
+  LINUX_EFI_RANDOM_SEED * Seed = NULL;
+  if(!HaveRng && !FileRefreshed && (PreviousSeed == NULL))
+  {
+    // The only source is a file that will still hold the same seed next boot
+    Status = EFI_ABORTED;
+  }
+  else
+  {
+    // Linux reads the table after ExitBootServices, so it has to be in memory that survives that
+    Status = ST->BootServices->AllocatePool(EfiACPIReclaimMemory, sizeof(LINUX_EFI_RANDOM_SEED) + RANDOM_SEED_SIZE, (void**)&Seed);
+  }
+
+  if(!EFI_ERROR(Status))
+  {
+    Blake2sInit(&Hash);
+    Blake2sUpdate(&Hash, "kernel", 6);
+    Blake2sUpdate(&Hash, Mixed, sizeof(Mixed));
+    Blake2sFinal(&Hash, Seed->Bits);
+    Seed->Size = RANDOM_SEED_SIZE;
+
+    Status = ST->BootServices->InstallConfigurationTable(&LinuxRandomSeedGuid, Seed);
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"Random seed InstallConfigurationTable error. 0x%llx\r\n", Status);
+      ZeroMem(Seed, sizeof(LINUX_EFI_RANDOM_SEED) + RANDOM_SEED_SIZE);
+      ST->BootServices->FreePool(Seed);
+    }
+    else if(PreviousSeed != NULL)
+    {
+      // Replaced, and already mixed in
+      ZeroMem(PreviousSeed, sizeof(UINT32) + PreviousSeed->Size);
+      ST->BootServices->FreePool(PreviousSeed);
+    }
+  }
+
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"Random seed: RNG %s, file %llu bytes%s, previous table %s, installed: %s\r\n", HaveRng ? L"yes" : L"no", FileSeedSize, FileRefreshed ? L" (refreshed)" : L"", PreviousSeed ? L"yes" : L"no", EFI_ERROR(Status) ? L"no" : L"yes");
+#endif
+
+  // Don't leave seed material lying around in freed stack memory
+  ZeroMem(RngSeed, sizeof(RngSeed));
+  ZeroMem(FileSeed, sizeof(FileSeed));
+  ZeroMem(Mixed, sizeof(Mixed));
+  ZeroMem(NextFileSeed, sizeof(NextFileSeed));
+}
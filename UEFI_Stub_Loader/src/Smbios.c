@@ -0,0 +1,197 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Per-Model Config Selection
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Lets one precompiled config serve many hardware models: kcmdtool can tag entries with SMBIOS product names, SKUs, or system
+// UUIDs (see Kernelcmd_bin.h), and the entry matching this machine becomes the default.
+//
+// The SMBIOS structure table is walked once, stopping at the System Information (Type 1) structure, and the three keys are
+// pulled out of it. LibGetSmbiosString in lib/smbios.c would walk the string set again for every string and has no idea where
+// the table ends, so the walk here does both in the same pass, bounded by the table length. Each key is then a single lookup in
+// the config's match table.
+//
+// Configs without a match table never touch SMBIOS at all.
+//
+
+#include "Stubloader.h"
+
+STATIC EFI_GUID Smbios3TableGuid = SMBIOS3_TABLE_GUID;
+
+//==================================================================================================================================
+//  ReadSmbiosSystemInfo: Index the SMBIOS Tables
+//==================================================================================================================================
+//
+// Finds the SMBIOS structure table (preferring the 64-bit SMBIOS 3 entry point) and fills in Info from its Type 1 structure.
+// Strings point into the table itself, with leading and trailing spaces trimmed. Returns EFI_NOT_FOUND if there's no table or
+// no Type 1 structure in it.
+//
+
+// Returns string Number (from 1) of the structure whose strings start at Strings, or NULL if it doesn't have one
+STATIC CONST UINT8 * SmbiosString(CONST UINT8 *Strings, CONST UINT8 *End, UINT8 Number, UINTN *Length)
+{
+  if(Number == 0)
+  {
+    return NULL;
+  }
+
+  while(Strings < End)
+  {
+    CONST UINT8 * String = Strings;
+    while((Strings < End) && (*Strings != 0))
+    {
+      Strings++;
+    }
+    if((Strings == String) || (Strings == End)) // End of the string set, or running off the table
+    {
+      return NULL;
+    }
+
+    if(--Number == 0)
+    {
+      // Firmware likes to pad these with spaces
+      CONST UINT8 * Last = Strings;
+      while((String < Last) && (*String == ' '))
+      {
+        String++;
+      }
+      while((Last > String) && (Last[-1] == ' '))
+      {
+        Last--;
+      }
+      *Length = Last - String;
+      return (*Length != 0) ? String : NULL;
+    }
+    Strings++;
+  }
+
+  return NULL;
+}
+
+EFI_STATUS ReadSmbiosSystemInfo(SMBIOS_SYSTEM_INFO *Info)
+{
+  SMBIOS3_ENTRY_POINT * Smbios3;
+  SMBIOS_STRUCTURE_TABLE * Smbios;
+  CONST UINT8 * Structure;
+  CONST UINT8 * End;
+
+  ZeroMem(Info, sizeof(SMBIOS_SYSTEM_INFO));
+
+  if(!EFI_ERROR(LibGetSystemConfigurationTable(&Smbios3TableGuid, (VOID**)&Smbios3)) && compare(Smbios3->AnchorString, "_SM3_", 5))
+  {
+    Structure = (CONST UINT8*)(UINTN)Smbios3->TableAddress;
+    End = Structure + Smbios3->TableMaximumSize;
+  }
+  else if(!EFI_ERROR(LibGetSystemConfigurationTable(&SMBIOSTableGuid, (VOID**)&Smbios)) && compare(Smbios->AnchorString, "_SM_", 4))
+  {
+    Structure = (CONST UINT8*)(UINTN)Smbios->TableAddress;
+    End = Structure + Smbios->TableLength;
+  }
+  else
+  {
+    return EFI_NOT_FOUND;
+  }
+
+  while((End - Structure) >= (INTN)sizeof(SMBIOS_HEADER))
+  {
+    CONST SMBIOS_HEADER * Header = (CONST SMBIOS_HEADER*)Structure;
+    CONST UINT8 * Strings = Structure + Header->Length;
+
+    if((Header->Length < sizeof(SMBIOS_HEADER)) || (Header->Type == 127) || (Strings > End)) // Broken, end-of-table, or cut off
+    {
+      break;
+    }
+
+    if(Header->Type == 1)
+    {
+      // Product Name is in every version; UUID came with SMBIOS 2.1 and SKU Number with 2.4
+      if(Header->Length > 0x05)
+      {
+        Info->ProductName = SmbiosString(Strings, End, Structure[0x05], &Info->ProductNameLength);
+      }
+      if(Header->Length >= 0x18)
+      {
+        CopyMem(&Info->Uuid, &Structure[0x08], sizeof(EFI_GUID));
+
+        // All zeros means there isn't one, and all ones means it hasn't been set
+        UINT8 Or = 0;
+        UINT8 And = 0xFF;
+        for(UINTN i = 0; i < sizeof(EFI_GUID); i++)
+        {
+          Or |= Structure[0x08 + i];
+          And &= Structure[0x08 + i];
+        }
+        Info->HaveUuid = (Or != 0) && (And != 0xFF);
+      }
+      if(Header->Length > 0x19)
+      {
+        Info->Sku = SmbiosString(Strings, End, Structure[0x19], &Info->SkuLength);
+      }
+      return EFI_SUCCESS;
+    }
+
+    // Skip the string set, which ends with two zero bytes (even if it's empty)
+    while(((Strings + 1) < End) && ((Strings[0] != 0) || (Strings[1] != 0)))
+    {
+      Strings++;
+    }
+    Structure = Strings + 2;
+  }
+
+  return EFI_NOT_FOUND;
+}
+
+//==================================================================================================================================
+//  SelectKernelcmdByHardware: Pick This Machine's Entry
+//==================================================================================================================================
+//
+// If Config has a match table, makes the entry matching this machine the default and switches Config to it. The system UUID is
+// the most specific key, so it wins over the SKU, which wins over the product name. Without a match, DefaultEntry stays as is.
+//
+
+VOID SelectKernelcmdByHardware(KERNEL_CONFIG *Config)
+{
+  SMBIOS_SYSTEM_INFO Info;
+  UINT32 Entry;
+
+  if(Config->MatchSlotCount == 0)
+  {
+    return;
+  }
+
+  if(EFI_ERROR(ReadSmbiosSystemInfo(&Info)))
+  {
+    LoaderPrint(L"No SMBIOS system information, using the default entry.\r\n");
+    return;
+  }
+
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"SMBIOS product name: %.*a\r\nSMBIOS SKU: %.*a\r\n", Info.ProductNameLength, Info.ProductName ? Info.ProductName : (CONST UINT8*)"", Info.SkuLength, Info.Sku ? Info.Sku : (CONST UINT8*)"");
+  if(Info.HaveUuid)
+  {
+    LoaderPrint(L"SMBIOS UUID: %g\r\n", &Info.Uuid);
+  }
+#endif
+
+  if((Info.HaveUuid && FindKernelcmdMatch(Config, KERNELCMD_MATCH_UUID, (CONST UINT8*)&Info.Uuid, sizeof(EFI_GUID), &Entry))
+    || ((Info.Sku != NULL) && FindKernelcmdMatch(Config, KERNELCMD_MATCH_SKU, Info.Sku, Info.SkuLength, &Entry))
+    || ((Info.ProductName != NULL) && FindKernelcmdMatch(Config, KERNELCMD_MATCH_PRODUCT, Info.ProductName, Info.ProductNameLength, &Entry)))
+  {
+    LoaderPrint(L"Using entry %u for this machine.\r\n", Entry + 1);
+    Config->DefaultEntry = Entry;
+    SelectKernelcmdEntry(Config, Entry);
+  }
+  else
+  {
+    LoaderPrint(L"No entry for this machine, using the default entry.\r\n");
+  }
+}
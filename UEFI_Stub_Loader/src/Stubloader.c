@@ -38,17 +38,21 @@
 // applicable), as this allows using the machine's native UEFI boot manager to
 // select between them as desired.
 //
+// Alternatively, a single Stub Loader can boot several OSes from one
+// precompiled config with an entry for each (see "Boot Menu" below).
+//
 // Kernelcmd.txt Format and Contents:
 //
-// Kernelcmd.txt should be stored in UTF-16 format in the same directory as the
-// stub loader on the EFI system partition. Windows Notepad and Wordpad can save
-// text files in this format (select "Unicode Text Document" or "UTF-16 LE" as
-// the encoding format in the "Save As" dialog). Linux users can use gedit or
-// xed, saving as a .txt file with UTF-16 encoding. Also, it does not matter if
-// the file uses Windows (CRLF) or Unix (LF) line endings, but the file does
-// need a 2-byte identification Byte Order Mark (BOM). Don't worry too much about
-// the BOM; it gets added automatically by all of the aforementioned editors when
-// saving with the correct encoding.
+// Kernelcmd.txt should be stored in the same directory as the stub loader on
+// the EFI system partition. It can be saved as plain ASCII, as UTF-8 (with or
+// without a BOM), or as UTF-16. UTF-8 is the default for most Linux editors and
+// tools, so any text editor will do. For UTF-16, Windows Notepad and Wordpad can
+// save text files in this format (select "Unicode Text Document" or "UTF-16 LE"
+// as the encoding format in the "Save As" dialog), as can gedit and xed. A
+// UTF-16 file does need a 2-byte identification Byte Order Mark (BOM), but it
+// gets added automatically by all of the aforementioned editors when saving
+// with the correct encoding. Also, it does not matter if the file uses Windows
+// (CRLF) or Unix (LF) line endings.
 //
 // The contents of the text file are simple: only three lines are needed. The
 // first line should be the location of the kernel to be booted relative to the
@@ -62,11 +66,123 @@
 //
 // ** Technically you could use the remainder of the text file to contain an
 // actual text document. You could put this info in there if you wanted, or your
-// favorite song lyrics, though the smaller the file the faster it is to load.
+// favorite song lyrics. The loader stops reading once it has the first two
+// lines, so anything after them doesn't slow down booting.
+//
+// Precompiled Kernelcmd.txt:
+//
+// Tools/kcmdtool can compile Kernelcmd.txt ahead of time into a small binary
+// file with the strings already in UTF-16 and a CRC32 to catch corruption
+// (e.g. "kcmdtool compile -o Kernelcmd.txt Kernelcmd-src.txt"). Save it under
+// the same name; the loader recognizes it by its signature and uses it as-is.
+// "kcmdtool check" validates text or compiled files, so build scripts can
+// reject a broken config before it ever reaches a machine.
+//
+// Kernelcmd Variable:
+//
+// The same precompiled config can be kept in an EFI NV variable instead
+// ("kcmdtool setvar Kernelcmd-src.txt" from a running Linux system). The loader
+// checks for it first and, if it's there and valid, never touches the
+// filesystem for its config at all. Otherwise it falls back to Kernelcmd.txt.
+// "kcmdtool delvar" removes the variable again.
+//
+// Embedded Kernelcmd:
+//
+// For images that should never read a config from anywhere, Compile.sh can
+// build a precompiled config into the loader itself as a .kcmd section (set
+// EMBEDDED_KCMD to a file made by kcmdtool). The loader then uses only that,
+// unless it was compiled with "kcmdtool compile --allow-override", in which
+// case the variable and Kernelcmd.txt still win when they exist.
+//
+// Boot Menu:
+//
+// "kcmdtool compile --timeout 5 -o Kernelcmd.txt ubuntu.txt fedora.txt" makes
+// a precompiled config with one entry per text file. With a timeout, the
+// loader lists the entries and boots the --default one (entry 1 unless set
+// otherwise) if no key is pressed in time; "--timeout forever" waits for a
+// choice. A timeout of 0, the default, boots the default entry without any
+// menu or waiting, so unattended machines aren't slowed down by it.
+//
+// Per-Model Entries:
+//
+// Entries of a precompiled config can be tied to hardware models with
+// "--match N:product=NAME", "--match N:sku=SKU", or "--match N:uuid=UUID",
+// using the SMBIOS System Information that "dmidecode -t 1" shows. The
+// entry matching the machine it boots on then becomes the default, so one
+// ESP image can carry the right kernel parameters for every model.
+//
+// Wildcard Kernel Paths:
+//
+// The file name part of the kernel path can be a wildcard pattern, e.g.
+// \EFI\linux\vmlinuz-*.efi (*, ?, and [a-z] sets all work; the directory part
+// can't have any). The loader then boots the newest matching file, comparing
+// the numbers in the names as version numbers, so vmlinuz-5.10.efi wins over
+// vmlinuz-5.9.efi. New kernels can then be dropped in without editing the config.
+//
+// Unattended Failover:
+//
+// "kcmdtool compile --fallback 2 --fallback 3 ..." lists entries to try, in
+// order, when the one being booted can't be found, fails to load (including
+// failing Secure Boot verification), or returns an error. The loader moves on
+// right away instead of waiting for a key, and notes each failure in the
+// volatile KernelcmdFailure variable; "kcmdtool showfail" prints them from the
+// OS that did boot. If nothing boots, the usual "Press any key" prompt waits
+// KEYWAIT_TIMEOUT seconds (see Stubloader.h) before returning to the firmware.
+//
+// Random Seed:
+//
+// The loader hands Linux a random seed (via the LINUX_EFI_RANDOM_SEED_TABLE
+// configuration table) made from the firmware's EFI_RNG_PROTOCOL and a
+// Randomseed.bin file next to STUBLOAD.EFI, which it creates if there's an RNG
+// and rewrites with a fresh seed on every boot. The kernel's CRNG is then ready
+// from the start, even on VMs without much entropy. Define DISABLE_RANDOM_SEED
+// in Stubloader.h to turn this off (e.g. if the ESP is read-only).
+//
+// Kernels on Other Partitions:
+//
+// The kernel path can start with the partition to boot from instead of the
+// ESP, as PARTUUID=GUID, PARTLABEL=LABEL, or PARTTYPE=GUID (the first partition
+// of that type), e.g. PARTUUID=8c3e2f5a-...-4b1d\vmlinuz.efi. "lsblk -o
+// +PARTUUID,PARTLABEL,PARTTYPE" shows these. The partition needs a filesystem
+// the firmware can read, and the kernel finds initrd= files on that partition
+// too. Labels can't have spaces, since those are dropped from the path.
+//
+// Kernels Inside ISO Images:
+//
+// A kernel path like \EFI\iso\rescue.iso:\casper\vmlinuz boots the kernel
+// from inside an ISO image (e.g. a distro's install or rescue ISO) without
+// another bootloader. The initrd= paths on the command line are then looked up
+// in the same image too, e.g. initrd=\casper\initrd, and handed to Linux
+// through its initrd device path, which needs Linux 5.8 or newer. The image's
+// file name can be a wildcard pattern, and the image can be on another
+// partition as above.
+//
+// Network Boot:
+//
+// A kernel path like TFTP=10.0.0.2\boot\vmlinuz fetches the kernel from that
+// TFTP server, and TFTP=\boot\vmlinuz from the server this loader was itself
+// PXE booted from. The initrd= files come from the same server, and are handed
+// to Linux the same way as for ISO images. The loader asks the server for big
+// blocks and windows of blocks per ACK (see Network Boot Settings in
+// Stubloader.h), so this is a good deal faster than the firmware's own TFTP.
+//
+// A kernel path like HTTP=10.0.0.2:8000\boot\vmlinuz does the same over plain
+// HTTP, fetching each file as several byte ranges over parallel connections if
+// the server supports ranges. Either kind of path can have a :PORT after the
+// server address, or be just a :PORT for the PXE server.
+//
+// ESP Layout:
+//
+// Kernels and initrds on an ESP that has seen many updates end up in pieces
+// all over it, which makes the firmware load them with lots of small reads.
+// Tools/esplayout moves them (and Kernelcmd.txt) into one run of clusters each,
+// back to back, on an unmounted ESP or an image of one. Building the loader with
+// TRACE_FILE_READS (see Stubloader.h) prints the files it reads, in order, and
+// "esplayout optimize --trace" takes that log to lay them out in that order.
 //
 // NOTE: If for some reason you need to use this with a big endian system, save
-// the text file as "Unicode big endian." You will also need to compile this
-// program for your big endian target.
+// the text file as UTF-8 or "Unicode big endian." You will also need to compile
+// this program for your big endian target.
 //
 
 #include "Stubloader.h"
@@ -88,23 +204,26 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
 */
   EFI_STATUS Status;
 
+  // Set up buffered output before printing anything
+  OutputInit();
+
 #ifdef DISABLE_UEFI_WATCHDOG_TIMER
   // Disable watchdog timer for debugging
   Status = BS->SetWatchdogTimer(0, 0, 0, NULL);
   if(EFI_ERROR(Status))
   {
-    Print(L"Error stopping watchdog, timeout still counting down...\r\n");
+    LoaderPrint(L"Error stopping watchdog, timeout still counting down...\r\n");
   }
 #endif
 
 #ifdef DEBUG_ENABLED // Lite debug version
-  Print(L"UEFI Stub Loader - V%d.%d DEBUG\r\n", MAJOR_VER, MINOR_VER);
+  LoaderPrint(L"UEFI Stub Loader - V%d.%d DEBUG\r\n", MAJOR_VER, MINOR_VER);
 #else // Release version
-  Print(L"UEFI Stub Loader - V%d.%d\r\n", MAJOR_VER, MINOR_VER);
+  LoaderPrint(L"UEFI Stub Loader - V%d.%d\r\n", MAJOR_VER, MINOR_VER);
 #endif
-  Print(L"Copyright (c) 2018-2019 KNNSpeed\r\n\n");
+  LoaderPrint(L"Copyright (c) 2018-2019 KNNSpeed\r\n\n");
 
-  Print(L"Loading...\r\n\n");
+  LoaderPrint(L"Loading...\r\n\n");
 
   // Use the known location of this loader to find the drive and file location of Kernelcmd.txt
   // Note: Loadedimage is an EFI_LOADED_IMAGE_PROTOCOL pointer and the data it refers to are the LOADED IMAGE characteristics of STUBLOAD.EFI
@@ -116,11 +235,296 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   Status = ST->BootServices->OpenProtocol(ImageHandle, &LoadedImageProtocol, (void**)&LoadedImage, ImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
   if(EFI_ERROR(Status))
   {
-    Print(L"LoadedImage OpenProtocol error. 0x%llx\r\n", Status);
+    LoaderPrint(L"LoadedImage OpenProtocol error. 0x%llx\r\n", Status);
+    goto Cleanup;
+  }
+
+  // Get the kernel image location and command line. A config built into this loader comes first, then NVRAM, and only then
+  // Kernelcmd.txt, so that the filesystem doesn't need to be touched unless it has to be.
+  KERNEL_CONFIG Config;
+  KERNEL_CONFIG EmbeddedConfig;
+
+  Status = ReadKernelcmdEmbedded(LoadedImage, &EmbeddedConfig);
+  BOOLEAN HaveEmbedded = !EFI_ERROR(Status);
+
+  if(HaveEmbedded && !(EmbeddedConfig.Flags & KERNELCMD_BIN_FLAG_ALLOW_OVERRIDE))
+  {
+    Config = EmbeddedConfig;
+#ifdef DEBUG_ENABLED
+    LoaderPrint(L"Using embedded config.\r\n");
+#endif
+  }
+  else
+  {
+    if((Status != EFI_NOT_FOUND) && !HaveEmbedded)
+    {
+      LoaderPrint(L"Ignoring embedded config.\r\n");
+    }
+
+    Status = ReadKernelcmdVariable(&Config);
+    if(EFI_ERROR(Status))
+    {
+      if(Status != EFI_NOT_FOUND)
+      {
+        LoaderPrint(L"Falling back to Kernelcmd.txt.\r\n");
+      }
+
+      Status = ReadKernelcmdFile(ImageHandle, LoadedImage, &Config);
+      if(EFI_ERROR(Status))
+      {
+        if(!HaveEmbedded)
+        {
+          goto Cleanup;
+        }
+        LoaderPrint(L"Using embedded config instead.\r\n");
+        Config = EmbeddedConfig;
+      }
+    }
+#ifdef DEBUG_ENABLED
+    else
+    {
+      LoaderPrint(L"Using Kernelcmd variable.\r\n");
+    }
+#endif
+  }
+
+  // Pick one of several boot entries: the one for this hardware model, if the config has any, and then from the menu, if it has one
+  SelectKernelcmdByHardware(&Config);
+  BootMenu(&Config);
+
+#ifndef DISABLE_RANDOM_SEED
+  // Seed Linux's CRNG so it doesn't stall waiting for entropy. Done once: fallback kernels get the same table.
+  InstallRandomSeed(LoadedImage);
+#endif
+
+  // Boot the chosen entry, and if that fails, go straight down the config's fallback list without waiting for anyone. Each
+  // failure is recorded in a volatile variable for the OS that does boot to find.
+  KERNELCMD_FAILURE Failures[KERNELCMD_MAX_FAILURES];
+  UINTN FailureCount = 0;
+  UINT32 FirstEntry = Config.Entry;
+  UINT32 Tried = 0; // Fallbacks tried (or skipped) so far
+  UINT32 Stage = 0;
+  CHAR16 * TextKernelPath = (Config.Image == NULL) ? Config.KernelPath : NULL; // Text configs' path has its own pool
+
+  for(;;)
+  {
+    Status = BootKernel(ImageHandle, LoadedImage, &Config, &Stage);
+    if(!EFI_ERROR(Status))
+    {
+      break;
+    }
+
+    if(FailureCount < KERNELCMD_MAX_FAILURES)
+    {
+      Failures[FailureCount].Entry = Config.Entry;
+      Failures[FailureCount].Stage = Stage;
+      Failures[FailureCount].Status = Status;
+      FailureCount++;
+
+      EFI_GUID FailureGuid = KERNELCMD_VARIABLE_GUID;
+      ST->RuntimeServices->SetVariable(L"" KERNELCMD_FAILURE_VARIABLE_NAME, &FailureGuid, EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS, FailureCount * sizeof(KERNELCMD_FAILURE), Failures);
+    }
+
+    // Next fallback that isn't the entry that just failed or the one chosen at the start
+    while((Tried < Config.FallbackCount) && ((KernelcmdFallback(&Config, Tried) == Config.Entry) || (KernelcmdFallback(&Config, Tried) == FirstEntry)))
+    {
+      Tried++;
+    }
+    if(Tried >= Config.FallbackCount)
+    {
+      break;
+    }
+
+    SelectKernelcmdEntry(&Config, KernelcmdFallback(&Config, Tried++));
+    LoaderPrint(L"Falling back to entry %u.\r\n", Config.Entry + 1);
+  }
+
+  if(TextKernelPath != NULL)
+  {
+    BS->FreePool(TextKernelPath);
+  }
+
+Cleanup:
+  // Every way out goes through here, including failing before anything could be tried
+  FreePartitionIndex();
+  BlockCacheFlush();
+  // gnu-efi's handle cache has notify events pointing into this image, which won't be around after returning
+  LibFlushHandleCache();
+
+  // Only gets here if nothing could be booted, or a kernel returned without an error
+  if(EFI_ERROR(Status))
+  {
     Keywait(L"\0");
+  }
+  else
+  {
+    Keywait(L"Kernel image returned...\r\n");
+  }
+  return Status;
+}
+
+//==================================================================================================================================
+//  BootKernel: Load and Start One Entry
+//==================================================================================================================================
+//
+// Loads the kernel of the entry Config points at, hands it its command line, and starts it. Only returns if that fails or the
+// kernel returns, with *Stage saying which step failed (KERNELCMD_STAGE_*). Prints what went wrong but never waits for a key,
+// so that efi_main can go straight on to a fallback entry.
+//
+
+EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, EFI_LOADED_IMAGE_PROTOCOL *LoadedImage, CONST KERNEL_CONFIG *Config, UINT32 *Stage)
+{
+  EFI_STATUS Status;
+
+  CHAR16 * KernelPath = Config->KernelPath; // EFI Kernel file's Path
+  CHAR16 * Cmdline = Config->Cmdline; // Command line to pass to EFI kernel
+  UINT32 CmdlineSize = (Config->CmdlineLength + 1) << 1; // Linux kernel only takes 256 to 4096 chars depending on architecture. Here's a couple billion.
+
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"Kernel image path: %s\r\nKernel image path size: %u\r\n", KernelPath, (Config->KernelPathLength + 1) << 1);
+  LoaderPrint(L"Kernel command line: %s\r\nKernel command line size: %u\r\n", Cmdline, CmdlineSize);
+  Keywait(L"Loading image... (might take a second or two after pressing a key)\r\n");
+#endif
+
+  *Stage = KERNELCMD_STAGE_FIND;
+  EFI_HANDLE LoadedKernelImageHandle;
+  if(StrnCmp(KernelPath, L"TFTP=", 5) == 0)
+  {
+    // A kernel path like TFTP=10.0.2.2\boot\vmlinuz is fetched over the network, and gets loaded from memory
+    Status = LoadTftpKernel(ImageHandle, LoadedImage->DeviceHandle, KernelPath, Cmdline, Config->CmdlineLength, Stage, &LoadedKernelImageHandle);
+  }
+  else if(StrnCmp(KernelPath, L"HTTP=", 5) == 0)
+  {
+    // Same over HTTP, like HTTP=10.0.0.2:8000\boot\vmlinuz
+    Status = LoadHttpKernel(ImageHandle, LoadedImage->DeviceHandle, KernelPath, Cmdline, Config->CmdlineLength, Stage, &LoadedKernelImageHandle);
+  }
+  else
+  {
+    // A kernel path like PARTUUID=...\EFI\linux\vmlinuz.efi is on another partition than STUBLOADER's
+    EFI_HANDLE DeviceHandle;
+    Status = LocateKernelPartition(LoadedImage->DeviceHandle, KernelPath, &DeviceHandle, &KernelPath);
+    if(EFI_ERROR(Status))
+    {
+      return Status;
+    }
+
+    // A kernel path like \EFI\iso\rescue.iso:\casper\vmlinuz is inside an ISO image, and gets loaded from memory
+    CONST CHAR16 * IsoSeparator = FindIsoSeparator(KernelPath);
+    if(IsoSeparator != NULL)
+    {
+      Status = LoadIsoKernel(ImageHandle, DeviceHandle, KernelPath, IsoSeparator, Cmdline, Config->CmdlineLength, Stage, &LoadedKernelImageHandle);
+    }
+    else
+    {
+      Status = LoadKernelFile(ImageHandle, DeviceHandle, KernelPath, Stage, &LoadedKernelImageHandle);
+
+#ifdef TRACE_FILE_READS
+      // Linux reads these itself once it's started, from the same partition
+      UINTN Position = 0;
+      UINTN Start;
+      UINTN Length;
+      while(!EFI_ERROR(Status) && NextInitrdArgument(Cmdline, Config->CmdlineLength, &Position, &Start, &Length))
+      {
+        LoaderPrint(L"File read: %.*s\r\n", Length, &Cmdline[Start]);
+      }
+#endif
+    }
+  }
+  if(EFI_ERROR(Status))
+  {
     return Status;
   }
 
+  // Now to associate the command line with the kernel, which is done by adding the command line to the load options of the loaded kernel image
+  EFI_LOADED_IMAGE_PROTOCOL * LoadedKernelImage; // Well this seems familiar...
+
+  Status = ST->BootServices->OpenProtocol(LoadedKernelImageHandle, &LoadedImageProtocol, (void**)&LoadedKernelImage, ImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"LoadedKernelImage OpenProtocol error. 0x%llx\r\n", Status);
+    ST->BootServices->UnloadImage(LoadedKernelImageHandle);
+    FreeInitrd();
+    return Status;
+  }
+
+  LoadedKernelImage->LoadOptions = Cmdline; // This was allocated pool of EfiLoaderData earlier so that it persists into the kernel.
+  LoadedKernelImage->LoadOptionsSize = CmdlineSize;
+
+#ifdef DEBUG_ENABLED
+  LoaderPrint(L"Block cache: %lu hits, %lu misses, %lu reads, %lu bytes bypassed\r\n", BlockCacheStats.Hits, BlockCacheStats.Misses, BlockCacheStats.ReadCalls, BlockCacheStats.BypassBytes);
+  LoaderPrint(L"Kernel command line: %s\r\nKernel command line size: %u\r\n\n", Cmdline, CmdlineSize);
+  LoaderPrint(L"Verify loaded command line: %s\r\nCommand line size: %u\r\n", LoadedKernelImage->LoadOptions, LoadedKernelImage->LoadOptionsSize);
+  Keywait(L"Starting image...\r\n");
+#endif
+
+  // Get any buffered output out of the way before handing over the console
+#ifdef QUIET_BOOT
+  OutputDiscard();
+#else
+  OutputSync();
+#endif
+
+  // Execute kernel EFI image by StartImage
+  *Stage = KERNELCMD_STAGE_START;
+  Status = ST->BootServices->StartImage(LoadedKernelImageHandle, NULL, NULL);
+
+  // If all goes well, this program should never get here.
+  LoaderPrint(L"Status: 0x%llx\r\n", Status);
+  FreeInitrd();
+  return Status;
+}
+
+//==================================================================================================================================
+//  LoadKernelFile: Load a Kernel Image File
+//==================================================================================================================================
+//
+// Loads the kernel file at KernelPath on DeviceHandle into *KernelImageHandle, picking the newest match if its file name is a
+// wildcard pattern. *Stage is set like BootKernel's. Prints what went wrong on errors.
+//
+
+EFI_STATUS LoadKernelFile(EFI_HANDLE ImageHandle, EFI_HANDLE DeviceHandle, CHAR16 *KernelPath, UINT32 *Stage, EFI_HANDLE *KernelImageHandle)
+{
+  EFI_STATUS Status;
+
+  // A kernel path like \EFI\linux\vmlinuz-*.efi picks the newest matching kernel
+  CHAR16 * ResolvedPath;
+  Status = ResolveKernelPath(DeviceHandle, KernelPath, &ResolvedPath);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  CHAR16 * Path = (ResolvedPath != NULL) ? ResolvedPath : KernelPath;
+
+#ifdef TRACE_FILE_READS
+  LoaderPrint(L"File read: %s\r\n", Path);
+#endif
+
+  // Finally time to get the kernel image, which will need its own EFI_HANDLE
+  // Doesn't seem like we can use EFI_SIMPLE_FILE_SYSTEM_PROTOCOL constructs for BS->LoadImage, instead it goes by the device path
+  // to the kernel on its partition (usually STUBLOADER's EFI partition)
+  *Stage = KERNELCMD_STAGE_LOAD;
+  Status = LoadKernelImage(ImageHandle, DeviceHandle, Path, NULL, 0, NULL, 0, KernelImageHandle);
+
+  if(ResolvedPath != NULL)
+  {
+    BS->FreePool(ResolvedPath);
+  }
+  return Status;
+}
+
+//==================================================================================================================================
+//  ReadKernelcmdFile: Get the Boot Config From Kernelcmd.txt
+//==================================================================================================================================
+//
+// Finds Kernelcmd.txt in the same directory as this loader and reads it into Config. Prints what went wrong on errors; the
+// caller is the one to stop and wait for a key.
+//
+
+EFI_STATUS ReadKernelcmdFile(EFI_HANDLE ImageHandle, EFI_LOADED_IMAGE_PROTOCOL *LoadedImage, KERNEL_CONFIG *Config)
+{
+  EFI_STATUS Status;
+
   // Get ready to get filesystem support
   EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *FileSystem;
 
@@ -128,8 +532,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   Status = ST->BootServices->OpenProtocol(LoadedImage->DeviceHandle, &FileSystemProtocol, (void**)&FileSystem, ImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
   if(EFI_ERROR(Status))
   {
-    Print(L"FileSystem OpenProtocol error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
+    LoaderPrint(L"FileSystem OpenProtocol error. 0x%llx\r\n", Status);
     return Status;
   }
 
@@ -139,8 +542,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   Status = FileSystem->OpenVolume(FileSystem, &CurrentDriveRoot);
   if(EFI_ERROR(Status))
   {
-    Print(L"OpenVolume error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
+    LoaderPrint(L"OpenVolume error. 0x%llx\r\n", Status);
     return Status;
   }
 
@@ -150,7 +552,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   CHAR16 * BootFilePath = ((FILEPATH_DEVICE_PATH*)LoadedImage->FilePath)->PathName;
 
 #ifdef DEBUG_ENABLED
-  Print(L"BootFilePath: %s\r\n", BootFilePath);
+  LoaderPrint(L"BootFilePath: %s\r\n", BootFilePath);
 #endif
 
   UINTN TxtFilePathPrefixLength = 0;
@@ -168,7 +570,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   TxtFilePathPrefixLength += 1; // To account for the last '\' in the file path (file path prefix does not get null-terminated)
 
 #ifdef DEBUG_ENABLED
-  Print(L"BootFilePathLength: %llu, TxtFilePathPrefixLength: %llu, BootFilePath Size: %llu \r\n", BootFilePathLength, TxtFilePathPrefixLength, StrSize(BootFilePath));
+  LoaderPrint(L"BootFilePathLength: %llu, TxtFilePathPrefixLength: %llu, BootFilePath Size: %llu \r\n", BootFilePathLength, TxtFilePathPrefixLength, StrSize(BootFilePath));
   Keywait(L"\0");
 #endif
 
@@ -182,8 +584,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   Status = ST->BootServices->AllocatePool(EfiBootServicesData, TxtFilePathSize, (void**)&TxtFilePath);
   if(EFI_ERROR(Status))
   {
-    Print(L"TxtFilePathPrefix AllocatePool error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
+    LoaderPrint(L"TxtFilePathPrefix AllocatePool error. 0x%llx\r\n", Status);
     return Status;
   }
 
@@ -194,7 +595,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   CopyMem(&TxtFilePath[TxtFilePathPrefixLength], TxtFileName, sizeof(TxtFileName));
 
 #ifdef DEBUG_ENABLED
-  Print(L"TxtFilePath: %s, TxtFilePath Size: %llu\r\n", TxtFilePath, TxtFilePathSize);
+  LoaderPrint(L"TxtFilePath: %s, TxtFilePath Size: %llu\r\n", TxtFilePath, TxtFilePathSize);
   Keywait(L"\0");
 #endif
 
@@ -206,51 +607,35 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   Status = CurrentDriveRoot->Open(CurrentDriveRoot, &KernelcmdFile, TxtFilePath, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
   if (EFI_ERROR(Status))
   {
-    Keywait(L"Kernelcmd.txt file is missing\r\n");
+    LoaderPrint(L"Kernelcmd.txt file is missing\r\n");
+    BS->FreePool(TxtFilePath);
     return Status;
   }
 
-#ifdef DEBUG_ENABLED
-  Keywait(L"Kernelcmd.txt file opened.\r\n");
+#ifdef TRACE_FILE_READS
+  LoaderPrint(L"File read: %s\r\n", TxtFilePath);
 #endif
 
-  // Now to get Kernelcmd.txt's file size
-  UINTN FileInfoSize;
-  // Need to know the size of the file metadata to get the file metadata...
-  Status = KernelcmdFile->GetInfo(KernelcmdFile, &gEfiFileInfoGuid, &FileInfoSize, NULL);
-  // GetInfo will intentionally error out and provide the correct FileInfoSize value
-
 #ifdef DEBUG_ENABLED
-  Print(L"FileInfoSize: %llu Bytes\r\n", FileInfoSize);
+  Keywait(L"Kernelcmd.txt file opened.\r\n");
 #endif
 
-  // Prep metadata destination
-  EFI_FILE_INFO *FileInfo;
-  // Reserve memory for file info/attributes and such, to prevent it from getting run over
-  Status = ST->BootServices->AllocatePool(EfiBootServicesData, FileInfoSize, (void**)&FileInfo);
-  if(EFI_ERROR(Status))
+#ifdef SHOW_KERNEL_METADATA
+  // Show metadata
+  EFI_FILE_INFO *FileInfo = LibFileInfo(KernelcmdFile);
+  if(FileInfo == NULL)
   {
-    Print(L"FileInfo AllocatePool error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
+    // Skips ReadKernelcmd, but still closes the file and frees TxtFilePath below
+    LoaderPrint(L"GetInfo error.\r\n");
+    Status = EFI_LOAD_ERROR;
   }
-
-  // Actually get the metadata
-  Status = KernelcmdFile->GetInfo(KernelcmdFile, &gEfiFileInfoGuid, &FileInfoSize, FileInfo);
-  if(EFI_ERROR(Status))
+  else
   {
-    Print(L"GetInfo error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-#ifdef SHOW_KERNEL_METADATA
-  // Show metadata
-  Print(L"FileName: %s\r\n", FileInfo->FileName);
-  Print(L"Size: %llu\r\n", FileInfo->Size);
-  Print(L"FileSize: %llu\r\n", FileInfo->FileSize);
-  Print(L"PhysicalSize: %llu\r\n", FileInfo->PhysicalSize);
-  Print(L"Attribute: %llx\r\n", FileInfo->Attribute);
+    LoaderPrint(L"FileName: %s\r\n", FileInfo->FileName);
+    LoaderPrint(L"Size: %llu\r\n", FileInfo->Size);
+    LoaderPrint(L"FileSize: %llu\r\n", FileInfo->FileSize);
+    LoaderPrint(L"PhysicalSize: %llu\r\n", FileInfo->PhysicalSize);
+    LoaderPrint(L"Attribute: %llx\r\n", FileInfo->Attribute);
 /*
   NOTE: Attributes:
 
@@ -263,251 +648,26 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
   #define EFI_FILE_VALID_ATTR 0x0000000000000037
 
 */
-  Print(L"Created: %02hhu/%02hhu/%04hu - %02hhu:%02hhu:%02hhu.%u\r\n", FileInfo->CreateTime.Month, FileInfo->CreateTime.Day, FileInfo->CreateTime.Year, FileInfo->CreateTime.Hour, FileInfo->CreateTime.Minute, FileInfo->CreateTime.Second, FileInfo->CreateTime.Nanosecond);
-  Print(L"Last Modified: %02hhu/%02hhu/%04hu - %02hhu:%02hhu:%02hhu.%u\r\n", FileInfo->ModificationTime.Month, FileInfo->ModificationTime.Day, FileInfo->ModificationTime.Year, FileInfo->ModificationTime.Hour, FileInfo->ModificationTime.Minute, FileInfo->ModificationTime.Second, FileInfo->ModificationTime.Nanosecond);
-  Keywait(L"\0");
-#endif
-
-  // Read text file into memory now that we know the file size
-  CHAR16 * KernelcmdArray;
-  // Reserve memory for text file
-  Status = ST->BootServices->AllocatePool(EfiBootServicesData, FileInfo->FileSize, (void**)&KernelcmdArray);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"KernelcmdArray AllocatePool error. 0x%llx\r\n", Status);
+    LoaderPrint(L"Created: %02hhu/%02hhu/%04hu - %02hhu:%02hhu:%02hhu.%u\r\n", FileInfo->CreateTime.Month, FileInfo->CreateTime.Day, FileInfo->CreateTime.Year, FileInfo->CreateTime.Hour, FileInfo->CreateTime.Minute, FileInfo->CreateTime.Second, FileInfo->CreateTime.Nanosecond);
+    LoaderPrint(L"Last Modified: %02hhu/%02hhu/%04hu - %02hhu:%02hhu:%02hhu.%u\r\n", FileInfo->ModificationTime.Month, FileInfo->ModificationTime.Day, FileInfo->ModificationTime.Year, FileInfo->ModificationTime.Hour, FileInfo->ModificationTime.Minute, FileInfo->ModificationTime.Second, FileInfo->ModificationTime.Nanosecond);
+    BS->FreePool(FileInfo);
     Keywait(L"\0");
-    return Status;
-  }
-
-  // Actually read the file
-  Status = KernelcmdFile->Read(KernelcmdFile, &FileInfo->FileSize, KernelcmdArray);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"KernelcmdArray read error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
   }
-
-#ifdef DEBUG_ENABLED
-  Keywait(L"KernelcmdFile read into memory.\r\n");
 #endif
 
-  // UTF-16 format check
-  UINT16 BOM_check = UTF16_BOM_LE;
-  if(!compare(KernelcmdArray, &BOM_check, 2))
-  {
-    BOM_check = UTF16_BOM_BE; // Check endianness
-    if(compare(KernelcmdArray, &BOM_check, 2))
-    {
-      Print(L"Error: Kernelcmd.txt has the wrong endianness for this system.\r\n");
-    }
-    else // Probably missing a BOM
-    {
-      Print(L"Error: Kernelcmd.txt not formatted as UTF-16/UCS-2 with BOM.\r\n\n");
-      Print(L"Q: What is a BOM?\r\n\n");
-      Print(L"A: The BOM (Byte Order Mark) is a 2-byte identification sequence\r\n");
-      Print(L"(U+FEFF) at the start of a UTF16/UCS-2-encoded file.\r\n");
-      Print(L"Unfortunately not all editors add it in, and without\r\n");
-      Print(L"a BOM present programs like this one cannot easily tell that a\r\n");
-      Print(L"text file is encoded in UTF16/UCS-2.\r\n\n");
-      Print(L"Windows Notepad & Wordpad and Linux gedit & xed all add BOMs when\r\n");
-      Print(L"saving files as .txt with encoding set to \"Unicode\" (Windows)\r\n");
-      Print(L"or \"UTF16\" (Linux), so use one of them to make Kernelcmd.txt.\r\n\n");
-    }
-    Keywait(L"Please fix the file and try again.\r\n");
-    return Status;
-  }
   // Parse Kernelcmd.txt file for location of kernel image and command line
   // Kernel image location line will be of format e.g. \EFI\ubuntu\vmlinuz.efi followed by \n or \r\n
   // Command line will just go until the next \n or \r\n, and should just be loaded as a UTF-16 string
-
-  // Get size of kernel image path & command line and populate the data retention variables
-  UINT64 FirstLineLength = 0;
-  UINT64 KernelPathSize = 0;
-
-  for(UINT64 i = 1; i < ((FileInfo->FileSize) >> 1); i++) // i starts at 1 to skip the BOM, ((FileInfo->FileSize) >> 1) is the number of 2-byte units in the file
-  {
-    if(KernelcmdArray[i] == L'\n')
-    {
-      // Account for the L'\n'
-      FirstLineLength = i + 1;
-      // The extra +1 is to start the command line parse in the correct place
-      break;
-    }
-    else if(KernelcmdArray[i] == L'\r')
-    {
-      // There'll be a \n after the \r
-      FirstLineLength = i + 1 + 1;
-      // The extra +1 is to start the command line parse in the correct place
-      break;
-    }
-
-    if(KernelcmdArray[i] != L' ') // There might be an errant space or two. Ignore them.
-    {
-      KernelPathSize++;
-    }
-  }
-  UINT64 KernelPathLen = KernelPathSize; // Need this for later
-  // Need to add null terminator. Multiply by size of CHAR16 (2 bytes) to get size.
-  KernelPathSize = (KernelPathSize + 1) << 1; // (KernelPathSize + 1) * sizeof(CHAR16)
-
-#ifdef DEBUG_ENABLED
-  Print(L"KernelPathSize: %llu\r\n", KernelPathSize);
-#endif
-
-  // Command line's turn
-  UINT32 CmdlineSize = 0; // Linux kernel only takes 256 to 4096 chars depending on architecture. Here's a couple billion.
-
-  for(UINT64 j = FirstLineLength; j < ((FileInfo->FileSize) >> 1); j++)
-  {
-    if((KernelcmdArray[j] == L'\n') || (KernelcmdArray[j] == L'\r')) // Reached the end of the line
-    {
-      break;
-    }
-
-    CmdlineSize++;
-  }
-  UINT64 CmdlineLen = CmdlineSize; // Need this for later
-  // Need to add null terminator. Multiply by size of CHAR16 (2 bytes) to get size.
-  CmdlineSize = (CmdlineSize + 1) << 1; // (CmdlineSize + 1) * sizeof(CHAR16)
-
-#ifdef DEBUG_ENABLED
-  Print(L"CmdlineSize: %llu\r\n", CmdlineSize);
-#endif
-
-  CHAR16 * KernelPath; // EFI Kernel file's Path
-  Status = ST->BootServices->AllocatePool(EfiBootServicesData, KernelPathSize, (void**)&KernelPath);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"KernelPath AllocatePool error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  CHAR16 * Cmdline; // Command line to pass to EFI kernel
-  Status = ST->BootServices->AllocatePool(EfiLoaderData, CmdlineSize, (void**)&Cmdline);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"Cmdline AllocatePool error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  for(UINT64 i = 1; i < FirstLineLength; i++)
-  {
-    if((KernelcmdArray[i] == L'\n') || (KernelcmdArray[i] == L'\r'))
-    {
-      break;
-    }
-
-    if(KernelcmdArray[i] != L' ') // There might be an errant space or two. Ignore them.
-    {
-      KernelPath[i-1] = KernelcmdArray[i]; // i-1 to ignore the 2 bytes of UTF-16 BOM
-    }
-  }
-  KernelPath[KernelPathLen] = L'\0'; // Need to null-terminate this string
-
-  // Command line's turn
-  for(UINT64 j = FirstLineLength; j < ((FileInfo->FileSize) >> 1); j++)
+  // Only as much of the file as needed gets read, and both strings are built directly in their final buffers
+  if(!EFI_ERROR(Status))
   {
-    if((KernelcmdArray[j] == L'\n') || (KernelcmdArray[j] == L'\r')) // Reached the end of the line
-    {
-      break;
-    }
-
-    Cmdline[j-FirstLineLength] = KernelcmdArray[j];
+    Status = ReadKernelcmd(KernelcmdFile, Config);
   }
-  Cmdline[CmdlineLen] = L'\0'; // Need to null-terminate this string
-
-#ifdef DEBUG_ENABLED
-  Print(L"Kernel image path: %s\r\nKernel image path size: %u\r\n", KernelPath, KernelPathSize);
-  Print(L"Kernel command line: %s\r\nKernel command line size: %u\r\n", Cmdline, CmdlineSize);
-  Keywait(L"Loading image... (might take a second or two after pressing a key)\r\n");
-#endif
-
-  // Get UEFI device path that corresponds to STUBLOADER's EFI partition
-  // Doesn't seem like we can use EFI_SIMPLE_FILE_SYSTEM_PROTOCOL constructs for BS->LoadImage, instead we need to use EFI_DEVICE_PATH_PROTOCOL
-  EFI_DEVICE_PATH_PROTOCOL * FullDevicePath;
-  FullDevicePath = FileDevicePath(LoadedImage->DeviceHandle, KernelPath); // This allocates memory for us
+  KernelcmdFile->Close(KernelcmdFile);
 
   // Free pools allocated from before as they are no longer needed
-  Status = BS->FreePool(TxtFilePath);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"Error freeing TxtFilePathPrefix pool. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
+  BS->FreePool(TxtFilePath);
 
-  Status = BS->FreePool(KernelPath);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"Error freeing KernelPath pool. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  Status = BS->FreePool(KernelcmdArray);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"Error freeing KernelcmdArray pool. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  Status = BS->FreePool(FileInfo);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"Error freeing FileInfo pool. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  // Finally time to get the kernel image, which will need its own EFI_HANDLE
-  EFI_HANDLE LoadedKernelImageHandle;
-  // Load kernel image from its location
-  Status = ST->BootServices->LoadImage(FALSE, ImageHandle, FullDevicePath, NULL, 0, &LoadedKernelImageHandle);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"LoadedKernelImageHandle LoadImage error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  Status = BS->FreePool(FullDevicePath);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"Error freeing FullDevicePath pool. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  // Now to associate the command line with the kernel, which is done by adding the command line to the load options of the loaded kernel image
-  EFI_LOADED_IMAGE_PROTOCOL * LoadedKernelImage; // Well this seems familiar...
-
-  Status = ST->BootServices->OpenProtocol(LoadedKernelImageHandle, &LoadedImageProtocol, (void**)&LoadedKernelImage, ImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-  if(EFI_ERROR(Status))
-  {
-    Print(L"LoadedKernelImage OpenProtocol error. 0x%llx\r\n", Status);
-    Keywait(L"\0");
-    return Status;
-  }
-
-  LoadedKernelImage->LoadOptions = Cmdline; // This was allocated pool of EfiLoaderData earlier so that it persists into the kernel.
-  LoadedKernelImage->LoadOptionsSize = CmdlineSize;
-
-#ifdef DEBUG_ENABLED
-  Print(L"Kernel command line: %s\r\nKernel command line size: %u\r\n\n", Cmdline, CmdlineSize);
-  Print(L"Verify loaded command line: %s\r\nCommand line size: %u\r\n", LoadedKernelImage->LoadOptions, LoadedKernelImage->LoadOptionsSize);
-  Keywait(L"Starting image...\r\n");
-#endif
-
-  // Execute kernel EFI image by StartImage
-  Status = ST->BootServices->StartImage(LoadedKernelImageHandle, NULL, NULL);
-
-  // If all goes well, this program should never get here.
-  Print(L"Status: 0x%llx\r\n", Status);
-  Keywait(L"Kernel image returned...\r\n");
   return Status;
 }
 
@@ -515,7 +675,7 @@ EFI_STATUS efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)
 //  Keywait: Pause
 //==================================================================================================================================
 //
-// A simple pause function that waits for user input before continuing.
+// A simple pause function that waits for user input before continuing, or for KEYWAIT_TIMEOUT seconds if that is set.
 // Adapted from http://wiki.osdev.org/UEFI_Bare_Bones
 //
 
@@ -523,23 +683,36 @@ EFI_STATUS Keywait(CHAR16 *String)
 {
   EFI_STATUS Status;
   EFI_INPUT_KEY Key;
-  Print(String);
+  LoaderPrint(String);
+  LoaderPrint(L"Press any key to continue...");
+
+  // Everything up to here has been buffered; show it before waiting
+  OutputSync();
 
-  Status = ST->ConOut->OutputString(ST->ConOut, L"Press any key to continue...");
+  // Clear keystroke buffer
+  Status = ST->ConIn->Reset(ST->ConIn, FALSE);
   if (EFI_ERROR(Status))
   {
     return Status;
   }
 
-  // Clear keystroke buffer
-  Status = ST->ConIn->Reset(ST->ConIn, FALSE);
+  // Sleep until there's a key instead of spinning on ReadKeyStroke
+#if KEYWAIT_TIMEOUT
+  Status = WaitForSingleEvent(ST->ConIn->WaitForKey, KEYWAIT_TIMEOUT * 10000000ULL);
+  if (Status == EFI_TIMEOUT) // Nobody there; carry on (usually back to the firmware's next boot option)
+  {
+    LoaderPrint(L"\r\n");
+    return EFI_SUCCESS;
+  }
+#else
+  UINTN Index;
+  Status = ST->BootServices->WaitForEvent(1, &ST->ConIn->WaitForKey, &Index);
+#endif
   if (EFI_ERROR(Status))
   {
     return Status;
   }
-
-  // Poll for key
-  while ((Status = ST->ConIn->ReadKeyStroke(ST->ConIn, &Key)) == EFI_NOT_READY);
+  ST->ConIn->ReadKeyStroke(ST->ConIn, &Key);
 
   // Clear keystroke buffer (this is just a pause)
   Status = ST->ConIn->Reset(ST->ConIn, FALSE);
@@ -548,7 +721,7 @@ EFI_STATUS Keywait(CHAR16 *String)
     return Status;
   }
 
-  Print(L"\r\n");
+  LoaderPrint(L"\r\n");
 
   return Status;
 }
@@ -0,0 +1,651 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: TFTP Network Boot
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Fetches the kernel and its initrd= files over TFTP, for kernel paths like TFTP=10.0.2.2\boot\vmlinuz, or TFTP=\boot\vmlinuz
+// for the server this loader was itself PXE booted from. The initrd= paths are fetched from the same server, and all paths go
+// to the server with / instead of \ and without the leading one.
+//
+// The firmware's own TFTP client (EFI_PXE_BASE_CODE_PROTOCOL.Mtftp) sends an ACK for every 512-byte block and waits for the
+// next one, which takes ages for an initrd. This one talks to the UDP4 protocol directly and asks for large blocks (RFC 2348
+// blksize) and a window of blocks per ACK (RFC 7440 windowsize), along with the file's size (RFC 2349 tsize) so that each file
+// lands in a buffer allocated once, at its final size, straight out of the UDP driver's receive buffers. Servers that don't
+// know the options still work, just at the usual 512 bytes and one block per ACK.
+//
+// Lost blocks are handled as RFC 7440 suggests: the first block out of order gets an ACK for the last one received in order,
+// which makes the server resend the window from there, and a timeout resends the last ACK (or the request).
+//
+// The kernel is loaded from memory, and the initrds are handed to it as described in Initrd.c.
+//
+
+#include "Stubloader.h"
+
+#define TFTP_SERVER_PORT 69
+
+#define TFTP_OPCODE_RRQ 1
+#define TFTP_OPCODE_DATA 3
+#define TFTP_OPCODE_ACK 4
+#define TFTP_OPCODE_ERROR 5
+#define TFTP_OPCODE_OACK 6
+
+#define TFTP_ERROR_NOT_FOUND 1
+
+#define TFTP_DEFAULT_BLOCK_SIZE 512
+#define TFTP_MAX_REQUEST 512 // Request packets, and the part of option ACKs and error packets that gets looked at
+
+typedef struct {
+  NETWORK_INTERFACE *       Network;
+  EFI_HANDLE                ChildHandle;
+  EFI_UDP4 *                Udp;
+  UINT16                    TransferPort; // The server's port for the current transfer, 0 until it answers the request
+  EFI_EVENT                 TimerEvent;
+  EFI_UDP4_COMPLETION_TOKEN RxToken;
+  EFI_UDP4_COMPLETION_TOKEN TxToken;
+  EFI_UDP4_SESSION_DATA     TxSession;
+  EFI_UDP4_TRANSMIT_DATA    TxData;
+  UINT8                     TxPacket[TFTP_MAX_REQUEST];
+  UINTN                     RequestLength; // Of the request in TxPacket, for resending it
+} TFTP_SESSION;
+
+//==================================================================================================================================
+//  TftpSend: Send a Packet
+//==================================================================================================================================
+//
+// Sends Length bytes of TxPacket to the server's Port, and waits for the UDP driver to be done with them.
+//
+
+STATIC EFI_STATUS TftpSend(TFTP_SESSION *Session, UINT16 Port, UINTN Length)
+{
+  EFI_STATUS Status;
+
+  Session->TxSession.DestinationAddress = Session->Network->Server;
+  Session->TxSession.DestinationPort = Port;
+  Session->TxData.UdpSessionData = &Session->TxSession;
+  Session->TxData.GatewayAddress = Session->Network->HasGateway ? &Session->Network->Gateway : NULL;
+  Session->TxData.DataLength = (UINT32)Length;
+  Session->TxData.FragmentCount = 1;
+  Session->TxData.FragmentTable[0].FragmentLength = (UINT32)Length;
+  Session->TxData.FragmentTable[0].FragmentBuffer = Session->TxPacket;
+  Session->TxToken.Packet.TxData = &Session->TxData;
+
+  Status = Session->Udp->Transmit(Session->Udp, &Session->TxToken);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  while(ST->BootServices->CheckEvent(Session->TxToken.Event) == EFI_NOT_READY)
+  {
+    Session->Udp->Poll(Session->Udp);
+  }
+  return Session->TxToken.Status;
+}
+
+STATIC EFI_STATUS TftpSendAck(TFTP_SESSION *Session, UINT16 Block)
+{
+  Session->TxPacket[0] = 0;
+  Session->TxPacket[1] = TFTP_OPCODE_ACK;
+  Session->TxPacket[2] = (UINT8)(Block >> 8);
+  Session->TxPacket[3] = (UINT8)Block;
+  return TftpSend(Session, Session->TransferPort, 4);
+}
+
+//==================================================================================================================================
+//  TftpReceive: Wait for a Packet
+//==================================================================================================================================
+//
+// Waits up to TFTP_TIMEOUT_MS for the next packet, returning EFI_TIMEOUT if none comes. The packet stays in the UDP driver's
+// buffers until TftpRecycle hands them back, which also starts the next receive.
+//
+
+STATIC EFI_STATUS TftpRecycle(TFTP_SESSION *Session)
+{
+  if(Session->RxToken.Packet.RxData != NULL)
+  {
+    ST->BootServices->SignalEvent(Session->RxToken.Packet.RxData->RecycleSignal);
+    Session->RxToken.Packet.RxData = NULL;
+  }
+  return Session->Udp->Receive(Session->Udp, &Session->RxToken);
+}
+
+STATIC EFI_STATUS TftpReceive(TFTP_SESSION *Session, EFI_UDP4_RECEIVE_DATA **RxData)
+{
+  EFI_STATUS Status;
+
+  Status = ST->BootServices->SetTimer(Session->TimerEvent, TimerRelative, TFTP_TIMEOUT_MS * 10000ULL);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  for(;;)
+  {
+    Session->Udp->Poll(Session->Udp);
+
+    if(ST->BootServices->CheckEvent(Session->RxToken.Event) == EFI_SUCCESS)
+    {
+      // ICMP errors (e.g. nothing listening on the server) come in as failed receives
+      Status = Session->RxToken.Status;
+      if(EFI_ERROR(Status) || (Session->RxToken.Packet.RxData == NULL))
+      {
+        TftpRecycle(Session);
+        return EFI_ERROR(Status) ? Status : EFI_PROTOCOL_ERROR;
+      }
+      *RxData = Session->RxToken.Packet.RxData;
+      return EFI_SUCCESS;
+    }
+
+    if(ST->BootServices->CheckEvent(Session->TimerEvent) == EFI_SUCCESS)
+    {
+      return EFI_TIMEOUT;
+    }
+  }
+}
+
+// Copies Size bytes from Offset in a received packet, which can be in several fragments
+STATIC VOID TftpCopyOut(EFI_UDP4_RECEIVE_DATA *RxData, UINTN Offset, VOID *Buffer, UINTN Size)
+{
+  UINT8 * Out = Buffer;
+
+  for(UINT32 i = 0; (i < RxData->FragmentCount) && (Size != 0); i++)
+  {
+    UINTN Length = RxData->FragmentTable[i].FragmentLength;
+    if(Offset >= Length)
+    {
+      Offset -= Length;
+      continue;
+    }
+
+    UINTN Chunk = ((Length - Offset) < Size) ? (Length - Offset) : Size;
+    CopyMem(Out, (UINT8*)RxData->FragmentTable[i].FragmentBuffer + Offset, Chunk);
+    Out += Chunk;
+    Size -= Chunk;
+    Offset = 0;
+  }
+}
+
+//==================================================================================================================================
+//  TftpOpen: Get a UDP Socket
+//==================================================================================================================================
+//
+// Sets up a UDP4 instance on the network interface and with the addresses OpenNetwork picked. Without an address from PXE,
+// waits up to NETWORK_MAPPING_TIMEOUT seconds for the firmware's default address to be configured (e.g. over DHCP). Prints
+// what went wrong on errors.
+//
+
+STATIC EFI_STATUS TftpOpen(NETWORK_INTERFACE *Network, TFTP_SESSION *Session)
+{
+  EFI_STATUS Status;
+
+  ZeroMem(Session, sizeof(TFTP_SESSION));
+  Session->Network = Network;
+
+  EFI_UDP4_CONFIG_DATA Config;
+  ZeroMem(&Config, sizeof(Config));
+  Config.TimeToLive = 64;
+  Config.UseDefaultAddress = Network->UseDefaultAddress;
+  Config.StationAddress = Network->StationAddress;
+  Config.SubnetMask = Network->SubnetMask;
+
+  Status = Network->ServiceBinding->CreateChild(Network->ServiceBinding, &Session->ChildHandle);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Udp4 CreateChild error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  Status = ST->BootServices->HandleProtocol(Session->ChildHandle, &Udp4Protocol, (void**)&Session->Udp);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Udp4 HandleProtocol error. 0x%llx\r\n", Status);
+    Network->ServiceBinding->DestroyChild(Network->ServiceBinding, Session->ChildHandle);
+    return Status;
+  }
+
+  // Until DHCP is done, there's no default address yet
+  Status = Session->Udp->Configure(Session->Udp, &Config);
+  for(UINTN Waited = 0; (Status == EFI_NO_MAPPING) && (Waited < NETWORK_MAPPING_TIMEOUT * 10); Waited++)
+  {
+    ST->BootServices->Stall(100000);
+    Status = Session->Udp->Configure(Session->Udp, &Config);
+  }
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Udp4 Configure error. 0x%llx\r\n", Status);
+    Network->ServiceBinding->DestroyChild(Network->ServiceBinding, Session->ChildHandle);
+    return Status;
+  }
+
+  Status = ST->BootServices->CreateEvent(EVT_TIMER, 0, NULL, NULL, &Session->TimerEvent);
+  if(!EFI_ERROR(Status))
+  {
+    Status = ST->BootServices->CreateEvent(0, 0, NULL, NULL, &Session->RxToken.Event);
+    if(!EFI_ERROR(Status))
+    {
+      Status = ST->BootServices->CreateEvent(0, 0, NULL, NULL, &Session->TxToken.Event);
+      if(!EFI_ERROR(Status))
+      {
+        Status = Session->Udp->Receive(Session->Udp, &Session->RxToken);
+        if(!EFI_ERROR(Status))
+        {
+          return EFI_SUCCESS;
+        }
+        ST->BootServices->CloseEvent(Session->TxToken.Event);
+      }
+      ST->BootServices->CloseEvent(Session->RxToken.Event);
+    }
+    ST->BootServices->CloseEvent(Session->TimerEvent);
+  }
+
+  LoaderPrint(L"TFTP socket setup error. 0x%llx\r\n", Status);
+  Session->Udp->Configure(Session->Udp, NULL);
+  Network->ServiceBinding->DestroyChild(Network->ServiceBinding, Session->ChildHandle);
+  return Status;
+}
+
+STATIC VOID TftpClose(TFTP_SESSION *Session)
+{
+  Session->Udp->Cancel(Session->Udp, NULL);
+  if(Session->RxToken.Packet.RxData != NULL)
+  {
+    ST->BootServices->SignalEvent(Session->RxToken.Packet.RxData->RecycleSignal);
+  }
+  Session->Udp->Configure(Session->Udp, NULL);
+  ST->BootServices->CloseEvent(Session->TxToken.Event);
+  ST->BootServices->CloseEvent(Session->RxToken.Event);
+  ST->BootServices->CloseEvent(Session->TimerEvent);
+  Session->Network->ServiceBinding->DestroyChild(Session->Network->ServiceBinding, Session->ChildHandle);
+}
+
+//==================================================================================================================================
+//  TftpGet: Fetch One File
+//==================================================================================================================================
+//
+// Fetches Path (PathLength characters, not necessarily null-terminated) from the server and appends it to Buffer. Prints what
+// went wrong on errors.
+//
+
+STATIC UINT8 * TftpPutString(UINT8 *Out, CONST CHAR8 *String)
+{
+  while(*String != '\0')
+  {
+    *Out++ = *String++;
+  }
+  *Out++ = '\0';
+  return Out;
+}
+
+STATIC UINT8 * TftpPutNumber(UINT8 *Out, UINTN Number)
+{
+  CHAR8 Digits[21];
+  UINTN i = sizeof(Digits) - 1;
+
+  Digits[i] = '\0';
+  do
+  {
+    Digits[--i] = (CHAR8)('0' + Number % 10);
+    Number /= 10;
+  } while(Number != 0);
+
+  return TftpPutString(Out, &Digits[i]);
+}
+
+// Option names are case-insensitive
+STATIC BOOLEAN TftpOptionIs(CONST UINT8 *Name, CONST CHAR8 *Option)
+{
+  while(*Option != '\0')
+  {
+    UINT8 Char = *Name++;
+    if((Char >= 'A') && (Char <= 'Z'))
+    {
+      Char += 'a' - 'A';
+    }
+    if(Char != (UINT8)*Option++)
+    {
+      return FALSE;
+    }
+  }
+  return *Name == '\0';
+}
+
+// Picks the blksize, windowsize, and tsize the server agreed to out of an option ACK
+STATIC VOID TftpParseOptions(CONST UINT8 *Options, UINTN Length, UINTN *BlockSize, UINTN *WindowSize, UINTN *FileSize)
+{
+  UINTN Position = 0;
+
+  while(Position < Length)
+  {
+    CONST UINT8 * Name = &Options[Position];
+    while((Position < Length) && (Options[Position] != '\0'))
+    {
+      Position++;
+    }
+    Position++;
+
+    UINTN Value = 0;
+    while((Position < Length) && (Options[Position] != '\0'))
+    {
+      if((Options[Position] >= '0') && (Options[Position] <= '9'))
+      {
+        Value = Value * 10 + (Options[Position] - '0');
+      }
+      Position++;
+    }
+    Position++;
+    if(Position > Length)
+    {
+      break;
+    }
+
+    if(TftpOptionIs(Name, (CONST CHAR8*)"blksize"))
+    {
+      *BlockSize = Value;
+    }
+    else if(TftpOptionIs(Name, (CONST CHAR8*)"windowsize"))
+    {
+      *WindowSize = Value;
+    }
+    else if(TftpOptionIs(Name, (CONST CHAR8*)"tsize"))
+    {
+      *FileSize = Value;
+    }
+  }
+}
+
+STATIC EFI_STATUS TftpGet(TFTP_SESSION *Session, CONST CHAR16 *Path, UINTN PathLength, NETWORK_BUFFER *Buffer)
+{
+  EFI_STATUS Status;
+
+  // Read request: the path as ASCII with / for \, and the options
+  while((PathLength != 0) && ((*Path == L'\\') || (*Path == L'/')))
+  {
+    Path++;
+    PathLength--;
+  }
+  if((PathLength == 0) || (PathLength > TFTP_MAX_REQUEST - 64))
+  {
+    LoaderPrint(L"Bad TFTP path.\r\n");
+    return EFI_INVALID_PARAMETER;
+  }
+
+  UINT8 * Out = Session->TxPacket;
+  *Out++ = 0;
+  *Out++ = TFTP_OPCODE_RRQ;
+  for(UINTN i = 0; i < PathLength; i++)
+  {
+    if((Path[i] < 0x20) || (Path[i] > 0x7E))
+    {
+      LoaderPrint(L"TFTP paths can only be ASCII.\r\n");
+      return EFI_INVALID_PARAMETER;
+    }
+    *Out++ = (Path[i] == L'\\') ? '/' : (UINT8)Path[i];
+  }
+  *Out++ = '\0';
+  Out = TftpPutString(Out, (CONST CHAR8*)"octet");
+  Out = TftpPutString(Out, (CONST CHAR8*)"blksize");
+  Out = TftpPutNumber(Out, TFTP_BLOCK_SIZE);
+  Out = TftpPutString(Out, (CONST CHAR8*)"windowsize");
+  Out = TftpPutNumber(Out, TFTP_WINDOW_SIZE);
+  Out = TftpPutString(Out, (CONST CHAR8*)"tsize");
+  Out = TftpPutNumber(Out, 0);
+  Session->RequestLength = Out - Session->TxPacket;
+
+  Session->TransferPort = 0;
+  Status = TftpSend(Session, Session->Network->ServerPort, Session->RequestLength);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"TFTP request send error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  // Until an option ACK says otherwise, it's plain RFC 1350 TFTP
+  UINTN BlockSize = TFTP_DEFAULT_BLOCK_SIZE;
+  UINTN WindowSize = 1;
+  UINT64 Blocks = 0; // Received in order so far
+  UINTN InWindow = 0; // Received since the last ACK
+  BOOLEAN Gap = FALSE; // Out of order blocks already got an ACK for the last good one
+  UINTN Tries = 0;
+#ifdef DEBUG_ENABLED
+  UINTN Resends = 0;
+#endif
+
+  for(;;)
+  {
+    EFI_UDP4_RECEIVE_DATA * RxData;
+    Status = TftpReceive(Session, &RxData);
+    if(Status == EFI_TIMEOUT)
+    {
+      if(++Tries > TFTP_RETRIES)
+      {
+        LoaderPrint(L"TFTP server stopped answering.\r\n");
+        return EFI_TIMEOUT;
+      }
+#ifdef DEBUG_ENABLED
+      Resends++;
+#endif
+      // Without an answer, it's the request that got lost; after that, resending the last ACK restarts the window there
+      if(Session->TransferPort == 0)
+      {
+        Status = TftpSend(Session, Session->Network->ServerPort, Session->RequestLength);
+      }
+      else
+      {
+        Status = TftpSendAck(Session, (UINT16)Blocks);
+        InWindow = 0;
+      }
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"TFTP send error. 0x%llx\r\n", Status);
+        return Status;
+      }
+      continue;
+    }
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"TFTP receive error. 0x%llx\r\n", Status);
+      return Status;
+    }
+
+    // Only packets from the server, and after its first answer only from the port it answered from (its transfer ID)
+    UINT8 Header[4];
+    if((RxData->DataLength < 4) || (CompareMem(&RxData->UdpSession.SourceAddress, &Session->Network->Server, sizeof(EFI_IPv4_ADDRESS)) != 0) || ((Session->TransferPort != 0) && (RxData->UdpSession.SourcePort != Session->TransferPort)))
+    {
+      TftpRecycle(Session);
+      continue;
+    }
+    TftpCopyOut(RxData, 0, Header, 4);
+
+    UINT16 Opcode = (UINT16)((Header[0] << 8) | Header[1]);
+    UINT16 Number = (UINT16)((Header[2] << 8) | Header[3]);
+    UINTN Length = RxData->DataLength - 4;
+
+    if(Session->TransferPort == 0)
+    {
+      // Only an answer to this request picks the transfer ID. The same local port is used for every file, so a retransmitted
+      // last block of the previous file (whose final ACK got lost) can still turn up here from that transfer's port.
+      if((Opcode != TFTP_OPCODE_OACK) && (Opcode != TFTP_OPCODE_ERROR) && ((Opcode != TFTP_OPCODE_DATA) || (Number != 1)))
+      {
+        TftpRecycle(Session);
+        continue;
+      }
+      Session->TransferPort = RxData->UdpSession.SourcePort;
+    }
+
+    if(Opcode == TFTP_OPCODE_ERROR)
+    {
+      CHAR8 Message[64];
+      UINTN MessageLength = (Length < sizeof(Message) - 1) ? Length : sizeof(Message) - 1;
+      TftpCopyOut(RxData, 4, Message, MessageLength);
+      Message[MessageLength] = '\0';
+      TftpRecycle(Session);
+      LoaderPrint(L"TFTP error %u from server: %a\r\n", Number, Message);
+      return (Number == TFTP_ERROR_NOT_FOUND) ? EFI_NOT_FOUND : EFI_PROTOCOL_ERROR;
+    }
+
+    if((Opcode == TFTP_OPCODE_OACK) && (Blocks == 0))
+    {
+      // No block number here, the options start right after the opcode
+      UINT8 Options[TFTP_MAX_REQUEST];
+      UINTN OptionsLength = (Length + 2 < sizeof(Options)) ? (Length + 2) : sizeof(Options);
+      UINTN FileSize = 0;
+      TftpCopyOut(RxData, 2, Options, OptionsLength);
+      TftpRecycle(Session);
+      TftpParseOptions(Options, OptionsLength, &BlockSize, &WindowSize, &FileSize);
+
+      if((BlockSize < 8) || (BlockSize > TFTP_BLOCK_SIZE) || (WindowSize < 1) || (WindowSize > TFTP_WINDOW_SIZE))
+      {
+        LoaderPrint(L"TFTP server picked options it wasn't offered.\r\n");
+        return EFI_PROTOCOL_ERROR;
+      }
+
+      // With the size known, the file lands in a buffer that's already big enough
+      if(FileSize != 0)
+      {
+        Status = ReserveNetworkBuffer(Buffer, FileSize);
+        if(EFI_ERROR(Status))
+        {
+          return Status;
+        }
+      }
+
+      Tries = 0;
+      Status = TftpSendAck(Session, 0);
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"TFTP send error. 0x%llx\r\n", Status);
+        return Status;
+      }
+      continue;
+    }
+
+    if(Opcode != TFTP_OPCODE_DATA)
+    {
+      TftpRecycle(Session);
+      continue;
+    }
+
+    if(Number != (UINT16)(Blocks + 1))
+    {
+      // A block went missing (or this is a leftover from a window that's being resent): ask for the rest once
+      TftpRecycle(Session);
+      if(!Gap && (Number != (UINT16)Blocks))
+      {
+        Gap = TRUE;
+        InWindow = 0;
+#ifdef DEBUG_ENABLED
+        Resends++;
+#endif
+        Status = TftpSendAck(Session, (UINT16)Blocks);
+        if(EFI_ERROR(Status))
+        {
+          LoaderPrint(L"TFTP send error. 0x%llx\r\n", Status);
+          return Status;
+        }
+      }
+      continue;
+    }
+
+    if(Length > BlockSize)
+    {
+      TftpRecycle(Session);
+      LoaderPrint(L"TFTP block is bigger than agreed.\r\n");
+      return EFI_PROTOCOL_ERROR;
+    }
+
+    Status = ReserveNetworkBuffer(Buffer, Length);
+    if(EFI_ERROR(Status))
+    {
+      TftpRecycle(Session);
+      return Status;
+    }
+    TftpCopyOut(RxData, 4, Buffer->Data + Buffer->Size, Length);
+    Buffer->Size += Length;
+    TftpRecycle(Session);
+
+    Blocks++;
+    InWindow++;
+    Gap = FALSE;
+    Tries = 0;
+
+    // The last block is the short one, and each full window gets one ACK
+    if((Length < BlockSize) || (InWindow == WindowSize))
+    {
+      InWindow = 0;
+      Status = TftpSendAck(Session, Number);
+      if(EFI_ERROR(Status))
+      {
+        LoaderPrint(L"TFTP send error. 0x%llx\r\n", Status);
+        return Status;
+      }
+    }
+
+    if(Length < BlockSize)
+    {
+#ifdef DEBUG_ENABLED
+      LoaderPrint(L"TFTP: %lu blocks of %u bytes, window %u, %u resends.\r\n", Blocks, BlockSize, WindowSize, Resends);
+#endif
+      return EFI_SUCCESS;
+    }
+  }
+}
+
+//==================================================================================================================================
+//  LoadTftpKernel: Load a Kernel Over TFTP
+//==================================================================================================================================
+//
+// Fetches the kernel of a TFTP=ADDRESS[:PORT]\PATH kernel path and the initrd= files of Cmdline (CmdlineLength characters), installs
+// the initrds for Linux to pick up, and loads the kernel from memory into *KernelImageHandle. DefaultHandle is the device this
+// loader was booted from. *Stage is set like BootKernel's. Prints what went wrong on errors.
+//
+
+EFI_STATUS LoadTftpKernel(EFI_HANDLE ImageHandle, EFI_HANDLE DefaultHandle, CONST CHAR16 *KernelPath, CONST CHAR16 *Cmdline, UINTN CmdlineLength, UINT32 *Stage, EFI_HANDLE *KernelImageHandle)
+{
+  EFI_STATUS Status;
+
+  NETWORK_INTERFACE Network;
+  CONST CHAR16 * Path;
+  Status = OpenNetwork(DefaultHandle, &Udp4ServiceBindingProtocol, KernelPath, TFTP_SERVER_PORT, &Network, &Path);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  TFTP_SESSION Session;
+  Status = TftpOpen(&Network, &Session);
+  if(EFI_ERROR(Status))
+  {
+    return Status;
+  }
+
+  *Stage = KERNELCMD_STAGE_LOAD;
+  NETWORK_BUFFER Kernel = {NULL, 0, 0, EfiBootServicesData};
+  NETWORK_BUFFER Initrd = {NULL, 0, 0, EfiLoaderData}; // Several initrds go back to back
+  Status = TftpGet(&Session, Path, StrLen(Path), &Kernel);
+
+  UINTN Position = 0;
+  UINTN Start;
+  UINTN Length;
+  while(!EFI_ERROR(Status) && NextInitrdArgument(Cmdline, CmdlineLength, &Position, &Start, &Length))
+  {
+    Status = TftpGet(&Session, &Cmdline[Start], Length, &Initrd);
+  }
+  TftpClose(&Session);
+
+  if(EFI_ERROR(Status))
+  {
+    FreeNetworkBuffer(&Kernel);
+    FreeNetworkBuffer(&Initrd);
+    return Status;
+  }
+  return LoadFetchedKernel(ImageHandle, &Network, Path, &Kernel, &Initrd, KernelImageHandle);
+}
@@ -0,0 +1,172 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: UTF-8 to UTF-16 Conversion
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Converts UTF-8 (and so plain ASCII) text into the UTF-16 that UEFI uses for file paths and LoadOptions.
+//
+// Config files are almost entirely ASCII, so the converter checks 16 bytes at a time for any byte with the high bit set. If there
+// are none, the 16 bytes are widened to 16 UTF-16 characters in one go: SSE2 interleaves them with zero bytes (punpcklbw/
+// punpckhbw) and NEON does the same with vzip. Anything else falls back to a scalar decoder that validates each multibyte
+// sequence and emits surrogate pairs for characters outside the Basic Multilingual Plane.
+//
+
+#include "Stubloader.h"
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+#endif
+
+//==================================================================================================================================
+//  Utf8ToUtf16: Convert UTF-8 Text
+//==================================================================================================================================
+//
+// Converts up to InputSize bytes of UTF-8 from Input into Output, which needs room for InputSize characters (UTF-16 never needs
+// more characters than UTF-8 needs bytes). Returns the number of characters written, and sets *Consumed to the number of bytes
+// used. A multibyte sequence cut off by the end of Input is left unconsumed so the caller can carry it over to the next chunk.
+//
+// Returns EFI_INVALID_PARAMETER and sets *Consumed to the offset of the bad byte if the input isn't valid UTF-8.
+//
+
+EFI_STATUS Utf8ToUtf16(CONST UINT8 *Input, UINTN InputSize, CHAR16 *Output, UINTN *OutputLength, UINTN *Consumed)
+{
+  UINTN In = 0;
+  UINTN Out = 0;
+
+  while(In < InputSize)
+  {
+#if defined(__SSE2__)
+    // ASCII fast path: 16 bytes at a time
+    while((InputSize - In) >= 16)
+    {
+      __m128i Bytes = _mm_loadu_si128((CONST __m128i *)&Input[In]);
+      if(_mm_movemask_epi8(Bytes)) // Some byte has its high bit set
+      {
+        break;
+      }
+      __m128i Zero = _mm_setzero_si128();
+      _mm_storeu_si128((__m128i *)&Output[Out], _mm_unpacklo_epi8(Bytes, Zero));
+      _mm_storeu_si128((__m128i *)&Output[Out + 8], _mm_unpackhi_epi8(Bytes, Zero));
+      In += 16;
+      Out += 16;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    // ASCII fast path: 16 bytes at a time
+    while((InputSize - In) >= 16)
+    {
+      uint8x16_t Bytes = vld1q_u8(&Input[In]);
+      // Pairwise max folds 16 bytes down to lane 0 (vmaxvq_u8 would do it in one go, but it's AArch64-only)
+      uint8x8_t Max = vpmax_u8(vget_low_u8(Bytes), vget_high_u8(Bytes));
+      Max = vpmax_u8(Max, Max);
+      Max = vpmax_u8(Max, Max);
+      Max = vpmax_u8(Max, Max);
+      if(vget_lane_u8(Max, 0) & 0x80) // Some byte has its high bit set
+      {
+        break;
+      }
+      uint8x16x2_t Wide = vzipq_u8(Bytes, vdupq_n_u8(0));
+      vst1q_u8((uint8_t *)&Output[Out], Wide.val[0]);
+      vst1q_u8((uint8_t *)&Output[Out + 8], Wide.val[1]);
+      In += 16;
+      Out += 16;
+    }
+#endif
+
+    if(In >= InputSize)
+    {
+      break;
+    }
+
+    UINT8 Lead = Input[In];
+
+    if(Lead < 0x80)
+    {
+      Output[Out++] = Lead;
+      In++;
+      continue;
+    }
+
+    // Multibyte sequence: work out its length and the smallest code point it may encode (anything smaller is overlong)
+    UINTN Length;
+    UINT32 CodePoint;
+    UINT32 Minimum;
+
+    if((Lead & 0xE0) == 0xC0)
+    {
+      Length = 2;
+      CodePoint = Lead & 0x1F;
+      Minimum = 0x80;
+    }
+    else if((Lead & 0xF0) == 0xE0)
+    {
+      Length = 3;
+      CodePoint = Lead & 0x0F;
+      Minimum = 0x800;
+    }
+    else if((Lead & 0xF8) == 0xF0)
+    {
+      Length = 4;
+      CodePoint = Lead & 0x07;
+      Minimum = 0x10000;
+    }
+    else // Stray continuation byte or invalid lead byte
+    {
+      *OutputLength = Out;
+      *Consumed = In;
+      return EFI_INVALID_PARAMETER;
+    }
+
+    if((InputSize - In) < Length) // Cut off: leave it for the next chunk
+    {
+      break;
+    }
+
+    for(UINTN i = 1; i < Length; i++)
+    {
+      UINT8 Next = Input[In + i];
+      if((Next & 0xC0) != 0x80)
+      {
+        *OutputLength = Out;
+        *Consumed = In;
+        return EFI_INVALID_PARAMETER;
+      }
+      CodePoint = (CodePoint << 6) | (Next & 0x3F);
+    }
+
+    if((CodePoint < Minimum) || (CodePoint > 0x10FFFF) || ((CodePoint >= 0xD800) && (CodePoint <= 0xDFFF)))
+    {
+      *OutputLength = Out;
+      *Consumed = In;
+      return EFI_INVALID_PARAMETER;
+    }
+
+    if(CodePoint >= 0x10000)
+    {
+      // Surrogate pair; a 4-byte sequence always has room for the 2 characters
+      CodePoint -= 0x10000;
+      Output[Out++] = (CHAR16)(0xD800 | (CodePoint >> 10));
+      Output[Out++] = (CHAR16)(0xDC00 | (CodePoint & 0x3FF));
+    }
+    else
+    {
+      Output[Out++] = (CHAR16)CodePoint;
+    }
+
+    In += Length;
+  }
+
+  *OutputLength = Out;
+  *Consumed = In;
+  return EFI_SUCCESS;
+}
@@ -0,0 +1,298 @@
+//==================================================================================================================================
+//  UEFI Stub Loader: Wildcard Kernel Selection
+//==================================================================================================================================
+//
+// Version 2.1
+//
+// Author:
+//  KNNSpeed
+//
+// Source Code:
+//  https://github.com/KNNSpeed/UEFI-Stub-Loader
+//
+// About this file:
+//
+// Lets the kernel path end in a wildcard pattern, e.g. \EFI\linux\vmlinuz-*.efi, and boots the newest matching kernel. Only
+// the file name can have wildcards (*, ?, and [...] as understood by MetaiMatch); the directory part has to be exact.
+//
+// The directory is only scanned once: each Read() of a directory returns the EFI_FILE_INFO of the next entry, which already has
+// the name and attributes needed, so no candidate ever gets opened. The info buffer is sized so that any FAT long file name fits
+// the first time, and the best match so far is kept just by swapping buffers rather than copying its name.
+//
+
+#include "Stubloader.h"
+
+//==================================================================================================================================
+//  CompareVersions: Natural Version Order
+//==================================================================================================================================
+//
+// Compares two file names the way version numbers are ordered: runs of digits are compared as numbers (so 5.10 comes after
+// 5.9), and everything else is compared case-insensitively. Where one name has a digit and the other doesn't, the one with the
+// digit is newer, so 5.10.1 comes after 5.10. Returns < 0, 0, or > 0 like StrCmp.
+//
+
+STATIC CHAR16 FoldCase(CHAR16 Char)
+{
+  return ((Char >= L'A') && (Char <= L'Z')) ? (Char + (L'a' - L'A')) : Char;
+}
+
+STATIC BOOLEAN IsDigit(CHAR16 Char)
+{
+  return (Char >= L'0') && (Char <= L'9');
+}
+
+INTN CompareVersions(CONST CHAR16 *First, CONST CHAR16 *Second)
+{
+  while(*First && *Second)
+  {
+    if(IsDigit(*First) && IsDigit(*Second))
+    {
+      // Leading zeros don't change the number
+      while(*First == L'0')
+      {
+        First++;
+      }
+      while(*Second == L'0')
+      {
+        Second++;
+      }
+
+      UINTN FirstDigits = 0;
+      UINTN SecondDigits = 0;
+      while(IsDigit(First[FirstDigits]))
+      {
+        FirstDigits++;
+      }
+      while(IsDigit(Second[SecondDigits]))
+      {
+        SecondDigits++;
+      }
+
+      // More digits is a bigger number; otherwise the first differing digit decides
+      if(FirstDigits != SecondDigits)
+      {
+        return (FirstDigits > SecondDigits) ? 1 : -1;
+      }
+
+      for(UINTN i = 0; i < FirstDigits; i++)
+      {
+        if(First[i] != Second[i])
+        {
+          return (First[i] > Second[i]) ? 1 : -1;
+        }
+      }
+
+      First += FirstDigits;
+      Second += SecondDigits;
+      continue;
+    }
+
+    if(IsDigit(*First) != IsDigit(*Second))
+    {
+      return IsDigit(*First) ? 1 : -1;
+    }
+
+    CHAR16 FirstChar = FoldCase(*First);
+    CHAR16 SecondChar = FoldCase(*Second);
+    if(FirstChar != SecondChar)
+    {
+      return (FirstChar > SecondChar) ? 1 : -1;
+    }
+
+    First++;
+    Second++;
+  }
+
+  // A name that keeps going after the other one ends is newer (vmlinuz-5.10-1 after vmlinuz-5.10)
+  return (*First != L'\0') - (*Second != L'\0');
+}
+
+//==================================================================================================================================
+//  ResolveKernelPath: Expand a Wildcard Kernel Path
+//==================================================================================================================================
+//
+// If the file name in KernelPath has wildcards, finds the newest matching file and returns its full path in *ResolvedPath
+// (EfiBootServicesData, for the caller to free). If there are no wildcards, *ResolvedPath is set to NULL and KernelPath should
+// be used as it is. Prints what went wrong on errors.
+//
+
+STATIC BOOLEAN HasWildcards(CONST CHAR16 *String, UINTN Length)
+{
+  for(UINTN i = 0; i < Length; i++)
+  {
+    if((String[i] == L'*') || (String[i] == L'?') || (String[i] == L'['))
+    {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+EFI_STATUS ResolveKernelPath(EFI_HANDLE DeviceHandle, CHAR16 *KernelPath, CHAR16 **ResolvedPath)
+{
+  EFI_STATUS Status;
+
+  *ResolvedPath = NULL;
+
+  // Split into directory and file name at the last backslash
+  UINTN NameStart = 0;
+  UINTN PathLength = 0;
+  while(KernelPath[PathLength] != L'\0')
+  {
+    if(KernelPath[PathLength] == L'\\')
+    {
+      NameStart = PathLength + 1;
+    }
+    PathLength++;
+  }
+
+  if(!HasWildcards(&KernelPath[NameStart], PathLength - NameStart))
+  {
+    return EFI_SUCCESS;
+  }
+
+  if(HasWildcards(KernelPath, NameStart))
+  {
+    LoaderPrint(L"Error: Only the file name of the kernel path can have wildcards.\r\n");
+    return EFI_INVALID_PARAMETER;
+  }
+
+  CHAR16 * Pattern = &KernelPath[NameStart];
+
+  // Directory path with its trailing backslash, which Open() is fine with (and "\" on its own is the root). A pattern with no
+  // backslash at all is a file name in the root directory.
+  UINTN DirectoryLength = (NameStart == 0) ? 1 : NameStart;
+  CHAR16 * DirectoryPath;
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, (DirectoryLength + 1) * sizeof(CHAR16), (void**)&DirectoryPath);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"DirectoryPath AllocatePool error. 0x%llx\r\n", Status);
+    return Status;
+  }
+  if(NameStart == 0)
+  {
+    DirectoryPath[0] = L'\\';
+  }
+  else
+  {
+    CopyMem(DirectoryPath, KernelPath, NameStart * sizeof(CHAR16));
+  }
+  DirectoryPath[DirectoryLength] = L'\0';
+
+  EFI_FILE * Root = LibOpenRoot(DeviceHandle);
+  if(Root == NULL)
+  {
+    LoaderPrint(L"OpenVolume error.\r\n");
+    ST->BootServices->FreePool(DirectoryPath);
+    return EFI_NOT_FOUND;
+  }
+
+  EFI_FILE * Directory;
+  Status = Root->Open(Root, &Directory, DirectoryPath, EFI_FILE_MODE_READ, 0);
+  Root->Close(Root);
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Error: Kernel directory %s could not be opened. 0x%llx\r\n", DirectoryPath, Status);
+    ST->BootServices->FreePool(DirectoryPath);
+    return Status;
+  }
+
+  // Two info buffers: one being read into, and one holding the best match so far
+  EFI_FILE_INFO * Info = NULL;
+  EFI_FILE_INFO * Best = NULL;
+  UINTN InfoSize = KERNEL_DIR_INFO_SIZE;
+  UINTN BestSize = KERNEL_DIR_INFO_SIZE;
+  UINTN Matches = 0;
+
+  Status = ST->BootServices->AllocatePool(EfiBootServicesData, InfoSize, (void**)&Info);
+  if(EFI_ERROR(Status))
+  {
+    Info = NULL;
+  }
+  else
+  {
+    Status = ST->BootServices->AllocatePool(EfiBootServicesData, BestSize, (void**)&Best);
+    if(EFI_ERROR(Status))
+    {
+      Best = NULL;
+    }
+  }
+
+  while(!EFI_ERROR(Status))
+  {
+    UINTN ReadSize = InfoSize;
+    Status = Directory->Read(Directory, &ReadSize, Info);
+    if(Status == EFI_BUFFER_TOO_SMALL) // Only happens with names longer than FAT allows
+    {
+      ST->BootServices->FreePool(Info);
+      InfoSize = ReadSize;
+      Status = ST->BootServices->AllocatePool(EfiBootServicesData, InfoSize, (void**)&Info);
+      if(EFI_ERROR(Status))
+      {
+        Info = NULL;
+      }
+      continue;
+    }
+
+    if(EFI_ERROR(Status) || (ReadSize == 0)) // Error or end of directory
+    {
+      break;
+    }
+
+    if((Info->Attribute & EFI_FILE_DIRECTORY) || !MetaiMatch(Info->FileName, Pattern))
+    {
+      continue;
+    }
+
+    if((Matches == 0) || (CompareVersions(Info->FileName, Best->FileName) > 0))
+    {
+      EFI_FILE_INFO * Swap = Best;
+      UINTN SwapSize = BestSize;
+      Best = Info;
+      BestSize = InfoSize;
+      Info = Swap;
+      InfoSize = SwapSize;
+    }
+    Matches++;
+  }
+
+  Directory->Close(Directory);
+
+  if(EFI_ERROR(Status))
+  {
+    LoaderPrint(L"Error reading kernel directory %s. 0x%llx\r\n", DirectoryPath, Status);
+  }
+  else if(Matches == 0)
+  {
+    LoaderPrint(L"Error: No kernel in %s matches %s\r\n", DirectoryPath, Pattern);
+    Status = EFI_NOT_FOUND;
+  }
+  else
+  {
+    UINTN NameSize = StrSize(Best->FileName);
+    Status = ST->BootServices->AllocatePool(EfiBootServicesData, DirectoryLength * sizeof(CHAR16) + NameSize, (void**)ResolvedPath);
+    if(EFI_ERROR(Status))
+    {
+      LoaderPrint(L"ResolvedPath AllocatePool error. 0x%llx\r\n", Status);
+      *ResolvedPath = NULL;
+    }
+    else
+    {
+      CopyMem(*ResolvedPath, DirectoryPath, DirectoryLength * sizeof(CHAR16));
+      CopyMem(&(*ResolvedPath)[DirectoryLength], Best->FileName, NameSize);
+      LoaderPrint(L"Newest of %llu matching kernels: %s\r\n", Matches, Best->FileName);
+    }
+  }
+
+  if(Info != NULL)
+  {
+    ST->BootServices->FreePool(Info);
+  }
+  if(Best != NULL)
+  {
+    ST->BootServices->FreePool(Best);
+  }
+  ST->BootServices->FreePool(DirectoryPath);
+
+  return Status;
+}